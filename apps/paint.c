@@ -4,9 +4,10 @@
 #define PAINT_CANVAS_WIDTH 400
 #define PAINT_CANVAS_HEIGHT 300
 #define PAINT_TOOLBAR_HEIGHT 40
+#define PAINT_FILL_STACK 8192
 
 typedef struct {
-    uint32_t canvas[PAINT_CANVAS_HEIGHT][PAINT_CANVAS_WIDTH];
+    uint32_t (*canvas)[PAINT_CANVAS_WIDTH];  // PAINT_CANVAS_HEIGHT rows, from the page allocator
     uint32_t currentColor;
     int brushSize;
     int tool; // 0=brush, 1=eraser, 2=fill, 3=line, 4=rectangle, 5=circle
@@ -16,6 +17,8 @@ typedef struct {
     int startX; // For shapes
     int startY;
     int modified;
+    int filling;            // a fill is running, maybe with the UI lock given away
+    int closed;             // the window closed meanwhile; the fill frees this
 } PaintData;
 
 // Available colors
@@ -39,6 +42,43 @@ extern void DrawRect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t co
 extern void DrawPixel(uint32_t x, uint32_t y, uint32_t color);
 extern void DrawText(uint32_t x, uint32_t y, const char* text, uint32_t color);
 extern uint32_t GetPixel(uint32_t x, uint32_t y);
+extern void BlitRect(const uint32_t* src, uint32_t srcStride, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern void InvalidateWindowRect(void* win, int x, int y, int w, int h);
+extern void UiYield();
+extern void HeapFree(void* ptr);
+
+// Content area below the title bar, reported whenever the toolbar or palette changes
+void PaintInvalidate(void* win_ptr) {
+    typedef struct {
+        int x, y, width, height;
+    } WindowHeader;
+    
+    WindowHeader* win = (WindowHeader*)win_ptr;
+    InvalidateWindowRect(win_ptr, win->x + 2, win->y + 30, win->width - 4, win->height - 32);
+}
+
+// Canvas-local span (x0,y0)-(x1,y1) widened by pad, for strokes and shapes
+void PaintInvalidateCanvas(void* win_ptr, int x0, int y0, int x1, int y1, int pad) {
+    typedef struct {
+        int x, y, width, height;
+    } WindowHeader;
+    
+    WindowHeader* win = (WindowHeader*)win_ptr;
+    int canvasX = win->x + 10;
+    int canvasY = win->y + 40 + PAINT_TOOLBAR_HEIGHT;
+    
+    int minX = (x0 < x1 ? x0 : x1) - pad;
+    int minY = (y0 < y1 ? y0 : y1) - pad;
+    int maxX = (x0 > x1 ? x0 : x1) + pad;
+    int maxY = (y0 > y1 ? y0 : y1) + pad;
+    if(minX < 0) minX = 0;
+    if(minY < 0) minY = 0;
+    if(maxX >= PAINT_CANVAS_WIDTH) maxX = PAINT_CANVAS_WIDTH - 1;
+    if(maxY >= PAINT_CANVAS_HEIGHT) maxY = PAINT_CANVAS_HEIGHT - 1;
+    if(minX > maxX || minY > maxY) return;
+    
+    InvalidateWindowRect(win_ptr, canvasX + minX, canvasY + minY, maxX - minX + 1, maxY - minY + 1);
+}
 
 void PaintInit(PaintData* paint) {
     // Clear canvas to white
@@ -141,18 +181,105 @@ void PaintDrawCircle(PaintData* paint, int cx, int cy, int radius, uint32_t colo
     }
 }
 
-void PaintFloodFill(PaintData* paint, int x, int y, uint32_t targetColor, uint32_t fillColor) {
-    if(x < 0 || x >= PAINT_CANVAS_WIDTH || y < 0 || y >= PAINT_CANVAS_HEIGHT) return;
-    if(paint->canvas[y][x] != targetColor) return;
-    if(targetColor == fillColor) return;
-    
-    // Simple recursive flood fill (stack-based would be better for large areas)
-    paint->canvas[y][x] = fillColor;
-    
-    PaintFloodFill(paint, x + 1, y, targetColor, fillColor);
-    PaintFloodFill(paint, x - 1, y, targetColor, fillColor);
-    PaintFloodFill(paint, x, y + 1, targetColor, fillColor);
-    PaintFloodFill(paint, x, y - 1, targetColor, fillColor);
+// Scanline fill: each seed fills its whole run on a row, then seeds one
+// point per run of target colour above and below. Seeds live on a fixed
+// stack instead of the call stack; between runs the UI lock is offered to
+// anyone waiting, so a big fill does not freeze the screen.
+//
+// Seeds that do not fit on the stack are dropped, and a pass over the
+// canvas afterwards reseeds from every pixel this fill reached (tracked in
+// a bitmap), so noisy images still fill completely.
+//
+// The window can be closed while the lock is away. Closing leaves the
+// canvas and state to the fill, which frees them and returns 0.
+int PaintFloodFill(PaintData* paint, int x, int y, uint32_t targetColor, uint32_t fillColor) {
+    static int16_t seedX[PAINT_FILL_STACK];
+    static int16_t seedY[PAINT_FILL_STACK];
+    static uint8_t reached[PAINT_CANVAS_HEIGHT][(PAINT_CANVAS_WIDTH + 7) / 8];
+    
+    if(x < 0 || x >= PAINT_CANVAS_WIDTH || y < 0 || y >= PAINT_CANVAS_HEIGHT) return 1;
+    if(targetColor == fillColor) return 1;
+    
+    for(int row = 0; row < PAINT_CANVAS_HEIGHT; row++) {
+        for(int i = 0; i < (PAINT_CANVAS_WIDTH + 7) / 8; i++) reached[row][i] = 0;
+    }
+    
+    int top = 0;
+    seedX[top] = x;
+    seedY[top] = y;
+    top++;
+    
+    int overflowed = 0;
+    paint->filling = 1;
+    while(top > 0) {
+        while(top > 0) {
+            top--;
+            int sx = seedX[top];
+            int sy = seedY[top];
+            uint32_t* row = paint->canvas[sy];
+            if(row[sx] != targetColor) continue;
+            
+            int left = sx;
+            int right = sx;
+            while(left > 0 && row[left - 1] == targetColor) left--;
+            while(right < PAINT_CANVAS_WIDTH - 1 && row[right + 1] == targetColor) right++;
+            for(int i = left; i <= right; i++) {
+                row[i] = fillColor;
+                reached[sy][i >> 3] |= 1 << (i & 7);
+            }
+            
+            for(int ny = sy - 1; ny <= sy + 1; ny += 2) {
+                if(ny < 0 || ny >= PAINT_CANVAS_HEIGHT) continue;
+                uint32_t* next = paint->canvas[ny];
+                int inRun = 0;
+                for(int i = left; i <= right; i++) {
+                    if(next[i] != targetColor) {
+                        inRun = 0;
+                    } else if(!inRun) {
+                        inRun = 1;
+                        if(top < PAINT_FILL_STACK) {
+                            seedX[top] = i;
+                            seedY[top] = ny;
+                            top++;
+                        } else {
+                            overflowed = 1;
+                        }
+                    }
+                }
+            }
+            
+            UiYield();
+            if(paint->closed) {
+                HeapFree(paint->canvas);
+                HeapFree(paint);
+                return 0;
+            }
+        }
+        
+        if(!overflowed) break;
+        
+        // Reseed: target-colour pixels directly above or below a reached
+        // one. If they do not all fit, the next round scans again.
+        overflowed = 0;
+        for(int sy = 0; sy < PAINT_CANVAS_HEIGHT; sy++) {
+            for(int sx = 0; sx < PAINT_CANVAS_WIDTH; sx++) {
+                if(paint->canvas[sy][sx] != targetColor) continue;
+                int above = sy > 0 && (reached[sy - 1][sx >> 3] & (1 << (sx & 7)));
+                int below = sy < PAINT_CANVAS_HEIGHT - 1 && (reached[sy + 1][sx >> 3] & (1 << (sx & 7)));
+                if(above || below) {
+                    if(top == PAINT_FILL_STACK) {
+                        overflowed = 1;
+                        continue;
+                    }
+                    seedX[top] = sx;
+                    seedY[top] = sy;
+                    top++;
+                }
+            }
+        }
+    }
+    paint->filling = 0;
+    return 1;
 }
 
 void DrawPaintApp(void* win_ptr, PaintData* paint) {
@@ -218,11 +345,8 @@ void DrawPaintApp(void* win_ptr, PaintData* paint) {
     DrawRect(canvasX - 2, canvasY - 2, PAINT_CANVAS_WIDTH + 4, PAINT_CANVAS_HEIGHT + 4, 0x000000);
     
     // Draw canvas
-    for(int y = 0; y < PAINT_CANVAS_HEIGHT; y++) {
-        for(int x = 0; x < PAINT_CANVAS_WIDTH; x++) {
-            DrawPixel(canvasX + x, canvasY + y, paint->canvas[y][x]);
-        }
-    }
+    BlitRect(&paint->canvas[0][0], PAINT_CANVAS_WIDTH, canvasX, canvasY,
+             PAINT_CANVAS_WIDTH, PAINT_CANVAS_HEIGHT);
 }
 
 void HandlePaintMouseDown(void* win_ptr, PaintData* paint, int mouseX, int mouseY) {
@@ -241,7 +365,7 @@ void HandlePaintMouseDown(void* win_ptr, PaintData* paint, int mouseX, int mouse
             int btnX = canvasX + 5 + i * 65;
             if(mouseX >= btnX && mouseX < btnX + 60) {
                 paint->tool = i;
-                DrawPaintApp(win_ptr, paint);
+                PaintInvalidate(win_ptr);
                 return;
             }
         }
@@ -254,7 +378,7 @@ void HandlePaintMouseDown(void* win_ptr, PaintData* paint, int mouseX, int mouse
             int colorX = canvasX + i * 33;
             if(mouseX >= colorX && mouseX < colorX + 30) {
                 paint->currentColor = paintColors[i];
-                DrawPaintApp(win_ptr, paint);
+                PaintInvalidate(win_ptr);
                 return;
             }
         }
@@ -265,13 +389,13 @@ void HandlePaintMouseDown(void* win_ptr, PaintData* paint, int mouseX, int mouse
         // Decrease size
         if(mouseX >= canvasX + 80 && mouseX < canvasX + 100) {
             if(paint->brushSize > 1) paint->brushSize -= 2;
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidate(win_ptr);
             return;
         }
         // Increase size
         if(mouseX >= canvasX + 105 && mouseX < canvasX + 125) {
             if(paint->brushSize < 9) paint->brushSize += 2;
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidate(win_ptr);
             return;
         }
     }
@@ -291,18 +415,18 @@ void HandlePaintMouseDown(void* win_ptr, PaintData* paint, int mouseX, int mouse
         
         if(paint->tool == 0) { // Brush
             PaintDrawBrush(paint, localX, localY);
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidateCanvas(win_ptr, localX, localY, localX, localY, paint->brushSize / 2);
         } else if(paint->tool == 1) { // Eraser
             uint32_t oldColor = paint->currentColor;
             paint->currentColor = 0xFFFFFF;
             PaintDrawBrush(paint, localX, localY);
             paint->currentColor = oldColor;
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidateCanvas(win_ptr, localX, localY, localX, localY, paint->brushSize / 2);
         } else if(paint->tool == 2) { // Fill
             uint32_t targetColor = paint->canvas[localY][localX];
-            PaintFloodFill(paint, localX, localY, targetColor, paint->currentColor);
+            if(!PaintFloodFill(paint, localX, localY, targetColor, paint->currentColor)) return;
             paint->modified = 1;
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidateCanvas(win_ptr, 0, 0, PAINT_CANVAS_WIDTH - 1, PAINT_CANVAS_HEIGHT - 1, 0);
         }
     }
 }
@@ -328,18 +452,18 @@ void HandlePaintMouseMove(void* win_ptr, PaintData* paint, int mouseX, int mouse
         if(paint->tool == 0) { // Brush - draw line from last position
             PaintDrawLine(paint, paint->lastX, paint->lastY, localX, localY, paint->currentColor);
             PaintDrawBrush(paint, localX, localY);
+            PaintInvalidateCanvas(win_ptr, paint->lastX, paint->lastY, localX, localY, paint->brushSize / 2);
             paint->lastX = localX;
             paint->lastY = localY;
-            DrawPaintApp(win_ptr, paint);
         } else if(paint->tool == 1) { // Eraser
             uint32_t oldColor = paint->currentColor;
             paint->currentColor = 0xFFFFFF;
             PaintDrawLine(paint, paint->lastX, paint->lastY, localX, localY, 0xFFFFFF);
             PaintDrawBrush(paint, localX, localY);
             paint->currentColor = oldColor;
+            PaintInvalidateCanvas(win_ptr, paint->lastX, paint->lastY, localX, localY, paint->brushSize / 2);
             paint->lastX = localX;
             paint->lastY = localY;
-            DrawPaintApp(win_ptr, paint);
         }
     }
 }
@@ -364,10 +488,10 @@ void HandlePaintMouseUp(void* win_ptr, PaintData* paint, int mouseX, int mouseY)
         
         if(paint->tool == 3) { // Line
             PaintDrawLine(paint, paint->startX, paint->startY, localX, localY, paint->currentColor);
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidateCanvas(win_ptr, paint->startX, paint->startY, localX, localY, 0);
         } else if(paint->tool == 4) { // Rectangle
             PaintDrawRectangle(paint, paint->startX, paint->startY, localX, localY, paint->currentColor);
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidateCanvas(win_ptr, paint->startX, paint->startY, localX, localY, 0);
         } else if(paint->tool == 5) { // Circle
             int dx = localX - paint->startX;
             int dy = localY - paint->startY;
@@ -375,7 +499,7 @@ void HandlePaintMouseUp(void* win_ptr, PaintData* paint, int mouseX, int mouseY)
             // Calculate radius
             while(radius * radius < dx * dx + dy * dy) radius++;
             PaintDrawCircle(paint, paint->startX, paint->startY, radius, paint->currentColor);
-            DrawPaintApp(win_ptr, paint);
+            PaintInvalidateCanvas(win_ptr, paint->startX, paint->startY, paint->startX, paint->startY, radius);
         }
     }
     
@@ -391,12 +515,12 @@ void HandlePaintKeyPress(void* win_ptr, PaintData* paint, unsigned char key) {
             }
         }
         paint->modified = 1;
-        DrawPaintApp(win_ptr, paint);
+        PaintInvalidateCanvas(win_ptr, 0, 0, PAINT_CANVAS_WIDTH - 1, PAINT_CANVAS_HEIGHT - 1, 0);
     }
     // Toggle tools with number keys
     else if(key >= '1' && key <= '6') {
         paint->tool = key - '1';
-        DrawPaintApp(win_ptr, paint);
+        PaintInvalidate(win_ptr);
     }
 }
 
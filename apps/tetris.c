@@ -7,6 +7,12 @@
 #define BOARD_HEIGHT 20
 #define BLOCK_SIZE 20
 
+// Gravity: time per row at level 1, sped up per level down to a floor
+#define TETRIS_DROP_MS 500
+#define TETRIS_DROP_STEP_MS 33
+#define TETRIS_MIN_DROP_MS 80
+#define TETRIS_TICK_MS 20
+
 // Tetromino shapes (I, O, T, S, Z, J, L)
 static const int tetrominoes[7][4][4][4] = {
     // I piece
@@ -68,8 +74,8 @@ typedef struct {
     int level;
     int gameOver;
     int paused;
-    int dropCounter;
-    int dropSpeed;
+    uint64_t lastDropMs;
+    int dropIntervalMs;
     int clearing;
 } TetrisGame;
 
@@ -78,6 +84,18 @@ extern void DrawRect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t co
 extern void DrawText(uint32_t x, uint32_t y, const char* text, uint32_t color);
 extern void IntToStr(int num, char* str);
 extern int Random(int max);
+extern uint64_t ClockMs();
+extern void InvalidateWindowRect(void* win, int x, int y, int w, int h);
+
+// Content area below the title bar; the board, the side panel and the messages all live there
+void TetrisInvalidate(void* win_ptr) {
+    typedef struct {
+        int x, y, width, height;
+    } WindowHeader;
+    
+    WindowHeader* win = (WindowHeader*)win_ptr;
+    InvalidateWindowRect(win_ptr, win->x + 2, win->y + 30, win->width - 4, win->height - 32);
+}
 
 // Tetris-specific functions
 int TetrisCheckCollision(TetrisGame* game, int piece, int rotation, int x, int y) {
@@ -180,8 +198,8 @@ void TetrisInit(TetrisGame* game) {
     game->level = 1;
     game->gameOver = 0;
     game->paused = 0;
-    game->dropCounter = 0;
-    game->dropSpeed = 30;
+    game->lastDropMs = ClockMs();
+    game->dropIntervalMs = TETRIS_DROP_MS;
     game->clearing = 0;
     game->nextPiece = Random(7);
     TetrisSpawnPiece(game);
@@ -211,39 +229,40 @@ void TetrisDropPiece(TetrisGame* game) {
     }
 }
 
-void TetrisUpdate(TetrisGame* game) {
-    if(game->gameOver || game->paused) return;
+// Called on every timer tick; returns 1 when the board changed
+int TetrisUpdate(TetrisGame* game) {
+    if(game->gameOver || game->paused) return 0;
+    
+    uint64_t now = ClockMs();
+    if(now - game->lastDropMs < (uint64_t)game->dropIntervalMs) return 0;
+    game->lastDropMs = now;
     
-    game->dropCounter++;
-    if(game->dropCounter >= game->dropSpeed) {
-        game->dropCounter = 0;
+    if(!TetrisCheckCollision(game, game->currentPiece, game->currentRotation,
+                             game->currentX, game->currentY + 1)) {
+        game->currentY++;
+    } else {
+        game->clearing = 1;
+        TetrisLockPiece(game);
         
-        if(!TetrisCheckCollision(game, game->currentPiece, game->currentRotation,
-                                 game->currentX, game->currentY + 1)) {
-            game->currentY++;
-        } else {
-            game->clearing = 1;
-            TetrisLockPiece(game);
-            
-            int cleared = TetrisClearLines(game);
-            
-            if(cleared > 0) {
-                game->lines += cleared;
-                int lineScore = cleared * 100 * game->level;
-                if(cleared == 2) lineScore = 300 * game->level;
-                if(cleared == 3) lineScore = 500 * game->level;
-                if(cleared == 4) lineScore = 800 * game->level;
-                game->score += lineScore;
-                
-                game->level = (game->lines / 10) + 1;
-                game->dropSpeed = 30 - (game->level * 2);
-                if(game->dropSpeed < 5) game->dropSpeed = 5;
-            }
+        int cleared = TetrisClearLines(game);
+        
+        if(cleared > 0) {
+            game->lines += cleared;
+            int lineScore = cleared * 100 * game->level;
+            if(cleared == 2) lineScore = 300 * game->level;
+            if(cleared == 3) lineScore = 500 * game->level;
+            if(cleared == 4) lineScore = 800 * game->level;
+            game->score += lineScore;
             
-            game->clearing = 0;
-            TetrisSpawnPiece(game);
+            game->level = (game->lines / 10) + 1;
+            game->dropIntervalMs = TETRIS_DROP_MS - (game->level - 1) * TETRIS_DROP_STEP_MS;
+            if(game->dropIntervalMs < TETRIS_MIN_DROP_MS) game->dropIntervalMs = TETRIS_MIN_DROP_MS;
         }
+        
+        game->clearing = 0;
+        TetrisSpawnPiece(game);
     }
+    return 1;
 }
 
 void DrawTetrisBlock(int x, int y, uint32_t color) {
@@ -396,7 +415,7 @@ void HandleTetrisKeyPress(void* win_ptr, TetrisGame* game, unsigned char key) {
     
     if(key == 'r' && game->gameOver) {
         TetrisInit(game);
-        DrawTetrisBoard(win_ptr, game);
+        TetrisInvalidate(win_ptr);
         return;
     }
     
@@ -404,7 +423,9 @@ void HandleTetrisKeyPress(void* win_ptr, TetrisGame* game, unsigned char key) {
     
     if(key == 'p') {
         game->paused = !game->paused;
-        DrawTetrisBoard(win_ptr, game);
+        // The piece gets a full interval after resuming
+        if(!game->paused) game->lastDropMs = ClockMs();
+        TetrisInvalidate(win_ptr);
         return;
     }
     
@@ -412,20 +433,20 @@ void HandleTetrisKeyPress(void* win_ptr, TetrisGame* game, unsigned char key) {
     
     if(key == 'a') {
         TetrisMovePiece(game, -1, 0);
-        DrawTetrisBoard(win_ptr, game);
+        TetrisInvalidate(win_ptr);
     } else if(key == 'd') {
         TetrisMovePiece(game, 1, 0);
-        DrawTetrisBoard(win_ptr, game);
+        TetrisInvalidate(win_ptr);
     } else if(key == 's') {
         TetrisMovePiece(game, 0, 1);
         game->score += 1;
-        DrawTetrisBoard(win_ptr, game);
+        TetrisInvalidate(win_ptr);
     } else if(key == 'w') {
         TetrisRotatePiece(game);
-        DrawTetrisBoard(win_ptr, game);
+        TetrisInvalidate(win_ptr);
     } else if(key == ' ') {
         TetrisDropPiece(game);
-        DrawTetrisBoard(win_ptr, game);
+        TetrisInvalidate(win_ptr);
     }
 }
 
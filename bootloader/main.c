@@ -1,13 +1,145 @@
 #include <efi.h>
 #include <efilib.h>
 #include "../include/types.h"
+#include "../include/bootinfo.h"
 
-void KernelMain(Framebuffer *fb);
+void KernelMain(BootInfo *info);
+
+// Video mode policy: a mode of exactly GOP_PREFERRED_WIDTH x HEIGHT if the
+// firmware has one, otherwise the largest mode with 32-bit pixels
+#ifndef GOP_PREFERRED_WIDTH
+#define GOP_PREFERRED_WIDTH 0
+#endif
+#ifndef GOP_PREFERRED_HEIGHT
+#define GOP_PREFERRED_HEIGHT 0
+#endif
 
 EFI_GRAPHICS_OUTPUT_PROTOCOL *gop;
-Framebuffer framebuffer;
+BootInfo bootInfo;
+
+static void SetMasks(Framebuffer* fb, uint32_t format, uint32_t red, uint32_t green, uint32_t blue) {
+    fb->pixelFormat = format;
+    fb->redMask = red;
+    fb->greenMask = green;
+    fb->blueMask = blue;
+    fb->reservedMask = ~(red | green | blue);
+}
+
+// Fills in the pixel format and masks of a mode the kernel can draw to, a
+// linear framebuffer with 32-bit pixels; returns 0 for any other mode.
+// Bit mask modes that are really RGBX or BGRX are reported as such.
+static int DescribePixels(const EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* info, Framebuffer* fb) {
+    if(info->PixelFormat == PixelRedGreenBlueReserved8BitPerColor) {
+        SetMasks(fb, PIXEL_FORMAT_RGBX, 0x0000FF, 0x00FF00, 0xFF0000);
+        return 1;
+    }
+    if(info->PixelFormat == PixelBlueGreenRedReserved8BitPerColor) {
+        SetMasks(fb, PIXEL_FORMAT_BGRX, 0xFF0000, 0x00FF00, 0x0000FF);
+        return 1;
+    }
+    if(info->PixelFormat != PixelBitMask) return 0;    // Blt-only: no framebuffer
+
+    const EFI_PIXEL_BITMASK* m = &info->PixelInformation;
+    uint32_t used = m->RedMask | m->GreenMask | m->BlueMask | m->ReservedMask;
+    if(!m->RedMask || !m->GreenMask || !m->BlueMask || !(used >> 24)) return 0;
+
+    if(m->RedMask == 0xFF0000 && m->GreenMask == 0x00FF00 && m->BlueMask == 0x0000FF) {
+        SetMasks(fb, PIXEL_FORMAT_BGRX, m->RedMask, m->GreenMask, m->BlueMask);
+    } else if(m->RedMask == 0x0000FF && m->GreenMask == 0x00FF00 && m->BlueMask == 0xFF0000) {
+        SetMasks(fb, PIXEL_FORMAT_RGBX, m->RedMask, m->GreenMask, m->BlueMask);
+    } else {
+        SetMasks(fb, PIXEL_FORMAT_BITMASK, m->RedMask, m->GreenMask, m->BlueMask);
+    }
+    return 1;
+}
+
+// Ranks every mode the firmware offers and returns the best, or -1 if none
+// has a framebuffer the kernel can use. Among equals BGRX wins, since the
+// kernel presents it with a plain copy.
+static INT32 SelectGopMode() {
+    INT32 best = -1;
+    UINT64 bestScore = 0;
+    for(UINT32 mode = 0; mode < gop->Mode->MaxMode; mode++) {
+        EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* info;
+        UINTN infoSize;
+        EFI_STATUS status = uefi_call_wrapper(gop->QueryMode, 4, gop, mode, &infoSize, &info);
+        if(status == EFI_NOT_STARTED) {
+            // Some firmware wants a mode set before it answers queries
+            uefi_call_wrapper(gop->SetMode, 2, gop, gop->Mode->Mode);
+            status = uefi_call_wrapper(gop->QueryMode, 4, gop, mode, &infoSize, &info);
+        }
+        if(EFI_ERROR(status)) continue;
+
+        Framebuffer pixels;
+        if(DescribePixels(info, &pixels)) {
+            UINT64 area = (UINT64)info->HorizontalResolution * info->VerticalResolution;
+            int preferred = info->HorizontalResolution == GOP_PREFERRED_WIDTH &&
+                            info->VerticalResolution == GOP_PREFERRED_HEIGHT;
+            UINT64 score = ((UINT64)preferred << 62) | (area << 1) |
+                           (pixels.pixelFormat == PIXEL_FORMAT_BGRX);
+            if(score > bestScore) {
+                bestScore = score;
+                best = mode;
+            }
+        }
+        FreePool(info);
+    }
+    return best;
+}
+
+// ACPI 2.0 RSDP if the firmware has one, else the 1.0 one
+static void FindAcpiRsdp() {
+    EFI_GUID acpi20 = ACPI_20_TABLE_GUID;
+    EFI_GUID acpi10 = ACPI_TABLE_GUID;
+    for(UINTN i = 0; i < ST->NumberOfTableEntries; i++) {
+        EFI_CONFIGURATION_TABLE* table = &ST->ConfigurationTable[i];
+        if(CompareGuid(&table->VendorGuid, &acpi20) == 0) {
+            bootInfo.acpiRsdp = (uint64_t)table->VendorTable;
+            return;
+        }
+        if(CompareGuid(&table->VendorGuid, &acpi10) == 0) {
+            bootInfo.acpiRsdp = (uint64_t)table->VendorTable;
+        }
+    }
+}
+
+// Fetches the final memory map and leaves boot services. The buffer gets
+// slack up front because once ExitBootServices has failed, only
+// GetMemoryMap and ExitBootServices may be called again. *attempted says
+// whether that point was reached.
+static EFI_STATUS ExitFirmware(EFI_HANDLE imageHandle, int* attempted) {
+    *attempted = 0;
+    UINTN mapSize = 0;
+    UINTN mapKey, descriptorSize;
+    UINT32 descriptorVersion;
+    EFI_STATUS status = uefi_call_wrapper(BS->GetMemoryMap, 5, &mapSize, NULL, &mapKey,
+                                          &descriptorSize, &descriptorVersion);
+    if(status != EFI_BUFFER_TOO_SMALL) return status;
+
+    UINTN bufferSize = mapSize + 16 * descriptorSize;
+    EFI_MEMORY_DESCRIPTOR* map = AllocatePool(bufferSize);
+    if(!map) return EFI_OUT_OF_RESOURCES;
+
+    for(int attempt = 0; attempt < 8; attempt++) {
+        mapSize = bufferSize;
+        status = uefi_call_wrapper(BS->GetMemoryMap, 5, &mapSize, map, &mapKey,
+                                   &descriptorSize, &descriptorVersion);
+        if(EFI_ERROR(status)) return status;
+
+        *attempted = 1;
+        status = uefi_call_wrapper(BS->ExitBootServices, 2, imageHandle, mapKey);
+        if(!EFI_ERROR(status)) {
+            bootInfo.memoryMap = (uint8_t*)map;
+            bootInfo.memoryMapSize = mapSize;
+            bootInfo.descriptorSize = descriptorSize;
+            return EFI_SUCCESS;
+        }
+    }
+    return status;
+}
 
 EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
+    bootInfo.phaseTsc[BOOT_PHASE_EFI_ENTRY] = rdtsc();
     InitializeLib(ImageHandle, SystemTable);
     
     uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
@@ -27,20 +159,62 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     
     Print(L"[OK] Graphics Protocol located\n\r");
     
-    status = uefi_call_wrapper(gop->SetMode, 2, gop, 0);
+    INT32 mode = SelectGopMode();
+    if(mode < 0) {
+        Print(L"[ERROR] No 32-bit graphics mode with a framebuffer\n\r");
+        uefi_call_wrapper(BS->Stall, 1, 5000000);
+        return EFI_UNSUPPORTED;
+    }
+    // Switching modes can take a while and blanks some screens; skip it
+    // when the firmware is already there
+    if((UINT32)mode != gop->Mode->Mode) {
+        status = uefi_call_wrapper(gop->SetMode, 2, gop, (UINT32)mode);
+        if(EFI_ERROR(status)) {
+            Print(L"[ERROR] Failed to set graphics mode %d\n\r", mode);
+            uefi_call_wrapper(BS->Stall, 1, 5000000);
+            return status;
+        }
+    }
     
-    framebuffer.base = (uint32_t*)gop->Mode->FrameBufferBase;
-    framebuffer.width = gop->Mode->Info->HorizontalResolution;
-    framebuffer.height = gop->Mode->Info->VerticalResolution;
-    framebuffer.pixelsPerScanLine = gop->Mode->Info->PixelsPerScanLine;
+    Framebuffer* framebuffer = &bootInfo.framebuffer;
+    framebuffer->base = (uint32_t*)gop->Mode->FrameBufferBase;
+    framebuffer->width = gop->Mode->Info->HorizontalResolution;
+    framebuffer->height = gop->Mode->Info->VerticalResolution;
+    framebuffer->pixelsPerScanLine = gop->Mode->Info->PixelsPerScanLine;
+    DescribePixels(gop->Mode->Info, framebuffer);
+    bootInfo.phaseTsc[BOOT_PHASE_GOP] = rdtsc();
     
-    Print(L"[OK] Graphics: %dx%d\n\r", framebuffer.width, framebuffer.height);
+    static const CHAR16* formatNames[] = { L"RGBX", L"BGRX", L"bit mask" };
+    Print(L"[OK] Graphics: mode %d of %d, %dx%d %s\n\r", mode, gop->Mode->MaxMode,
+          framebuffer->width, framebuffer->height, formatNames[framebuffer->pixelFormat]);
     
+    FindAcpiRsdp();
+    if(bootInfo.acpiRsdp) Print(L"[OK] ACPI tables found\n\r");
+
+    // Application processors start in real mode, so their entry page
+    // has to be below 1 MB
+    EFI_PHYSICAL_ADDRESS trampoline = 0x9F000;
+    status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateMaxAddress, EfiLoaderData, 1, &trampoline);
+    if(!EFI_ERROR(status)) bootInfo.apTrampoline = trampoline;
+
     uefi_call_wrapper(BS->SetWatchdogTimer, 4, 0, 0, 0, NULL);
     Print(L"[OK] Starting kernel...\n\r");
-    uefi_call_wrapper(BS->Stall, 1, 2000000);
+    if(!FAST_BOOT) uefi_call_wrapper(BS->Stall, 1, 2000000);
+    
+    // Nothing past this point may call into the firmware, not even to
+    // report a failed ExitBootServices
+    int attempted;
+    status = ExitFirmware(ImageHandle, &attempted);
+    if(EFI_ERROR(status)) {
+        if(!attempted) {
+            Print(L"[ERROR] No memory map for ExitBootServices\n\r");
+            uefi_call_wrapper(BS->Stall, 1, 5000000);
+        }
+        return status;
+    }
+    bootInfo.phaseTsc[BOOT_PHASE_EXIT_FIRMWARE] = rdtsc();
     
-    KernelMain(&framebuffer);
+    KernelMain(&bootInfo);
     
     while(1) { }
     return EFI_SUCCESS;
@@ -0,0 +1,35 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "types.h"
+
+#define MAX_CPUS 16
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oemId[6];
+    char oemTableId[8];
+    uint32_t oemRevision;
+    uint32_t creatorId;
+    uint32_t creatorRevision;
+} __attribute__((packed)) AcpiHeader;
+
+// What the MADT says about the interrupt controllers
+typedef struct {
+    int cpuCount;                 // enabled processors, boot CPU included
+    uint32_t apicIds[MAX_CPUS];
+    uint64_t lapicAddress;
+    int ioApicCount;
+    uint32_t ioApicAddress;       // first I/O APIC
+    int pcatCompat;               // 8259s present as well
+} MadtInfo;
+
+// Function declarations
+int InitAcpi(uint64_t rsdpAddress);
+const AcpiHeader* AcpiFindTable(const char* signature);
+const MadtInfo* GetMadtInfo();
+
+#endif
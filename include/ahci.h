@@ -0,0 +1,72 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "types.h"
+#include "block.h"
+
+#define AHCI_MAX_PORTS  32
+#define AHCI_PRDS       1         // per command; buffers are contiguous
+
+typedef volatile struct {
+    uint32_t clb, clbu;           // command list base
+    uint32_t fb, fbu;             // received FIS base
+    uint32_t is, ie;
+    uint32_t cmd;
+    uint32_t reserved0;
+    uint32_t tfd;                 // task file: ATA status and error
+    uint32_t sig;
+    uint32_t ssts, sctl, serr, sact;
+    uint32_t ci;                  // commands issued, cleared as they finish
+    uint32_t sntf, fbs;
+    uint32_t reserved1[11];
+    uint32_t vendor[4];
+} AhciPort;
+
+typedef volatile struct {
+    uint32_t cap, ghc, is, pi, vs;
+    uint32_t cccCtl, cccPorts, emLoc, emCtl, cap2, bohc;
+    uint8_t reserved[0xA0 - 0x2C];
+    uint8_t vendor[0x100 - 0xA0];
+    AhciPort ports[AHCI_MAX_PORTS];
+} AhciHba;
+
+typedef struct {
+    uint16_t flags;               // FIS length in dwords, write bit
+    uint16_t prdtLength;
+    volatile uint32_t prdByteCount;
+    uint32_t ctba, ctbau;         // command table, 128 byte aligned
+    uint32_t reserved[4];
+} AhciCommandHeader;
+
+typedef struct {
+    uint32_t dba, dbau;
+    uint32_t reserved;
+    uint32_t dbc;                 // byte count - 1
+} AhciPrd;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    AhciPrd prdt[AHCI_PRDS];
+} AhciCommandTable;
+
+// Register host to device FIS
+typedef struct {
+    uint8_t type;
+    uint8_t flags;                // bit 7: command
+    uint8_t command;
+    uint8_t featureLow;
+    uint8_t lba0, lba1, lba2;
+    uint8_t device;
+    uint8_t lba3, lba4, lba5;
+    uint8_t featureHigh;
+    uint8_t countLow, countHigh;
+    uint8_t icc, control;
+    uint8_t reserved[4];
+} AhciFisH2D;
+
+// Function declarations
+int InitAhci();
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "types.h"
+
+// Local APIC register offsets (xAPIC MMIO layout)
+#define LAPIC_ID            0x20
+#define LAPIC_VERSION       0x30
+#define LAPIC_TPR           0x80
+#define LAPIC_EOI           0xB0
+#define LAPIC_SVR           0xF0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_DELIVER_NMI   0x400
+#define LAPIC_DELIVER_EXTINT 0x700
+#define LAPIC_TIMER_ONESHOT 0x00000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DEADLINE 0x40000
+
+// Interrupt command register, low half
+#define LAPIC_ICR_FIXED     0x000
+#define LAPIC_ICR_INIT      0x500
+#define LAPIC_ICR_STARTUP   0x600
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_ICR_ASSERT    0x4000
+#define LAPIC_ICR_ALL_BUT_SELF 0xC0000
+
+// Function declarations
+int InitLapic();
+int LapicPresent();
+int LapicX2Mode();
+uint32_t LapicRead(uint32_t reg);
+void LapicWrite(uint32_t reg, uint32_t value);
+void LapicEoi();
+uint32_t LapicId();
+void InitLapicAp();
+void LapicSendIpi(uint32_t apicId, uint32_t command);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "types.h"
+#include "block.h"
+
+#define CACHE_BLOCK_SECTORS     8         // 4 KB, a page
+#define CACHE_BLOCKS            256       // 1 MB of cached disk
+#define CACHE_BUCKETS           512       // hash chains, a power of two
+#define CACHE_BATCH_SECTORS     128       // largest write-back request, 64 KB
+#define CACHE_WRITEBACK_MS      2000      // dirty data older than this goes out
+
+typedef struct {
+    uint64_t hits;                // blocks found in the cache
+    uint64_t misses;              // blocks read from the disk
+    uint64_t prefetches;          // misses started ahead of the read
+    uint64_t evictions;
+    uint64_t writebacks;          // write requests issued
+    uint64_t sectorsWritten;
+    uint64_t errors;
+    uint32_t dirtyBlocks;         // now
+    uint32_t usedBlocks;          // now
+} CacheStats;
+
+// Function declarations
+int InitCache();
+void StartCacheTask();
+int CacheRead(BlockDevice* dev, uint64_t lba, uint32_t count, void* buffer);
+int CacheWrite(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buffer);
+void CachePrefetch(BlockDevice* dev, uint64_t lba, uint32_t count);
+int CacheFlush(BlockDevice* dev);
+void GetCacheStats(CacheStats* out);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdint.h>
+
+// Rects at least this big (in bytes) use non-temporal stores
+#define BLIT_NT_THRESHOLD (1024 * 1024)
+
+typedef struct {
+    const char* name;
+    void (*fillRow)(uint32_t* dst, uint32_t color, int count);
+    void (*fillRowNT)(uint32_t* dst, uint32_t color, int count);
+    void (*copyRow)(uint32_t* dst, const uint32_t* src, int count);
+    void (*copyRowNT)(uint32_t* dst, const uint32_t* src, int count);
+    void (*blendRow)(uint32_t* dst, const uint32_t* src, int count);      // premultiplied over
+    void (*fillAlphaRow)(uint32_t* dst, uint32_t color, int count);       // premultiplied color over
+    void (*swapRow)(uint32_t* dst, const uint32_t* src, int count);       // copy, red and blue exchanged
+    void (*swapRowNT)(uint32_t* dst, const uint32_t* src, int count);
+} BlitKernels;
+
+// Function declarations
+void FillRowScalar(uint32_t* dst, uint32_t color, int count);
+void CopyRowScalar(uint32_t* dst, const uint32_t* src, int count);
+void FillRowSSE2(uint32_t* dst, uint32_t color, int count);
+void FillRowSSE2NT(uint32_t* dst, uint32_t color, int count);
+void CopyRowSSE2(uint32_t* dst, const uint32_t* src, int count);
+void CopyRowSSE2NT(uint32_t* dst, const uint32_t* src, int count);
+void FillRowAVX2(uint32_t* dst, uint32_t color, int count);
+void FillRowAVX2NT(uint32_t* dst, uint32_t color, int count);
+void CopyRowAVX2(uint32_t* dst, const uint32_t* src, int count);
+void CopyRowAVX2NT(uint32_t* dst, const uint32_t* src, int count);
+uint32_t PremultiplyColor(uint32_t argb);
+void BlendRowScalar(uint32_t* dst, const uint32_t* src, int count);
+void FillAlphaRowScalar(uint32_t* dst, uint32_t color, int count);
+void BlendRowSSE2(uint32_t* dst, const uint32_t* src, int count);
+void FillAlphaRowSSE2(uint32_t* dst, uint32_t color, int count);
+void BlendRowAVX2(uint32_t* dst, const uint32_t* src, int count);
+void FillAlphaRowAVX2(uint32_t* dst, uint32_t color, int count);
+void CopyRowSwapRBScalar(uint32_t* dst, const uint32_t* src, int count);
+void CopyRowSwapRBSSE2(uint32_t* dst, const uint32_t* src, int count);
+void CopyRowSwapRBSSE2NT(uint32_t* dst, const uint32_t* src, int count);
+void CopyRowSwapRBAVX2(uint32_t* dst, const uint32_t* src, int count);
+void CopyRowSwapRBAVX2NT(uint32_t* dst, const uint32_t* src, int count);
+void MemCopyRepMovsb(void* dst, const void* src, uint64_t n);
+void MemSetRepStosb(void* dst, uint8_t value, uint64_t n);
+void MemCopySSE2(void* dst, const void* src, uint64_t n);
+void MemSetSSE2(void* dst, uint8_t value, uint64_t n);
+void MemCopyAVX2(void* dst, const void* src, uint64_t n);
+void MemSetAVX2(void* dst, uint8_t value, uint64_t n);
+void BlitFence(void);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "types.h"
+
+#define BLOCK_SECTOR_SIZE   512
+#define MAX_BLOCK_DEVICES   8
+#define BLOCK_MAX_DEPTH     32
+
+// BlockRequest.status
+#define BLOCK_PENDING       0
+#define BLOCK_DONE          1
+#define BLOCK_FAILED        (-1)
+
+typedef struct {
+    uint64_t lba;
+    uint32_t count;               // sectors, at most the device's maxTransfer
+    int write;
+    void* buffer;                 // identity mapped, so also the DMA address
+    volatile int status;          // BLOCK_PENDING until the driver is done
+} BlockRequest;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sectorsRead;
+    uint64_t sectorsWritten;
+    uint64_t errors;
+    uint64_t queueFull;           // submits that waited for a free slot
+} BlockStats;
+
+// A disk as drivers register it. submit() and poll() are called with
+// interrupts off, so they never race each other on the boot CPU.
+typedef struct BlockDevice {
+    char name[8];
+    const char* driver;
+    uint64_t sectors;
+    uint32_t maxTransfer;         // sectors per request
+    int queueDepth;               // requests the driver takes at once
+    int inFlight;
+    int readOnly;
+    int failed;                   // timed out; no more requests
+    void* driverData;
+    int (*submit)(struct BlockDevice* dev, BlockRequest* req);    // 0 when full
+    void (*poll)(struct BlockDevice* dev);
+    BlockStats stats;
+} BlockDevice;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t us;
+} BlockBenchResult;
+
+// Function declarations
+int RegisterBlockDevice(BlockDevice* dev);
+int BlockDeviceCount();
+BlockDevice* GetBlockDevice(int index);
+BlockDevice* FindBlockDevice(const char* name);
+BlockDevice* CreateRamDisk(void* image, uint64_t sectors);
+int BlockSubmit(BlockDevice* dev, BlockRequest* req);
+void BlockPoll(BlockDevice* dev);
+int BlockWait(BlockDevice* dev, BlockRequest* req);
+void BlockComplete(BlockDevice* dev, BlockRequest* req, int ok);
+int BlockRead(BlockDevice* dev, uint64_t lba, uint32_t count, void* buffer);
+int BlockWrite(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buffer);
+int BlockBench(BlockDevice* dev, int random, uint32_t sectorsPerRequest, int depth,
+               uint64_t requests, BlockBenchResult* out);
+
+#endif
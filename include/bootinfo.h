@@ -0,0 +1,69 @@
+#ifndef BOOTINFO_H
+#define BOOTINFO_H
+
+#include "types.h"
+
+// Build with FAST_BOOT=1 to drop the loader's pause and the loading bar
+// and to bring up PS/2 while the first frame is drawn
+#ifndef FAST_BOOT
+#define FAST_BOOT 0
+#endif
+
+// Boot phases, stamped with the TSC as each one finishes. The loader
+// fills in the ones before KernelMain; the rest are BootMark() calls.
+#define BOOT_PHASE_EFI_ENTRY     0
+#define BOOT_PHASE_GOP           1
+#define BOOT_PHASE_EXIT_FIRMWARE 2
+#define BOOT_PHASE_KERNEL_ENTRY  3
+#define BOOT_PHASE_MEMORY        4
+#define BOOT_PHASE_TIMER         5
+#define BOOT_PHASE_SMP           6
+#define BOOT_PHASE_FAT           7
+#define BOOT_PHASE_MOUSE         8
+#define BOOT_PHASE_FIRST_FRAME   9
+#define BOOT_PHASES              10
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// UEFI memory types, as they appear in the memory map
+#define BOOT_MEM_RESERVED      0
+#define BOOT_MEM_LOADER_CODE   1
+#define BOOT_MEM_LOADER_DATA   2
+#define BOOT_MEM_BOOT_CODE     3
+#define BOOT_MEM_BOOT_DATA     4
+#define BOOT_MEM_RUNTIME_CODE  5
+#define BOOT_MEM_RUNTIME_DATA  6
+#define BOOT_MEM_CONVENTIONAL  7
+#define BOOT_MEM_UNUSABLE      8
+#define BOOT_MEM_ACPI_RECLAIM  9
+#define BOOT_MEM_ACPI_NVS      10
+#define BOOT_MEM_MMIO          11
+#define BOOT_MEM_MMIO_PORT     12
+
+// Same layout as EFI_MEMORY_DESCRIPTOR. Entries are descriptorSize apart,
+// which may be more than sizeof(BootMemoryDescriptor).
+typedef struct {
+    uint32_t type;
+    uint32_t pad;
+    uint64_t physicalStart;
+    uint64_t virtualStart;
+    uint64_t pageCount;
+    uint64_t attribute;
+} BootMemoryDescriptor;
+
+// What the bootloader hands KernelMain once boot services are gone
+typedef struct {
+    Framebuffer framebuffer;
+    uint8_t* memoryMap;
+    uint64_t memoryMapSize;
+    uint64_t descriptorSize;
+    uint64_t acpiRsdp;            // 0 if the firmware published none
+    uint64_t apTrampoline;        // free page below 1 MB for AP start code, or 0
+    uint64_t phaseTsc[BOOT_PHASES];   // 0 for phases not reached yet
+} BootInfo;
+
+#endif
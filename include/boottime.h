@@ -0,0 +1,18 @@
+#ifndef BOOTTIME_H
+#define BOOTTIME_H
+
+#include "types.h"
+#include "bootinfo.h"
+
+typedef struct {
+    const char* name;
+    uint64_t atUs;                // since efi_main, 0 if not reached
+    int reached;
+} BootPhase;
+
+// Function declarations
+void InitBootTime(BootInfo* info);
+void BootMark(int phase);
+int GetBootPhases(BootPhase* out);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include "types.h"
+
+#define MAX_DAMAGE_RECTS 16
+
+// Parallel repaint cuts damage along a grid of these cells, one work item each
+#define COMPOSE_TILE_SIZE 128
+#define MAX_COMPOSE_TILES 512
+
+// Soft drop shadow below and right of each window, and the darkening laid
+// over windows without focus (straight ARGB)
+#define WINDOW_SHADOW 6
+#define WINDOW_SHADOW_ALPHA 0x70
+#define INACTIVE_DIM_COLOR 0x28000000
+
+typedef struct {
+    uint64_t frames;
+    uint64_t lastFramePixels;
+    uint64_t lastFrameRects;
+    uint64_t totalPixels;
+    uint64_t peakFramePixels;
+    uint64_t lastFrameDrawn;      // pixels written while repainting; drawn / damaged
+    uint64_t totalDrawn;          // is the overdraw ratio
+    uint64_t totalPresentPixels;  // copied from the shadow to the framebuffer
+    uint64_t cursorOnlyFrames;    // presents with no repaint, just the cursor
+    uint64_t parallelFrames;      // repainted as tiles across cores
+    uint64_t lastFrameTiles;
+    uint64_t surfacePages;        // held by window surfaces
+} CompositorStats;
+
+// Function declarations
+void InvalidateRect(int x, int y, int w, int h);
+void InvalidateWindowRect(void* win, int x, int y, int w, int h);
+void InvalidateScreen();
+int RenderFrame();
+void PresentFrame();
+void ComposeFrame();
+void PresentRect(int x, int y, int w, int h);
+void GetCompositorStats(CompositorStats* out);
+void SetParallelCompose(int enabled);
+int ParallelCompose();
+uint64_t BenchmarkRepaint(int cores, int runs);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+#include "blit.h"
+#include "font.h"
+
+typedef struct {
+    char vendor[13];
+    char brand[49];
+    int family, model, stepping;
+    int sse3, ssse3, sse41, sse42, popcnt;
+    int xsave, avx, avx2, fma, bmi2, avx512f;
+    int erms;                     // fast rep movsb/stosb
+    int fsrm;                     // ... for short runs too
+    int avxUsable;                // AVX state enabled in XCR0
+    uint64_t xcr0;
+    uint32_t xsaveSize;           // bytes XSAVE writes for xcr0, 512 with FXSAVE
+} CpuFeatures;
+
+// Hot routines, each bound once at boot to the best variant for the CPU
+typedef struct {
+    const BlitKernels* blit;      // rect fills, blits, blends
+    GlyphRowFn glyphRow;
+    void (*memCopy)(void* dst, const void* src, uint64_t n);
+    void (*memSet)(void* dst, uint8_t value, uint64_t n);
+    const char* glyphName;
+    const char* memCopyName;
+    const char* memSetName;
+} CpuDispatch;
+
+// Function declarations
+void InitCpu();
+const CpuFeatures* GetCpuFeatures();
+void MemCopy(void* dst, const void* src, uint64_t n);
+void MemSet(void* dst, uint8_t value, uint64_t n);
+
+#endif
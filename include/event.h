@@ -0,0 +1,58 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "types.h"
+
+#define EVENT_QUEUE_SIZE 128
+
+// Window types 0-5: about, terminal, file browser, editor, tetris, paint.
+// Each type with app logic gets its own task and event queue.
+#define WINDOW_TYPES 6
+
+// Event types
+#define EVENT_KEY_DOWN     1
+#define EVENT_KEY_UP       2
+#define EVENT_POINTER_MOVE 3
+#define EVENT_BUTTON_DOWN  4
+#define EVENT_BUTTON_UP    5
+#define EVENT_TIMER        6
+#define EVENT_INVALIDATE   7
+
+typedef struct {
+    int type;
+    int window;         // target handle, or -1 for kernel input
+    uint64_t timeUs;    // when the oldest input folded into this event arrived
+    int x, y;           // pointer position, or invalidate origin
+    int w, h;           // invalidate size
+    int code;           // scancode, button bits, or timer ticks
+    uint32_t serial;    // the target window's serial, for app events
+} Event;
+
+typedef struct {
+    uint64_t posted;
+    uint64_t dispatched;
+    uint64_t mergedMoves;       // pointer moves folded into the one before
+    uint64_t mergedTimers;      // timer ticks delivered as one event
+    uint64_t mergedInvalidates;
+    uint64_t dropped;           // queue full
+    uint64_t lockContended;     // UI lock acquisitions that had to wait
+    uint32_t peakDepth;
+} EventStats;
+
+// Function declarations
+void PostEvent(const Event* ev);
+void PostKeyScancode(uint8_t scancode, uint64_t timeUs);
+void PostMousePacket(int deltaX, int deltaY, int buttons, uint64_t timeUs);
+void PostInvalidate(int window, int x, int y, int w, int h);
+void PostWindowEvent(int window, int type, int code, int x, int y);
+int SetWindowTimer(int window, uint32_t periodMs);
+void ClearWindowTimer(int window);
+int DispatchEvents();
+void StartEventTasks();
+void WakeInputTask();
+void UiLock();
+void UiUnlock();
+void UiYield();
+void GetEventStats(EventStats* out);
+
+#endif
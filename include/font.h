@@ -0,0 +1,15 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include "types.h"
+
+typedef void (*GlyphRowFn)(uint32_t* dst, uint8_t bits, uint32_t color);
+
+// Function declarations
+void GlyphRowScalar(uint32_t* dst, uint8_t bits, uint32_t color);
+void GlyphRowSSE2(uint32_t* dst, uint8_t bits, uint32_t color);
+void GlyphRowAVX2(uint32_t* dst, uint8_t bits, uint32_t color);
+void RenderTextRun(uint32_t* pixels, int stride, const Rect* clip, int x, int y,
+                   const char* text, int len, uint32_t color, GlyphRowFn glyphRow);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "types.h"
+
+#define FRAME_RATE_HZ 60
+
+// Times are in microseconds. "last" values describe the latest frame that
+// had something to render; idle frames only bump frames and idleFrames.
+typedef struct {
+    uint32_t targetHz;
+    uint64_t frames;
+    uint64_t idleFrames;
+    uint64_t missedFrames;      // frame slots skipped because work overran
+    uint32_t lastLockUs;        // waiting for the UI lock
+    uint32_t lastRenderUs;
+    uint32_t lastPresentUs;
+    uint32_t peakFrameUs;       // worst lock wait + render + present
+    uint64_t totalLockUs;
+    uint64_t totalRenderUs;
+    uint64_t totalPresentUs;
+} FrameStats;
+
+// Function declarations
+void StartFrameTask();
+void GetFrameStats(FrameStats* out);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "types.h"
+
+// Small objects come from one-page slabs in power of two size classes,
+// 16 to 1024 bytes; anything bigger gets whole pages of its own
+#define HEAP_MIN_SHIFT   4
+#define HEAP_CLASSES     7
+#define HEAP_MAX_SMALL   (1 << (HEAP_MIN_SHIFT + HEAP_CLASSES - 1))
+
+typedef struct {
+    uint32_t size;                // object size of the class
+    uint32_t slabs;               // pages held, empty ones included
+    uint64_t inUse;
+    uint64_t allocations;
+    uint64_t frees;
+} HeapClassStats;
+
+typedef struct {
+    HeapClassStats classes[HEAP_CLASSES];
+    uint64_t largeInUse;          // objects on the page path
+    uint64_t largePages;
+    uint64_t largeAllocations;
+    uint64_t largeFrees;
+    uint64_t bytesInUse;          // rounded up to the class or to pages
+    uint64_t peakBytesInUse;
+    uint64_t failures;
+    uint64_t badFrees;            // pointers the heap did not hand out
+} HeapStats;
+
+// Function declarations
+void* HeapAlloc(uint64_t size);
+void* HeapAllocZeroed(uint64_t size);
+void HeapFree(void* ptr);
+void GetHeapStats(HeapStats* out);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+
+#include "types.h"
+
+#define IDT_ENTRIES 256
+#define EXCEPTION_VECTORS 32
+
+// Vectors owned by the kernel. The 8259 PICs are remapped to 0x20-0x2F
+// and reach the CPU through LAPIC LINT0; LAPIC sources sit above them.
+#define VECTOR_IRQ_BASE 0x20
+#define VECTOR_TIMER    0x40
+#define VECTOR_SMP_WAKE 0x50
+#define VECTOR_YIELD    0x81
+#define VECTOR_SPURIOUS 0xFF
+
+// Legacy IRQ lines
+#define IRQ_KEYBOARD 1
+#define IRQ_CASCADE  2
+#define IRQ_MOUSE    12
+
+// Room in the frame for the FPU/SSE/AVX state: XSAVE with x87, SSE and
+// AVX enabled needs 832 bytes at a 64-byte boundary, which can be up to 48
+// bytes into the area since the frame itself is only 16-byte aligned
+#define FPU_STATE_SIZE 1088
+#define FPU_XSAVE_MAX  (FPU_STATE_SIZE - 48)
+
+// Stack layout built by the interrupt stubs, lowest address first. The
+// FPU/SSE/AVX state is part of the frame so a handler may use vector code
+// and a preempted task keeps its vector registers.
+typedef struct {
+    uint8_t fpuState[FPU_STATE_SIZE];     // see FrameFpuState()
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t errorCode;        // 0 for vectors without one
+    uint64_t rip, cs, rflags, rsp, ss;
+} InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame* frame);
+
+// Function declarations
+void InitInterrupts();
+void SetInterruptHandler(int vector, InterruptHandler handler);
+void EnableInterrupts();
+uint64_t DisableInterrupts();
+void RestoreInterrupts(uint64_t flags);
+uint64_t InterruptCount(int vector);
+int InInterrupt();
+void PicUnmask(int irq);
+void PicEoi(int irq);
+void SetFpuSaveMode(int xsave);
+uint8_t* FrameFpuState(InterruptFrame* frame);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "types.h"
+
+#define KLOG_LINES 64
+#define KLOG_LINE_LENGTH 80
+
+// Function declarations
+void KLog(const char* text);
+int KLogLineCount();
+const char* KLogLine(int index);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef MEMTYPE_H
+#define MEMTYPE_H
+
+#include "types.h"
+
+// x86 memory type encodings, shared by the PAT and the MTRRs
+#define MEMTYPE_UC  0
+#define MEMTYPE_WC  1
+#define MEMTYPE_WT  4
+#define MEMTYPE_WP  5
+#define MEMTYPE_WB  6
+#define MEMTYPE_UCM 7   // UC-, PAT only
+#define MEMTYPE_NONE -1
+
+// PAT slot reprogrammed to WC; slots 0-3 keep their power-on types so
+// entries the firmware built still mean what they did.
+#define PAT_WC_INDEX 4
+
+#define PT_POOL_PAGES 16
+
+// Function declarations
+int InitPat();
+int SetRangeWriteCombining(uint64_t base, uint64_t size);
+int PageTablesUsed();
+int PageMemType(uint64_t addr);
+int MtrrMemType(uint64_t addr);
+const char* MemTypeName(int type);
+
+#endif
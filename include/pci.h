@@ -0,0 +1,55 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "types.h"
+
+#define MAX_PCI_DEVICES 64
+
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_CLASS           0x08      // revision, prog IF, subclass, class
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_SECONDARY_BUS   0x19      // bridges
+#define PCI_SUBSYSTEM_ID    0x2E
+#define PCI_CAPABILITIES    0x34
+#define PCI_INTERRUPT_LINE  0x3C
+
+#define PCI_COMMAND_IO      0x0001
+#define PCI_COMMAND_MEMORY  0x0002
+#define PCI_COMMAND_MASTER  0x0004
+#define PCI_COMMAND_INTX_OFF 0x0400
+
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_CLASS_BRIDGE    0x06
+#define PCI_SUBCLASS_SATA   0x06
+#define PCI_SUBCLASS_PCI_BRIDGE 0x04
+
+typedef struct {
+    uint8_t bus, device, function;
+    uint16_t vendorId, deviceId;
+    uint8_t classCode, subclass, progIf;
+    uint8_t irqLine;
+} PciDevice;
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    int io;                       // I/O ports rather than memory
+} PciBar;
+
+// Function declarations
+void InitPci();
+uint32_t PciRead32(const PciDevice* dev, uint8_t offset);
+uint16_t PciRead16(const PciDevice* dev, uint8_t offset);
+uint8_t PciRead8(const PciDevice* dev, uint8_t offset);
+void PciWrite32(const PciDevice* dev, uint8_t offset, uint32_t value);
+void PciWrite16(const PciDevice* dev, uint8_t offset, uint16_t value);
+int PciReadBar(const PciDevice* dev, int index, PciBar* out);
+void PciEnable(const PciDevice* dev, uint16_t command);
+const PciDevice* PciFindClass(uint8_t classCode, uint8_t subclass, int progIf, int nth);
+const PciDevice* PciFindDevice(uint16_t vendorId, uint16_t deviceId, int nth);
+int GetPciDevices(const PciDevice** out);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include "types.h"
+#include "bootinfo.h"
+
+#define PAGE_SIZE 4096
+#define PAGES_FOR(bytes) (((uint64_t)(bytes) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+typedef struct {
+    uint64_t totalPages;          // RAM the kernel may hand out, used or not
+    uint64_t freePages;
+    uint64_t reclaimedPages;      // from boot-services memory
+    uint64_t bitmapPages;
+    uint64_t tablePages;          // kernel page tables
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t failures;
+    uint64_t peakUsedPages;
+} PageStats;
+
+// Function declarations
+void InitPageAllocator(const BootInfo* info);
+void ReclaimBootMemory();
+void* AllocPages(uint64_t count);
+void* AllocZeroedPages(uint64_t count);
+void FreePages(void* addr, uint64_t count);
+void GetPageStats(PageStats* out);
+
+#endif
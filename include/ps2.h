@@ -0,0 +1,35 @@
+#ifndef PS2_H
+#define PS2_H
+
+#include "types.h"
+
+#define PS2_DATA    0x60
+#define PS2_STATUS  0x64
+#define PS2_COMMAND 0x64
+
+#define PS2_RING_SIZE 256       // events per device, power of two
+#define PS2_TIMEOUT_US 20000
+
+// One keyboard scancode (bytes[0]) or one complete 3-byte mouse packet,
+// stamped with ClockUs() when the interrupt read it
+typedef struct {
+    uint64_t timeUs;
+    uint8_t bytes[3];
+} Ps2Event;
+
+typedef struct {
+    uint64_t keyEvents;
+    uint64_t mousePackets;
+    uint64_t dropped;           // ring full
+    uint64_t resyncs;           // mouse bytes thrown away to find a packet start
+    uint32_t maxDepth;
+    uint32_t lastLatencyUs;     // interrupt to handler
+    uint32_t maxLatencyUs;
+} Ps2Stats;
+
+// Function declarations
+void InitPs2();
+int ProcessInput();
+void GetPs2Stats(Ps2Stats* out);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include "types.h"
+
+#define MAX_REGION_RECTS 32
+
+// Set of non-overlapping rects
+typedef struct {
+    int count;
+    Rect rects[MAX_REGION_RECTS];
+} Region;
+
+// Function declarations
+void RegionSet(Region* region, const Rect* rect);
+int RegionSubtract(Region* region, const Rect* cut);
+int RegionArea(const Region* region);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+#include "acpi.h"
+
+// Stack for each application processor, from the page allocator
+#define SMP_STACK_SIZE 0x10000
+
+// Per-CPU area; GS points at it on every core
+typedef struct PerCpu {
+    struct PerCpu* self;          // read through %gs:0
+    int index;                    // 0 is the boot CPU
+    uint32_t apicId;
+    volatile int online;
+    int interruptDepth;
+    uint64_t stackTop;
+    uint64_t items;               // SmpRun() work items done here
+    uint64_t wakeups;
+} PerCpu;
+
+typedef void (*SmpWorkFn)(int item, void* arg);
+
+typedef struct {
+    int cpus;                     // online, boot CPU included
+    uint64_t jobs;
+    uint64_t items;
+} SmpStats;
+
+static inline PerCpu* ThisCpu() {
+    PerCpu* cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Function declarations
+void InitBootCpu();
+int InitSmp(uint64_t trampolinePage);
+int CpuCount();
+const PerCpu* GetCpu(int index);
+void SmpRun(SmpWorkFn fn, void* arg, int items, int cores);
+void GetSmpStats(SmpStats* out);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "types.h"
+#include "interrupt.h"
+
+#define MAX_TASKS 16
+#define TASK_NAME_LENGTH 16
+
+// Each task's stack comes from the page allocator
+#define TASK_STACK_SIZE 0x10000
+
+// Time slice for tasks of equal priority
+#define TASK_SLICE_US 10000
+
+// Priorities, most urgent first. A ready task always runs before any
+// task of a lower priority.
+#define TASK_PRIORITY_HIGH   0     // input, compositor
+#define TASK_PRIORITY_NORMAL 1     // apps
+#define TASK_PRIORITY_IDLE   2
+#define TASK_PRIORITIES      3
+
+// Task states
+#define TASK_UNUSED   0
+#define TASK_READY    1
+#define TASK_RUNNING  2
+#define TASK_BLOCKED  3
+#define TASK_SLEEPING 4
+#define TASK_DEAD     5
+
+typedef void (*TaskEntry)(void* arg);
+
+typedef struct {
+    int id;
+    char name[TASK_NAME_LENGTH];
+    int state;
+    int priority;
+    uint64_t cpuUs;
+    uint64_t switches;      // times switched in
+} TaskInfo;
+
+// Sleeping lock. Waiters block instead of spinning; unlocking wakes them
+// all and lets the most urgent one in first.
+typedef struct {
+    volatile int locked;
+    int owner;
+    uint32_t waiters;       // bit per task id
+    uint64_t contended;     // lock attempts that had to wait
+} Mutex;
+
+// Function declarations
+void InitTasks();
+int CreateTask(const char* name, int priority, TaskEntry entry, void* arg);
+int TaskingActive();
+int CurrentTask();
+void TaskYield();
+void TaskWait();
+void TaskWake(int id);
+void TaskSleepUntilUs(uint64_t deadlineUs);
+void RunIdleTask();
+int TaskSwitchPending();
+uint64_t TaskSwitch(InterruptFrame* frame);
+void MutexLock(Mutex* m);
+void MutexUnlock(Mutex* m);
+int GetTaskList(TaskInfo* out, int max);
+
+#endif
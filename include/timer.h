@@ -0,0 +1,35 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+#define MAX_TIMERS 16
+#define PIT_HZ 1193182
+
+typedef void (*TimerCallback)(void* arg);
+
+typedef struct {
+    uint64_t tscHz;
+    uint64_t lapicHz;       // LAPIC timer input after the divider; 0 if unused
+    int invariantTsc;
+    int tscDeadline;        // LAPIC timer armed by absolute TSC value
+    int activeTimers;
+    uint64_t interrupts;
+    uint64_t callbacks;
+} TimerInfo;
+
+// Function declarations
+void InitTimer();
+uint64_t ClockNs();
+uint64_t ClockUs();
+uint64_t ClockMs();
+uint64_t TscToUs(uint64_t ticks);
+int TimerOneShot(uint64_t delayUs, TimerCallback fn, void* arg);
+int TimerPeriodic(uint64_t periodUs, TimerCallback fn, void* arg);
+void TimerCancel(int handle);
+void SleepUntilUs(uint64_t deadlineUs);
+void SleepUs(uint64_t us);
+void SleepMs(uint64_t ms);
+void GetTimerInfo(TimerInfo* out);
+
+#endif
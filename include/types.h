@@ -3,11 +3,36 @@
 
 #include <stdint.h>
 
+// Framebuffer pixel layouts, numbered like EFI_GRAPHICS_PIXEL_FORMAT. All
+// are 32 bits per pixel; the kernel draws in BGRX (0x00RRGGBB) and the
+// present step writes whatever the framebuffer wants.
+#define PIXEL_FORMAT_RGBX    0    // red in the lowest byte
+#define PIXEL_FORMAT_BGRX    1    // blue in the lowest byte
+#define PIXEL_FORMAT_BITMASK 2    // anything else, described by the masks
+
 typedef struct {
     uint32_t *base;
     uint64_t width;
     uint64_t height;
     uint64_t pixelsPerScanLine;
+    uint32_t pixelFormat;
+    uint32_t redMask;
+    uint32_t greenMask;
+    uint32_t blueMask;
+    uint32_t reservedMask;
 } Framebuffer;
 
+typedef struct {
+    int x, y, w, h;
+} Rect;
+
+// Pixels are premultiplied ARGB. Opaque layers (window surfaces, the screen)
+// are copied rather than blended, so their alpha byte is not looked at.
+typedef struct {
+    uint32_t *pixels;
+    int width;
+    int height;
+    int stride;
+} Surface;
+
 #endif
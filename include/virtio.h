@@ -0,0 +1,46 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "types.h"
+#include "block.h"
+
+#define VIRTIO_VENDOR_ID        0x1AF4
+#define VIRTIO_BLK_LEGACY_ID    0x1001
+#define VIRTIO_BLK_MODERN_ID    0x1042
+
+// Split virtqueue, laid out as the legacy interface wants it: descriptors,
+// then the available ring, then the used ring on the next page
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VirtqDesc;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} VirtqAvail;
+
+typedef struct {
+    uint32_t id;                  // head descriptor of the chain
+    uint32_t len;
+} VirtqUsedElem;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    VirtqUsedElem ring[];
+} VirtqUsed;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} VirtioBlkHeader;
+
+// Function declarations
+int InitVirtioBlk();
+
+#endif
@@ -0,0 +1,216 @@
+// ACPI table lookup. The bootloader hands over the RSDP from the EFI
+// configuration table; without one the BIOS area below 1 MB is searched.
+// Tables are found through the XSDT (or the RSDT on ACPI 1.0) and checked
+// against their checksums. Only the MADT is parsed so far, for the local
+// APIC ids of the processors.
+
+#ifndef ACPI_C
+#define ACPI_C
+
+#include "../include/acpi.h"
+
+#define MADT_LOCAL_APIC     0
+#define MADT_IO_APIC        1
+#define MADT_LAPIC_OVERRIDE 5
+#define MADT_LOCAL_X2APIC   9
+#define MADT_CPU_ENABLED    1
+#define MADT_PCAT_COMPAT    1
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oemId[6];
+    uint8_t revision;
+    uint32_t rsdtAddress;
+    uint32_t length;            // ACPI 2.0 and later from here on
+    uint64_t xsdtAddress;
+    uint8_t extendedChecksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    AcpiHeader header;
+    uint32_t lapicAddress;
+    uint32_t flags;
+} __attribute__((packed)) AcpiMadt;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) MadtEntry;
+
+typedef struct {
+    MadtEntry entry;
+    uint8_t processorId;
+    uint8_t apicId;
+    uint32_t flags;
+} __attribute__((packed)) MadtLocalApic;
+
+typedef struct {
+    MadtEntry entry;
+    uint8_t ioApicId;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsiBase;
+} __attribute__((packed)) MadtIoApic;
+
+typedef struct {
+    MadtEntry entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed)) MadtLapicOverride;
+
+typedef struct {
+    MadtEntry entry;
+    uint16_t reserved;
+    uint32_t apicId;
+    uint32_t flags;
+    uint32_t processorUid;
+} __attribute__((packed)) MadtLocalX2Apic;
+
+static const AcpiRsdp* rsdp = NULL;
+static MadtInfo madtInfo;
+static int madtFound = 0;
+
+static int AcpiChecksumOk(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+static const AcpiRsdp* CheckRsdp(uint64_t addr) {
+    const AcpiRsdp* candidate = (const AcpiRsdp*)addr;
+    if(strncmp(candidate->signature, "RSD PTR ", 8) != 0) return NULL;
+    if(!AcpiChecksumOk(candidate, 20)) return NULL;
+    if(candidate->revision >= 2 && !AcpiChecksumOk(candidate, candidate->length)) return NULL;
+    return candidate;
+}
+
+// The RSDP sits on a 16 byte boundary in the BIOS ROM area on legacy boots
+static const AcpiRsdp* FindRsdp(uint64_t hint) {
+    if(hint) {
+        const AcpiRsdp* found = CheckRsdp(hint);
+        if(found) return found;
+    }
+    for(uint64_t addr = 0xE0000; addr < 0x100000; addr += 16) {
+        const AcpiRsdp* found = CheckRsdp(addr);
+        if(found) return found;
+    }
+    return NULL;
+}
+
+static const AcpiHeader* CheckTable(uint64_t addr, const char* signature) {
+    const AcpiHeader* table = (const AcpiHeader*)addr;
+    if(!table || strncmp(table->signature, signature, 4) != 0) return NULL;
+    if(!AcpiChecksumOk(table, table->length)) return NULL;
+    return table;
+}
+
+const AcpiHeader* AcpiFindTable(const char* signature) {
+    if(!rsdp) return NULL;
+
+    if(rsdp->revision >= 2 && rsdp->xsdtAddress) {
+        const AcpiHeader* xsdt = CheckTable(rsdp->xsdtAddress, "XSDT");
+        if(xsdt) {
+            const uint8_t* entries = (const uint8_t*)xsdt + sizeof(AcpiHeader);
+            int count = (xsdt->length - sizeof(AcpiHeader)) / 8;
+            for(int i = 0; i < count; i++) {
+                const AcpiHeader* table = CheckTable(*(const uint64_t*)(entries + i * 8), signature);
+                if(table) return table;
+            }
+            return NULL;
+        }
+    }
+
+    const AcpiHeader* rsdt = CheckTable(rsdp->rsdtAddress, "RSDT");
+    if(!rsdt) return NULL;
+    const uint8_t* entries = (const uint8_t*)rsdt + sizeof(AcpiHeader);
+    int count = (rsdt->length - sizeof(AcpiHeader)) / 4;
+    for(int i = 0; i < count; i++) {
+        const AcpiHeader* table = CheckTable(*(const uint32_t*)(entries + i * 4), signature);
+        if(table) return table;
+    }
+    return NULL;
+}
+
+static void AddMadtCpu(uint32_t apicId) {
+    for(int i = 0; i < madtInfo.cpuCount; i++) {
+        if(madtInfo.apicIds[i] == apicId) return;
+    }
+    if(madtInfo.cpuCount < MAX_CPUS) madtInfo.apicIds[madtInfo.cpuCount++] = apicId;
+}
+
+// Processors that are disabled, or only online capable, are left out
+static void ParseMadt(const AcpiMadt* madt) {
+    madtInfo.lapicAddress = madt->lapicAddress;
+    madtInfo.pcatCompat = (madt->flags & MADT_PCAT_COMPAT) != 0;
+
+    const uint8_t* p = (const uint8_t*)madt + sizeof(AcpiMadt);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    while(p + sizeof(MadtEntry) <= end) {
+        const MadtEntry* entry = (const MadtEntry*)p;
+        if(entry->length < sizeof(MadtEntry) || p + entry->length > end) break;
+
+        if(entry->type == MADT_LOCAL_APIC) {
+            const MadtLocalApic* lapic = (const MadtLocalApic*)p;
+            if(lapic->flags & MADT_CPU_ENABLED) AddMadtCpu(lapic->apicId);
+        } else if(entry->type == MADT_LOCAL_X2APIC) {
+            const MadtLocalX2Apic* x2apic = (const MadtLocalX2Apic*)p;
+            if(x2apic->flags & MADT_CPU_ENABLED) AddMadtCpu(x2apic->apicId);
+        } else if(entry->type == MADT_IO_APIC) {
+            const MadtIoApic* ioApic = (const MadtIoApic*)p;
+            if(madtInfo.ioApicCount == 0) madtInfo.ioApicAddress = ioApic->address;
+            madtInfo.ioApicCount++;
+        } else if(entry->type == MADT_LAPIC_OVERRIDE) {
+            madtInfo.lapicAddress = ((const MadtLapicOverride*)p)->address;
+        }
+        p += entry->length;
+    }
+}
+
+// rsdpAddress comes from the EFI configuration table, 0 if there was none
+int InitAcpi(uint64_t rsdpAddress) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+
+    rsdp = FindRsdp(rsdpAddress);
+    if(!rsdp) {
+        KLog("acpi: no RSDP, single processor");
+        return 0;
+    }
+    strcpy(line, "acpi: RSDP at ");
+    HexToStr((uint64_t)rsdp, num);
+    strcat(line, num);
+    strcat(line, ", revision ");
+    IntToStr(rsdp->revision, num);
+    strcat(line, num);
+    KLog(line);
+
+    const AcpiHeader* madt = AcpiFindTable("APIC");
+    if(!madt) {
+        KLog("acpi: no MADT");
+        return 0;
+    }
+    ParseMadt((const AcpiMadt*)madt);
+    madtFound = 1;
+
+    strcpy(line, "acpi: MADT lists ");
+    IntToStr(madtInfo.cpuCount, num);
+    strcat(line, num);
+    strcat(line, " cpus, ");
+    IntToStr(madtInfo.ioApicCount, num);
+    strcat(line, num);
+    strcat(line, " I/O APIC at ");
+    HexToStr(madtInfo.ioApicAddress, num);
+    strcat(line, num);
+    KLog(line);
+    return 1;
+}
+
+// NULL when there is no MADT
+const MadtInfo* GetMadtInfo() {
+    return madtFound ? &madtInfo : NULL;
+}
+
+#endif // ACPI_C
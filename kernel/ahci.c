@@ -0,0 +1,253 @@
+// AHCI SATA driver. Every port with a disk behind it becomes a block device
+// with its own command list; requests go out as READ/WRITE DMA EXT in
+// separate command slots, so several are queued with the HBA at once and
+// it works through them in order. NCQ would let the disk reorder them but
+// needs SActive bookkeeping and the FPDMA commands; QEMU's AHCI gains
+// little from it.
+//
+// Each slot has a command table with one PRD, enough for any identity
+// mapped buffer. The HBA stays in AHCI mode with its interrupts off and
+// the block layer polls PxCI. A task file error fails everything queued on
+// the port and restarts it.
+
+#ifndef AHCI_C
+#define AHCI_C
+
+#include "../include/ahci.h"
+
+#define AHCI_BAR                5
+#define AHCI_GHC_IE             (1U << 1)
+#define AHCI_GHC_AE             (1U << 31)
+#define AHCI_CAP_S64A           (1U << 31)
+#define AHCI_CMD_ST             (1 << 0)
+#define AHCI_CMD_FRE            (1 << 4)
+#define AHCI_CMD_FR             (1 << 14)
+#define AHCI_CMD_CR             (1 << 15)
+#define AHCI_IS_TFES            (1 << 30)
+#define AHCI_TFD_ERR            0x01
+#define AHCI_SSTS_DET_PRESENT   3
+#define AHCI_SIG_ATA            0x00000101
+#define AHCI_HEADER_WRITE       (1 << 6)
+#define AHCI_TABLE_SIZE         256           // per slot, keeps 128 byte alignment
+
+#define FIS_TYPE_REG_H2D        0x27
+#define ATA_READ_DMA_EXT        0x25
+#define ATA_WRITE_DMA_EXT       0x35
+#define ATA_IDENTIFY            0xEC
+#define ATA_DEVICE_LBA          0x40
+
+#define AHCI_MAX_DISKS          4
+#define AHCI_MAX_TRANSFER       256           // sectors, 128 KB
+#define AHCI_STOP_TIMEOUT_US    500000
+#define AHCI_IDENTIFY_TIMEOUT_US 1000000
+
+typedef struct {
+    BlockDevice dev;
+    AhciPort* port;
+    int slotCount;
+    uint32_t busy;                // slots issued and not yet retired
+    AhciCommandHeader* commandList;
+    uint8_t* tables;
+    BlockRequest* slots[BLOCK_MAX_DEPTH];
+} AhciDisk;
+
+static int ahciDiskCount = 0;
+
+static int WaitClear(volatile uint32_t* reg, uint32_t bits, uint64_t timeoutUs) {
+    uint64_t start = ClockUs();
+    while(*reg & bits) {
+        if(ClockUs() - start > timeoutUs) return 0;
+        __asm__ volatile("pause");
+    }
+    return 1;
+}
+
+static int StopPort(AhciPort* port) {
+    port->cmd &= ~AHCI_CMD_ST;
+    if(!WaitClear(&port->cmd, AHCI_CMD_CR, AHCI_STOP_TIMEOUT_US)) return 0;
+    port->cmd &= ~AHCI_CMD_FRE;
+    return WaitClear(&port->cmd, AHCI_CMD_FR, AHCI_STOP_TIMEOUT_US);
+}
+
+static void StartPort(AhciPort* port) {
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    port->cmd |= AHCI_CMD_FRE;
+    WaitClear(&port->cmd, AHCI_CMD_CR, AHCI_STOP_TIMEOUT_US);
+    port->cmd |= AHCI_CMD_ST;
+}
+
+static void BuildCommand(AhciDisk* disk, int slot, uint8_t command, uint64_t lba,
+                         uint32_t count, void* buffer, uint32_t bytes, int write) {
+    AhciCommandHeader* header = &disk->commandList[slot];
+    AhciCommandTable* table = (AhciCommandTable*)(disk->tables + slot * AHCI_TABLE_SIZE);
+
+    AhciFisH2D* fis = (AhciFisH2D*)table->cfis;
+    MemSet(fis, 0, sizeof(AhciFisH2D));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = 0x80;
+    fis->command = command;
+    fis->device = ATA_DEVICE_LBA;
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    fis->lba4 = lba >> 32;
+    fis->lba5 = lba >> 40;
+    fis->countLow = count;
+    fis->countHigh = count >> 8;
+
+    table->prdt[0].dba = (uint32_t)(uint64_t)buffer;
+    table->prdt[0].dbau = (uint64_t)buffer >> 32;
+    table->prdt[0].reserved = 0;
+    table->prdt[0].dbc = bytes - 1;
+
+    header->flags = sizeof(AhciFisH2D) / 4 | (write ? AHCI_HEADER_WRITE : 0);
+    header->prdtLength = 1;
+    header->prdByteCount = 0;
+}
+
+static void FailAll(AhciDisk* disk) {
+    for(int slot = 0; slot < disk->slotCount; slot++) {
+        if(!(disk->busy & (1U << slot))) continue;
+        BlockRequest* req = disk->slots[slot];
+        disk->slots[slot] = NULL;
+        BlockComplete(&disk->dev, req, 0);
+    }
+    disk->busy = 0;
+}
+
+static int AhciSubmit(BlockDevice* dev, BlockRequest* req) {
+    AhciDisk* disk = (AhciDisk*)dev->driverData;
+    uint32_t free = ~disk->busy & (disk->slotCount == 32 ? 0xFFFFFFFF : (1U << disk->slotCount) - 1);
+    if(!free) return 0;
+    int slot = __builtin_ctz(free);
+
+    BuildCommand(disk, slot, req->write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT, req->lba,
+                 req->count, req->buffer, req->count * BLOCK_SECTOR_SIZE, req->write);
+    disk->slots[slot] = req;
+    disk->busy |= 1U << slot;
+    __sync_synchronize();
+    disk->port->ci = 1U << slot;
+    return 1;
+}
+
+static void AhciPoll(BlockDevice* dev) {
+    AhciDisk* disk = (AhciDisk*)dev->driverData;
+    AhciPort* port = disk->port;
+    if(!disk->busy) return;
+
+    if((port->is & AHCI_IS_TFES) || (port->tfd & AHCI_TFD_ERR)) {
+        StopPort(port);
+        FailAll(disk);
+        StartPort(port);
+        return;
+    }
+
+    uint32_t done = disk->busy & ~port->ci;
+    while(done) {
+        int slot = __builtin_ctz(done);
+        done &= done - 1;
+        BlockRequest* req = disk->slots[slot];
+        disk->slots[slot] = NULL;
+        disk->busy &= ~(1U << slot);
+        BlockComplete(dev, req, 1);
+    }
+}
+
+// IDENTIFY DEVICE, issued and waited for directly before the disk is
+// registered; returns the sector count, 0 on failure
+static uint64_t IdentifyDisk(AhciDisk* disk, uint16_t* identify) {
+    BuildCommand(disk, 0, ATA_IDENTIFY, 0, 0, identify, BLOCK_SECTOR_SIZE, 0);
+    __sync_synchronize();
+    disk->port->ci = 1;
+    if(!WaitClear(&disk->port->ci, 1, AHCI_IDENTIFY_TIMEOUT_US)) return 0;
+    if(disk->port->is & AHCI_IS_TFES) return 0;
+
+    if(identify[83] & (1 << 10)) {
+        return (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) |
+               ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+    }
+    return (uint64_t)identify[60] | ((uint64_t)identify[61] << 16);
+}
+
+static int StartAhciPort(AhciHba* hba, int index) {
+    AhciPort* port = &hba->ports[index];
+    if((port->ssts & 0xF) != AHCI_SSTS_DET_PRESENT || port->sig != AHCI_SIG_ATA) return 0;
+
+    // Page 0: command list, received FIS, IDENTIFY data; then the tables
+    int slotCount = ((hba->cap >> 8) & 0x1F) + 1;
+    if(slotCount > BLOCK_MAX_DEPTH) slotCount = BLOCK_MAX_DEPTH;
+    uint64_t pages = 1 + PAGES_FOR(slotCount * AHCI_TABLE_SIZE);
+    AhciDisk* disk = (AhciDisk*)HeapAllocZeroed(sizeof(AhciDisk));
+    uint8_t* memory = (uint8_t*)AllocZeroedPages(pages);
+    if(!disk || !memory) {
+        KLog("ahci: out of memory for a port");
+        return 0;
+    }
+    if(!(hba->cap & AHCI_CAP_S64A) && (uint64_t)memory + pages * PAGE_SIZE > 0x100000000ULL) {
+        KLog("ahci: 32-bit HBA and no memory below 4 GB, port skipped");
+        return 0;
+    }
+
+    disk->port = port;
+    disk->slotCount = slotCount;
+    disk->commandList = (AhciCommandHeader*)memory;
+    disk->tables = memory + PAGE_SIZE;
+    for(int slot = 0; slot < slotCount; slot++) {
+        uint64_t table = (uint64_t)(disk->tables + slot * AHCI_TABLE_SIZE);
+        disk->commandList[slot].ctba = (uint32_t)table;
+        disk->commandList[slot].ctbau = table >> 32;
+    }
+
+    if(!StopPort(port)) {
+        KLog("ahci: port would not stop");
+        return 0;
+    }
+    port->clb = (uint32_t)(uint64_t)memory;
+    port->clbu = (uint64_t)memory >> 32;
+    port->fb = (uint32_t)(uint64_t)(memory + 1024);
+    port->fbu = (uint64_t)(memory + 1024) >> 32;
+    port->ie = 0;
+    StartPort(port);
+
+    BlockDevice* dev = &disk->dev;
+    dev->sectors = IdentifyDisk(disk, (uint16_t*)(memory + 2048));
+    if(!dev->sectors) {
+        KLog("ahci: IDENTIFY failed");
+        StopPort(port);
+        return 0;
+    }
+    strcpy(dev->name, "sda");
+    dev->name[2] += ahciDiskCount;
+    dev->driver = "ahci";
+    dev->maxTransfer = AHCI_MAX_TRANSFER;
+    dev->queueDepth = slotCount;
+    dev->driverData = disk;
+    dev->submit = AhciSubmit;
+    dev->poll = AhciPoll;
+    if(!RegisterBlockDevice(dev)) return 0;
+    ahciDiskCount++;
+    return 1;
+}
+
+// Returns how many disks were brought up
+int InitAhci() {
+    const PciDevice* pci;
+    for(int i = 0; (pci = PciFindClass(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, 1, i)); i++) {
+        PciBar bar;
+        if(!PciReadBar(pci, AHCI_BAR, &bar) || bar.io) continue;
+        PciEnable(pci, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_OFF);
+
+        AhciHba* hba = (AhciHba*)bar.base;
+        hba->ghc |= AHCI_GHC_AE;
+        hba->ghc &= ~AHCI_GHC_IE;
+        uint32_t implemented = hba->pi;
+        for(int port = 0; port < AHCI_MAX_PORTS && ahciDiskCount < AHCI_MAX_DISKS; port++) {
+            if(implemented & (1U << port)) StartAhciPort(hba, port);
+        }
+    }
+    return ahciDiskCount;
+}
+
+#endif // AHCI_C
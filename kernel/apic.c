@@ -0,0 +1,123 @@
+// Local APIC access. The xAPIC registers are memory mapped at the address in
+// IA32_APIC_BASE (0xFEE00000 unless the firmware moved it), which the
+// firmware's identity map covers as uncached MMIO. If the firmware already
+// switched to x2APIC mode the same registers are MSRs at 0x800 + offset/16.
+
+#ifndef APIC_C
+#define APIC_C
+
+#include "../include/apic.h"
+
+#define MSR_APIC_BASE     0x1B
+#define APIC_BASE_ENABLE  0x800
+#define APIC_BASE_X2APIC  0x400
+#define APIC_BASE_MASK    0xFFFFFF000ULL
+#define MSR_X2APIC_FIRST  0x800
+
+static volatile uint32_t* lapicBase = NULL;
+static int lapicPresent = 0;
+static int lapicX2 = 0;
+
+uint32_t LapicRead(uint32_t reg) {
+    if(lapicX2) return (uint32_t)rdmsr(MSR_X2APIC_FIRST + (reg >> 4));
+    return lapicBase[reg / 4];
+}
+
+void LapicWrite(uint32_t reg, uint32_t value) {
+    if(lapicX2) {
+        wrmsr(MSR_X2APIC_FIRST + (reg >> 4), value);
+        return;
+    }
+    lapicBase[reg / 4] = value;
+}
+
+void LapicEoi() {
+    LapicWrite(LAPIC_EOI, 0);
+}
+
+uint32_t LapicId() {
+    uint32_t id = LapicRead(LAPIC_ID);
+    return lapicX2 ? id : id >> 24;
+}
+
+int LapicPresent() {
+    return lapicPresent;
+}
+
+int LapicX2Mode() {
+    return lapicX2;
+}
+
+// Software-enables the LAPIC with the spurious vector and all priorities
+// accepted. LINT0 is set up as virtual wire so the 8259 still gets through.
+int InitLapic() {
+    uint32_t a, b, c, d;
+    Cpuid(1, &a, &b, &c, &d);
+    if(!(d & (1 << 9))) {
+        KLog("apic: no local APIC");
+        return 0;
+    }
+
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    if(!(base & APIC_BASE_ENABLE)) {
+        base |= APIC_BASE_ENABLE;
+        wrmsr(MSR_APIC_BASE, base);
+    }
+    lapicX2 = (base & APIC_BASE_X2APIC) != 0;
+    lapicBase = (volatile uint32_t*)(base & APIC_BASE_MASK);
+    lapicPresent = 1;
+
+    LapicWrite(LAPIC_TPR, 0);
+    LapicWrite(LAPIC_SVR, 0x100 | VECTOR_SPURIOUS);
+    LapicWrite(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    LapicWrite(LAPIC_LVT_LINT0, LAPIC_DELIVER_EXTINT);
+    LapicWrite(LAPIC_LVT_LINT1, LAPIC_DELIVER_NMI);
+    LapicEoi();
+
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    strcpy(line, "apic: LAPIC id ");
+    IntToStr(LapicId(), num);
+    strcat(line, num);
+    strcat(line, lapicX2 ? " x2APIC" : " at ");
+    if(!lapicX2) {
+        HexToStr((uint64_t)lapicBase, num);
+        strcat(line, num);
+    }
+    strcat(line, ", version ");
+    HexToStr(LapicRead(LAPIC_VERSION) & 0xFF, num);
+    strcat(line, num);
+    KLog(line);
+    return 1;
+}
+
+// Same setup on an application processor, which finds its LAPIC in the
+// firmware's default mode. Only the boot CPU takes the 8259 through LINT0.
+void InitLapicAp() {
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    uint64_t want = base | APIC_BASE_ENABLE | (lapicX2 ? APIC_BASE_X2APIC : 0);
+    if(want != base) wrmsr(MSR_APIC_BASE, want);
+
+    LapicWrite(LAPIC_TPR, 0);
+    LapicWrite(LAPIC_SVR, 0x100 | VECTOR_SPURIOUS);
+    LapicWrite(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    LapicWrite(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    LapicWrite(LAPIC_LVT_LINT1, LAPIC_DELIVER_NMI);
+    LapicEoi();
+}
+
+// Sends an IPI and waits until the LAPIC has accepted it. command is the low
+// half of the ICR; apicId is ignored when it uses a destination shorthand.
+void LapicSendIpi(uint32_t apicId, uint32_t command) {
+    if(lapicX2) {
+        wrmsr(MSR_X2APIC_FIRST + (LAPIC_ICR_LOW >> 4), ((uint64_t)apicId << 32) | command);
+        return;
+    }
+    LapicWrite(LAPIC_ICR_HIGH, apicId << 24);
+    LapicWrite(LAPIC_ICR_LOW, command);
+    while(LapicRead(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+#endif // APIC_C
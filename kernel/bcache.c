@@ -0,0 +1,368 @@
+// Buffer cache between the file system and the block layer. Disks are
+// cached in page sized blocks of CACHE_BLOCK_SECTORS, found through a hash
+// on (device, block) and kept on an LRU list; when the cache is full the
+// least recently used block is reused. All the misses of one CacheRead()
+// are requested before the first is waited for, and CachePrefetch() starts
+// them without waiting at all, so the device queue stays busy.
+//
+// Writes only land in the cache and mark their sectors dirty. Dirty
+// sectors reach the disk on CacheFlush(), when a dirty block is about to
+// be evicted, and from the write-back task once the oldest of them is
+// CACHE_WRITEBACK_MS old. A flush walks the dirty blocks in disk order and
+// gathers each run of adjacent dirty sectors into one request.
+//
+// Callers hold the UI lock, as the file system does, or run during boot
+// before the tasks start.
+
+#ifndef BCACHE_C
+#define BCACHE_C
+
+#include "../include/bcache.h"
+
+#define CACHE_NONE (-1)
+
+typedef struct {
+    BlockDevice* dev;             // NULL while unused
+    uint64_t block;               // first sector / CACHE_BLOCK_SECTORS
+    uint32_t sectors;             // fewer where the disk ends mid block
+    uint8_t dirty;                // bit per sector
+    int loading;                  // req is in flight
+    uint64_t dirtySinceUs;
+    int hashNext;
+    int lruPrev, lruNext;         // toward lruHead, the most recently used
+    BlockRequest req;
+    uint8_t* data;
+} CacheBlock;
+
+static CacheBlock cacheBlocks[CACHE_BLOCKS];
+static int cacheBuckets[CACHE_BUCKETS];
+static int lruHead = CACHE_NONE;
+static int lruTail = CACHE_NONE;
+static int flushOrder[CACHE_BLOCKS];
+static uint8_t* batchBuffer = NULL;
+static int cacheReady = 0;
+static CacheStats cacheStats;
+
+static uint32_t CacheHash(BlockDevice* dev, uint64_t block) {
+    uint64_t key = block ^ ((uint64_t)dev >> 4);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40) & (CACHE_BUCKETS - 1);
+}
+
+static int CacheLookup(BlockDevice* dev, uint64_t block) {
+    for(int i = cacheBuckets[CacheHash(dev, block)]; i != CACHE_NONE; i = cacheBlocks[i].hashNext) {
+        if(cacheBlocks[i].dev == dev && cacheBlocks[i].block == block) return i;
+    }
+    return CACHE_NONE;
+}
+
+static void HashRemove(int i) {
+    CacheBlock* b = &cacheBlocks[i];
+    int* link = &cacheBuckets[CacheHash(b->dev, b->block)];
+    while(*link != i) link = &cacheBlocks[*link].hashNext;
+    *link = b->hashNext;
+}
+
+static void LruUnlink(int i) {
+    CacheBlock* b = &cacheBlocks[i];
+    if(b->lruPrev != CACHE_NONE) cacheBlocks[b->lruPrev].lruNext = b->lruNext;
+    else lruHead = b->lruNext;
+    if(b->lruNext != CACHE_NONE) cacheBlocks[b->lruNext].lruPrev = b->lruPrev;
+    else lruTail = b->lruPrev;
+}
+
+static void LruPushFront(int i) {
+    CacheBlock* b = &cacheBlocks[i];
+    b->lruPrev = CACHE_NONE;
+    b->lruNext = lruHead;
+    if(lruHead != CACHE_NONE) cacheBlocks[lruHead].lruPrev = i;
+    else lruTail = i;
+    lruHead = i;
+}
+
+static void LruPushBack(int i) {
+    CacheBlock* b = &cacheBlocks[i];
+    b->lruNext = CACHE_NONE;
+    b->lruPrev = lruTail;
+    if(lruTail != CACHE_NONE) cacheBlocks[lruTail].lruNext = i;
+    else lruHead = i;
+    lruTail = i;
+}
+
+static void CacheTouch(int i) {
+    if(lruHead == i) return;
+    LruUnlink(i);
+    LruPushFront(i);
+}
+
+// Unused blocks wait at the LRU tail, so they are taken before any data
+static void CacheDrop(int i) {
+    CacheBlock* b = &cacheBlocks[i];
+    HashRemove(i);
+    b->dev = NULL;
+    b->dirty = 0;
+    cacheStats.usedBlocks--;
+    LruUnlink(i);
+    LruPushBack(i);
+}
+
+// Waits for the read of block i; one that failed is dropped again
+static int FinishLoad(int i) {
+    CacheBlock* b = &cacheBlocks[i];
+    if(!b->loading) return 1;
+    int ok = BlockWait(b->dev, &b->req);
+    b->loading = 0;
+    if(!ok) {
+        cacheStats.errors++;
+        CacheDrop(i);
+    }
+    return ok;
+}
+
+// Writes the run gathered in batchBuffer and marks its sectors clean
+static int WriteRun(BlockDevice* dev, uint64_t lba, uint32_t count) {
+    cacheStats.writebacks++;
+    if(!BlockWrite(dev, lba, count, batchBuffer)) {
+        cacheStats.errors++;
+        return 0;
+    }
+    cacheStats.sectorsWritten += count;
+    for(uint64_t sector = lba; sector < lba + count; sector++) {
+        CacheBlock* b = &cacheBlocks[CacheLookup(dev, sector / CACHE_BLOCK_SECTORS)];
+        b->dirty &= ~(1 << (sector % CACHE_BLOCK_SECTORS));
+        if(!b->dirty) cacheStats.dirtyBlocks--;
+    }
+    return 1;
+}
+
+static int FlushBefore(const CacheBlock* a, const CacheBlock* b) {
+    if(a->dev != b->dev) return (uint64_t)a->dev < (uint64_t)b->dev;
+    return a->block < b->block;
+}
+
+// Writes the dirty sectors of dev, or of every device with NULL
+int CacheFlush(BlockDevice* dev) {
+    if(!cacheReady) return 1;
+
+    // Disk order; there are at most CACHE_BLOCKS, so insertion sort it is
+    int count = 0;
+    for(int i = 0; i < CACHE_BLOCKS; i++) {
+        CacheBlock* b = &cacheBlocks[i];
+        if(!b->dirty || (dev && b->dev != dev)) continue;
+        int j = count++;
+        while(j > 0 && FlushBefore(b, &cacheBlocks[flushOrder[j - 1]])) {
+            flushOrder[j] = flushOrder[j - 1];
+            j--;
+        }
+        flushOrder[j] = i;
+    }
+
+    int ok = 1;
+    BlockDevice* runDev = NULL;
+    uint64_t runLba = 0;
+    uint32_t runCount = 0;
+    for(int k = 0; k < count; k++) {
+        CacheBlock* b = &cacheBlocks[flushOrder[k]];
+        uint32_t limit = b->dev->maxTransfer < CACHE_BATCH_SECTORS ? b->dev->maxTransfer : CACHE_BATCH_SECTORS;
+        for(uint32_t s = 0; s < b->sectors; s++) {
+            uint64_t lba = b->block * CACHE_BLOCK_SECTORS + s;
+            int dirty = (b->dirty >> s) & 1;
+            if(runCount && (!dirty || b->dev != runDev || lba != runLba + runCount || runCount == limit)) {
+                if(!WriteRun(runDev, runLba, runCount)) ok = 0;
+                runCount = 0;
+            }
+            if(!dirty) continue;
+            if(!runCount) {
+                runDev = b->dev;
+                runLba = lba;
+            }
+            MemCopy(batchBuffer + runCount * BLOCK_SECTOR_SIZE, b->data + s * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+            runCount++;
+        }
+    }
+    if(runCount && !WriteRun(runDev, runLba, runCount)) ok = 0;
+    return ok;
+}
+
+// The least recently used block that is not still being read, emptied for
+// reuse. A dirty one flushes the cache first, which batches its sectors
+// with any neighbours instead of writing the block alone.
+static int CacheEvict() {
+    int i = lruTail;
+    while(i != CACHE_NONE && cacheBlocks[i].loading && cacheBlocks[i].req.status == BLOCK_PENDING) {
+        i = cacheBlocks[i].lruPrev;
+    }
+    if(i == CACHE_NONE) i = lruTail;
+    CacheBlock* b = &cacheBlocks[i];
+    if(b->loading && !FinishLoad(i)) return i;
+    if(b->dirty && (!CacheFlush(NULL) || b->dirty)) return CACHE_NONE;
+    if(b->dev) {
+        HashRemove(i);
+        b->dev = NULL;
+        cacheStats.usedBlocks--;
+        cacheStats.evictions++;
+    }
+    return i;
+}
+
+static int CacheClaim(BlockDevice* dev, uint64_t block) {
+    int i = CacheEvict();
+    if(i == CACHE_NONE) return CACHE_NONE;
+    CacheBlock* b = &cacheBlocks[i];
+    uint64_t left = dev->sectors - block * CACHE_BLOCK_SECTORS;
+    b->dev = dev;
+    b->block = block;
+    b->sectors = left < CACHE_BLOCK_SECTORS ? left : CACHE_BLOCK_SECTORS;
+    b->dirty = 0;
+    b->loading = 0;
+    uint32_t bucket = CacheHash(dev, block);
+    b->hashNext = cacheBuckets[bucket];
+    cacheBuckets[bucket] = i;
+    cacheStats.usedBlocks++;
+    CacheTouch(i);
+    return i;
+}
+
+// Starts reading a block that is not cached; a request the device refuses
+// comes back failed and FinishLoad() drops the block
+static int StartRead(BlockDevice* dev, uint64_t block, int ahead) {
+    int i = CacheClaim(dev, block);
+    if(i == CACHE_NONE) return CACHE_NONE;
+    CacheBlock* b = &cacheBlocks[i];
+    b->req.lba = block * CACHE_BLOCK_SECTORS;
+    b->req.count = b->sectors;
+    b->req.write = 0;
+    b->req.buffer = b->data;
+    b->loading = 1;
+    cacheStats.misses++;
+    if(ahead) cacheStats.prefetches++;
+    BlockSubmit(dev, &b->req);
+    return i;
+}
+
+void CachePrefetch(BlockDevice* dev, uint64_t lba, uint32_t count) {
+    if(!cacheReady || count == 0 || lba + count > dev->sectors) return;
+    uint64_t last = (lba + count - 1) / CACHE_BLOCK_SECTORS;
+    for(uint64_t block = lba / CACHE_BLOCK_SECTORS; block <= last; block++) {
+        if(CacheLookup(dev, block) == CACHE_NONE) StartRead(dev, block, 1);
+    }
+}
+
+// Returns 1 once every sector is copied out
+int CacheRead(BlockDevice* dev, uint64_t lba, uint32_t count, void* buffer) {
+    if(!cacheReady) return BlockRead(dev, lba, count, buffer);
+    if(count == 0) return 1;
+    if(lba + count > dev->sectors) return 0;
+    uint64_t first = lba / CACHE_BLOCK_SECTORS;
+    uint64_t last = (lba + count - 1) / CACHE_BLOCK_SECTORS;
+
+    // Every miss is requested before the first is waited for. A read of
+    // more than half the cache could evict its own blocks, so the rest of
+    // a long one is read as it goes.
+    for(uint64_t block = first; block <= last && block - first < CACHE_BLOCKS / 2; block++) {
+        int i = CacheLookup(dev, block);
+        if(i == CACHE_NONE) StartRead(dev, block, 0);
+        else cacheStats.hits++;
+    }
+
+    uint8_t* out = (uint8_t*)buffer;
+    for(uint64_t block = first; block <= last; block++) {
+        int i = CacheLookup(dev, block);
+        if(i == CACHE_NONE) i = StartRead(dev, block, 0);
+        if(i == CACHE_NONE || !FinishLoad(i)) return 0;
+        CacheBlock* b = &cacheBlocks[i];
+        uint64_t start = block * CACHE_BLOCK_SECTORS;
+        uint64_t from = lba > start ? lba - start : 0;
+        uint64_t to = lba + count - start < b->sectors ? lba + count - start : b->sectors;
+        MemCopy(out + (start + from - lba) * BLOCK_SECTOR_SIZE, b->data + from * BLOCK_SECTOR_SIZE,
+                (to - from) * BLOCK_SECTOR_SIZE);
+        CacheTouch(i);
+    }
+    return 1;
+}
+
+// Returns 1 once every sector is in the cache; the disk sees it later
+int CacheWrite(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    if(!cacheReady) return BlockWrite(dev, lba, count, buffer);
+    if(count == 0) return 1;
+    if(dev->readOnly || dev->failed || lba + count > dev->sectors) {
+        cacheStats.errors++;
+        return 0;
+    }
+    uint64_t last = (lba + count - 1) / CACHE_BLOCK_SECTORS;
+
+    const uint8_t* in = (const uint8_t*)buffer;
+    for(uint64_t block = lba / CACHE_BLOCK_SECTORS; block <= last; block++) {
+        uint64_t start = block * CACHE_BLOCK_SECTORS;
+        uint64_t left = dev->sectors - start;
+        uint64_t sectors = left < CACHE_BLOCK_SECTORS ? left : CACHE_BLOCK_SECTORS;
+        uint64_t from = lba > start ? lba - start : 0;
+        uint64_t to = lba + count - start < sectors ? lba + count - start : sectors;
+
+        // A block written over whole is never read first
+        int i = CacheLookup(dev, block);
+        if(i != CACHE_NONE) cacheStats.hits++;
+        else if(from == 0 && to == sectors) i = CacheClaim(dev, block);
+        else i = StartRead(dev, block, 0);
+        if(i == CACHE_NONE || !FinishLoad(i)) return 0;
+
+        CacheBlock* b = &cacheBlocks[i];
+        MemCopy(b->data + from * BLOCK_SECTOR_SIZE, in + (start + from - lba) * BLOCK_SECTOR_SIZE,
+                (to - from) * BLOCK_SECTOR_SIZE);
+        if(!b->dirty) {
+            b->dirtySinceUs = ClockUs();
+            cacheStats.dirtyBlocks++;
+        }
+        b->dirty |= ((1 << to) - 1) & ~((1 << from) - 1);
+        CacheTouch(i);
+    }
+    return 1;
+}
+
+static void CacheTaskMain(void* arg) {
+    uint64_t maxAge = CACHE_WRITEBACK_MS * 1000ULL;
+    while(1) {
+        SleepUntilUs(ClockUs() + maxAge / 2);
+        if(!cacheStats.dirtyBlocks) continue;
+
+        // Everything goes once the oldest block is due, so the young
+        // blocks next to it share its requests
+        UiLock();
+        uint64_t now = ClockUs();
+        for(int i = 0; i < CACHE_BLOCKS; i++) {
+            if(cacheBlocks[i].dirty && now - cacheBlocks[i].dirtySinceUs >= maxAge) {
+                CacheFlush(NULL);
+                break;
+            }
+        }
+        UiUnlock();
+    }
+}
+
+void StartCacheTask() {
+    if(cacheReady) CreateTask("bflush", TASK_PRIORITY_NORMAL, CacheTaskMain, NULL);
+}
+
+// Without memory for the blocks the cache stays off and reads and writes
+// go straight to the block layer
+int InitCache() {
+    uint8_t* data = (uint8_t*)AllocPages(PAGES_FOR(CACHE_BLOCKS * CACHE_BLOCK_SECTORS * BLOCK_SECTOR_SIZE));
+    batchBuffer = (uint8_t*)AllocPages(PAGES_FOR(CACHE_BATCH_SECTORS * BLOCK_SECTOR_SIZE));
+    if(!data || !batchBuffer) {
+        KLog("bcache: no memory, disk I/O is uncached");
+        return 0;
+    }
+    for(int i = 0; i < CACHE_BUCKETS; i++) cacheBuckets[i] = CACHE_NONE;
+    for(int i = 0; i < CACHE_BLOCKS; i++) {
+        cacheBlocks[i].dev = NULL;
+        cacheBlocks[i].data = data + i * CACHE_BLOCK_SECTORS * BLOCK_SECTOR_SIZE;
+        LruPushBack(i);
+    }
+    cacheReady = 1;
+    return 1;
+}
+
+void GetCacheStats(CacheStats* out) {
+    *out = cacheStats;
+}
+
+#endif // BCACHE_C
@@ -0,0 +1,616 @@
+// Row fill, copy and blend kernels behind DrawRect, BlitRect, BlendRect and
+// DrawRectAlpha, and the byte copy/fill behind MemCopy and MemSet.
+// Only depends on <stdint.h> and the compiler intrinsics so that
+// tools/gfxbench.c can build the exact same code on the host.
+
+#ifndef BLIT_C
+#define BLIT_C
+
+#include <immintrin.h>
+#include "../include/blit.h"
+
+void FillRowScalar(uint32_t* dst, uint32_t color, int count) {
+    for(int i = 0; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+void CopyRowScalar(uint32_t* dst, const uint32_t* src, int count) {
+    for(int i = 0; i < count; i++) {
+        dst[i] = src[i];
+    }
+}
+
+// SSE2 is part of x86_64, so these are always safe to call.
+void FillRowSSE2(uint32_t* dst, uint32_t color, int count) {
+    while(count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = color;
+        count--;
+    }
+    __m128i v = _mm_set1_epi32((int)color);
+    while(count >= 16) {
+        _mm_store_si128((__m128i*)dst, v);
+        _mm_store_si128((__m128i*)(dst + 4), v);
+        _mm_store_si128((__m128i*)(dst + 8), v);
+        _mm_store_si128((__m128i*)(dst + 12), v);
+        dst += 16;
+        count -= 16;
+    }
+    while(count >= 4) {
+        _mm_store_si128((__m128i*)dst, v);
+        dst += 4;
+        count -= 4;
+    }
+    while(count > 0) {
+        *dst++ = color;
+        count--;
+    }
+}
+
+// Streaming stores bypass the cache; callers must BlitFence() when done.
+void FillRowSSE2NT(uint32_t* dst, uint32_t color, int count) {
+    while(count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = color;
+        count--;
+    }
+    __m128i v = _mm_set1_epi32((int)color);
+    while(count >= 16) {
+        _mm_stream_si128((__m128i*)dst, v);
+        _mm_stream_si128((__m128i*)(dst + 4), v);
+        _mm_stream_si128((__m128i*)(dst + 8), v);
+        _mm_stream_si128((__m128i*)(dst + 12), v);
+        dst += 16;
+        count -= 16;
+    }
+    while(count >= 4) {
+        _mm_stream_si128((__m128i*)dst, v);
+        dst += 4;
+        count -= 4;
+    }
+    while(count > 0) {
+        *dst++ = color;
+        count--;
+    }
+}
+
+void CopyRowSSE2(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = *src++;
+        count--;
+    }
+    while(count >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 12));
+        _mm_store_si128((__m128i*)dst, a);
+        _mm_store_si128((__m128i*)(dst + 4), b);
+        _mm_store_si128((__m128i*)(dst + 8), c);
+        _mm_store_si128((__m128i*)(dst + 12), d);
+        dst += 16;
+        src += 16;
+        count -= 16;
+    }
+    while(count >= 4) {
+        _mm_store_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+        dst += 4;
+        src += 4;
+        count -= 4;
+    }
+    while(count > 0) {
+        *dst++ = *src++;
+        count--;
+    }
+}
+
+void CopyRowSSE2NT(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = *src++;
+        count--;
+    }
+    while(count >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 12));
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 4), b);
+        _mm_stream_si128((__m128i*)(dst + 8), c);
+        _mm_stream_si128((__m128i*)(dst + 12), d);
+        dst += 16;
+        src += 16;
+        count -= 16;
+    }
+    while(count >= 4) {
+        _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+        dst += 4;
+        src += 4;
+        count -= 4;
+    }
+    while(count > 0) {
+        *dst++ = *src++;
+        count--;
+    }
+}
+
+// AVX2 variants, only selected when InitCpu() finds AVX2 and has enabled
+// the YMM state in XCR0.
+__attribute__((target("avx2")))
+void FillRowAVX2(uint32_t* dst, uint32_t color, int count) {
+    while(count > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = color;
+        count--;
+    }
+    __m256i v = _mm256_set1_epi32((int)color);
+    while(count >= 32) {
+        _mm256_store_si256((__m256i*)dst, v);
+        _mm256_store_si256((__m256i*)(dst + 8), v);
+        _mm256_store_si256((__m256i*)(dst + 16), v);
+        _mm256_store_si256((__m256i*)(dst + 24), v);
+        dst += 32;
+        count -= 32;
+    }
+    while(count >= 8) {
+        _mm256_store_si256((__m256i*)dst, v);
+        dst += 8;
+        count -= 8;
+    }
+    while(count > 0) {
+        *dst++ = color;
+        count--;
+    }
+}
+
+__attribute__((target("avx2")))
+void FillRowAVX2NT(uint32_t* dst, uint32_t color, int count) {
+    while(count > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = color;
+        count--;
+    }
+    __m256i v = _mm256_set1_epi32((int)color);
+    while(count >= 32) {
+        _mm256_stream_si256((__m256i*)dst, v);
+        _mm256_stream_si256((__m256i*)(dst + 8), v);
+        _mm256_stream_si256((__m256i*)(dst + 16), v);
+        _mm256_stream_si256((__m256i*)(dst + 24), v);
+        dst += 32;
+        count -= 32;
+    }
+    while(count >= 8) {
+        _mm256_stream_si256((__m256i*)dst, v);
+        dst += 8;
+        count -= 8;
+    }
+    while(count > 0) {
+        *dst++ = color;
+        count--;
+    }
+}
+
+__attribute__((target("avx2")))
+void CopyRowAVX2(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = *src++;
+        count--;
+    }
+    while(count >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 24));
+        _mm256_store_si256((__m256i*)dst, a);
+        _mm256_store_si256((__m256i*)(dst + 8), b);
+        _mm256_store_si256((__m256i*)(dst + 16), c);
+        _mm256_store_si256((__m256i*)(dst + 24), d);
+        dst += 32;
+        src += 32;
+        count -= 32;
+    }
+    while(count >= 8) {
+        _mm256_store_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        dst += 8;
+        src += 8;
+        count -= 8;
+    }
+    while(count > 0) {
+        *dst++ = *src++;
+        count--;
+    }
+}
+
+__attribute__((target("avx2")))
+void CopyRowAVX2NT(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = *src++;
+        count--;
+    }
+    while(count >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 24));
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 8), b);
+        _mm256_stream_si256((__m256i*)(dst + 16), c);
+        _mm256_stream_si256((__m256i*)(dst + 24), d);
+        dst += 32;
+        src += 32;
+        count -= 32;
+    }
+    while(count >= 8) {
+        _mm256_stream_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        dst += 8;
+        src += 8;
+        count -= 8;
+    }
+    while(count > 0) {
+        *dst++ = *src++;
+        count--;
+    }
+}
+
+// Copies with red and blue exchanged, for presenting to RGBX framebuffers.
+// The alpha/reserved byte and green stay where they are.
+static inline uint32_t SwapRB(uint32_t p) {
+    return (p & 0xFF00FF00) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
+}
+
+void CopyRowSwapRBScalar(uint32_t* dst, const uint32_t* src, int count) {
+    for(int i = 0; i < count; i++) {
+        dst[i] = SwapRB(src[i]);
+    }
+}
+
+static inline __m128i SwapRBSSE2(__m128i p) {
+    const __m128i ag = _mm_set1_epi32((int)0xFF00FF00);
+    const __m128i low = _mm_set1_epi32(0xFF);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(p, low), 16);
+    return _mm_or_si128(_mm_and_si128(p, ag), _mm_or_si128(r, b));
+}
+
+void CopyRowSwapRBSSE2(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+    while(count >= 4) {
+        _mm_store_si128((__m128i*)dst, SwapRBSSE2(_mm_loadu_si128((const __m128i*)src)));
+        dst += 4;
+        src += 4;
+        count -= 4;
+    }
+    while(count > 0) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+}
+
+void CopyRowSwapRBSSE2NT(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+    while(count >= 4) {
+        _mm_stream_si128((__m128i*)dst, SwapRBSSE2(_mm_loadu_si128((const __m128i*)src)));
+        dst += 4;
+        src += 4;
+        count -= 4;
+    }
+    while(count > 0) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+}
+
+// One byte shuffle per 8 pixels: bytes 0 and 2 of each pixel trade places
+__attribute__((target("avx2")))
+static inline __m256i SwapRBAVX2(__m256i p) {
+    const __m256i order = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    return _mm256_shuffle_epi8(p, order);
+}
+
+__attribute__((target("avx2")))
+void CopyRowSwapRBAVX2(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+    while(count >= 8) {
+        _mm256_store_si256((__m256i*)dst, SwapRBAVX2(_mm256_loadu_si256((const __m256i*)src)));
+        dst += 8;
+        src += 8;
+        count -= 8;
+    }
+    while(count > 0) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+}
+
+__attribute__((target("avx2")))
+void CopyRowSwapRBAVX2NT(uint32_t* dst, const uint32_t* src, int count) {
+    while(count > 0 && ((uintptr_t)dst & 31)) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+    while(count >= 8) {
+        _mm256_stream_si256((__m256i*)dst, SwapRBAVX2(_mm256_loadu_si256((const __m256i*)src)));
+        dst += 8;
+        src += 8;
+        count -= 8;
+    }
+    while(count > 0) {
+        *dst++ = SwapRB(*src++);
+        count--;
+    }
+}
+
+// Blending works on premultiplied ARGB: "over" is dst = src + dst * (255 - srcA) / 255
+// per channel. Every variant divides by 255 the same way, so SIMD output is
+// bit-identical to the scalar path.
+static inline uint32_t Div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t BlendPixel(uint32_t src, uint32_t dst, uint32_t inv) {
+    uint32_t out = 0;
+    for(int shift = 0; shift < 32; shift += 8) {
+        uint32_t c = ((src >> shift) & 0xFF) + Div255(((dst >> shift) & 0xFF) * inv);
+        if(c > 255) c = 255;
+        out |= c << shift;
+    }
+    return out;
+}
+
+// Straight 0xAARRGGBB to premultiplied
+uint32_t PremultiplyColor(uint32_t argb) {
+    uint32_t a = argb >> 24;
+    uint32_t r = Div255(((argb >> 16) & 0xFF) * a);
+    uint32_t g = Div255(((argb >> 8) & 0xFF) * a);
+    uint32_t b = Div255((argb & 0xFF) * a);
+    return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+void BlendRowScalar(uint32_t* dst, const uint32_t* src, int count) {
+    for(int i = 0; i < count; i++) {
+        dst[i] = BlendPixel(src[i], dst[i], 255 - (src[i] >> 24));
+    }
+}
+
+// Constant-alpha fill: color is premultiplied and blended over every pixel
+void FillAlphaRowScalar(uint32_t* dst, uint32_t color, int count) {
+    uint32_t inv = 255 - (color >> 24);
+    for(int i = 0; i < count; i++) {
+        dst[i] = BlendPixel(color, dst[i], inv);
+    }
+}
+
+// 16-bit lanes holding channel * factor; same rounding as Div255()
+static inline __m128i Div255Epu16SSE2(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Scales the four pixels in d by the per-pixel 16-bit factors
+static inline __m128i ScalePixelsSSE2(__m128i d, __m128i invLo, __m128i invHi) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = Div255Epu16SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), invLo));
+    __m128i hi = Div255Epu16SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), invHi));
+    return _mm_packus_epi16(lo, hi);
+}
+
+void BlendRowSSE2(uint32_t* dst, const uint32_t* src, int count) {
+    __m128i all = _mm_set1_epi16(255);
+    while(count >= 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)src);
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+
+        // Spread each pixel's 255 - alpha over its four 16-bit channel lanes
+        __m128i a = _mm_srli_epi32(s, 24);
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+        __m128i invLo = _mm_sub_epi16(all, _mm_unpacklo_epi32(a, a));
+        __m128i invHi = _mm_sub_epi16(all, _mm_unpackhi_epi32(a, a));
+
+        __m128i out = _mm_adds_epu8(s, ScalePixelsSSE2(d, invLo, invHi));
+        _mm_storeu_si128((__m128i*)dst, out);
+        dst += 4;
+        src += 4;
+        count -= 4;
+    }
+    BlendRowScalar(dst, src, count);
+}
+
+void FillAlphaRowSSE2(uint32_t* dst, uint32_t color, int count) {
+    __m128i c = _mm_set1_epi32((int)color);
+    __m128i inv = _mm_set1_epi16((short)(255 - (color >> 24)));
+    while(count >= 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        _mm_storeu_si128((__m128i*)dst, _mm_adds_epu8(c, ScalePixelsSSE2(d, inv, inv)));
+        dst += 4;
+        count -= 4;
+    }
+    FillAlphaRowScalar(dst, color, count);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Div255Epu16AVX2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+// Unpack and pack both work within 128-bit lanes, so pixel order survives
+__attribute__((target("avx2")))
+static inline __m256i ScalePixelsAVX2(__m256i d, __m256i invLo, __m256i invHi) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = Div255Epu16AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), invLo));
+    __m256i hi = Div255Epu16AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), invHi));
+    return _mm256_packus_epi16(lo, hi);
+}
+
+__attribute__((target("avx2")))
+void BlendRowAVX2(uint32_t* dst, const uint32_t* src, int count) {
+    __m256i all = _mm256_set1_epi16(255);
+    while(count >= 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)src);
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+
+        __m256i a = _mm256_srli_epi32(s, 24);
+        a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+        __m256i invLo = _mm256_sub_epi16(all, _mm256_unpacklo_epi32(a, a));
+        __m256i invHi = _mm256_sub_epi16(all, _mm256_unpackhi_epi32(a, a));
+
+        __m256i out = _mm256_adds_epu8(s, ScalePixelsAVX2(d, invLo, invHi));
+        _mm256_storeu_si256((__m256i*)dst, out);
+        dst += 8;
+        src += 8;
+        count -= 8;
+    }
+    // The tail runs legacy SSE code; leaving the upper YMM halves dirty
+    // would make every one of those instructions pay a transition stall
+    _mm256_zeroupper();
+    BlendRowSSE2(dst, src, count);
+}
+
+__attribute__((target("avx2")))
+void FillAlphaRowAVX2(uint32_t* dst, uint32_t color, int count) {
+    __m256i c = _mm256_set1_epi32((int)color);
+    __m256i inv = _mm256_set1_epi16((short)(255 - (color >> 24)));
+    while(count >= 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_adds_epu8(c, ScalePixelsAVX2(d, inv, inv)));
+        dst += 8;
+        count -= 8;
+    }
+    _mm256_zeroupper();
+    FillAlphaRowSSE2(dst, color, count);
+}
+
+// Byte copies and fills. rep movsb/stosb is the fastest way on CPUs with
+// ERMS (and for short runs with FSRM); elsewhere it only does the tails of
+// the vector loops. None of these may be written as plain byte loops: the
+// compiler would turn them back into memcpy/memset calls.
+static inline void RepMovsb(uint8_t* dst, const uint8_t* src, uint64_t n) {
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void RepStosb(uint8_t* dst, uint8_t value, uint64_t n) {
+    __asm__ volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(value) : "memory");
+}
+
+void MemCopyRepMovsb(void* dst, const void* src, uint64_t n) {
+    RepMovsb((uint8_t*)dst, (const uint8_t*)src, n);
+}
+
+void MemSetRepStosb(void* dst, uint8_t value, uint64_t n) {
+    RepStosb((uint8_t*)dst, value, n);
+}
+
+void MemCopySSE2(void* dst, const void* src, uint64_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    while(n >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_storeu_si128((__m128i*)d, a);
+        _mm_storeu_si128((__m128i*)(d + 16), b);
+        _mm_storeu_si128((__m128i*)(d + 32), c);
+        _mm_storeu_si128((__m128i*)(d + 48), e);
+        d += 64;
+        s += 64;
+        n -= 64;
+    }
+    while(n >= 16) {
+        _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+        d += 16;
+        s += 16;
+        n -= 16;
+    }
+    RepMovsb(d, s, n);
+}
+
+void MemSetSSE2(void* dst, uint8_t value, uint64_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    __m128i v = _mm_set1_epi8((char)value);
+    while(n >= 64) {
+        _mm_storeu_si128((__m128i*)d, v);
+        _mm_storeu_si128((__m128i*)(d + 16), v);
+        _mm_storeu_si128((__m128i*)(d + 32), v);
+        _mm_storeu_si128((__m128i*)(d + 48), v);
+        d += 64;
+        n -= 64;
+    }
+    while(n >= 16) {
+        _mm_storeu_si128((__m128i*)d, v);
+        d += 16;
+        n -= 16;
+    }
+    RepStosb(d, value, n);
+}
+
+__attribute__((target("avx2")))
+void MemCopyAVX2(void* dst, const void* src, uint64_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    while(n >= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+        _mm256_storeu_si256((__m256i*)d, a);
+        _mm256_storeu_si256((__m256i*)(d + 32), b);
+        _mm256_storeu_si256((__m256i*)(d + 64), c);
+        _mm256_storeu_si256((__m256i*)(d + 96), e);
+        d += 128;
+        s += 128;
+        n -= 128;
+    }
+    while(n >= 32) {
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+    RepMovsb(d, s, n);
+}
+
+__attribute__((target("avx2")))
+void MemSetAVX2(void* dst, uint8_t value, uint64_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    __m256i v = _mm256_set1_epi8((char)value);
+    while(n >= 128) {
+        _mm256_storeu_si256((__m256i*)d, v);
+        _mm256_storeu_si256((__m256i*)(d + 32), v);
+        _mm256_storeu_si256((__m256i*)(d + 64), v);
+        _mm256_storeu_si256((__m256i*)(d + 96), v);
+        d += 128;
+        n -= 128;
+    }
+    while(n >= 32) {
+        _mm256_storeu_si256((__m256i*)d, v);
+        d += 32;
+        n -= 32;
+    }
+    RepStosb(d, value, n);
+}
+
+void BlitFence(void) {
+    _mm_sfence();
+}
+
+static const BlitKernels blitKernelsSSE2 = {
+    "sse2", FillRowSSE2, FillRowSSE2NT, CopyRowSSE2, CopyRowSSE2NT,
+    BlendRowSSE2, FillAlphaRowSSE2, CopyRowSwapRBSSE2, CopyRowSwapRBSSE2NT
+};
+
+static const BlitKernels blitKernelsAVX2 = {
+    "avx2", FillRowAVX2, FillRowAVX2NT, CopyRowAVX2, CopyRowAVX2NT,
+    BlendRowAVX2, FillAlphaRowAVX2, CopyRowSwapRBAVX2, CopyRowSwapRBAVX2NT
+};
+
+#endif // BLIT_C
@@ -0,0 +1,278 @@
+// Block device layer. Drivers register a BlockDevice with a submit hook
+// that queues one request (a run of sectors to or from a buffer) and a
+// poll hook that completes whatever the hardware has finished; the layer
+// keeps the request accounting and gives the rest of the kernel plain
+// BlockRead()/BlockWrite() calls. Longer transfers are cut into the
+// driver's largest request and up to its queue depth go out together.
+//
+// Completion is polled. Requests come from tasks holding the UI lock or
+// from boot code, and a disk in QEMU finishes sooner than an interrupt
+// would be worth. Buffers are identity mapped, so drivers hand their
+// addresses straight to the device for DMA.
+
+#ifndef BLOCK_C
+#define BLOCK_C
+
+#include "../include/block.h"
+
+#define BLOCK_TIMEOUT_US    5000000
+
+static BlockDevice* blockDevices[MAX_BLOCK_DEVICES];
+static int blockDeviceCount = 0;
+static uint64_t benchSeed = 0;
+
+int RegisterBlockDevice(BlockDevice* dev) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    if(blockDeviceCount == MAX_BLOCK_DEVICES) return 0;
+    blockDevices[blockDeviceCount++] = dev;
+
+    strcpy(line, "blk: ");
+    strcat(line, dev->name);
+    strcat(line, " (");
+    strcat(line, dev->driver);
+    strcat(line, ") ");
+    UIntToStr(dev->sectors * BLOCK_SECTOR_SIZE / (1024 * 1024), num);
+    strcat(line, num);
+    strcat(line, " MB, queue ");
+    IntToStr(dev->queueDepth, num);
+    strcat(line, num);
+    strcat(line, " x ");
+    UIntToStr(dev->maxTransfer * BLOCK_SECTOR_SIZE / 1024, num);
+    strcat(line, num);
+    strcat(line, dev->readOnly ? " KB, read-only" : " KB");
+    KLog(line);
+    return 1;
+}
+
+int BlockDeviceCount() {
+    return blockDeviceCount;
+}
+
+BlockDevice* GetBlockDevice(int index) {
+    if(index < 0 || index >= blockDeviceCount) return NULL;
+    return blockDevices[index];
+}
+
+BlockDevice* FindBlockDevice(const char* name) {
+    for(int i = 0; i < blockDeviceCount; i++) {
+        if(strcmp(blockDevices[i]->name, name) == 0) return blockDevices[i];
+    }
+    return NULL;
+}
+
+// Called by drivers, with interrupts off, once the device is done with req
+void BlockComplete(BlockDevice* dev, BlockRequest* req, int ok) {
+    dev->inFlight--;
+    if(!ok) dev->stats.errors++;
+    req->status = ok ? BLOCK_DONE : BLOCK_FAILED;
+}
+
+// Queues req, waiting for a free slot if the driver has none. Returns 0,
+// with req failed, for a request the device cannot take at all.
+int BlockSubmit(BlockDevice* dev, BlockRequest* req) {
+    if(dev->failed || req->count == 0 || req->count > dev->maxTransfer ||
+       req->lba + req->count > dev->sectors || (req->write && dev->readOnly)) {
+        req->status = BLOCK_FAILED;
+        dev->stats.errors++;
+        return 0;
+    }
+
+    req->status = BLOCK_PENDING;
+    int waited = 0;
+    while(1) {
+        uint64_t flags = DisableInterrupts();
+        dev->inFlight++;
+        int queued = dev->submit(dev, req);
+        if(queued) {
+            if(req->write) {
+                dev->stats.writes++;
+                dev->stats.sectorsWritten += req->count;
+            } else {
+                dev->stats.reads++;
+                dev->stats.sectorsRead += req->count;
+            }
+        } else {
+            dev->inFlight--;
+        }
+        RestoreInterrupts(flags);
+        if(queued) return 1;
+
+        if(!waited) dev->stats.queueFull++;
+        waited = 1;
+        BlockPoll(dev);
+        __asm__ volatile("pause");
+    }
+}
+
+void BlockPoll(BlockDevice* dev) {
+    if(dev->failed) return;
+    uint64_t flags = DisableInterrupts();
+    dev->poll(dev);
+    RestoreInterrupts(flags);
+}
+
+static void TakeOffline(BlockDevice* dev) {
+    char line[KLOG_LINE_LENGTH];
+    dev->failed = 1;
+    strcpy(line, "blk: ");
+    strcat(line, dev->name);
+    strcat(line, " timed out, taken offline");
+    KLog(line);
+}
+
+// A device that sits on a request for BLOCK_TIMEOUT_US is given up on
+int BlockWait(BlockDevice* dev, BlockRequest* req) {
+    uint64_t start = ClockUs();
+    while(req->status == BLOCK_PENDING) {
+        BlockPoll(dev);
+        if(req->status != BLOCK_PENDING) break;
+        if(dev->failed) return 0;
+        if(ClockUs() - start > BLOCK_TIMEOUT_US) {
+            TakeOffline(dev);
+            return 0;
+        }
+        __asm__ volatile("pause");
+    }
+    return req->status == BLOCK_DONE;
+}
+
+static int Transfer(BlockDevice* dev, uint64_t lba, uint32_t count, uint8_t* buffer, int write) {
+    BlockRequest reqs[BLOCK_MAX_DEPTH];
+    int depth = dev->queueDepth < BLOCK_MAX_DEPTH ? dev->queueDepth : BLOCK_MAX_DEPTH;
+    int ok = 1;
+
+    while(count > 0 && ok) {
+        int batch = 0;
+        while(count > 0 && batch < depth) {
+            uint32_t n = count < dev->maxTransfer ? count : dev->maxTransfer;
+            BlockRequest* req = &reqs[batch];
+            req->lba = lba;
+            req->count = n;
+            req->write = write;
+            req->buffer = buffer;
+            if(!BlockSubmit(dev, req)) {
+                ok = 0;
+                break;
+            }
+            batch++;
+            lba += n;
+            count -= n;
+            buffer += (uint64_t)n * BLOCK_SECTOR_SIZE;
+        }
+        for(int i = 0; i < batch; i++) {
+            if(!BlockWait(dev, &reqs[i])) ok = 0;
+        }
+    }
+    return ok;
+}
+
+// Both return 1 once every sector is transferred
+int BlockRead(BlockDevice* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return Transfer(dev, lba, count, (uint8_t*)buffer, 0);
+}
+
+int BlockWrite(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return Transfer(dev, lba, count, (uint8_t*)buffer, 1);
+}
+
+// RAM disk: requests are copies and finish inside submit
+static int RamDiskSubmit(BlockDevice* dev, BlockRequest* req) {
+    uint8_t* sector = (uint8_t*)dev->driverData + req->lba * BLOCK_SECTOR_SIZE;
+    uint64_t bytes = (uint64_t)req->count * BLOCK_SECTOR_SIZE;
+    if(req->write) MemCopy(sector, req->buffer, bytes);
+    else MemCopy(req->buffer, sector, bytes);
+    BlockComplete(dev, req, 1);
+    return 1;
+}
+
+static void RamDiskPoll(BlockDevice* dev) {
+}
+
+BlockDevice* CreateRamDisk(void* image, uint64_t sectors) {
+    BlockDevice* dev = (BlockDevice*)HeapAllocZeroed(sizeof(BlockDevice));
+    if(!dev) return NULL;
+    strcpy(dev->name, "ram0");
+    dev->driver = "ramdisk";
+    dev->sectors = sectors;
+    dev->maxTransfer = 256;
+    dev->queueDepth = 1;
+    dev->driverData = image;
+    dev->submit = RamDiskSubmit;
+    dev->poll = RamDiskPoll;
+    if(!RegisterBlockDevice(dev)) {
+        HeapFree(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+static uint64_t BenchRandom() {
+    benchSeed ^= benchSeed << 13;
+    benchSeed ^= benchSeed >> 7;
+    benchSeed ^= benchSeed << 17;
+    return benchSeed;
+}
+
+// Read throughput: requests of sectorsPerRequest, sequential or at random
+// aligned offsets, keeping depth of them in flight. Nothing is written.
+// Like BlockWait, a device that completes nothing for BLOCK_TIMEOUT_US is
+// taken offline.
+int BlockBench(BlockDevice* dev, int random, uint32_t sectorsPerRequest, int depth,
+               uint64_t requests, BlockBenchResult* out) {
+    BlockRequest reqs[BLOCK_MAX_DEPTH];
+    int busy[BLOCK_MAX_DEPTH];
+    out->requests = out->bytes = out->errors = out->us = 0;
+
+    if(depth > dev->queueDepth) depth = dev->queueDepth;
+    if(depth > BLOCK_MAX_DEPTH) depth = BLOCK_MAX_DEPTH;
+    if(sectorsPerRequest > dev->maxTransfer) sectorsPerRequest = dev->maxTransfer;
+    uint64_t span = dev->sectors / sectorsPerRequest;
+    if(dev->failed || depth < 1 || span == 0) return 0;
+
+    uint64_t requestBytes = (uint64_t)sectorsPerRequest * BLOCK_SECTOR_SIZE;
+    uint64_t bufferPages = PAGES_FOR(requestBytes * depth);
+    uint8_t* buffers = (uint8_t*)AllocPages(bufferPages);
+    if(!buffers) return 0;
+    if(!benchSeed) benchSeed = rdtsc() | 1;
+
+    for(int i = 0; i < depth; i++) busy[i] = 0;
+    uint64_t issued = 0;
+    uint64_t start = ClockUs();
+    uint64_t lastDone = start;
+    while(out->requests < requests && !dev->failed) {
+        for(int i = 0; i < depth; i++) {
+            if(busy[i]) {
+                if(reqs[i].status == BLOCK_PENDING) continue;
+                busy[i] = 0;
+                lastDone = ClockUs();
+                out->requests++;
+                if(reqs[i].status == BLOCK_DONE) out->bytes += requestBytes;
+                else out->errors++;
+            }
+            if(issued == requests) continue;
+            uint64_t slot = random ? BenchRandom() % span : issued % span;
+            reqs[i].lba = slot * sectorsPerRequest;
+            reqs[i].count = sectorsPerRequest;
+            reqs[i].write = 0;
+            reqs[i].buffer = buffers + i * requestBytes;
+            issued++;
+            if(BlockSubmit(dev, &reqs[i])) {
+                busy[i] = 1;
+            } else {
+                out->requests++;
+                out->errors++;
+            }
+        }
+        BlockPoll(dev);
+        if(ClockUs() - lastDone > BLOCK_TIMEOUT_US) TakeOffline(dev);
+    }
+    out->us = ClockUs() - start;
+
+    // A device that went offline may still write into the buffers
+    if(dev->failed) return 0;
+    FreePages(buffers, bufferPages);
+    return 1;
+}
+
+#endif // BLOCK_C
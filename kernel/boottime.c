@@ -0,0 +1,63 @@
+// Boot phase timing. The loader stamps the TSC at efi_main, after GOP setup
+// and after ExitBootServices into BootInfo; the kernel adds a stamp as
+// each later phase finishes. Stamps are raw TSC values so phases from
+// before the timer is calibrated cost nothing; they are turned into
+// microseconds when read. Once both the first frame and PS/2 are up, the
+// time to a usable desktop goes to the kernel log.
+
+#ifndef BOOTTIME_C
+#define BOOTTIME_C
+
+#include "../include/boottime.h"
+
+static const char* bootPhaseNames[BOOT_PHASES] = {
+    "efi entry", "gop setup", "exit boot services", "kernel entry",
+    "page allocator", "timer", "cpus online", "fat init", "ps/2 init",
+    "first frame"
+};
+
+static uint64_t* phaseTsc = NULL;
+static int desktopLogged = 0;
+
+static uint64_t PhaseUs(int phase) {
+    uint64_t start = phaseTsc[BOOT_PHASE_EFI_ENTRY];
+    if(!phaseTsc[phase] || phaseTsc[phase] < start) return 0;
+    return TscToUs(phaseTsc[phase] - start);
+}
+
+// The stamps live in BootInfo, which the kernel keeps for good
+void InitBootTime(BootInfo* info) {
+    phaseTsc = info->phaseTsc;
+    BootMark(BOOT_PHASE_KERNEL_ENTRY);
+}
+
+void BootMark(int phase) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    if(!phaseTsc || phase < 0 || phase >= BOOT_PHASES) return;
+    phaseTsc[phase] = rdtsc();
+
+    if(desktopLogged || !phaseTsc[BOOT_PHASE_FIRST_FRAME] || !phaseTsc[BOOT_PHASE_MOUSE]) return;
+    desktopLogged = 1;
+    uint64_t ready = PhaseUs(BOOT_PHASE_FIRST_FRAME);
+    if(PhaseUs(BOOT_PHASE_MOUSE) > ready) ready = PhaseUs(BOOT_PHASE_MOUSE);
+    strcpy(line, "boot: desktop usable ");
+    UIntToStr(ready / 1000, num);
+    strcat(line, num);
+    strcat(line, FAST_BOOT ? " ms after efi entry (fast boot)" : " ms after efi entry");
+    KLog(line);
+}
+
+// Fills out[BOOT_PHASES] in phase order and returns how many were reached
+int GetBootPhases(BootPhase* out) {
+    int reached = 0;
+    for(int i = 0; i < BOOT_PHASES; i++) {
+        out[i].name = bootPhaseNames[i];
+        out[i].reached = phaseTsc && phaseTsc[i] != 0;
+        out[i].atUs = out[i].reached ? PhaseUs(i) : 0;
+        reached += out[i].reached;
+    }
+    return reached;
+}
+
+#endif // BOOTTIME_C
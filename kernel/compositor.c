@@ -0,0 +1,581 @@
+// Damage-tracking compositor. Anything that changes on screen reports the
+// rectangle it touched; once per frame the damage list is repainted with the
+// clip set to each region, so a click no longer repaints the whole desktop.
+//
+// Every window keeps its own off-screen surface. App draw code only runs when
+// part of that surface is marked dirty; moving, raising or uncovering a window
+// just blits the cached pixels.
+//
+// All of it lands in a system-RAM shadow of the screen. Presenting copies the
+// damaged rects to the GOP framebuffer and lays the cursor sprite over them
+// on the way, so the framebuffer is only ever written, never read back.
+// The shadow is always BGRX; the row copy that presents it is picked for the
+// framebuffer's pixel format once at boot.
+//
+// With more than one core online the repaint is cut into screen tiles that
+// every core renders at the same time through SmpRun().
+
+#ifndef COMPOSITOR_C
+#define COMPOSITOR_C
+
+#include "../include/compositor.h"
+
+#define CURSOR_SIZE 20
+
+typedef struct {
+    uint32_t pixels[CURSOR_SIZE * CURSOR_SIZE];  // alpha byte 0 = transparent
+    int hotX, hotY;
+} CursorSprite;
+
+enum { CURSOR_NORMAL, CURSOR_CLICK, CURSOR_DRAG, CURSOR_SHAPES };
+
+static Rect damageRects[MAX_DAMAGE_RECTS];
+static int damageCount = 0;
+static CompositorStats compStats;
+static Rect composeTiles[MAX_COMPOSE_TILES];
+static int parallelCompose = 1;
+
+// Premultiplied black falloff for the right edge and bottom-right corner
+static uint32_t shadowEdge[WINDOW_SHADOW];
+static uint32_t shadowCorner[WINDOW_SHADOW * WINDOW_SHADOW];
+
+typedef void (*PresentRowFn)(uint32_t* dst, const uint32_t* src, int count);
+
+// Shadow to framebuffer row copies, from SelectPresentKernels()
+static PresentRowFn presentRow = CopyRowSSE2;
+static PresentRowFn presentRowNT = CopyRowSSE2NT;
+
+// Bit mask framebuffers: each 8-bit channel is shifted right by drop, to
+// the mask's width, then left by shift to the mask's position
+typedef struct {
+    int drop;
+    int shift;
+} MaskChannel;
+
+static MaskChannel maskChannels[3];             // red, green, blue
+
+static CursorSprite cursorSprites[CURSOR_SHAPES];
+static const CursorSprite* cursorSprite = NULL;  // NULL until ShowCursor()
+static Rect cursorRect;                          // where cursorSprite is on screen
+
+// Two regions are worth merging when they overlap or when their bounding box
+// wastes less than a quarter of the area they cover together.
+static int ShouldMergeRects(const Rect* a, const Rect* b) {
+    if(RectIntersect(a, b, NULL)) return 1;
+    Rect u;
+    RectUnion(a, b, &u);
+    int covered = RectArea(a) + RectArea(b);
+    return RectArea(&u) <= covered + covered / 4;
+}
+
+void InvalidateRect(int x, int y, int w, int h) {
+    Rect screen = {0, 0, (int)fb->width, (int)fb->height};
+    Rect r = {x, y, w, h};
+    if(w <= 0 || h <= 0) return;
+    if(!RectIntersect(&r, &screen, &r)) return;
+
+    // Fold r into any region it should merge with; a merge can make the grown
+    // rect mergeable with others, so rescan until nothing changes.
+    int merged = 1;
+    while(merged) {
+        merged = 0;
+        for(int i = 0; i < damageCount; i++) {
+            if(ShouldMergeRects(&damageRects[i], &r)) {
+                RectUnion(&damageRects[i], &r, &r);
+                damageRects[i] = damageRects[--damageCount];
+                merged = 1;
+                break;
+            }
+        }
+    }
+
+    if(damageCount == MAX_DAMAGE_RECTS) {
+        // List is full: grow whichever region gets the least bigger.
+        int best = 0;
+        int bestGrowth = 0x7FFFFFFF;
+        for(int i = 0; i < damageCount; i++) {
+            Rect u;
+            RectUnion(&damageRects[i], &r, &u);
+            int growth = RectArea(&u) - RectArea(&damageRects[i]);
+            if(growth < bestGrowth) {
+                bestGrowth = growth;
+                best = i;
+            }
+        }
+        RectUnion(&damageRects[best], &r, &damageRects[best]);
+        return;
+    }
+
+    damageRects[damageCount++] = r;
+}
+
+void InvalidateScreen() {
+    damageCount = 0;
+    InvalidateRect(0, 0, fb->width, fb->height);
+}
+
+void InitScreenSurface() {
+    screenSurface.width = fb->width;
+    screenSurface.height = fb->height;
+    screenSurface.stride = fb->width;
+    screenSurface.pixels = (uint32_t*)AllocPages(PAGES_FOR((uint64_t)fb->width * fb->height * sizeof(uint32_t)));
+    if(!screenSurface.pixels) {
+        // No memory for the shadow: draw straight to the framebuffer and
+        // go without a cursor rather than read VRAM back.
+        screenSurface = frontSurface;
+    }
+}
+
+static MaskChannel MaskChannelFor(uint32_t mask) {
+    MaskChannel c = {8, 0};
+    if(!mask) return c;
+    while(!(mask & 1)) {
+        mask >>= 1;
+        c.shift++;
+    }
+    int width = 0;
+    while(mask & 1) {
+        mask >>= 1;
+        width++;
+    }
+    c.drop = width < 8 ? 8 - width : 0;
+    if(width > 8) c.shift += width - 8;          // channel lands in the top bits
+    return c;
+}
+
+// Only for bit mask layouts that are neither RGBX nor BGRX, which no
+// common firmware reports; those go through one scalar conversion per pixel
+static void PresentRowMask(uint32_t* dst, const uint32_t* src, int count) {
+    const MaskChannel* r = &maskChannels[0];
+    const MaskChannel* g = &maskChannels[1];
+    const MaskChannel* b = &maskChannels[2];
+    for(int i = 0; i < count; i++) {
+        uint32_t p = src[i];
+        dst[i] = (((p >> 16) & 0xFF) >> r->drop << r->shift) |
+                 (((p >> 8) & 0xFF) >> g->drop << g->shift) |
+                 ((p & 0xFF) >> b->drop << b->shift);
+    }
+}
+
+// Picks the present copy for the framebuffer's pixel format; call after
+// the blit kernels are chosen
+void SelectPresentKernels() {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    const char* format;
+    const char* method;
+
+    if(fb->pixelFormat == PIXEL_FORMAT_RGBX) {
+        presentRow = cpuDispatch.blit->swapRow;
+        presentRowNT = cpuDispatch.blit->swapRowNT;
+        format = "RGBX";
+        method = "red/blue swap";
+    } else if(fb->pixelFormat == PIXEL_FORMAT_BITMASK) {
+        maskChannels[0] = MaskChannelFor(fb->redMask);
+        maskChannels[1] = MaskChannelFor(fb->greenMask);
+        maskChannels[2] = MaskChannelFor(fb->blueMask);
+        presentRow = PresentRowMask;
+        presentRowNT = PresentRowMask;
+        format = "bit mask";
+        method = "per-pixel mask conversion";
+    } else {
+        presentRow = cpuDispatch.blit->copyRow;
+        presentRowNT = cpuDispatch.blit->copyRowNT;
+        format = "BGRX";
+        method = "copy";
+    }
+
+    strcpy(line, "fb: ");
+    UIntToStr(fb->width, num);
+    strcat(line, num);
+    strcat(line, "x");
+    UIntToStr(fb->height, num);
+    strcat(line, num);
+    strcat(line, " ");
+    strcat(line, format);
+    strcat(line, ", present by ");
+    strcat(line, method);
+    strcat(line, " (");
+    strcat(line, cpuDispatch.blit->name);
+    strcat(line, ")");
+    KLog(line);
+    if(screenSurface.pixels == frontSurface.pixels && fb->pixelFormat != PIXEL_FORMAT_BGRX) {
+        KLog("fb: no shadow surface, colors will be wrong on this format");
+    }
+}
+
+static void InitCursorSprite(CursorSprite* sprite, int hotX, int hotY,
+                             void (*draw)(uint32_t), uint32_t color) {
+    Surface target = {sprite->pixels, CURSOR_SIZE, CURSOR_SIZE, CURSOR_SIZE};
+    for(int i = 0; i < CURSOR_SIZE * CURSOR_SIZE; i++) sprite->pixels[i] = 0;
+    sprite->hotX = hotX;
+    sprite->hotY = hotY;
+
+    SetDrawTarget(&target, 0, 0);
+    draw(color | CURSOR_OPAQUE);
+    ResetDrawTarget();
+}
+
+void InitCursorSprites() {
+    InitCursorSprite(&cursorSprites[CURSOR_NORMAL], 0, 0, DrawCursorArrow, COLOR_CURSOR_NORMAL);
+    InitCursorSprite(&cursorSprites[CURSOR_CLICK], 0, 0, DrawCursorArrow, COLOR_CURSOR_CLICK);
+    InitCursorSprite(&cursorSprites[CURSOR_DRAG], 9, 9, DrawCursorMove, COLOR_CURSOR_DRAG);
+}
+
+static const CursorSprite* CurrentCursorSprite() {
+    for(int i = 0; i < windowCount; i++) {
+        if(windows[i].dragging) return &cursorSprites[CURSOR_DRAG];
+    }
+    return &cursorSprites[mouseButtons ? CURSOR_CLICK : CURSOR_NORMAL];
+}
+
+void ShowCursor() {
+    if(screenSurface.pixels == frontSurface.pixels) return;
+    cursorSprite = CurrentCursorSprite();
+    cursorRect.x = mouseX - cursorSprite->hotX;
+    cursorRect.y = mouseY - cursorSprite->hotY;
+    cursorRect.w = CURSOR_SIZE;
+    cursorRect.h = CURSOR_SIZE;
+}
+
+static uint32_t ShadowAlpha(int distance) {
+    return WINDOW_SHADOW_ALPHA * (WINDOW_SHADOW - distance) / WINDOW_SHADOW;
+}
+
+void InitWindowShadow() {
+    for(int x = 0; x < WINDOW_SHADOW; x++) {
+        shadowEdge[x] = ShadowAlpha(x) << 24;
+        for(int y = 0; y < WINDOW_SHADOW; y++) {
+            uint32_t alpha = ShadowAlpha(x) * ShadowAlpha(y) / WINDOW_SHADOW_ALPHA;
+            shadowCorner[y * WINDOW_SHADOW + x] = alpha << 24;
+        }
+    }
+}
+
+int InitWindowSurface(Window* win) {
+    uint64_t pages = PAGES_FOR((uint64_t)win->width * win->height * sizeof(uint32_t));
+    win->surface.pixels = (uint32_t*)AllocPages(pages);
+    if(!win->surface.pixels) return 0;
+    win->surface.width = win->width;
+    win->surface.height = win->height;
+    win->surface.stride = win->width;
+    compStats.surfacePages += pages;
+
+    win->surfaceDirty.x = 0;
+    win->surfaceDirty.y = 0;
+    win->surfaceDirty.w = win->width;
+    win->surfaceDirty.h = win->height;
+    return 1;
+}
+
+void FreeWindowSurface(Window* win) {
+    if(!win->surface.pixels) return;
+    uint64_t pages = PAGES_FOR((uint64_t)win->surface.width * win->surface.height * sizeof(uint32_t));
+    FreePages(win->surface.pixels, pages);
+    compStats.surfacePages -= pages;
+    win->surface.pixels = NULL;
+}
+
+// Windows cast a drop shadow to the bottom right. Only the composited
+// image changes, the cached surface is reused as is.
+void InvalidateWindow(Window* win) {
+    InvalidateRect(win->x, win->y, win->width + WINDOW_SHADOW, win->height + WINDOW_SHADOW);
+}
+
+// Screen-space rect inside win whose content changed and must be re-rendered
+void InvalidateWindowRect(void* win_ptr, int x, int y, int w, int h) {
+    Window* win = (Window*)win_ptr;
+    Rect bounds = {0, 0, win->surface.width, win->surface.height};
+    Rect r = {x - win->x, y - win->y, w, h};
+    if(!RectIntersect(&r, &bounds, &r)) return;
+
+    if(win->surfaceDirty.w > 0) {
+        RectUnion(&win->surfaceDirty, &r, &win->surfaceDirty);
+    } else {
+        win->surfaceDirty = r;
+    }
+    InvalidateRect(win->x + r.x, win->y + r.y, r.w, r.h);
+}
+
+void InvalidateWindowContent(Window* win) {
+    InvalidateWindowRect(win, win->x, win->y, win->width, win->height);
+}
+
+static void RenderWindowSurface(Window* win) {
+    if(win->surfaceDirty.w <= 0) return;
+
+    // Windows without focus are stored dimmed, so compositing them stays a
+    // plain copy; focus changes re-render the whole surface anyway.
+    SetDrawTarget(&win->surface, win->x, win->y);
+    SetClipRect(&win->surfaceDirty);
+    DrawWindow(win);
+    if(!win->isFocused) {
+        DrawRectAlpha(win->x, win->y, win->width, win->height, INACTIVE_DIM_COLOR);
+    }
+    ResetDrawTarget();
+
+    win->surfaceDirty.w = 0;
+    win->surfaceDirty.h = 0;
+}
+
+// Blended onto whatever is already below the window. Offset by the shadow
+// size, so the top and left edges stay hidden under the window.
+static void DrawWindowShadow(Window* win) {
+    int right = win->x + win->width;
+    int bottom = win->y + win->height;
+    BlendRect(shadowEdge, 0, right, win->y + WINDOW_SHADOW, WINDOW_SHADOW, win->height - WINDOW_SHADOW);
+    for(int d = 0; d < WINDOW_SHADOW; d++) {
+        DrawRectAlpha(win->x + WINDOW_SHADOW, bottom + d, win->width - WINDOW_SHADOW, 1, ShadowAlpha(d) << 24);
+    }
+    BlendRect(shadowCorner, WINDOW_SHADOW, right, bottom, WINDOW_SHADOW, WINDOW_SHADOW);
+}
+
+// Removes what covers the screen above stacking position first: the windows
+// from there up, and the taskbar
+static void CutOccluders(Region* visible, int first) {
+    Rect taskbar = {0, (int)fb->height - 48, (int)fb->width, 48};
+    RegionSubtract(visible, &taskbar);
+    for(int z = first; z < zCount && visible->count > 0; z++) {
+        Window* win = &windows[zOrder[z]];
+        if(!win->visible) continue;
+        Rect bounds = {win->x, win->y, win->width, win->height};
+        RegionSubtract(visible, &bounds);
+    }
+}
+
+// Paints back to front, but every layer is clipped to the part of it still
+// visible on screen, so covered pixels are never written. If a region runs
+// out of rects it stays a superset, which the painter's order makes safe.
+static void RepaintRegion(const Rect* region) {
+    Region visible;
+    Rect clip;
+    ResetClipRect();
+
+    RegionSet(&visible, region);
+    CutOccluders(&visible, 0);
+    if(visible.count > 0) {
+        SetClipRegion(&visible);
+        DrawDesktop();
+    }
+
+    for(int z = 0; z < zCount; z++) {
+        Window* win = &windows[zOrder[z]];
+        if(!win->visible) continue;
+        Rect bounds = {win->x, win->y, win->width, win->height};
+        Rect outer = {win->x, win->y, win->width + WINDOW_SHADOW, win->height + WINDOW_SHADOW};
+        if(!RectIntersect(&outer, region, &clip)) continue;
+
+        if(!win->dragging) {
+            RegionSet(&visible, &clip);
+            RegionSubtract(&visible, &bounds);
+            CutOccluders(&visible, z + 1);
+            if(visible.count > 0) {
+                SetClipRegion(&visible);
+                DrawWindowShadow(win);
+            }
+        }
+
+        if(RectIntersect(&bounds, region, &clip)) {
+            RegionSet(&visible, &clip);
+            CutOccluders(&visible, z + 1);
+            if(visible.count > 0) {
+                SetClipRegion(&visible);
+                BlitRect(win->surface.pixels, win->surface.stride, win->x, win->y,
+                         win->surface.width, win->surface.height);
+            }
+        }
+    }
+
+    Rect taskbar = {0, (int)fb->height - 48, (int)fb->width, 48};
+    if(RectIntersect(&taskbar, region, &clip)) {
+        SetClipRegion(NULL);
+        SetClipRect(&clip);
+        DrawTaskbar();
+    }
+
+    ResetClipRect();
+}
+
+// Copies one row span from the shadow to the framebuffer, overlaying the
+// cursor where the span crosses it. The cursor part is merged in a small
+// buffer first so it goes through the same format-specific copy.
+static void PresentSpan(uint32_t* dst, const uint32_t* src, int x, int y, int w,
+                        PresentRowFn copyRow) {
+    if(!cursorSprite || y < cursorRect.y || y >= cursorRect.y + CURSOR_SIZE ||
+       x + w <= cursorRect.x || x >= cursorRect.x + CURSOR_SIZE) {
+        copyRow(dst, src, w);
+        return;
+    }
+
+    int c0 = cursorRect.x > x ? cursorRect.x : x;
+    int c1 = cursorRect.x + CURSOR_SIZE < x + w ? cursorRect.x + CURSOR_SIZE : x + w;
+    const uint32_t* sprite = cursorSprite->pixels + (y - cursorRect.y) * CURSOR_SIZE - cursorRect.x;
+
+    uint32_t merged[CURSOR_SIZE];
+    if(c0 > x) copyRow(dst, src, c0 - x);
+    for(int px = c0; px < c1; px++) {
+        uint32_t pixel = sprite[px];
+        merged[px - c0] = (pixel >> 24) ? (pixel & 0xFFFFFF) : src[px - x];
+    }
+    copyRow(dst + (c0 - x), merged, c1 - c0);
+    if(c1 < x + w) copyRow(dst + (c1 - x), src + (c1 - x), x + w - c1);
+}
+
+static uint64_t PresentRegion(const Rect* region) {
+    Rect screen = {0, 0, frontSurface.width, frontSurface.height};
+    Rect r;
+    if(screenSurface.pixels == frontSurface.pixels) return 0;
+    if(!RectIntersect(region, &screen, &r)) return 0;
+
+    uint64_t bytes = (uint64_t)r.w * r.h * sizeof(uint32_t);
+    PresentRowFn copyRow = bytes >= BLIT_NT_THRESHOLD ? presentRowNT : presentRow;
+
+    const uint32_t* src = screenSurface.pixels + r.y * screenSurface.stride + r.x;
+    uint32_t* dst = frontSurface.pixels + r.y * frontSurface.stride + r.x;
+    for(int y = r.y; y < r.y + r.h; y++) {
+        PresentSpan(dst, src, r.x, y, r.w, copyRow);
+        src += screenSurface.stride;
+        dst += frontSurface.stride;
+    }
+    BlitFence();
+    return (uint64_t)r.w * r.h;
+}
+
+static void RepaintTile(int item, void* arg) {
+    RepaintRegion(&((const Rect*)arg)[item]);
+}
+
+// Cuts the damage along a grid and keeps, per cell, the bounding box of the
+// damage inside it. Cells never overlap, so no pixel is painted by two cores
+// at once even where damage rects do. The grid coarsens on huge screens.
+static int BuildComposeTiles(const Rect* rects, int count) {
+    int size = COMPOSE_TILE_SIZE;
+    while(((fb->width + size - 1) / size) * ((fb->height + size - 1) / size) > MAX_COMPOSE_TILES) {
+        size *= 2;
+    }
+
+    int tiles = 0;
+    for(int y = 0; y < (int)fb->height; y += size) {
+        for(int x = 0; x < (int)fb->width; x += size) {
+            Rect cell = {x, y, size, size};
+            Rect box, part;
+            int found = 0;
+            for(int i = 0; i < count; i++) {
+                if(!RectIntersect(&rects[i], &cell, &part)) continue;
+                if(found) RectUnion(&box, &part, &box);
+                else box = part;
+                found = 1;
+            }
+            if(found) composeTiles[tiles++] = box;
+        }
+    }
+    return tiles;
+}
+
+// Returns the number of tiles, 0 when it all ran on this core
+static int RepaintDamage(const Rect* rects, int count, int cores) {
+    if(cores <= 1) {
+        for(int i = 0; i < count; i++) RepaintRegion(&rects[i]);
+        return 0;
+    }
+    int tiles = BuildComposeTiles(rects, count);
+    SmpRun(RepaintTile, composeTiles, tiles, cores);
+    return tiles;
+}
+
+static uint64_t PixelsWrittenAllCpus() {
+    uint64_t total = 0;
+    for(int i = 0; i < MAX_CPUS; i++) total += drawContexts[i].pixelsWritten;
+    return total;
+}
+
+// For drawing done outside ComposeFrame, such as the boot loading bar
+void PresentRect(int x, int y, int w, int h) {
+    Rect r = {x, y, w, h};
+    compStats.totalPresentPixels += PresentRegion(&r);
+}
+
+// Render step: brings dirty window surfaces up to date and repaints the
+// frame's damage into the screen shadow. The damage list is kept for
+// PresentFrame(). Returns 0 when there was nothing to repaint.
+int RenderFrame() {
+    if(damageCount == 0) return 0;
+
+    for(int i = 0; i < windowCount; i++) {
+        if(windows[i].visible) RenderWindowSurface(&windows[i]);
+    }
+
+    uint64_t pixels = 0;
+    uint64_t drawnBefore = PixelsWrittenAllCpus();
+    int tiles = RepaintDamage(damageRects, damageCount, parallelCompose ? CpuCount() : 1);
+    for(int i = 0; i < damageCount; i++) pixels += RectArea(&damageRects[i]);
+    uint64_t drawn = PixelsWrittenAllCpus() - drawnBefore;
+
+    compStats.frames++;
+    compStats.lastFramePixels = pixels;
+    compStats.lastFrameRects = damageCount;
+    compStats.totalPixels += pixels;
+    compStats.lastFrameDrawn = drawn;
+    compStats.totalDrawn += drawn;
+    compStats.lastFrameTiles = tiles;
+    if(tiles) compStats.parallelFrames++;
+    if(pixels > compStats.peakFramePixels) compStats.peakFramePixels = pixels;
+    return 1;
+}
+
+// Present step: copies the rendered damage to the framebuffer. A cursor
+// move or shape change alone only needs the old and new cursor rects
+// presented again; nothing is repainted in the shadow for it.
+void PresentFrame() {
+    Rect oldCursor = cursorRect;
+    const CursorSprite* oldSprite = cursorSprite;
+    if(oldSprite) ShowCursor();
+    int cursorChanged = cursorSprite != oldSprite ||
+                        cursorRect.x != oldCursor.x || cursorRect.y != oldCursor.y;
+
+    uint64_t presented = 0;
+    for(int i = 0; i < damageCount; i++) {
+        presented += PresentRegion(&damageRects[i]);
+    }
+    if(cursorChanged) {
+        presented += PresentRegion(&oldCursor);
+        presented += PresentRegion(&cursorRect);
+        if(damageCount == 0) compStats.cursorOnlyFrames++;
+    }
+
+    compStats.totalPresentPixels += presented;
+    damageCount = 0;
+}
+
+void ComposeFrame() {
+    RenderFrame();
+    PresentFrame();
+}
+
+void GetCompositorStats(CompositorStats* out) {
+    *out = compStats;
+}
+
+void SetParallelCompose(int enabled) {
+    parallelCompose = enabled;
+}
+
+int ParallelCompose() {
+    return parallelCompose && CpuCount() > 1;
+}
+
+// Average microseconds to repaint the whole screen into the shadow on
+// `cores` CPUs. Nothing is presented; the shadow ends up as it was.
+uint64_t BenchmarkRepaint(int cores, int runs) {
+    Rect screen = {0, 0, (int)fb->width, (int)fb->height};
+    for(int i = 0; i < windowCount; i++) {
+        if(windows[i].visible) RenderWindowSurface(&windows[i]);
+    }
+    if(runs < 1) runs = 1;
+
+    uint64_t start = ClockUs();
+    for(int i = 0; i < runs; i++) RepaintDamage(&screen, 1, cores);
+    return (ClockUs() - start) / runs;
+}
+
+#endif // COMPOSITOR_C
@@ -0,0 +1,223 @@
+// CPU feature detection and vector state setup. The firmware leaves SSE on
+// but makes no promise about AVX, so the kernel enables what it uses
+// itself: CR0 and CR4 for the FPU and SSE, XSAVE and XCR0 for AVX when the
+// CPU has it and the interrupt frame has room for the state. Then every hot
+// routine in cpuDispatch is bound to the best variant the CPU can run.
+//
+// Runs first in KernelMain, before any interrupt frame exists, since it
+// changes how the stubs save vector state. Application processors copy
+// CR0, CR4 and XCR0 from the boot CPU.
+
+#ifndef CPU_C
+#define CPU_C
+
+#include "../include/cpu.h"
+
+#define CR0_MP          (1ULL << 1)
+#define CR0_EM          (1ULL << 2)
+#define CR0_TS          (1ULL << 3)
+#define CR0_NE          (1ULL << 5)
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_XSAVE       (1ULL << 18)
+
+#define XCR0_X87        (1ULL << 0)
+#define XCR0_SSE        (1ULL << 1)
+#define XCR0_AVX        (1ULL << 2)
+
+static CpuFeatures cpuFeatures;
+
+static void DetectFeatures(CpuFeatures* f) {
+    uint32_t a, b, c, d;
+    Cpuid(0, &a, &b, &c, &d);
+    uint32_t maxLeaf = a;
+    *(uint32_t*)&f->vendor[0] = b;
+    *(uint32_t*)&f->vendor[4] = d;
+    *(uint32_t*)&f->vendor[8] = c;
+    f->vendor[12] = '\0';
+
+    Cpuid(1, &a, &b, &c, &d);
+    f->stepping = a & 0xF;
+    f->model = (a >> 4) & 0xF;
+    f->family = (a >> 8) & 0xF;
+    if(f->family == 0xF) f->family += (a >> 20) & 0xFF;
+    if(f->family >= 6) f->model |= ((a >> 16) & 0xF) << 4;
+    f->sse3 = (c >> 0) & 1;
+    f->ssse3 = (c >> 9) & 1;
+    f->fma = (c >> 12) & 1;
+    f->sse41 = (c >> 19) & 1;
+    f->sse42 = (c >> 20) & 1;
+    f->popcnt = (c >> 23) & 1;
+    f->xsave = (c >> 26) & 1;
+    f->avx = (c >> 28) & 1;
+
+    if(maxLeaf >= 7) {
+        Cpuid(7, &a, &b, &c, &d);
+        f->avx2 = (b >> 5) & 1;
+        f->bmi2 = (b >> 8) & 1;
+        f->erms = (b >> 9) & 1;
+        f->avx512f = (b >> 16) & 1;
+        f->fsrm = (d >> 4) & 1;
+    }
+
+    Cpuid(0x80000000, &a, &b, &c, &d);
+    if(a >= 0x80000004) {
+        uint32_t* brand = (uint32_t*)f->brand;
+        for(uint32_t leaf = 0; leaf < 3; leaf++) {
+            Cpuid(0x80000002 + leaf, &brand[leaf * 4], &brand[leaf * 4 + 1],
+                  &brand[leaf * 4 + 2], &brand[leaf * 4 + 3]);
+        }
+        f->brand[48] = '\0';
+    }
+}
+
+static void WriteXcr0(uint64_t value) {
+    __asm__ volatile("xsetbv" : : "c"(0), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// FPU native error reporting, no emulation, no lazy switching trap; SSE
+// with FXSAVE and unmasked SIMD exceptions delivered as #XM; then AVX
+static void EnableVectorState(CpuFeatures* f) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+
+    uint64_t cr4 = ReadCR4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if(f->xsave) cr4 |= CR4_XSAVE;
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+
+    f->xsaveSize = 512;
+    if(!f->xsave) return;
+
+    uint32_t a, b, c, d;
+    f->xcr0 = XCR0_X87 | XCR0_SSE;
+    WriteXcr0(f->xcr0);
+    if(f->avx) {
+        WriteXcr0(f->xcr0 | XCR0_AVX);
+        Cpuid(0xD, &a, &b, &c, &d);
+        if(b <= FPU_XSAVE_MAX) {
+            f->xcr0 |= XCR0_AVX;
+            f->avxUsable = 1;
+        } else {
+            WriteXcr0(f->xcr0);
+        }
+    }
+    Cpuid(0xD, &a, &b, &c, &d);
+    f->xsaveSize = b;
+    SetFpuSaveMode(1);
+}
+
+static void SelectKernels(const CpuFeatures* f) {
+    int avx2 = f->avx2 && f->avxUsable;
+
+    cpuDispatch.blit = avx2 ? &blitKernelsAVX2 : &blitKernelsSSE2;
+    cpuDispatch.glyphRow = avx2 ? GlyphRowAVX2 : GlyphRowSSE2;
+    cpuDispatch.glyphName = avx2 ? "avx2" : "sse2";
+
+    if(f->fsrm || f->erms) {
+        cpuDispatch.memCopy = MemCopyRepMovsb;
+        cpuDispatch.memCopyName = f->fsrm ? "rep movsb (fsrm)" : "rep movsb (erms)";
+    } else {
+        cpuDispatch.memCopy = avx2 ? MemCopyAVX2 : MemCopySSE2;
+        cpuDispatch.memCopyName = avx2 ? "avx2" : "sse2";
+    }
+    if(f->erms) {
+        cpuDispatch.memSet = MemSetRepStosb;
+        cpuDispatch.memSetName = "rep stosb (erms)";
+    } else {
+        cpuDispatch.memSet = avx2 ? MemSetAVX2 : MemSetSSE2;
+        cpuDispatch.memSetName = avx2 ? "avx2" : "sse2";
+    }
+}
+
+static void AppendFeature(char* line, const char* name, int present) {
+    if(!present) return;
+    strcat(line, " ");
+    strcat(line, name);
+}
+
+void InitCpu() {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    CpuFeatures* f = &cpuFeatures;
+
+    DetectFeatures(f);
+    EnableVectorState(f);
+    SelectKernels(f);
+
+    strcpy(line, "cpu: ");
+    strcat(line, f->vendor);
+    strcat(line, " family ");
+    IntToStr(f->family, num);
+    strcat(line, num);
+    strcat(line, " model ");
+    IntToStr(f->model, num);
+    strcat(line, num);
+    strcat(line, " stepping ");
+    IntToStr(f->stepping, num);
+    strcat(line, num);
+    KLog(line);
+    if(f->brand[0]) {
+        const char* brand = f->brand;
+        while(*brand == ' ') brand++;
+        strcpy(line, "cpu: ");
+        strcat(line, brand);
+        KLog(line);
+    }
+
+    // Lines are kept under KLOG_LINE_LENGTH with every feature present
+    strcpy(line, "cpu: vector sse2");
+    AppendFeature(line, "sse3", f->sse3);
+    AppendFeature(line, "ssse3", f->ssse3);
+    AppendFeature(line, "sse4.1", f->sse41);
+    AppendFeature(line, "sse4.2", f->sse42);
+    AppendFeature(line, "avx", f->avx);
+    AppendFeature(line, "avx2", f->avx2);
+    AppendFeature(line, "fma", f->fma);
+    AppendFeature(line, "avx512f", f->avx512f);
+    KLog(line);
+    strcpy(line, "cpu: other");
+    AppendFeature(line, "popcnt", f->popcnt);
+    AppendFeature(line, "bmi2", f->bmi2);
+    AppendFeature(line, "erms", f->erms);
+    AppendFeature(line, "fsrm", f->fsrm);
+    KLog(line);
+
+    strcpy(line, f->xsave ? "cpu: xsave, xcr0 " : "cpu: fxsave only");
+    if(f->xsave) {
+        HexToStr(f->xcr0, num);
+        strcat(line, num);
+        strcat(line, ", ");
+        UIntToStr(f->xsaveSize, num);
+        strcat(line, num);
+        strcat(line, " bytes saved per interrupt");
+    }
+    if(f->avx && !f->avxUsable) strcat(line, ", AVX left off");
+    KLog(line);
+
+    strcpy(line, "cpu: fill/blit ");
+    strcat(line, cpuDispatch.blit->name);
+    strcat(line, ", glyph ");
+    strcat(line, cpuDispatch.glyphName);
+    KLog(line);
+    strcpy(line, "cpu: memcpy ");
+    strcat(line, cpuDispatch.memCopyName);
+    strcat(line, ", memset ");
+    strcat(line, cpuDispatch.memSetName);
+    KLog(line);
+}
+
+const CpuFeatures* GetCpuFeatures() {
+    return &cpuFeatures;
+}
+
+void MemCopy(void* dst, const void* src, uint64_t n) {
+    cpuDispatch.memCopy(dst, src, n);
+}
+
+void MemSet(void* dst, uint8_t value, uint64_t n) {
+    cpuDispatch.memSet(dst, value, n);
+}
+
+#endif // CPU_C
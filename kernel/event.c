@@ -0,0 +1,337 @@
+// Kernel event queues. Input, window timers and deferred invalidations are
+// posted as typed events. The input task dispatches the kernel queue:
+// focus, dragging, closing and the desktop are handled right there, and
+// anything meant for an app is forwarded to the queue of the task that
+// runs that window type. Each app task handles its events and redraws its
+// own windows' surfaces.
+//
+// Posting merges an event into the newest queued one where only the latest
+// state matters: consecutive pointer moves keep the last position, timer
+// ticks add up, and consecutive invalidations of one window become their
+// bounding rect. A drag therefore moves the window once per dispatch, not
+// once per packet.
+//
+// Window state, the queues and everything the compositor touches are
+// guarded by one UI lock. Timer interrupts only count ticks per window and
+// wake the input task, which turns them into events.
+
+#ifndef EVENT_C
+#define EVENT_C
+
+#include "../include/event.h"
+
+typedef struct {
+    Event events[EVENT_QUEUE_SIZE];
+    int head;
+    int count;
+} EventQueue;
+
+static EventQueue kernelQueue;
+static EventQueue appQueues[WINDOW_TYPES];
+static int appTasks[WINDOW_TYPES] = { -1, -1, -1, -1, -1, -1 };
+static int inputTask = -1;
+static Mutex uiLock;
+static EventStats eventStats;
+
+static int pointerX = -1;      // position after the last posted packet
+static int pointerY = -1;
+static int pointerButtons = 0;
+
+static volatile uint32_t windowTimerTicks[MAX_WINDOWS];
+static int windowTimers[MAX_WINDOWS];
+
+static int MergeEvent(Event* last, const Event* ev) {
+    if(last->type != ev->type || last->window != ev->window || last->serial != ev->serial) return 0;
+
+    if(ev->type == EVENT_POINTER_MOVE && last->code == ev->code) {
+        last->x = ev->x;
+        last->y = ev->y;
+        eventStats.mergedMoves++;
+        return 1;
+    }
+    if(ev->type == EVENT_TIMER) {
+        last->code += ev->code;
+        eventStats.mergedTimers += ev->code;
+        return 1;
+    }
+    if(ev->type == EVENT_INVALIDATE) {
+        Rect a = { last->x, last->y, last->w, last->h };
+        Rect b = { ev->x, ev->y, ev->w, ev->h };
+        Rect u;
+        RectUnion(&a, &b, &u);
+        last->x = u.x;
+        last->y = u.y;
+        last->w = u.w;
+        last->h = u.h;
+        eventStats.mergedInvalidates++;
+        return 1;
+    }
+    return 0;
+}
+
+static void PushEvent(EventQueue* queue, const Event* ev) {
+    if(queue->count > 0) {
+        Event* last = &queue->events[(queue->head + queue->count - 1) % EVENT_QUEUE_SIZE];
+        if(MergeEvent(last, ev)) return;
+    }
+
+    if(queue->count == EVENT_QUEUE_SIZE) {
+        eventStats.dropped++;
+        return;
+    }
+    queue->events[(queue->head + queue->count) % EVENT_QUEUE_SIZE] = *ev;
+    queue->count++;
+    eventStats.posted++;
+    if(queue->count > eventStats.peakDepth) eventStats.peakDepth = queue->count;
+}
+
+static int PopEvent(EventQueue* queue, Event* out) {
+    if(queue->count == 0) return 0;
+    *out = queue->events[queue->head];
+    queue->head = (queue->head + 1) % EVENT_QUEUE_SIZE;
+    queue->count--;
+    return 1;
+}
+
+void PostEvent(const Event* ev) {
+    PushEvent(&kernelQueue, ev);
+}
+
+void PostKeyScancode(uint8_t scancode, uint64_t timeUs) {
+    Event ev = {0};
+    ev.type = (scancode & 0x80) ? EVENT_KEY_UP : EVENT_KEY_DOWN;
+    ev.window = -1;
+    ev.timeUs = timeUs;
+    ev.code = scancode & 0x7F;
+    PostEvent(&ev);
+}
+
+// Turns a relative packet into an absolute pointer move plus a button
+// event when the left button changed
+void PostMousePacket(int deltaX, int deltaY, int buttons, uint64_t timeUs) {
+    if(pointerX < 0) {
+        pointerX = mouseX;
+        pointerY = mouseY;
+    }
+    int x = pointerX + deltaX;
+    int y = pointerY + deltaY;
+    if(x < 0) x = 0;
+    if(y < 0) y = 0;
+    if(x >= fb->width - 20) x = fb->width - 20;
+    if(y >= fb->height - 20) y = fb->height - 20;
+
+    Event ev = {0};
+    ev.window = -1;
+    ev.timeUs = timeUs;
+    ev.x = x;
+    ev.y = y;
+
+    if(x != pointerX || y != pointerY) {
+        ev.type = EVENT_POINTER_MOVE;
+        ev.code = pointerButtons;
+        PostEvent(&ev);
+    }
+
+    int left = buttons & 0x01;
+    if(left != pointerButtons) {
+        ev.type = left ? EVENT_BUTTON_DOWN : EVENT_BUTTON_UP;
+        ev.code = left;
+        PostEvent(&ev);
+    }
+
+    pointerX = x;
+    pointerY = y;
+    pointerButtons = left;
+}
+
+// Screen-space rect inside a window, applied when the event is dispatched
+void PostInvalidate(int window, int x, int y, int w, int h) {
+    Event ev = {0};
+    ev.type = EVENT_INVALIDATE;
+    ev.window = window;
+    ev.timeUs = ClockUs();
+    ev.x = x;
+    ev.y = y;
+    ev.w = w;
+    ev.h = h;
+    PostEvent(&ev);
+}
+
+// Queues an event for the task that runs this window's type. Windows
+// without app logic have no task and the event is dropped.
+void PostWindowEvent(int window, int type, int code, int x, int y) {
+    int windowType = windows[window].windowType;
+    if(windowType < 0 || windowType >= WINDOW_TYPES || appTasks[windowType] < 0) return;
+
+    Event ev = {0};
+    ev.type = type;
+    ev.window = window;
+    ev.serial = windows[window].serial;
+    ev.timeUs = ClockUs();
+    ev.x = x;
+    ev.y = y;
+    ev.code = code;
+    PushEvent(&appQueues[windowType], &ev);
+    TaskWake(appTasks[windowType]);
+}
+
+static void WindowTimerTick(void* arg) {
+    windowTimerTicks[(intptr_t)arg]++;
+    WakeInputTask();
+}
+
+// Sends the window an EVENT_TIMER every periodMs; ticks missed before the
+// input task gets to them arrive as one event with the tick count in code
+int SetWindowTimer(int window, uint32_t periodMs) {
+    ClearWindowTimer(window);
+    windowTimers[window] = TimerPeriodic((uint64_t)periodMs * 1000, WindowTimerTick, (void*)(intptr_t)window) + 1;
+    return windowTimers[window] != 0;
+}
+
+void ClearWindowTimer(int window) {
+    if(windowTimers[window]) {
+        TimerCancel(windowTimers[window] - 1);
+        windowTimers[window] = 0;
+    }
+    windowTimerTicks[window] = 0;
+}
+
+static void PostTimerEvents() {
+    for(int i = 0; i < windowCount; i++) {
+        if(!windowTimerTicks[i]) continue;
+        uint32_t ticks = __atomic_exchange_n(&windowTimerTicks[i], 0, __ATOMIC_SEQ_CST);
+        if(!ticks) continue;
+
+        Event ev = {0};
+        ev.type = EVENT_TIMER;
+        ev.window = i;
+        ev.timeUs = ClockUs();
+        ev.code = ticks;
+        PostEvent(&ev);
+        eventStats.mergedTimers += ticks - 1;
+    }
+}
+
+static void DispatchEvent(const Event* ev) {
+    Window* win = ev->window >= 0 ? &windows[ev->window] : NULL;
+
+    switch(ev->type) {
+        case EVENT_KEY_DOWN:
+        case EVENT_KEY_UP:
+            HandleKeyEvent(ev->code, ev->type == EVENT_KEY_DOWN);
+            break;
+        case EVENT_POINTER_MOVE:
+            oldMouseX = mouseX;
+            oldMouseY = mouseY;
+            mouseX = ev->x;
+            mouseY = ev->y;
+            if(mouseButtons) HandleMouseMove(mouseX, mouseY);
+            break;
+        case EVENT_BUTTON_DOWN:
+            HandleMouseClick(ev->x, ev->y);
+            mouseButtons = 1;
+            break;
+        case EVENT_BUTTON_UP:
+            HandleMouseRelease();
+            mouseButtons = 0;
+            break;
+        case EVENT_TIMER:
+            if(win && win->visible) PostWindowEvent(ev->window, EVENT_TIMER, ev->code, 0, 0);
+            break;
+        case EVENT_INVALIDATE:
+            if(win && win->visible) InvalidateWindowRect(win, ev->x, ev->y, ev->w, ev->h);
+            break;
+    }
+}
+
+// Runs every event on the kernel queue, including ones posted by the
+// handlers, and returns how many were dispatched. Caller holds the UI lock.
+int DispatchEvents() {
+    PostTimerEvents();
+
+    int dispatched = 0;
+    Event ev;
+    while(PopEvent(&kernelQueue, &ev)) {
+        DispatchEvent(&ev);
+        dispatched++;
+    }
+    eventStats.dispatched += dispatched;
+    return dispatched;
+}
+
+static void InputTaskMain(void* arg) {
+    while(1) {
+        TaskWait();
+        UiLock();
+        ProcessInput();
+        DispatchEvents();
+        UiUnlock();
+    }
+}
+
+// One per window type: handles that type's events, then redraws the
+// surfaces they dirtied so the compositor only has to copy them
+static void AppTaskMain(void* arg) {
+    int windowType = (int)(intptr_t)arg;
+    EventQueue* queue = &appQueues[windowType];
+
+    while(1) {
+        TaskWait();
+        UiLock();
+        Event ev;
+        while(PopEvent(queue, &ev)) {
+            // The window may have closed, and its slot been reused, since
+            Window* win = &windows[ev.window];
+            if(!win->visible || win->windowType != windowType || win->serial != ev.serial) continue;
+            HandleWindowEvent(win, &ev);
+            eventStats.dispatched++;
+        }
+        for(int i = 0; i < windowCount; i++) {
+            if(windows[i].visible && windows[i].windowType == windowType) {
+                RenderWindowSurface(&windows[i]);
+            }
+        }
+        UiUnlock();
+    }
+}
+
+void StartEventTasks() {
+    static const char* appNames[WINDOW_TYPES] = {
+        NULL, "terminal", "files", "editor", "tetris", "paint"
+    };
+
+    inputTask = CreateTask("input", TASK_PRIORITY_HIGH, InputTaskMain, NULL);
+    for(int type = 0; type < WINDOW_TYPES; type++) {
+        if(appNames[type]) {
+            appTasks[type] = CreateTask(appNames[type], TASK_PRIORITY_NORMAL, AppTaskMain, (void*)(intptr_t)type);
+        }
+    }
+}
+
+// Safe from interrupt handlers
+void WakeInputTask() {
+    TaskWake(inputTask);
+}
+
+void UiLock() {
+    if(uiLock.locked) eventStats.lockContended++;
+    MutexLock(&uiLock);
+}
+
+void UiUnlock() {
+    MutexUnlock(&uiLock);
+}
+
+// Lets waiting tasks at the UI in during long work that holds the lock
+void UiYield() {
+    if(!uiLock.waiters) return;
+    UiUnlock();
+    TaskYield();
+    UiLock();
+}
+
+void GetEventStats(EventStats* out) {
+    *out = eventStats;
+}
+
+#endif // EVENT_C
@@ -0,0 +1,193 @@
+// 8x8 bitmap font and the glyph renderer behind DrawText/DrawTextRun.
+// Like blit.c this only needs <stdint.h> and intrinsics, so tools/gfxbench.c
+// builds it on the host too.
+
+#ifndef FONT_C
+#define FONT_C
+
+#include "blit.c"
+#include "../include/font.h"
+
+// 8x8 bitmap font
+static const unsigned char font8x8[128][8] = {
+    [' '] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    ['!'] = {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00},
+    ['"'] = {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    ['#'] = {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00},
+    ['$'] = {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00},
+    ['%'] = {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00},
+    ['&'] = {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00},
+    ['\''] = {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00},
+    ['('] = {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00},
+    [')'] = {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00},
+    ['*'] = {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00},
+    ['+'] = {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00},
+    [','] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06},
+    ['-'] = {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00},
+    ['.'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00},
+    ['/'] = {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00},
+    ['0'] = {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00},
+    ['1'] = {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00},
+    ['2'] = {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00},
+    ['3'] = {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00},
+    ['4'] = {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00},
+    ['5'] = {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00},
+    ['6'] = {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00},
+    ['7'] = {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00},
+    ['8'] = {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00},
+    ['9'] = {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00},
+    [':'] = {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00},
+    [';'] = {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06},
+    ['<'] = {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00},
+    ['='] = {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00},
+    ['>'] = {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00},
+    ['?'] = {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00},
+    ['@'] = {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00},
+    ['A'] = {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00},
+    ['B'] = {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00},
+    ['C'] = {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00},
+    ['D'] = {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00},
+    ['E'] = {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00},
+    ['F'] = {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00},
+    ['G'] = {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00},
+    ['H'] = {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00},
+    ['I'] = {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
+    ['J'] = {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00},
+    ['K'] = {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00},
+    ['L'] = {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00},
+    ['M'] = {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00},
+    ['N'] = {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00},
+    ['O'] = {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00},
+    ['P'] = {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00},
+    ['Q'] = {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00},
+    ['R'] = {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00},
+    ['S'] = {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00},
+    ['T'] = {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
+    ['U'] = {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00},
+    ['V'] = {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00},
+    ['W'] = {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00},
+    ['X'] = {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00},
+    ['Y'] = {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00},
+    ['Z'] = {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00},
+    ['['] = {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00},
+    ['\\'] = {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00},
+    [']'] = {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00},
+    ['^'] = {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00},
+    ['_'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF},
+    ['`'] = {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00},
+    ['a'] = {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00},
+    ['b'] = {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00},
+    ['c'] = {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00},
+    ['d'] = {0x38, 0x30, 0x30, 0x3e, 0x33, 0x33, 0x6E, 0x00},
+    ['e'] = {0x00, 0x00, 0x1E, 0x33, 0x3f, 0x03, 0x1E, 0x00},
+    ['f'] = {0x1C, 0x36, 0x06, 0x0f, 0x06, 0x06, 0x0F, 0x00},
+    ['g'] = {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F},
+    ['h'] = {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00},
+    ['i'] = {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
+    ['j'] = {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E},
+    ['k'] = {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00},
+    ['l'] = {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
+    ['m'] = {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00},
+    ['n'] = {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00},
+    ['o'] = {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00},
+    ['p'] = {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F},
+    ['q'] = {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78},
+    ['r'] = {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00},
+    ['s'] = {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00},
+    ['t'] = {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00},
+    ['u'] = {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00},
+    ['v'] = {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00},
+    ['w'] = {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00},
+    ['x'] = {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00},
+    ['y'] = {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F},
+    ['z'] = {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00},
+    ['{'] = {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00},
+    ['|'] = {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00},
+    ['}'] = {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00},
+    ['~'] = {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+// Each glyph row byte expanded to eight 32-bit lane masks (bit n -> pixel n),
+// generated by the preprocessor so nothing is built at boot.
+#define GLYPH_LANE(b, n) ((((b) >> (n)) & 1) ? 0xFFFFFFFFu : 0u)
+#define GLYPH_MASK(b) { GLYPH_LANE(b, 0), GLYPH_LANE(b, 1), GLYPH_LANE(b, 2), GLYPH_LANE(b, 3), \
+                        GLYPH_LANE(b, 4), GLYPH_LANE(b, 5), GLYPH_LANE(b, 6), GLYPH_LANE(b, 7) }
+#define GLYPH_MASK4(b) GLYPH_MASK(b), GLYPH_MASK((b) + 1), GLYPH_MASK((b) + 2), GLYPH_MASK((b) + 3)
+#define GLYPH_MASK16(b) GLYPH_MASK4(b), GLYPH_MASK4((b) + 4), GLYPH_MASK4((b) + 8), GLYPH_MASK4((b) + 12)
+#define GLYPH_MASK64(b) GLYPH_MASK16(b), GLYPH_MASK16((b) + 16), GLYPH_MASK16((b) + 32), GLYPH_MASK16((b) + 48)
+
+static const uint32_t glyphRowMasks[256][8] __attribute__((aligned(32))) = {
+    GLYPH_MASK64(0), GLYPH_MASK64(64), GLYPH_MASK64(128), GLYPH_MASK64(192)
+};
+
+// Writes the set pixels of one 8-pixel glyph row at dst.
+void GlyphRowScalar(uint32_t* dst, uint8_t bits, uint32_t color) {
+    for(int col = 0; col < 8; col++) {
+        if(bits & (1 << col)) dst[col] = color;
+    }
+}
+
+// Blends color into the 8 destination pixels through the lane mask. This
+// reads the destination, which is fine now that text lands in RAM surfaces.
+void GlyphRowSSE2(uint32_t* dst, uint8_t bits, uint32_t color) {
+    const __m128i* mask = (const __m128i*)glyphRowMasks[bits];
+    __m128i v = _mm_set1_epi32((int)color);
+    __m128i lo = _mm_loadu_si128((const __m128i*)dst);
+    __m128i hi = _mm_loadu_si128((const __m128i*)(dst + 4));
+    lo = _mm_or_si128(_mm_andnot_si128(mask[0], lo), _mm_and_si128(mask[0], v));
+    hi = _mm_or_si128(_mm_andnot_si128(mask[1], hi), _mm_and_si128(mask[1], v));
+    _mm_storeu_si128((__m128i*)dst, lo);
+    _mm_storeu_si128((__m128i*)(dst + 4), hi);
+}
+
+// One masked store per glyph row; unset lanes are never touched.
+__attribute__((target("avx2")))
+void GlyphRowAVX2(uint32_t* dst, uint8_t bits, uint32_t color) {
+    __m256i mask = _mm256_load_si256((const __m256i*)glyphRowMasks[bits]);
+    _mm256_maskstore_epi32((int*)dst, mask, _mm256_set1_epi32((int)color));
+}
+
+// Renders len characters starting at (x, y) into pixels, clipped to clip.
+// The visible character range and row range are worked out once; only the
+// glyphs straddling the clip edge fall back to trimmed scalar rows.
+void RenderTextRun(uint32_t* pixels, int stride, const Rect* clip, int x, int y,
+                   const char* text, int len, uint32_t color, GlyphRowFn glyphRow) {
+    int clipX1 = clip->x + clip->w;
+    int clipY1 = clip->y + clip->h;
+
+    int rowStart = clip->y > y ? clip->y - y : 0;
+    int rowEnd = clipY1 - y < 8 ? clipY1 - y : 8;
+    if(rowStart >= rowEnd || len <= 0) return;
+    if(clipX1 <= x) return;
+
+    int first = clip->x > x ? (clip->x - x) / 8 : 0;
+    int last = (clipX1 - x + 7) / 8;
+    if(last > len) last = len;
+
+    uint32_t* rowBase = pixels + (y + rowStart) * stride;
+    for(int i = first; i < last; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if(c >= 128) c = '?';
+        const unsigned char* glyph = font8x8[c];
+        int cx = x + i * 8;
+        uint32_t* dst = rowBase + cx;
+
+        if(cx >= clip->x && cx + 8 <= clipX1) {
+            for(int row = rowStart; row < rowEnd; row++) {
+                if(glyph[row]) glyphRow(dst, glyph[row], color);
+                dst += stride;
+            }
+        } else {
+            int lo = clip->x > cx ? clip->x - cx : 0;
+            int hi = clipX1 - cx < 8 ? clipX1 - cx : 8;
+            uint8_t colMask = (uint8_t)(((1 << hi) - 1) & ~((1 << lo) - 1));
+            for(int row = rowStart; row < rowEnd; row++) {
+                uint8_t bits = glyph[row] & colMask;
+                if(bits) GlyphRowScalar(dst, bits, color);
+                dst += stride;
+            }
+        }
+    }
+}
+
+#endif // FONT_C
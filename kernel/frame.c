@@ -0,0 +1,66 @@
+// Frame scheduler. The compositor task wakes once per frame slot at
+// FRAME_RATE_HZ and, holding the UI lock:
+//   render  - repaints the damage the other tasks left into the screen
+//             shadow
+//   present - copies it to the framebuffer
+// then sleeps until the next slot. Input and apps run in their own tasks
+// and only mark state and screen areas dirty, so how much they do never
+// sets the frame rate.
+
+#ifndef FRAME_C
+#define FRAME_C
+
+#include "../include/frame.h"
+
+static FrameStats frameStats;
+
+static void FrameTaskMain(void* arg) {
+    uint64_t period = 1000000 / FRAME_RATE_HZ;
+    uint64_t deadline = ClockUs();
+    frameStats.targetHz = FRAME_RATE_HZ;
+
+    while(1) {
+        uint64_t start = ClockUs();
+        UiLock();
+        uint64_t locked = ClockUs();
+        int rendered = RenderFrame();
+        uint64_t renderedAt = ClockUs();
+        PresentFrame();
+        UiUnlock();
+        uint64_t end = ClockUs();
+
+        if(frameStats.frames == 0) BootMark(BOOT_PHASE_FIRST_FRAME);
+        frameStats.frames++;
+        if(rendered) {
+            frameStats.lastLockUs = locked - start;
+            frameStats.lastRenderUs = renderedAt - locked;
+            frameStats.lastPresentUs = end - renderedAt;
+            frameStats.totalLockUs += frameStats.lastLockUs;
+            frameStats.totalRenderUs += frameStats.lastRenderUs;
+            frameStats.totalPresentUs += frameStats.lastPresentUs;
+            uint32_t total = end - start;
+            if(total > frameStats.peakFrameUs) frameStats.peakFrameUs = total;
+        } else {
+            frameStats.idleFrames++;
+        }
+
+        // An overrun skips the slots it ate instead of bunching frames up
+        deadline += period;
+        if(end > deadline) {
+            uint64_t behind = (end - deadline) / period + 1;
+            frameStats.missedFrames += behind;
+            deadline += behind * period;
+        }
+        SleepUntilUs(deadline);
+    }
+}
+
+void StartFrameTask() {
+    CreateTask("compositor", TASK_PRIORITY_HIGH, FrameTaskMain, NULL);
+}
+
+void GetFrameStats(FrameStats* out) {
+    *out = frameStats;
+}
+
+#endif // FRAME_C
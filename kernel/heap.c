@@ -0,0 +1,200 @@
+// Kernel heap on top of the page allocator. Requests up to HEAP_MAX_SMALL
+// bytes are rounded up to a power of two class and served from one-page
+// slabs: a header at the start of the page, then equal objects threaded on
+// a free list. Slabs with room sit on their class's list; a slab that
+// empties out goes back to the page allocator unless it is the last one
+// with room. Bigger requests get their own run of pages behind the same
+// header, so HeapFree() finds out which kind it has from the page the
+// pointer is in.
+//
+// Like the page allocator, the heap is not locked; it is used during boot
+// and from tasks holding the UI lock.
+
+#ifndef HEAP_C
+#define HEAP_C
+
+#include "../include/heap.h"
+
+#define HEAP_SLAB_MAGIC  0x424C4153      // "SLAB"
+#define HEAP_LARGE_MAGIC 0x4752414C      // "LARG"
+#define HEAP_HEADER_SIZE 64              // keeps objects 64 byte aligned
+
+typedef struct HeapSlab {
+    uint32_t magic;
+    uint16_t sizeClass;
+    uint16_t freeCount;
+    uint64_t pages;                      // large objects only
+    void* freeList;
+    struct HeapSlab* next;               // slabs of the class with room
+    struct HeapSlab* prev;
+} HeapSlab;
+
+static HeapSlab* partialSlabs[HEAP_CLASSES];
+static HeapStats heapStats;
+
+static inline uint32_t ClassSize(int sizeClass) {
+    return 1U << (HEAP_MIN_SHIFT + sizeClass);
+}
+
+static inline int ClassCapacity(int sizeClass) {
+    return (PAGE_SIZE - HEAP_HEADER_SIZE) / ClassSize(sizeClass);
+}
+
+static int SizeClass(uint64_t size) {
+    int sizeClass = 0;
+    while(ClassSize(sizeClass) < size) sizeClass++;
+    return sizeClass;
+}
+
+static void CountBytes(int64_t delta) {
+    heapStats.bytesInUse += delta;
+    if(heapStats.bytesInUse > heapStats.peakBytesInUse) heapStats.peakBytesInUse = heapStats.bytesInUse;
+}
+
+static void LinkSlab(HeapSlab* slab) {
+    slab->prev = NULL;
+    slab->next = partialSlabs[slab->sizeClass];
+    if(slab->next) slab->next->prev = slab;
+    partialSlabs[slab->sizeClass] = slab;
+}
+
+static void UnlinkSlab(HeapSlab* slab) {
+    if(slab->prev) slab->prev->next = slab->next;
+    else partialSlabs[slab->sizeClass] = slab->next;
+    if(slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static HeapSlab* NewSlab(int sizeClass) {
+    HeapSlab* slab = (HeapSlab*)AllocPages(1);
+    if(!slab) return NULL;
+
+    uint32_t size = ClassSize(sizeClass);
+    int capacity = ClassCapacity(sizeClass);
+    uint8_t* objects = (uint8_t*)slab + HEAP_HEADER_SIZE;
+    for(int i = 0; i < capacity - 1; i++) {
+        *(void**)(objects + i * size) = objects + (i + 1) * size;
+    }
+    *(void**)(objects + (capacity - 1) * size) = NULL;
+
+    slab->magic = HEAP_SLAB_MAGIC;
+    slab->sizeClass = sizeClass;
+    slab->freeCount = capacity;
+    slab->pages = 1;
+    slab->freeList = objects;
+    LinkSlab(slab);
+    heapStats.classes[sizeClass].slabs++;
+    return slab;
+}
+
+static void* AllocSmall(int sizeClass) {
+    HeapSlab* slab = partialSlabs[sizeClass];
+    if(!slab) slab = NewSlab(sizeClass);
+    if(!slab) return NULL;
+
+    void* object = slab->freeList;
+    slab->freeList = *(void**)object;
+    if(--slab->freeCount == 0) UnlinkSlab(slab);
+
+    HeapClassStats* stats = &heapStats.classes[sizeClass];
+    stats->inUse++;
+    stats->allocations++;
+    CountBytes(ClassSize(sizeClass));
+    return object;
+}
+
+static void FreeSmall(HeapSlab* slab, void* object) {
+    int sizeClass = slab->sizeClass;
+    uint64_t offset = (uint8_t*)object - ((uint8_t*)slab + HEAP_HEADER_SIZE);
+    if(offset % ClassSize(sizeClass) != 0) {
+        heapStats.badFrees++;
+        return;
+    }
+
+    *(void**)object = slab->freeList;
+    slab->freeList = object;
+    if(slab->freeCount++ == 0) LinkSlab(slab);
+
+    HeapClassStats* stats = &heapStats.classes[sizeClass];
+    stats->inUse--;
+    stats->frees++;
+    CountBytes(-(int64_t)ClassSize(sizeClass));
+
+    // An empty slab is kept only while it is the class's last one with room
+    if(slab->freeCount == ClassCapacity(sizeClass) &&
+       (slab->next || slab->prev)) {
+        UnlinkSlab(slab);
+        slab->magic = 0;
+        FreePages(slab, 1);
+        stats->slabs--;
+    }
+}
+
+static void* AllocLarge(uint64_t size) {
+    uint64_t pages = PAGES_FOR(size + HEAP_HEADER_SIZE);
+    HeapSlab* header = (HeapSlab*)AllocPages(pages);
+    if(!header) return NULL;
+
+    header->magic = HEAP_LARGE_MAGIC;
+    header->sizeClass = 0;
+    header->freeCount = 0;
+    header->pages = pages;
+    header->freeList = NULL;
+    header->next = header->prev = NULL;
+
+    heapStats.largeInUse++;
+    heapStats.largePages += pages;
+    heapStats.largeAllocations++;
+    CountBytes(pages * PAGE_SIZE);
+    return (uint8_t*)header + HEAP_HEADER_SIZE;
+}
+
+static void FreeLarge(HeapSlab* header, void* ptr) {
+    if(ptr != (uint8_t*)header + HEAP_HEADER_SIZE) {
+        heapStats.badFrees++;
+        return;
+    }
+    uint64_t pages = header->pages;
+    header->magic = 0;
+    FreePages(header, pages);
+
+    heapStats.largeInUse--;
+    heapStats.largePages -= pages;
+    heapStats.largeFrees++;
+    CountBytes(-(int64_t)(pages * PAGE_SIZE));
+}
+
+// NULL for size 0 or when the page allocator is out of memory
+void* HeapAlloc(uint64_t size) {
+    if(size == 0) return NULL;
+    void* ptr = size <= HEAP_MAX_SMALL ? AllocSmall(SizeClass(size)) : AllocLarge(size);
+    if(!ptr) heapStats.failures++;
+    return ptr;
+}
+
+void* HeapAllocZeroed(uint64_t size) {
+    void* ptr = HeapAlloc(size);
+    if(ptr) MemSet(ptr, 0, size);
+    return ptr;
+}
+
+void HeapFree(void* ptr) {
+    if(!ptr) return;
+    HeapSlab* header = (HeapSlab*)((uint64_t)ptr & ~(uint64_t)(PAGE_SIZE - 1));
+    if((uint8_t*)ptr < (uint8_t*)header + HEAP_HEADER_SIZE) {
+        heapStats.badFrees++;
+    } else if(header->magic == HEAP_SLAB_MAGIC) {
+        FreeSmall(header, ptr);
+    } else if(header->magic == HEAP_LARGE_MAGIC) {
+        FreeLarge(header, ptr);
+    } else {
+        heapStats.badFrees++;
+    }
+}
+
+void GetHeapStats(HeapStats* out) {
+    *out = heapStats;
+    for(int i = 0; i < HEAP_CLASSES; i++) out->classes[i].size = ClassSize(i);
+}
+
+#endif // HEAP_C
@@ -0,0 +1,348 @@
+// Interrupt descriptor table. Every vector gets a 16-byte stub that pushes
+// a dummy error code where the CPU does not, then the vector number, and
+// jumps to a common entry that saves the general registers and the vector
+// state (XSAVE once the CPU setup turns it on, FXSAVE before that) into an
+// InterruptFrame and calls InterruptDispatch(), then resumes
+// whichever frame that returns, which is how tasks get switched. Vectors with
+// no handler are counted and ignored; an unhandled exception stops the
+// machine with a panic screen.
+//
+// The 8259 PICs are remapped to VECTOR_IRQ_BASE with every line masked,
+// which also stops the firmware timer tick; the kernel makes no boot-service
+// calls after KernelMain. Drivers unmask the lines they handle.
+
+#ifndef INTERRUPT_C
+#define INTERRUPT_C
+
+#include "../include/interrupt.h"
+
+typedef struct {
+    uint16_t offsetLow;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t typeAttr;
+    uint16_t offsetMid;
+    uint32_t offsetHigh;
+    uint32_t reserved;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) IdtPointer;
+
+typedef IdtPointer GdtPointer;
+
+#define IDT_GATE_INTERRUPT 0x8E    // present, ring 0, 64-bit interrupt gate
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define ISR_STUB_SIZE 16
+#define ISR_STRING(x) #x
+#define ISR_NUMBER(x) ISR_STRING(x)
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
+
+// Null, 64-bit ring 0 code, data; accessed bits preset so the CPU never
+// writes to the table
+static uint64_t gdt[3] __attribute__((aligned(16))) = {
+    0, 0x00AF9B000000FFFFULL, 0x00CF93000000FFFFULL
+};
+static IdtEntry idt[IDT_ENTRIES] __attribute__((aligned(16)));
+static uint8_t fpuXsave __attribute__((used)) = 0;   // read by isrCommon
+static InterruptHandler interruptHandlers[IDT_ENTRIES];
+static uint64_t interruptCounts[IDT_ENTRIES];
+
+static const char* exceptionNames[EXCEPTION_VECTORS] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range",
+    "invalid opcode", "device not available", "double fault", "coprocessor overrun",
+    "invalid TSS", "segment not present", "stack fault", "general protection",
+    "page fault", "reserved", "x87 error", "alignment check", "machine check",
+    "SIMD error", "virtualization", "control protection", "reserved", "reserved",
+    "reserved", "reserved", "reserved", "reserved", "hypervisor injection",
+    "VMM communication", "security", "reserved"
+};
+
+static uint64_t InterruptDispatch(InterruptFrame* frame) __attribute__((used));
+
+// Stubs for vectors 8, 10-14, 17, 21, 29 and 30 skip the dummy push because
+// the CPU supplies an error code for those.
+__asm__(
+    ".pushsection .text\n"
+    ".align 16\n"
+    "isrStubs:\n"
+    ".set isrVector, 0\n"
+    ".rept 256\n"
+    ".align 16\n"
+    ".if !(isrVector == 8 || (isrVector >= 10 && isrVector <= 14) || isrVector == 17 || isrVector == 21 || isrVector == 29 || isrVector == 30)\n"
+    "    pushq $0\n"
+    ".endif\n"
+    "    pushq $isrVector\n"
+    "    jmp isrCommon\n"
+    ".set isrVector, isrVector + 1\n"
+    ".endr\n"
+    "isrCommon:\n"
+    "    pushq %rax\n"
+    "    pushq %rbx\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %rbp\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $" ISR_NUMBER(FPU_STATE_SIZE) ", %rsp\n"
+    "    leaq 63(%rsp), %rdi\n"
+    "    andq $-64, %rdi\n"
+    "    cmpb $0, fpuXsave(%rip)\n"
+    "    je 1f\n"
+    "    movl $-1, %eax\n"
+    "    movl $-1, %edx\n"
+    "    xsave (%rdi)\n"
+    "    jmp 2f\n"
+    "1:  fxsave (%rdi)\n"
+    "2:  cld\n"
+    "    movq %rsp, %rdi\n"
+    "    call InterruptDispatch\n"
+    "    movq %rax, %rsp\n"
+    "    leaq 63(%rsp), %rdi\n"
+    "    andq $-64, %rdi\n"
+    "    cmpb $0, fpuXsave(%rip)\n"
+    "    je 3f\n"
+    "    movl $-1, %eax\n"
+    "    movl $-1, %edx\n"
+    "    xrstor (%rdi)\n"
+    "    jmp 4f\n"
+    "3:  fxrstor (%rdi)\n"
+    "4:  addq $" ISR_NUMBER(FPU_STATE_SIZE) ", %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rbp\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rbx\n"
+    "    popq %rax\n"
+    "    addq $16, %rsp\n"
+    "    iretq\n"
+    ".popsection\n"
+);
+
+// Draws the exception and the tail of the boot log straight onto the
+// framebuffer, then halts for good
+static void Panic(InterruptFrame* frame) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    int vector = (int)frame->vector;
+
+    strcpy(line, "panic: ");
+    strcat(line, exceptionNames[vector]);
+    strcat(line, " err ");
+    HexToStr(frame->errorCode, num);
+    strcat(line, num);
+    strcat(line, " rip ");
+    HexToStr(frame->rip, num);
+    strcat(line, num);
+    KLog(line);
+
+    SetDrawTarget(&frontSurface, 0, 0);
+    DrawRect(0, 0, frontSurface.width, frontSurface.height, 0x800000);
+    int y = 20;
+    DrawText(20, y, line, COLOR_WHITE);
+    if(vector == 14) {
+        uint64_t cr2;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        strcpy(line, "fault address ");
+        HexToStr(cr2, num);
+        strcat(line, num);
+        DrawText(20, y += 16, line, COLOR_WHITE);
+    }
+    y += 16;
+    for(int i = 0; i < KLogLineCount() && y + 16 < frontSurface.height; i++) {
+        DrawText(20, y += 16, KLogLine(i), COLOR_WHITE);
+    }
+    BlitFence();
+
+    while(1) {
+        __asm__ volatile("cli; hlt");
+    }
+}
+
+// Returns the stack pointer to resume with: the same frame, or another
+// task's saved frame when the scheduler wants to switch
+static uint64_t InterruptDispatch(InterruptFrame* frame) {
+    int vector = (int)frame->vector;
+    PerCpu* cpu = ThisCpu();
+    interruptCounts[vector]++;
+    cpu->interruptDepth++;
+
+    if(interruptHandlers[vector]) {
+        interruptHandlers[vector](frame);
+    } else if(vector < EXCEPTION_VECTORS && vector != 2) {
+        Panic(frame);
+    }
+
+    cpu->interruptDepth--;
+    // Tasks only run on the boot CPU
+    if(cpu->index == 0 && TaskSwitchPending()) return TaskSwitch(frame);
+    return (uint64_t)frame;
+}
+
+// Reinitializes both PICs: master at VECTOR_IRQ_BASE, slave 8 above it on
+// IRQ2, all lines masked
+static void RemapPic() {
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    outb(PIC1_COMMAND, 0x11);              // ICW1: init, ICW4 follows
+    outb(PIC2_COMMAND, 0x11);
+    outb(PIC1_DATA, VECTOR_IRQ_BASE);      // ICW2: vector base
+    outb(PIC2_DATA, VECTOR_IRQ_BASE + 8);
+    outb(PIC1_DATA, 1 << IRQ_CASCADE);     // ICW3: slave on IRQ2
+    outb(PIC2_DATA, IRQ_CASCADE);
+    outb(PIC1_DATA, 0x01);                 // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+void PicUnmask(int irq) {
+    if(irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = IRQ_CASCADE;
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+void PicEoi(int irq) {
+    if(irq >= 8) outb(PIC2_COMMAND, PIC_EOI);
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+// Switches the stubs to XSAVE/XRSTOR. Only safe while no interrupt frame is
+// live, since a frame saved one way cannot be restored the other.
+void SetFpuSaveMode(int xsave) {
+    fpuXsave = xsave != 0;
+}
+
+// Where the stubs keep the vector state in a frame: the first 64-byte
+// boundary of fpuState
+uint8_t* FrameFpuState(InterruptFrame* frame) {
+    return (uint8_t*)(((uint64_t)frame->fpuState + 63) & ~63ULL);
+}
+
+// IRQ7 and IRQ15 also arrive when a request goes away before it is
+// acknowledged. Those are not in service and get no EOI, except that a
+// spurious IRQ15 still went through the master's cascade line.
+static void SpuriousPicInterrupt(InterruptFrame* frame) {
+    int irq = frame->vector - VECTOR_IRQ_BASE;
+    int command = irq >= 8 ? PIC2_COMMAND : PIC1_COMMAND;
+    outb(command, PIC_READ_ISR);
+    if(inb(command) & 0x80) {
+        PicEoi(irq);
+    } else if(irq >= 8) {
+        outb(PIC1_COMMAND, PIC_EOI);
+    }
+}
+
+static void SetIdtGate(int vector, uint64_t handler, uint16_t selector) {
+    IdtEntry* e = &idt[vector];
+    e->offsetLow = handler & 0xFFFF;
+    e->selector = selector;
+    e->ist = 0;
+    e->typeAttr = IDT_GATE_INTERRUPT;
+    e->offsetMid = (handler >> 16) & 0xFFFF;
+    e->offsetHigh = handler >> 32;
+    e->reserved = 0;
+}
+
+// Loads the kernel GDT in place of the firmware's, which sits in
+// boot-services memory, and reloads CS through a far return. GS is left
+// alone so its base keeps pointing at the PerCpu area.
+static void LoadKernelGdt() {
+    GdtPointer gdtr;
+    gdtr.limit = sizeof(gdt) - 1;
+    gdtr.base = (uint64_t)gdt;
+    __asm__ volatile(
+        "lgdt %0\n"
+        "pushq %1\n"
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "movw %w2, %%ds\n"
+        "movw %w2, %%es\n"
+        "movw %w2, %%ss\n"
+        : : "m"(gdtr), "r"((uint64_t)GDT_KERNEL_CODE), "r"((uint64_t)GDT_KERNEL_DATA)
+        : "rax", "memory");
+}
+
+void InitInterrupts() {
+    DisableInterrupts();
+
+    LoadKernelGdt();
+    RemapPic();
+
+    uint64_t stubs;
+    uint16_t cs;
+    __asm__ volatile("lea isrStubs(%%rip), %0" : "=r"(stubs));
+    __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+    for(int i = 0; i < IDT_ENTRIES; i++) {
+        SetIdtGate(i, stubs + i * ISR_STUB_SIZE, cs);
+    }
+
+    IdtPointer idtr;
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint64_t)idt;
+    __asm__ volatile("lidt %0" : : "m"(idtr));
+
+    SetInterruptHandler(VECTOR_IRQ_BASE + 7, SpuriousPicInterrupt);
+    SetInterruptHandler(VECTOR_IRQ_BASE + 15, SpuriousPicInterrupt);
+    KLog("irq: IDT loaded, 8259 PIC remapped to 0x20");
+}
+
+void SetInterruptHandler(int vector, InterruptHandler handler) {
+    interruptHandlers[vector] = handler;
+}
+
+void EnableInterrupts() {
+    __asm__ volatile("sti" : : : "memory");
+}
+
+// Returns the previous RFLAGS for RestoreInterrupts()
+uint64_t DisableInterrupts() {
+    uint64_t flags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void RestoreInterrupts(uint64_t flags) {
+    if(flags & 0x200) EnableInterrupts();
+}
+
+uint64_t InterruptCount(int vector) {
+    return interruptCounts[vector];
+}
+
+// True while a handler runs, where blocking or yielding is not allowed
+int InInterrupt() {
+    return ThisCpu()->interruptDepth > 0;
+}
+
+#endif // INTERRUPT_C
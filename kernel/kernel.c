@@ -1,4 +1,27 @@
 #include "../include/types.h"
+#include "../include/compositor.h"
+#include "../include/interrupt.h"
+#include "../include/task.h"
+#include "../include/apic.h"
+#include "../include/timer.h"
+#include "../include/ps2.h"
+#include "../include/event.h"
+#include "../include/frame.h"
+#include "../include/acpi.h"
+#include "../include/smp.h"
+#include "../include/bootinfo.h"
+#include "../include/pmm.h"
+#include "../include/heap.h"
+#include "../include/boottime.h"
+#include "../include/cpu.h"
+#include "../include/pci.h"
+#include "../include/block.h"
+#include "../include/virtio.h"
+#include "../include/ahci.h"
+#include "../include/bcache.h"
+#include "font.c"
+#include "klog.c"
+#include "region.c"
 #include "../apps/tetris.c"
 #include "../apps/paint.c"
 
@@ -7,8 +30,20 @@
 #define TERMINAL_HISTORY_SIZE 10
 #define MAX_FILES 64
 #define MAX_FILENAME 64
-
-// FAT12 structures
+#define RAMDISK_SECTORS 2880
+#define FAT12_MAX_CLUSTERS 4085
+#define FAT16_MAX_CLUSTERS 65525
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5
+#define FAT12_EOC 0xFFF
+#define FAT16_EOC 0xFFFF
+#define FAT32_EOC 0x0FFFFFFF
+#define FAT32_ENTRY_MASK 0x0FFFFFFF
+#define FAT32_NO_MIRROR 0x80
+#define FSINFO_LEAD_SIGNATURE 0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FAT_READAHEAD 4         // clusters requested ahead of a read
+
+// FAT12/16/32 structures
 #pragma pack(push, 1)
 typedef struct {
     uint8_t jump[3];
@@ -25,7 +60,28 @@ typedef struct {
     uint16_t headCount;
     uint32_t hiddenSectors;
     uint32_t totalSectors32;
-} FAT12_BPB;
+} FAT_BPB;
+
+// FAT32 carries on where the FAT12/16 BPB stops
+typedef struct {
+    uint32_t sectorsPerFat32;
+    uint16_t extFlags;            // bit 7: only the active FAT (bits 0-3) is kept
+    uint16_t version;
+    uint32_t rootCluster;
+    uint16_t fsInfoSector;
+    uint16_t backupBootSector;
+    uint8_t reserved[12];
+} FAT32_BPBExt;
+
+typedef struct {
+    uint32_t leadSignature;
+    uint8_t reserved1[480];
+    uint32_t structSignature;
+    uint32_t freeCount;           // 0xFFFFFFFF when unknown
+    uint32_t nextFree;            // where to start looking, a hint
+    uint8_t reserved2[12];
+    uint32_t trailSignature;
+} FAT32_FSInfo;
 
 typedef struct {
     char name[11];
@@ -40,7 +96,19 @@ typedef struct {
     uint16_t modifyDate;
     uint16_t clusterLow;
     uint32_t fileSize;
-} FAT12_DirEntry;
+} FAT_DirEntry;
+
+// A part of a long name, 13 UCS-2 characters, stored before its 8.3 entry
+typedef struct {
+    uint8_t order;                // 1 nearest the 8.3 entry, FAT_LFN_LAST on the last part
+    uint16_t name1[5];
+    uint8_t attributes;           // ATTR_LONG_NAME
+    uint8_t type;
+    uint8_t checksum;             // of the 8.3 name
+    uint16_t name2[6];
+    uint16_t cluster;             // always 0
+    uint16_t name3[2];
+} FAT_LfnEntry;
 #pragma pack(pop)
 
 #define ATTR_READ_ONLY 0x01
@@ -49,12 +117,41 @@ typedef struct {
 #define ATTR_VOLUME_ID 0x08
 #define ATTR_DIRECTORY 0x10
 #define ATTR_ARCHIVE   0x20
+#define ATTR_LONG_NAME 0x0F
+
+#define FAT_LFN_LAST 0x40
+#define FAT_LFN_CHARS 13
+#define FAT_LFN_MAX_ENTRIES 20
+#define FAT_LONG_NAME 256             // 255 characters and the terminator
+#define FAT_DIR_MAX_ENTRIES 65536
+#define MAX_OPEN_DIRS 8
+#define DIR_INDEX_EMPTY 0xFFFFFFFF
+#define DIR_INDEX_DELETED 0xFFFFFFFE
+
+typedef struct {
+    uint32_t hash;
+    uint32_t entry;               // 8.3 entry, or DIR_INDEX_EMPTY/DELETED
+} DirIndexSlot;
+
+// A directory read in whole, with a hash index of its names
+typedef struct {
+    uint32_t cluster;             // 0 for the fixed FAT12/16 root
+    uint8_t* entries;
+    uint32_t entryCount;
+    uint64_t pages;
+    uint32_t lastCluster;
+    DirIndexSlot* index;
+    uint32_t indexSize;           // a power of two
+    uint32_t indexUsed;           // slots not empty, deleted ones included
+    uint32_t freeHint;            // no free entries before this one
+    uint64_t lastUse;
+} FatDir;
 
 typedef struct {
     char name[MAX_FILENAME];
     int isDirectory;
     uint32_t size;
-    uint16_t cluster;
+    uint32_t cluster;
 } FileEntry;
 
 typedef struct {
@@ -98,17 +195,40 @@ typedef struct {
     int lastDrawX, lastDrawY;
     int windowType;           
     int isFocused;
-    TerminalData termData;
-    FileBrowserData browserData;   
-    TextEditorData editorData;     
-    TetrisGame tetrisGame; 
-    PaintData paintData;
+    Surface surface;          // retained window image, rendered only when dirty
+    Rect surfaceDirty;        // surface-local area to re-render, empty when clean
+    union {                   // heap state of the window type, NULL for about
+        void* appData;
+        TerminalData* termData;
+        FileBrowserData* browserData;
+        TextEditorData* editorData;
+        TetrisGame* tetrisGame;
+        PaintData* paintData;
+    };
+    uint32_t serial;          // new each time the slot is set up
 } Window;
 
 static Framebuffer *fb;
-static Window windows[16];
-static int windowCount = 0;
-static int focusedWindow = -1;
+//Everything is drawn into screenSurface, a system-RAM shadow of the screen;
+//the compositor copies damaged areas to frontSurface (the GOP framebuffer).
+static Surface screenSurface;
+static Surface frontSurface;
+
+//Hot routines (fills, blits, glyphs, memcpy/memset), bound by InitCpu()
+static CpuDispatch cpuDispatch = {
+    &blitKernelsSSE2, GlyphRowSSE2, MemCopySSE2, MemSetSSE2, "sse2", "sse2", "sse2"
+};
+//Windows never move while open; their slot index is the window handle.
+//Closing one frees its state and hands the slot to the next window.
+//Stacking lives in zOrder, bottom to top, so raising one just moves ints.
+#define MAX_WINDOWS 16
+#define WINDOW_FREE -1               // windowType of a closed slot
+static Window windows[MAX_WINDOWS];
+static int windowCount = 0;          // slots ever used; loops stop here
+static int zOrder[MAX_WINDOWS];      // handles of open windows, bottom first
+static int zCount = 0;
+static int focusedWindow = -1;       // handle, or -1
+static uint32_t windowSerial = 0;
 
 //Mouse state
 static int mouseX = 400;
@@ -121,15 +241,57 @@ static int mouseButtons = 0;
 static int ctrlPressed = 0;
 static int shiftPressed = 0;
 
-//Back buffer for cursor
-static uint32_t cursorBackBuffer[20 * 20];
-static int cursorBackBufferValid = 0;
-
-//FAT12 state
-static uint8_t* diskImage = NULL;
-static FAT12_BPB bpb;
-static uint16_t* fatTable = NULL;
-static uint8_t* rootDir = NULL;
+//Draw state. Coordinates given to Draw* are relative to the target's origin.
+//The clip is in draw target coordinates, always inside the target.
+//PushClipRect narrows it and saves the old one on clipStack. When clipRegion
+//is set, primitives also only touch the parts of it inside clipRect.
+//Every CPU has its own copy so screen tiles can be repainted in parallel;
+//the names below always mean the running CPU's.
+#define CLIP_STACK_DEPTH 8
+typedef struct {
+    Surface* target;
+    int originX, originY;
+    Rect clip;
+    Rect clipStack[CLIP_STACK_DEPTH];
+    int clipDepth;
+    const Region* clipRegion;
+    uint64_t pixelsWritten;   // by the draw primitives, for the overdraw count
+} DrawContext;
+static DrawContext drawContexts[MAX_CPUS];
+
+#define drawTarget        (drawContexts[ThisCpu()->index].target)
+#define drawOriginX       (drawContexts[ThisCpu()->index].originX)
+#define drawOriginY       (drawContexts[ThisCpu()->index].originY)
+#define clipRect          (drawContexts[ThisCpu()->index].clip)
+#define clipStack         (drawContexts[ThisCpu()->index].clipStack)
+#define clipDepth         (drawContexts[ThisCpu()->index].clipDepth)
+#define clipRegion        (drawContexts[ThisCpu()->index].clipRegion)
+#define drawPixelsWritten (drawContexts[ThisCpu()->index].pixelsWritten)
+
+//FAT state. The FAT and the directories in use are cached whole and
+//written through a sector at a time. freeMap has a set bit per free cluster.
+static BlockDevice* fatDevice = NULL;
+static FAT_BPB bpb;
+static int fatBits = 0;                     // 12, 16 or 32
+static uint8_t* fatTable = NULL;
+static uint32_t sectorsPerFat = 0;
+static int activeFat = 0;                   // the copy read at mount
+static int fatMirrored = 1;                 // writes go to every copy
+static uint32_t rootCluster = 0;            // FAT32 root chain
+static FatDir openDirs[MAX_OPEN_DIRS];
+static uint64_t dirUseCount = 0;
+static uint8_t* clusterBuffer = NULL;
+static uint8_t* fatDirty = NULL;            // per FAT sector
+static uint64_t* freeMap = NULL;
+static uint32_t freeClusters = 0;
+static uint32_t nextFreeCluster = 2;
+static FAT32_FSInfo fsInfo __attribute__((aligned(16)));
+static uint32_t fsInfoSector = 0;           // 0 without a valid FSInfo
+static int fsInfoDirty = 0;
+static uint32_t fatStartSector = 0;
+static uint32_t rootDirStartSector = 0;
+static uint32_t dataStartSector = 0;
+static uint32_t clusterCount = 0;
 
 //Color Definitions
 #define COLOR_DESKTOP_BG    0x003366
@@ -145,6 +307,8 @@ static uint8_t* rootDir = NULL;
 #define COLOR_TERMINAL_TEXT 0x00FF00
 #define COLOR_CURSOR_NORMAL 0x00FF00
 #define COLOR_CURSOR_CLICK  0xFF0000
+#define COLOR_CURSOR_DRAG   0xFFFFFF
+#define CURSOR_OPAQUE       0xFF000000
 
 static inline uint8_t inb(uint16_t port) {
     uint8_t ret;
@@ -156,6 +320,38 @@ static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ volatile("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t val) {
+    __asm__ volatile("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+#include "memtype.c"
+
 // String functions
 int strlen(const char* str) {
     int len = 0;
@@ -223,6 +419,39 @@ void IntToStr(int num, char* str) {
     str[j] = '\0';
 }
 
+void UIntToStr(uint64_t num, char* str) {
+    char temp[32];
+    int i = 0;
+    do {
+        temp[i++] = '0' + (num % 10);
+        num /= 10;
+    } while(num > 0);
+    
+    int j = 0;
+    while(i > 0) {
+        str[j++] = temp[--i];
+    }
+    str[j] = '\0';
+}
+
+void HexToStr(uint64_t num, char* str) {
+    const char* digits = "0123456789ABCDEF";
+    char temp[16];
+    int i = 0;
+    do {
+        temp[i++] = digits[num & 0xF];
+        num >>= 4;
+    } while(num > 0);
+    
+    int j = 0;
+    str[j++] = '0';
+    str[j++] = 'x';
+    while(i > 0) {
+        str[j++] = temp[--i];
+    }
+    str[j] = '\0';
+}
+
 static unsigned int randSeed = 12345;
 
 void SetRandomSeed(unsigned int seed) {
@@ -234,155 +463,249 @@ int Random(int max) {
     return randSeed % max;
 }
 
+void SetClipRect(const Rect* r) {
+    int x0 = r->x < 0 ? 0 : r->x;
+    int y0 = r->y < 0 ? 0 : r->y;
+    int x1 = r->x + r->w;
+    int y1 = r->y + r->h;
+    if(x1 > drawTarget->width) x1 = drawTarget->width;
+    if(y1 > drawTarget->height) y1 = drawTarget->height;
+    clipRect.x = x0;
+    clipRect.y = y0;
+    clipRect.w = x1 > x0 ? x1 - x0 : 0;
+    clipRect.h = y1 > y0 ? y1 - y0 : 0;
+    clipDepth = 0;
+}
+
+void ResetClipRect() {
+    clipRect.x = 0;
+    clipRect.y = 0;
+    clipRect.w = drawTarget->width;
+    clipRect.h = drawTarget->height;
+    clipDepth = 0;
+    clipRegion = NULL;
+}
+
+// Narrows the clip to a rect given in draw coordinates until PopClipRect
+void PushClipRect(int x, int y, int w, int h) {
+    if(clipDepth < CLIP_STACK_DEPTH) {
+        clipStack[clipDepth] = clipRect;
+        Rect r = {x - drawOriginX, y - drawOriginY, w, h};
+        if(!RectIntersect(&clipRect, &r, &clipRect)) {
+            clipRect.w = 0;
+            clipRect.h = 0;
+        }
+    }
+    clipDepth++;
+}
+
+void PopClipRect() {
+    if(clipDepth == 0) return;
+    clipDepth--;
+    if(clipDepth < CLIP_STACK_DEPTH) clipRect = clipStack[clipDepth];
+}
+
+// Restricts drawing to region (target coordinates); NULL lifts it
+void SetClipRegion(const Region* region) {
+    clipRegion = region;
+}
+
+// Steps through the pieces of the current clip: clipRect, or clipRect cut
+// by each rect of clipRegion. Start with *index = 0.
+static int NextClipRect(int* index, Rect* out) {
+    if(!clipRegion) {
+        if(*index > 0 || clipRect.w <= 0 || clipRect.h <= 0) return 0;
+        (*index)++;
+        *out = clipRect;
+        return 1;
+    }
+    while(*index < clipRegion->count) {
+        if(RectIntersect(&clipRegion->rects[(*index)++], &clipRect, out)) return 1;
+    }
+    return 0;
+}
+
+// Redirects drawing into target; (originX, originY) maps to its top-left pixel
+void SetDrawTarget(Surface* target, int originX, int originY) {
+    drawTarget = target;
+    drawOriginX = originX;
+    drawOriginY = originY;
+    ResetClipRect();
+}
+
+void ResetDrawTarget() {
+    SetDrawTarget(&screenSurface, 0, 0);
+}
+
 void DrawPixel(uint32_t x, uint32_t y, uint32_t color) {
-    if(x < fb->width && y < fb->height) {
-        fb->base[y * fb->pixelsPerScanLine + x] = color;
+    int px = (int)x - drawOriginX;
+    int py = (int)y - drawOriginY;
+    Rect clip;
+    int it = 0;
+    while(NextClipRect(&it, &clip)) {
+        if(px >= clip.x && px < clip.x + clip.w &&
+           py >= clip.y && py < clip.y + clip.h) {
+            drawTarget->pixels[py * drawTarget->stride + px] = color;
+            drawPixelsWritten++;
+            return;
+        }
     }
 }
 
 uint32_t GetPixel(uint32_t x, uint32_t y) {
-    if(x < fb->width && y < fb->height) {
-        return fb->base[y * fb->pixelsPerScanLine + x];
+    int px = (int)x - drawOriginX;
+    int py = (int)y - drawOriginY;
+    if(px >= 0 && px < drawTarget->width && py >= 0 && py < drawTarget->height) {
+        return drawTarget->pixels[py * drawTarget->stride + px];
     }
     return 0;
 }
 
+// Clips the rect (x0, y0)-(x1, y1) in target coordinates to clip
+static int ClipSpan(const Rect* clip, int* x0, int* y0, int* x1, int* y1) {
+    if(*x0 < clip->x) *x0 = clip->x;
+    if(*y0 < clip->y) *y0 = clip->y;
+    if(*x1 > clip->x + clip->w) *x1 = clip->x + clip->w;
+    if(*y1 > clip->y + clip->h) *y1 = clip->y + clip->h;
+    return *x0 < *x1 && *y0 < *y1;
+}
+
 void DrawRect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color) {
-    if(x >= fb->width || y >= fb->height) return;
-    
-    uint32_t maxW = (x + w > fb->width) ? fb->width - x : w;
-    uint32_t maxH = (y + h > fb->height) ? fb->height - y : h;
-    
-    for(uint32_t dy = 0; dy < maxH; dy++) {
-        uint32_t offset = (y + dy) * fb->pixelsPerScanLine + x;
-        for(uint32_t dx = 0; dx < maxW; dx++) {
-            fb->base[offset + dx] = color;
-        }
-    }
-}
-
-// 8x8 bitmap font
-static const unsigned char font8x8[128][8] = {
-    [' '] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
-    ['!'] = {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00},
-    ['"'] = {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
-    ['#'] = {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00},
-    ['$'] = {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00},
-    ['%'] = {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00},
-    ['&'] = {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00},
-    ['\''] = {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00},
-    ['('] = {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00},
-    [')'] = {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00},
-    ['*'] = {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00},
-    ['+'] = {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00},
-    [','] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06},
-    ['-'] = {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00},
-    ['.'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00},
-    ['/'] = {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00},
-    ['0'] = {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00},
-    ['1'] = {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00},
-    ['2'] = {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00},
-    ['3'] = {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00},
-    ['4'] = {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00},
-    ['5'] = {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00},
-    ['6'] = {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00},
-    ['7'] = {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00},
-    ['8'] = {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00},
-    ['9'] = {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00},
-    [':'] = {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00},
-    [';'] = {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06},
-    ['<'] = {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00},
-    ['='] = {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00},
-    ['>'] = {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00},
-    ['?'] = {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00},
-    ['@'] = {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00},
-    ['A'] = {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00},
-    ['B'] = {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00},
-    ['C'] = {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00},
-    ['D'] = {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00},
-    ['E'] = {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00},
-    ['F'] = {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00},
-    ['G'] = {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00},
-    ['H'] = {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00},
-    ['I'] = {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
-    ['J'] = {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00},
-    ['K'] = {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00},
-    ['L'] = {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00},
-    ['M'] = {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00},
-    ['N'] = {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00},
-    ['O'] = {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00},
-    ['P'] = {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00},
-    ['Q'] = {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00},
-    ['R'] = {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00},
-    ['S'] = {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00},
-    ['T'] = {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
-    ['U'] = {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00},
-    ['V'] = {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00},
-    ['W'] = {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00},
-    ['X'] = {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00},
-    ['Y'] = {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00},
-    ['Z'] = {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00},
-    ['['] = {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00},
-    ['\\'] = {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00},
-    [']'] = {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00},
-    ['^'] = {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00},
-    ['_'] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF},
-    ['`'] = {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00},
-    ['a'] = {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00},
-    ['b'] = {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00},
-    ['c'] = {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00},
-    ['d'] = {0x38, 0x30, 0x30, 0x3e, 0x33, 0x33, 0x6E, 0x00},
-    ['e'] = {0x00, 0x00, 0x1E, 0x33, 0x3f, 0x03, 0x1E, 0x00},
-    ['f'] = {0x1C, 0x36, 0x06, 0x0f, 0x06, 0x06, 0x0F, 0x00},
-    ['g'] = {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F},
-    ['h'] = {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00},
-    ['i'] = {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
-    ['j'] = {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E},
-    ['k'] = {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00},
-    ['l'] = {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},
-    ['m'] = {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00},
-    ['n'] = {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00},
-    ['o'] = {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00},
-    ['p'] = {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F},
-    ['q'] = {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78},
-    ['r'] = {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00},
-    ['s'] = {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00},
-    ['t'] = {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00},
-    ['u'] = {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00},
-    ['v'] = {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00},
-    ['w'] = {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00},
-    ['x'] = {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00},
-    ['y'] = {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F},
-    ['z'] = {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00},
-    ['{'] = {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00},
-    ['|'] = {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00},
-    ['}'] = {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00},
-    ['~'] = {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
-};
+    Rect clip;
+    int it = 0;
+    while(NextClipRect(&it, &clip)) {
+        int x0 = (int)x - drawOriginX;
+        int y0 = (int)y - drawOriginY;
+        int x1 = x0 + (int)w;
+        int y1 = y0 + (int)h;
+        if(!ClipSpan(&clip, &x0, &y0, &x1, &y1)) continue;
+        
+        int width = x1 - x0;
+        int streaming = (uint64_t)width * (y1 - y0) * 4 >= BLIT_NT_THRESHOLD;
+        void (*fillRow)(uint32_t*, uint32_t, int) = streaming ? cpuDispatch.blit->fillRowNT : cpuDispatch.blit->fillRow;
+        
+        uint32_t* row = drawTarget->pixels + y0 * drawTarget->stride + x0;
+        for(int dy = y0; dy < y1; dy++) {
+            fillRow(row, color, width);
+            row += drawTarget->stride;
+        }
+        if(streaming) BlitFence();
+        drawPixelsWritten += (uint64_t)width * (y1 - y0);
+    }
+}
 
-void DrawChar(uint32_t x, uint32_t y, char c, uint32_t color) {
-    if(c < 0 || c >= 128) c = '?';
+// Copies a w x h block of pixels from src (srcStride pixels per row) to (x, y)
+void BlitRect(const uint32_t* src, uint32_t srcStride, uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    int dx0 = (int)x - drawOriginX;
+    int dy0 = (int)y - drawOriginY;
+    Rect clip;
+    int it = 0;
+    while(NextClipRect(&it, &clip)) {
+        int x0 = dx0;
+        int y0 = dy0;
+        int x1 = x0 + (int)w;
+        int y1 = y0 + (int)h;
+        if(!ClipSpan(&clip, &x0, &y0, &x1, &y1)) continue;
+        
+        int width = x1 - x0;
+        int streaming = (uint64_t)width * (y1 - y0) * 4 >= BLIT_NT_THRESHOLD;
+        void (*copyRow)(uint32_t*, const uint32_t*, int) = streaming ? cpuDispatch.blit->copyRowNT : cpuDispatch.blit->copyRow;
+        
+        const uint32_t* srcRow = src + (y0 - dy0) * srcStride + (x0 - dx0);
+        uint32_t* dstRow = drawTarget->pixels + y0 * drawTarget->stride + x0;
+        for(int dy = y0; dy < y1; dy++) {
+            copyRow(dstRow, srcRow, width);
+            srcRow += srcStride;
+            dstRow += drawTarget->stride;
+        }
+        if(streaming) BlitFence();
+        drawPixelsWritten += (uint64_t)width * (y1 - y0);
+    }
+}
+
+// Blends a w x h block of premultiplied ARGB pixels over (x, y). A srcStride
+// of 0 repeats the first row, which is how shadow edges are drawn.
+void BlendRect(const uint32_t* src, uint32_t srcStride, uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    int dx0 = (int)x - drawOriginX;
+    int dy0 = (int)y - drawOriginY;
+    Rect clip;
+    int it = 0;
+    while(NextClipRect(&it, &clip)) {
+        int x0 = dx0;
+        int y0 = dy0;
+        int x1 = x0 + (int)w;
+        int y1 = y0 + (int)h;
+        if(!ClipSpan(&clip, &x0, &y0, &x1, &y1)) continue;
+        
+        int width = x1 - x0;
+        const uint32_t* srcRow = src + (y0 - dy0) * srcStride + (x0 - dx0);
+        uint32_t* dstRow = drawTarget->pixels + y0 * drawTarget->stride + x0;
+        for(int dy = y0; dy < y1; dy++) {
+            cpuDispatch.blit->blendRow(dstRow, srcRow, width);
+            srcRow += srcStride;
+            dstRow += drawTarget->stride;
+        }
+        drawPixelsWritten += (uint64_t)width * (y1 - y0);
+    }
+}
+
+// Fills a rect with a translucent color given as straight 0xAARRGGBB
+void DrawRectAlpha(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t argb) {
+    uint32_t alpha = argb >> 24;
+    if(alpha == 0) return;
+    if(alpha == 255) {
+        DrawRect(x, y, w, h, argb);
+        return;
+    }
     
-    const unsigned char* glyph = font8x8[(int)c];
-    for(int row = 0; row < 8; row++) {
-        unsigned char line = glyph[row];
-        for(int col = 0; col < 8; col++) {
-            if(line & (1 << col)) {
-                DrawPixel(x + col, y + row, color);
-            }
+    uint32_t color = PremultiplyColor(argb);
+    Rect clip;
+    int it = 0;
+    while(NextClipRect(&it, &clip)) {
+        int x0 = (int)x - drawOriginX;
+        int y0 = (int)y - drawOriginY;
+        int x1 = x0 + (int)w;
+        int y1 = y0 + (int)h;
+        if(!ClipSpan(&clip, &x0, &y0, &x1, &y1)) continue;
+        
+        int width = x1 - x0;
+        uint32_t* row = drawTarget->pixels + y0 * drawTarget->stride + x0;
+        for(int dy = y0; dy < y1; dy++) {
+            cpuDispatch.blit->fillAlphaRow(row, color, width);
+            row += drawTarget->stride;
         }
+        drawPixelsWritten += (uint64_t)width * (y1 - y0);
     }
 }
 
-void DrawText(uint32_t x, uint32_t y, const char* text, uint32_t color) {
-    uint32_t xPos = x;
-    for(int i = 0; text[i] != '\0'; i++) {
-        DrawChar(xPos, y, text[i], color);
-        xPos += 8;
+// Draws len characters on one line; clipping is worked out once per run and
+// clip piece. Counted as whole 8x8 cells for the overdraw figures.
+void DrawTextRun(uint32_t x, uint32_t y, const char* text, int len, uint32_t color) {
+    int tx = (int)x - drawOriginX;
+    int ty = (int)y - drawOriginY;
+    Rect clip;
+    int it = 0;
+    while(NextClipRect(&it, &clip)) {
+        int x0 = tx;
+        int y0 = ty;
+        int x1 = tx + len * 8;
+        int y1 = ty + 8;
+        if(!ClipSpan(&clip, &x0, &y0, &x1, &y1)) continue;
+        RenderTextRun(drawTarget->pixels, drawTarget->stride, &clip,
+                      tx, ty, text, len, color, cpuDispatch.glyphRow);
+        drawPixelsWritten += (uint64_t)(x1 - x0) * (y1 - y0);
     }
 }
 
-// Fake loading bar shown at boot. Duration in milliseconds (approximate).
+void DrawChar(uint32_t x, uint32_t y, char c, uint32_t color) {
+    DrawTextRun(x, y, &c, 1, color);
+}
+
+void DrawText(uint32_t x, uint32_t y, const char* text, uint32_t color) {
+    DrawTextRun(x, y, text, strlen(text), color);
+}
+
+// Fake loading bar shown at boot. Duration in milliseconds.
 void ShowLoadingBar(int durationMs) {
     int steps = 100;
     int barW = fb->width / 2;
@@ -396,7 +719,9 @@ void ShowLoadingBar(int durationMs) {
     // Draw border and empty bar
     DrawRect(barX - 2, barY - 2, barW + 4, barH + 4, COLOR_BORDER);
     DrawRect(barX, barY, barW, barH, COLOR_WHITE);
+    PresentRect(0, 0, fb->width, fb->height);
 
+    uint64_t start = ClockUs();
     for(int s = 0; s <= steps; s++) {
         int filled = (s * barW) / steps;
 
@@ -412,217 +737,1177 @@ void ShowLoadingBar(int durationMs) {
         DrawRect(barX + (barW/2) - 40, barY + barH + 8, 80, 12, COLOR_DESKTOP_BG);
         DrawText(barX + (barW/2) - 40, barY + barH + 8, "Loading...", COLOR_WHITE);
         DrawText(barX + (barW/2) - 12, barY + barH + 8, perc, COLOR_WHITE);
+        PresentRect(barX, barY, barW, barH + 20);
 
-        // Rough busy-wait to approximate requested duration
         // Split total duration across steps
-        int approxDelayLoops = (durationMs / (steps + 1)) * 30;
-        if(approxDelayLoops < 1) approxDelayLoops = 1;
-        for(volatile int d = 0; d < approxDelayLoops; d++) {
-            for(volatile int z = 0; z < 50; z++);
-        }
+        SleepUntilUs(start + (uint64_t)durationMs * 1000 * (s + 1) / (steps + 1));
     }
 
     // Small pause at end to show 100%
-    for(volatile int d = 0; d < 200000; d++);
+    SleepMs(200);
 }
 
-// FAT12 functions
-void InitFAT12() {
-    diskImage = (uint8_t*)0x100000;
-    
-    FAT12_BPB* bpbPtr = (FAT12_BPB*)diskImage;
+// FAT functions. The volume is whatever block device carries a FAT file
+// system at sector 0, so files saved to it survive a reboot; without one
+// the stock folders go on a ramdisk. The FAT type follows from the
+// cluster count, as the specification has it: 12-bit entries are packed
+// two to three bytes, FAT32 entries use their low 28 bits and the root
+// directory is a cluster chain instead of a fixed area. Files are cluster
+// chains: reads follow the chain with readahead, writes extend or trim it.
+// Everything after the mount goes through the buffer cache, so the disk
+// sees writes when the cache writes back.
+
+// Entry access on a raw FAT, for the mounted one and the ramdisk builder
+static uint32_t FatEntryAt(const uint8_t* fat, int bits, uint32_t cluster) {
+    if(bits == 12) {
+        uint32_t offset = cluster + cluster / 2;
+        uint32_t pair = fat[offset] | (fat[offset + 1] << 8);
+        return cluster & 1 ? pair >> 4 : pair & 0xFFF;
+    }
+    if(bits == 16) return ((const uint16_t*)fat)[cluster];
+    return ((const uint32_t*)fat)[cluster] & FAT32_ENTRY_MASK;
+}
+
+static void PutFatEntry(uint8_t* fat, int bits, uint32_t cluster, uint32_t value) {
+    if(bits == 12) {
+        uint32_t offset = cluster + cluster / 2;
+        if(cluster & 1) {
+            fat[offset] = (fat[offset] & 0x0F) | (value << 4);
+            fat[offset + 1] = value >> 4;
+        } else {
+            fat[offset] = value;
+            fat[offset + 1] = (fat[offset + 1] & 0xF0) | ((value >> 8) & 0x0F);
+        }
+    } else if(bits == 16) {
+        ((uint16_t*)fat)[cluster] = value;
+    } else {
+        uint32_t* entry = &((uint32_t*)fat)[cluster];
+        *entry = (*entry & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK);
+    }
+}
+
+static uint8_t ShortNameChecksum(const char* name) {
+    uint8_t sum = 0;
+    for(int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)name[i];
+    return sum;
+}
+
+static uint16_t GetLfnChar(const FAT_LfnEntry* lfn, int i) {
+    if(i < 5) return lfn->name1[i];
+    if(i < 11) return lfn->name2[i - 5];
+    return lfn->name3[i - 11];
+}
+
+static void SetLfnChar(FAT_LfnEntry* lfn, int i, uint16_t c) {
+    if(i < 5) lfn->name1[i] = c;
+    else if(i < 11) lfn->name2[i - 5] = c;
+    else lfn->name3[i - 11] = c;
+}
+
+// Builds a 1.44 MB FAT12 volume image holding the stock folders and files
+static uint8_t* BuildRamDiskImage() {
+    uint8_t* diskImage = (uint8_t*)AllocZeroedPages(PAGES_FOR(RAMDISK_SECTORS * BLOCK_SECTOR_SIZE));
+    if(!diskImage) return NULL;
+
+    FAT_BPB* bpbPtr = (FAT_BPB*)diskImage;
     bpbPtr->jump[0] = 0xEB;
     bpbPtr->jump[1] = 0x3C;
     bpbPtr->jump[2] = 0x90;
-    
+
     for(int i = 0; i < 8; i++) bpbPtr->oem[i] = "RGOS2.1.0"[i];
-    
+
     bpbPtr->bytesPerSector = 512;
     bpbPtr->sectorsPerCluster = 1;
     bpbPtr->reservedSectors = 1;
     bpbPtr->fatCount = 2;
     bpbPtr->rootEntries = 224;
-    bpbPtr->totalSectors = 2880;
+    bpbPtr->totalSectors = RAMDISK_SECTORS;
     bpbPtr->mediaType = 0xF0;
     bpbPtr->sectorsPerFat = 9;
     bpbPtr->sectorsPerTrack = 18;
     bpbPtr->headCount = 2;
     bpbPtr->hiddenSectors = 0;
     bpbPtr->totalSectors32 = 0;
-    
-    bpb = *bpbPtr;
-    
-    uint32_t fatOffset = bpb.reservedSectors * bpb.bytesPerSector;
-    fatTable = (uint16_t*)(diskImage + fatOffset);
-    
-    fatTable[0] = 0xFF0;
-    fatTable[1] = 0xFFF;
-    
-    uint32_t rootDirOffset = fatOffset + (bpb.fatCount * bpb.sectorsPerFat * bpb.bytesPerSector);
-    rootDir = diskImage + rootDirOffset;
-    
-    FAT12_DirEntry* entries = (FAT12_DirEntry*)rootDir;
-    
+    diskImage[510] = 0x55;
+    diskImage[511] = 0xAA;
+
+    uint32_t fatOffset = bpbPtr->reservedSectors * bpbPtr->bytesPerSector;
+    uint8_t* fat = diskImage + fatOffset;
+
+    PutFatEntry(fat, 12, 0, 0xF00 | bpbPtr->mediaType);
+    PutFatEntry(fat, 12, 1, FAT12_EOC);
+
+    uint32_t rootDirOffset = fatOffset + (bpbPtr->fatCount * bpbPtr->sectorsPerFat * bpbPtr->bytesPerSector);
+    FAT_DirEntry* entries = (FAT_DirEntry*)(diskImage + rootDirOffset);
+
     for(int i = 0; i < 11; i++) entries[0].name[i] = "RGOS  DISK "[i];
     entries[0].attributes = ATTR_VOLUME_ID;
-    
-    for(int i = 0; i < 11; i++) entries[1].name[i] = "DOCUMENTS  "[i];
-    entries[1].attributes = ATTR_DIRECTORY;
-    entries[1].clusterLow = 2;
-    
-    for(int i = 0; i < 11; i++) entries[2].name[i] = "PICTURES   "[i];
+
+    // DOCUMENTS is a letter too long for 8.3, so it is DOCUME~1 with its
+    // full name in a long name entry
+    for(int i = 0; i < 11; i++) entries[2].name[i] = "DOCUME~1   "[i];
     entries[2].attributes = ATTR_DIRECTORY;
-    entries[2].clusterLow = 3;
-    
-    for(int i = 0; i < 11; i++) entries[3].name[i] = "README  TXT"[i];
-    entries[3].attributes = ATTR_ARCHIVE;
-    entries[3].clusterLow = 4;
-    entries[3].fileSize = 256;
-    
-    for(int i = 0; i < 11; i++) entries[4].name[i] = "KERNEL  BIN"[i];
+    entries[2].clusterLow = 2;
+    FAT_LfnEntry* lfn = (FAT_LfnEntry*)&entries[1];
+    lfn->order = 1 | FAT_LFN_LAST;
+    lfn->attributes = ATTR_LONG_NAME;
+    lfn->checksum = ShortNameChecksum(entries[2].name);
+    for(int i = 0; i < FAT_LFN_CHARS; i++) SetLfnChar(lfn, i, i < 9 ? "DOCUMENTS"[i] : i == 9 ? 0 : 0xFFFF);
+
+    for(int i = 0; i < 11; i++) entries[3].name[i] = "PICTURES   "[i];
+    entries[3].attributes = ATTR_DIRECTORY;
+    entries[3].clusterLow = 3;
+
+    for(int i = 0; i < 11; i++) entries[4].name[i] = "README  TXT"[i];
     entries[4].attributes = ATTR_ARCHIVE;
-    entries[4].clusterLow = 5;
-    entries[4].fileSize = 4096;
-    
-    for(int i = 0; i < 11; i++) entries[5].name[i] = "CONFIG  SYS"[i];
+    entries[4].clusterLow = 4;
+    entries[4].fileSize = 256;
+
+    for(int i = 0; i < 11; i++) entries[5].name[i] = "KERNEL  BIN"[i];
     entries[5].attributes = ATTR_ARCHIVE;
-    entries[5].clusterLow = 6;
-    entries[5].fileSize = 128;
-    
-    fatTable[2] = 0xFFF;
-    fatTable[3] = 0xFFF;
-    fatTable[4] = 0xFFF;
-    fatTable[5] = 0xFFF;
-    fatTable[6] = 0xFFF;
+    entries[5].clusterLow = 5;
+    entries[5].fileSize = 4096;
+
+    for(int i = 0; i < 11; i++) entries[6].name[i] = "CONFIG  SYS"[i];
+    entries[6].attributes = ATTR_ARCHIVE;
+    entries[6].clusterLow = 6;
+    entries[6].fileSize = 128;
+
+    for(uint32_t cluster = 2; cluster <= 6; cluster++) PutFatEntry(fat, 12, cluster, FAT12_EOC);
+
+    // The folders hold just "." and "..", whose cluster 0 is the root
+    uint32_t dataOffset = rootDirOffset + bpbPtr->rootEntries * sizeof(FAT_DirEntry);
+    for(uint32_t cluster = 2; cluster <= 3; cluster++) {
+        FAT_DirEntry* dir = (FAT_DirEntry*)(diskImage + dataOffset + (cluster - 2) * bpbPtr->bytesPerSector);
+        for(int i = 0; i < 11; i++) {
+            dir[0].name[i] = ".          "[i];
+            dir[1].name[i] = "..         "[i];
+        }
+        dir[0].attributes = dir[1].attributes = ATTR_DIRECTORY;
+        dir[0].clusterLow = cluster;
+    }
+
+    // Both FATs start out the same
+    uint8_t* secondFat = diskImage + fatOffset + bpbPtr->sectorsPerFat * bpbPtr->bytesPerSector;
+    MemCopy(secondFat, fat, bpbPtr->sectorsPerFat * bpbPtr->bytesPerSector);
+    return diskImage;
+}
+
+static inline int ValidCluster(uint32_t cluster) {
+    return cluster >= 2 && cluster < clusterCount + 2;
+}
+
+static uint32_t GetFatEntry(uint32_t cluster) {
+    return FatEntryAt(fatTable, fatBits, cluster);
+}
+
+static uint32_t FatEoc() {
+    return fatBits == 12 ? FAT12_EOC : fatBits == 16 ? FAT16_EOC : FAT32_EOC;
+}
+
+// FAT entries change in the cached FAT and dirty their sector (both of
+// them for a FAT12 entry straddling two); FlushFat() hands the dirty
+// sectors of every copy to the cache, adjacent ones in one call. The free
+// map and count follow every change.
+static void SetFatEntry(uint32_t cluster, uint32_t value) {
+    uint32_t offset = fatBits == 12 ? cluster + cluster / 2 : cluster * (fatBits / 8);
+    uint32_t lastByte = offset + (fatBits == 12 ? 1 : fatBits / 8 - 1);
+    PutFatEntry(fatTable, fatBits, cluster, value);
+    fatDirty[offset / BLOCK_SECTOR_SIZE] = 1;
+    fatDirty[lastByte / BLOCK_SECTOR_SIZE] = 1;
+
+    uint64_t bit = 1ULL << (cluster % 64);
+    int wasFree = (freeMap[cluster / 64] & bit) != 0;
+    if(value == 0 && !wasFree) {
+        freeMap[cluster / 64] |= bit;
+        freeClusters++;
+    } else if(value != 0 && wasFree) {
+        freeMap[cluster / 64] &= ~bit;
+        freeClusters--;
+    }
+    fsInfoDirty = 1;
+}
+
+// First cluster in [from, limit) that is free (or, with free 0, in use),
+// else limit. Whole words of the map are skipped at a time.
+static uint32_t ScanFreeMap(uint32_t from, uint32_t limit, int free) {
+    if(from >= limit) return limit;
+    uint32_t word = from / 64;
+    uint64_t bits = (free ? freeMap[word] : ~freeMap[word]) & (~0ULL << (from % 64));
+    while(!bits) {
+        word++;
+        if((uint64_t)word * 64 >= limit) return limit;
+        bits = free ? freeMap[word] : ~freeMap[word];
+    }
+    uint32_t cluster = word * 64 + __builtin_ctzll(bits);
+    return cluster < limit ? cluster : limit;
+}
+
+static void BuildFreeMap() {
+    freeClusters = 0;
+    for(uint32_t cluster = 2; cluster < clusterCount + 2; cluster++) {
+        if(GetFatEntry(cluster) != 0) continue;
+        freeMap[cluster / 64] |= 1ULL << (cluster % 64);
+        freeClusters++;
+    }
+}
+
+static int FlushFat() {
+    int ok = 1;
+    uint32_t sector = 0;
+    while(sector < sectorsPerFat) {
+        if(!fatDirty[sector]) {
+            sector++;
+            continue;
+        }
+        uint32_t run = 0;
+        while(sector + run < sectorsPerFat && fatDirty[sector + run]) fatDirty[sector + run++] = 0;
+        uint8_t* data = fatTable + sector * BLOCK_SECTOR_SIZE;
+        for(int i = 0; i < bpb.fatCount; i++) {
+            if(!fatMirrored && i != activeFat) continue;
+            if(!CacheWrite(fatDevice, fatStartSector + i * sectorsPerFat + sector, run, data)) ok = 0;
+        }
+        sector += run;
+    }
+
+    if(fsInfoSector && fsInfoDirty) {
+        fsInfo.freeCount = freeClusters;
+        fsInfo.nextFree = nextFreeCluster;
+        if(CacheWrite(fatDevice, fsInfoSector, 1, &fsInfo)) fsInfoDirty = 0;
+        else ok = 0;
+    }
+    return ok;
+}
+
+static uint64_t ClusterSector(uint32_t cluster) {
+    return dataStartSector + (uint64_t)(cluster - 2) * bpb.sectorsPerCluster;
+}
+
+static uint32_t ClusterBytes() {
+    return bpb.sectorsPerCluster * BLOCK_SECTOR_SIZE;
+}
+
+static void FreeChain(uint32_t cluster) {
+    for(uint32_t n = 0; ValidCluster(cluster) && n < clusterCount; n++) {
+        uint32_t next = GetFatEntry(cluster);
+        SetFatEntry(cluster, 0);
+        if(cluster < nextFreeCluster) nextFreeCluster = cluster;
+        cluster = next;
+    }
+}
+
+// First free run of want clusters at or after from (wrapping round to
+// cluster 2); if there is none, the longest run seen, which may be empty
+static uint32_t FindFreeClusters(uint32_t from, uint32_t want, uint32_t* length) {
+    uint32_t end = clusterCount + 2;
+    uint32_t bestStart = 0, bestLength = 0;
+    if(!ValidCluster(from)) from = 2;
+    for(int pass = 0; pass < 2 && freeClusters > 0; pass++) {
+        uint32_t cluster = pass ? 2 : from;
+        uint32_t limit = pass ? from : end;
+        while((cluster = ScanFreeMap(cluster, limit, 1)) < limit) {
+            uint32_t start = cluster;
+            cluster = ScanFreeMap(start, limit - start > want ? start + want : limit, 0);
+            if(cluster - start > bestLength) {
+                bestStart = start;
+                bestLength = cluster - start;
+                if(bestLength == want) {
+                    *length = want;
+                    return start;
+                }
+            }
+        }
+    }
+    *length = bestLength;
+    return bestStart;
+}
+
+// Allocates count clusters as a chain, in as few contiguous runs as the
+// free space allows, and links it after prev if that is a cluster. The
+// search starts right after prev so a growing file stays contiguous.
+// Returns the first cluster, or 0 with nothing allocated.
+static uint32_t AllocateChain(uint32_t count, uint32_t prev) {
+    uint32_t first = 0;
+    uint32_t last = prev;
+    if(count > freeClusters) return 0;
+    while(count > 0) {
+        uint32_t length;
+        uint32_t start = FindFreeClusters(ValidCluster(last) ? last + 1 : nextFreeCluster, count, &length);
+        if(length == 0) {
+            if(first) FreeChain(first);
+            if(ValidCluster(prev)) SetFatEntry(prev, FatEoc());
+            return 0;
+        }
+        for(uint32_t i = 0; i < length; i++) {
+            SetFatEntry(start + i, i + 1 < length ? start + i + 1 : FatEoc());
+        }
+        if(ValidCluster(last)) SetFatEntry(last, start);
+        if(!first) first = start;
+        last = start + length - 1;
+        count -= length;
+    }
+    nextFreeCluster = ValidCluster(last + 1) ? last + 1 : 2;
+    return first;
 }
 
-void FormatFAT12Name(const char* fat12Name, char* output) {
+static uint32_t ClustersFor(uint32_t size) {
+    return (size + ClusterBytes() - 1) / ClusterBytes();
+}
+
+// Writes size bytes along the chain at first, extending the chain when it
+// is too short and freeing what is left over when it is too long. Runs of
+// adjacent clusters go out as one request straight from content; only a
+// partial last cluster is copied. The FAT is flushed once at the end.
+int WriteFileContent(uint32_t first, const char* content, uint32_t size) {
+    if(!ValidCluster(first) || !fatDevice) return 0;
+    uint32_t clusterBytes = ClusterBytes();
+    uint32_t cluster = first;
+    uint32_t last = 0;
+    uint32_t offset = 0;
+    int ok = 1;
+
+    while(offset < size && ok) {
+        if(!ValidCluster(cluster)) {
+            cluster = AllocateChain(ClustersFor(size - offset), last);
+            if(!cluster) {
+                ok = 0;
+                break;
+            }
+        }
+        uint32_t run = 1;
+        while(offset + run * clusterBytes < size && GetFatEntry(cluster + run - 1) == cluster + run) run++;
+
+        uint32_t bytes = run * clusterBytes;
+        if(bytes > size - offset) bytes = size - offset;
+        uint32_t whole = bytes / clusterBytes;
+        if(whole) ok = CacheWrite(fatDevice, ClusterSector(cluster), whole * bpb.sectorsPerCluster, content + offset);
+        if(ok && bytes % clusterBytes) {
+            MemSet(clusterBuffer, 0, clusterBytes);
+            MemCopy(clusterBuffer, content + offset + whole * clusterBytes, bytes % clusterBytes);
+            ok = CacheWrite(fatDevice, ClusterSector(cluster + whole), bpb.sectorsPerCluster, clusterBuffer);
+        }
+        offset += bytes;
+        last = cluster + run - 1;
+        cluster = GetFatEntry(last);
+    }
+
+    if(ok && ValidCluster(last) && ValidCluster(GetFatEntry(last))) {
+        uint32_t rest = GetFatEntry(last);
+        SetFatEntry(last, FatEoc());
+        FreeChain(rest);
+    }
+    if(!FlushFat()) ok = 0;
+    return ok;
+}
+
+// Reads size bytes along the chain at first into buffer, through the
+// cache. The clusters up to FAT_READAHEAD ahead of the one being copied are
+// already requested, so a fragmented chain still keeps the disk busy.
+// Returns the bytes read, short at the end of the chain or on an error.
+static uint32_t ReadChain(uint32_t first, uint8_t* buffer, uint32_t size) {
+    uint32_t clusterBytes = ClusterBytes();
+    uint32_t clusters = ClustersFor(size);
+    uint32_t cluster = first, ahead = first;
+    uint32_t done = 0, requested = 0;
+    uint32_t offset = 0;
+
+    while(offset < size && ValidCluster(cluster)) {
+        while(requested < clusters && requested < done + FAT_READAHEAD && ValidCluster(ahead)) {
+            CachePrefetch(fatDevice, ClusterSector(ahead), bpb.sectorsPerCluster);
+            ahead = GetFatEntry(ahead);
+            requested++;
+        }
+        uint32_t n = size - offset < clusterBytes ? size - offset : clusterBytes;
+        uint32_t sectors = (n + BLOCK_SECTOR_SIZE - 1) / BLOCK_SECTOR_SIZE;
+        if(n % BLOCK_SECTOR_SIZE == 0) {
+            if(!CacheRead(fatDevice, ClusterSector(cluster), sectors, buffer + offset)) break;
+        } else {
+            if(!CacheRead(fatDevice, ClusterSector(cluster), sectors, clusterBuffer)) break;
+            MemCopy(buffer + offset, clusterBuffer, n);
+        }
+        offset += n;
+        done++;
+        cluster = GetFatEntry(cluster);
+    }
+    return offset;
+}
+
+// Bytes past the end of the chain, or past a read error, come back zero
+void ReadFileContent(uint32_t cluster, char* buffer, uint32_t size) {
+    uint32_t offset = 0;
+    if(ValidCluster(cluster) && fatDevice) offset = ReadChain(cluster, (uint8_t*)buffer, size);
+    if(offset < size) MemSet(buffer + offset, 0, size - offset);
+}
+
+void FormatFATName(const char* fatName, char* output) {
     int outputPos = 0;
-    
-    for(int i = 0; i < 8 && fat12Name[i] != ' '; i++) {
-        output[outputPos++] = fat12Name[i];
+
+    for(int i = 0; i < 8 && fatName[i] != ' '; i++) {
+        output[outputPos++] = fatName[i];
     }
-    
+
     int hasExt = 0;
     for(int i = 8; i < 11; i++) {
-        if(fat12Name[i] != ' ') {
+        if(fatName[i] != ' ') {
             hasExt = 1;
             break;
         }
     }
-    
+
     if(hasExt) {
         output[outputPos++] = '.';
-        for(int i = 8; i < 11 && fat12Name[i] != ' '; i++) {
-            output[outputPos++] = fat12Name[i];
+        for(int i = 8; i < 11 && fatName[i] != ' '; i++) {
+            output[outputPos++] = fatName[i];
         }
     }
-    
+
     output[outputPos] = '\0';
 }
 
-void LoadRootDirectory(FileBrowserData* fb) {
-    fb->fileCount = 0;
-    fb->scrollOffset = 0;
-    fb->selectedIndex = 0;
-    
-    FAT12_DirEntry* entries = (FAT12_DirEntry*)rootDir;
-    
-    for(int i = 0; i < bpb.rootEntries && fb->fileCount < MAX_FILES; i++) {
+// FAT12/16 keep no high half; on FAT32 it is part of the cluster number
+static uint32_t EntryCluster(const FAT_DirEntry* entry) {
+    return entry->clusterLow | (fatBits == 32 ? (uint32_t)entry->clusterHigh << 16 : 0);
+}
+
+static char UpperAscii(char c) {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+// File names compare without regard to case, as FAT does
+static int NamesEqual(const char* a, const char* b) {
+    while(*a && UpperAscii(*a) == UpperAscii(*b)) {
+        a++;
+        b++;
+    }
+    return UpperAscii(*a) == UpperAscii(*b);
+}
+
+static uint32_t NameHash(const char* name) {
+    uint32_t hash = 2166136261U;
+    for(; *name; name++) hash = (hash ^ (uint8_t)UpperAscii(*name)) * 16777619U;
+    return hash;
+}
+
+// The long name held by the entries just before the 8.3 entry at index,
+// in ASCII with '?' for anything wider. Returns how many entries it
+// takes, 0 if there is none or it belongs to some other (deleted) entry.
+static int LongNameAt(const FatDir* dir, uint32_t index, char* out) {
+    const FAT_DirEntry* entries = (const FAT_DirEntry*)dir->entries;
+    uint8_t sum = ShortNameChecksum(entries[index].name);
+    int length = 0;
+    for(uint32_t n = 1; n <= FAT_LFN_MAX_ENTRIES && n <= index; n++) {
+        const FAT_LfnEntry* lfn = (const FAT_LfnEntry*)&entries[index - n];
+        if(lfn->attributes != ATTR_LONG_NAME || lfn->order == 0xE5 ||
+           (lfn->order & 0x1F) != n || lfn->checksum != sum) {
+            return 0;
+        }
+        for(int i = 0; i < FAT_LFN_CHARS && length < FAT_LONG_NAME - 1; i++) {
+            uint16_t c = GetLfnChar(lfn, i);
+            if(c == 0) break;
+            out[length++] = c < 0x80 ? c : '?';
+        }
+        if(lfn->order & FAT_LFN_LAST) {
+            out[length] = '\0';
+            return length ? n : 0;
+        }
+    }
+    return 0;
+}
+
+// Whether the 8.3 entry at index is called name, by either of its names
+static int EntryHasName(const FatDir* dir, uint32_t index, const char* name) {
+    char entryName[FAT_LONG_NAME];
+    FormatFATName(((const FAT_DirEntry*)dir->entries)[index].name, entryName);
+    if(NamesEqual(entryName, name)) return 1;
+    return LongNameAt(dir, index, entryName) && NamesEqual(entryName, name);
+}
+
+// The index is open addressed with linear probing. Every 8.3 entry is in it
+// under its short name and, if it has one, its long name. A directory of n
+// entries holds at most n names, and the table has at least 2n slots.
+static void IndexInsert(FatDir* dir, const char* name, uint32_t entry) {
+    uint32_t mask = dir->indexSize - 1;
+    uint32_t hash = NameHash(name);
+    uint32_t slot = hash & mask;
+    while(dir->index[slot].entry < DIR_INDEX_DELETED) slot = (slot + 1) & mask;
+    if(dir->index[slot].entry == DIR_INDEX_EMPTY) dir->indexUsed++;
+    dir->index[slot].hash = hash;
+    dir->index[slot].entry = entry;
+}
+
+// Each entry is in the table under two names, so the slot to clear is the
+// one whose hash is this name's too
+static void IndexRemove(FatDir* dir, const char* name, uint32_t entry) {
+    uint32_t mask = dir->indexSize - 1;
+    uint32_t hash = NameHash(name);
+    uint32_t slot = hash & mask;
+    for(uint32_t n = 0; n < dir->indexSize && dir->index[slot].entry != DIR_INDEX_EMPTY; n++) {
+        if(dir->index[slot].entry == entry && dir->index[slot].hash == hash) {
+            dir->index[slot].entry = DIR_INDEX_DELETED;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+static void IndexEntry(FatDir* dir, uint32_t index) {
+    char name[FAT_LONG_NAME];
+    FormatFATName(((FAT_DirEntry*)dir->entries)[index].name, name);
+    IndexInsert(dir, name, index);
+    if(LongNameAt(dir, index, name)) IndexInsert(dir, name, index);
+}
+
+// (Re)builds the index from the entries. The old one stays if there is no
+// memory for a new one.
+static int BuildDirIndex(FatDir* dir) {
+    uint32_t size = 16;
+    while(size < dir->entryCount * 2) size *= 2;
+    DirIndexSlot* index = (DirIndexSlot*)HeapAlloc(size * sizeof(DirIndexSlot));
+    if(!index) return 0;
+    HeapFree(dir->index);
+    dir->index = index;
+    dir->indexSize = size;
+    dir->indexUsed = 0;
+    for(uint32_t i = 0; i < size; i++) index[i].entry = DIR_INDEX_EMPTY;
+
+    FAT_DirEntry* entries = (FAT_DirEntry*)dir->entries;
+    for(uint32_t i = 0; i < dir->entryCount; i++) {
         if(entries[i].name[0] == 0x00) break;
-        if(entries[i].name[0] == 0xE5) continue;
-        if(entries[i].attributes == ATTR_VOLUME_ID) continue;
-        
-        FileEntry* file = &fb->files[fb->fileCount];
-        
-        FormatFAT12Name(entries[i].name, file->name);
+        if((uint8_t)entries[i].name[0] == 0xE5) continue;
+        if(entries[i].attributes & ATTR_VOLUME_ID) continue;    // labels and long name parts
+        IndexEntry(dir, i);
+    }
+    return 1;
+}
+
+// Adds a new entry's names, rebuilding first if deleted slots have filled
+// the table
+static void IndexNewEntry(FatDir* dir, uint32_t index) {
+    if((dir->indexUsed + 2) * 4 > dir->indexSize * 3 && BuildDirIndex(dir)) return;
+    IndexEntry(dir, index);
+}
+
+// The 8.3 entry called name, or -1
+static int DirLookup(const FatDir* dir, const char* name) {
+    uint32_t mask = dir->indexSize - 1;
+    uint32_t hash = NameHash(name);
+    uint32_t slot = hash & mask;
+    for(uint32_t n = 0; n < dir->indexSize && dir->index[slot].entry != DIR_INDEX_EMPTY; n++) {
+        const DirIndexSlot* s = &dir->index[slot];
+        if(s->entry != DIR_INDEX_DELETED && s->hash == hash && EntryHasName(dir, s->entry, name)) return s->entry;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static void CloseDir(FatDir* dir) {
+    FreePages(dir->entries, dir->pages);
+    HeapFree(dir->index);
+    dir->entries = NULL;
+    dir->index = NULL;
+    dir->lastUse = 0;
+}
+
+// Directories are read in whole on first use and indexed, and stay until
+// MAX_OPEN_DIRS others have been used since. Cluster 0 is the root, as in
+// a ".." entry. The pointer is good until the next OpenDir().
+static FatDir* OpenDir(uint32_t cluster) {
+    if(cluster == 0 && fatBits == 32) cluster = rootCluster;
+    FatDir* victim = &openDirs[0];
+    for(int i = 0; i < MAX_OPEN_DIRS; i++) {
+        FatDir* dir = &openDirs[i];
+        if(dir->entries && dir->cluster == cluster) {
+            dir->lastUse = ++dirUseCount;
+            return dir;
+        }
+        if(dir->lastUse < victim->lastUse) victim = dir;
+    }
+    CloseDir(victim);
+
+    uint32_t clusterBytes = ClusterBytes();
+    uint32_t clusters = 0;
+    uint32_t last = 0;
+    uint64_t bytes;
+    if(cluster == 0) {
+        bytes = (uint64_t)bpb.rootEntries * sizeof(FAT_DirEntry);
+    } else {
+        uint32_t maxClusters = (FAT_DIR_MAX_ENTRIES * sizeof(FAT_DirEntry) + clusterBytes - 1) / clusterBytes;
+        for(uint32_t c = cluster; ValidCluster(c) && clusters < maxClusters; c = GetFatEntry(c)) {
+            last = c;
+            clusters++;
+        }
+        if(clusters == 0) return NULL;
+        bytes = (uint64_t)clusters * clusterBytes;
+    }
+
+    uint64_t pages = PAGES_FOR(bytes);
+    uint8_t* entries = (uint8_t*)AllocPages(pages);
+    if(!entries) return NULL;
+    int ok = cluster == 0 ?
+        CacheRead(fatDevice, rootDirStartSector, (bytes + BLOCK_SECTOR_SIZE - 1) / BLOCK_SECTOR_SIZE, entries) :
+        ReadChain(cluster, entries, bytes) == bytes;
+    if(!ok) {
+        FreePages(entries, pages);
+        return NULL;
+    }
+
+    victim->cluster = cluster;
+    victim->entries = entries;
+    victim->entryCount = bytes / sizeof(FAT_DirEntry);
+    victim->pages = pages;
+    victim->lastCluster = last;
+    victim->freeHint = 0;
+    if(!BuildDirIndex(victim)) {
+        CloseDir(victim);
+        return NULL;
+    }
+    victim->lastUse = ++dirUseCount;
+    return victim;
+}
+
+static void CloseAllDirs() {
+    for(int i = 0; i < MAX_OPEN_DIRS; i++) CloseDir(&openDirs[i]);
+}
+
+// Entries go back to the disk a sector at a time; in a subdirectory or
+// the FAT32 root that means finding the sector's cluster along the chain
+static int WriteDirEntries(FatDir* dir, uint32_t first, uint32_t count) {
+    uint32_t firstSector = first * sizeof(FAT_DirEntry) / BLOCK_SECTOR_SIZE;
+    uint32_t lastSector = (first + count - 1) * sizeof(FAT_DirEntry) / BLOCK_SECTOR_SIZE;
+    uint32_t sectorsPerCluster = bpb.sectorsPerCluster;
+    int ok = 1;
+    for(uint32_t sector = firstSector; sector <= lastSector; sector++) {
+        uint8_t* data = dir->entries + sector * BLOCK_SECTOR_SIZE;
+        if(dir->cluster == 0) {
+            if(!CacheWrite(fatDevice, rootDirStartSector + sector, 1, data)) ok = 0;
+            continue;
+        }
+        uint32_t cluster = dir->cluster;
+        for(uint32_t n = sector / sectorsPerCluster; n > 0 && ValidCluster(cluster); n--) cluster = GetFatEntry(cluster);
+        if(!ValidCluster(cluster) ||
+           !CacheWrite(fatDevice, ClusterSector(cluster) + sector % sectorsPerCluster, 1, data)) {
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+// A full directory gets another cluster, zeroed on the disk before the FAT
+// links it in. The fixed FAT12/16 root cannot grow.
+static int GrowDir(FatDir* dir) {
+    uint32_t clusterBytes = ClusterBytes();
+    uint32_t added = clusterBytes / sizeof(FAT_DirEntry);
+    if(dir->cluster == 0 || dir->entryCount + added > FAT_DIR_MAX_ENTRIES) return 0;
+    uint64_t bytes = (uint64_t)dir->entryCount * sizeof(FAT_DirEntry);
+    uint64_t pages = PAGES_FOR(bytes + clusterBytes);
+    uint8_t* grown = pages > dir->pages ? (uint8_t*)AllocPages(pages) : dir->entries;
+    if(!grown) return 0;
+
+    uint32_t cluster = AllocateChain(1, dir->lastCluster);
+    MemSet(clusterBuffer, 0, clusterBytes);
+    if(!cluster || !CacheWrite(fatDevice, ClusterSector(cluster), bpb.sectorsPerCluster, clusterBuffer)) {
+        if(cluster) {
+            SetFatEntry(dir->lastCluster, FatEoc());
+            FreeChain(cluster);
+        }
+        FlushFat();
+        if(grown != dir->entries) FreePages(grown, pages);
+        return 0;
+    }
+    FlushFat();
+
+    if(grown != dir->entries) {
+        MemCopy(grown, dir->entries, bytes);
+        FreePages(dir->entries, dir->pages);
+        dir->entries = grown;
+        dir->pages = pages;
+    }
+    MemSet(dir->entries + bytes, 0, clusterBytes);
+    dir->lastCluster = cluster;
+    dir->entryCount += added;
+    BuildDirIndex(dir);
+    return 1;
+}
+
+// The first run of count unused entries, or -1
+static int FindFreeEntries(FatDir* dir, uint32_t count) {
+    FAT_DirEntry* entries = (FAT_DirEntry*)dir->entries;
+    uint32_t run = 0;
+    for(uint32_t i = dir->freeHint; i < dir->entryCount; i++) {
+        uint8_t first = entries[i].name[0];
+        if(first != 0x00 && first != 0xE5) {
+            run = 0;
+            continue;
+        }
+        if(++run == count) return i + 1 - count;
+    }
+    return -1;
+}
+
+static void UnmountFat() {
+    FreePages(fatTable, PAGES_FOR(sectorsPerFat * BLOCK_SECTOR_SIZE));
+    FreePages(clusterBuffer, PAGES_FOR(ClusterBytes()));
+    FreePages(freeMap, PAGES_FOR((clusterCount + 2 + 63) / 64 * sizeof(uint64_t)));
+    HeapFree(fatDirty);
+    CloseAllDirs();
+    fatDevice = NULL;
+    fatTable = NULL;
+    clusterBuffer = fatDirty = NULL;
+    freeMap = NULL;
+}
+
+// Mounts the volume at the start of dev if it holds a FAT file system.
+// The FAT (the active copy) is read in whole, past the cache it would
+// only flood, and the free map is built from the FAT, so the free space
+// is known from here on without a scan. FAT32's FSInfo count is only a
+// hint that tools may leave stale; it is put right on the next flush. The
+// root directory is opened here so a volume without one is not mounted.
+static int MountFat(BlockDevice* dev) {
+    static uint8_t bootSector[BLOCK_SECTOR_SIZE] __attribute__((aligned(16)));
+    if(!BlockRead(dev, 0, 1, bootSector)) return 0;
+
+    FAT_BPB* b = (FAT_BPB*)bootSector;
+    FAT32_BPBExt* ext = (FAT32_BPBExt*)(bootSector + sizeof(FAT_BPB));
+    uint32_t total = b->totalSectors ? b->totalSectors : b->totalSectors32;
+    uint32_t perFat = b->sectorsPerFat ? b->sectorsPerFat : ext->sectorsPerFat32;
+    if(b->bytesPerSector != BLOCK_SECTOR_SIZE || b->sectorsPerCluster == 0 || b->fatCount == 0 ||
+       perFat == 0 || total > dev->sectors) {
+        return 0;
+    }
+    uint32_t rootSectors = (b->rootEntries * sizeof(FAT_DirEntry) + BLOCK_SECTOR_SIZE - 1) / BLOCK_SECTOR_SIZE;
+    uint32_t fatStart = b->reservedSectors;
+    uint32_t rootStart = fatStart + b->fatCount * perFat;
+    uint32_t dataStart = rootStart + rootSectors;
+    if(dataStart >= total) return 0;
+    uint32_t clusters = (total - dataStart) / b->sectorsPerCluster;
+    int bits = clusters < FAT12_MAX_CLUSTERS ? 12 : clusters < FAT16_MAX_CLUSTERS ? 16 : 32;
+
+    int active = 0, mirrored = 1;
+    if(bits == 32) {
+        if(b->rootEntries != 0 || b->sectorsPerFat != 0 || clusters > FAT32_MAX_CLUSTERS ||
+           ext->rootCluster < 2 || ext->rootCluster >= clusters + 2) {
+            return 0;
+        }
+        if(ext->extFlags & FAT32_NO_MIRROR) {
+            mirrored = 0;
+            active = ext->extFlags & 0xF;
+            if(active >= b->fatCount) return 0;
+        }
+    } else if(b->rootEntries == 0) {
+        return 0;
+    }
+    uint64_t fatBytes = bits == 12 ? ((clusters + 2) * 3 + 1) / 2 : (uint64_t)(clusters + 2) * (bits / 8);
+    if(fatBytes > (uint64_t)perFat * BLOCK_SECTOR_SIZE) return 0;
+
+    uint64_t fatPages = PAGES_FOR(perFat * BLOCK_SECTOR_SIZE);
+    uint64_t clusterPages = PAGES_FOR(b->sectorsPerCluster * BLOCK_SECTOR_SIZE);
+    uint64_t mapPages = PAGES_FOR((clusters + 2 + 63) / 64 * sizeof(uint64_t));
+    uint8_t* fat = (uint8_t*)AllocPages(fatPages);
+    uint8_t* cluster = (uint8_t*)AllocPages(clusterPages);
+    uint64_t* map = (uint64_t*)AllocZeroedPages(mapPages);
+    uint8_t* dirty = (uint8_t*)HeapAllocZeroed(perFat);
+    if(!fat || !cluster || !map || !dirty ||
+       !BlockRead(dev, fatStart + active * perFat, perFat, fat)) {
+        FreePages(fat, fatPages);
+        FreePages(cluster, clusterPages);
+        FreePages(map, mapPages);
+        HeapFree(dirty);
+        return 0;
+    }
+
+    fatDevice = dev;
+    bpb = *b;
+    fatBits = bits;
+    fatTable = fat;
+    sectorsPerFat = perFat;
+    activeFat = active;
+    fatMirrored = mirrored;
+    clusterBuffer = cluster;
+    fatDirty = dirty;
+    freeMap = map;
+    fatStartSector = fatStart;
+    rootDirStartSector = rootStart;
+    dataStartSector = dataStart;
+    clusterCount = clusters;
+    BuildFreeMap();
+    nextFreeCluster = 2;
+    fsInfoSector = 0;
+    fsInfoDirty = 0;
+
+    if(bits == 32) {
+        rootCluster = ext->rootCluster;
+        if(ext->fsInfoSector != 0 && ext->fsInfoSector < b->reservedSectors &&
+           BlockRead(dev, ext->fsInfoSector, 1, &fsInfo) &&
+           fsInfo.leadSignature == FSINFO_LEAD_SIGNATURE &&
+           fsInfo.structSignature == FSINFO_STRUCT_SIGNATURE) {
+            fsInfoSector = ext->fsInfoSector;
+            if(ValidCluster(fsInfo.nextFree)) nextFreeCluster = fsInfo.nextFree;
+            fsInfoDirty = fsInfo.freeCount != freeClusters;
+        }
+    }
+    if(!OpenDir(0)) {
+        UnmountFat();
+        return 0;
+    }
+    return 1;
+}
+
+void InitFAT() {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+
+    for(int i = 0; i < BlockDeviceCount() && !fatDevice; i++) {
+        MountFat(GetBlockDevice(i));
+    }
+    if(!fatDevice) {
+        KLog("fat: no FAT volume on any disk, using a ramdisk");
+        uint8_t* image = BuildRamDiskImage();
+        BlockDevice* ram = image ? CreateRamDisk(image, RAMDISK_SECTORS) : NULL;
+        if(!ram || !MountFat(ram)) {
+            KLog("fat: no memory for the ramdisk");
+            return;
+        }
+    }
+
+    strcpy(line, "fat: FAT");
+    IntToStr(fatBits, num);
+    strcat(line, num);
+    strcat(line, " on ");
+    strcat(line, fatDevice->name);
+    strcat(line, ", ");
+    UIntToStr(clusterCount, num);
+    strcat(line, num);
+    strcat(line, " clusters of ");
+    UIntToStr(ClusterBytes(), num);
+    strcat(line, num);
+    strcat(line, " bytes, ");
+    UIntToStr(freeClusters, num);
+    strcat(line, num);
+    strcat(line, " free");
+    KLog(line);
+}
+
+// Copies the next component of *path into name and steps past it.
+// Returns 0 at the end of the path.
+static int NextComponent(const char** path, char* name) {
+    const char* p = *path;
+    while(*p == '/') p++;
+    if(!*p) return 0;
+    int length = 0;
+    while(*p && *p != '/') {
+        if(length < FAT_LONG_NAME - 1) name[length++] = *p;
+        p++;
+    }
+    name[length] = '\0';
+    *path = p;
+    return 1;
+}
+
+static FatDir* EnterDir(FatDir* dir, const char* name) {
+    int index = DirLookup(dir, name);
+    if(index < 0) return NULL;
+    FAT_DirEntry* entry = (FAT_DirEntry*)dir->entries + index;
+    if(!(entry->attributes & ATTR_DIRECTORY)) return NULL;
+    return OpenDir(EntryCluster(entry));
+}
+
+// Walks path from the root, one index lookup per directory on the way
+static FatDir* OpenPath(const char* path) {
+    char name[FAT_LONG_NAME];
+    FatDir* dir = fatDevice ? OpenDir(0) : NULL;
+    while(dir && NextComponent(&path, name)) dir = EnterDir(dir, name);
+    return dir;
+}
+
+// The directory holding the last component of path, which is copied to
+// name; NULL if a directory on the way is missing or path is empty
+static FatDir* OpenParent(const char* path, char* name) {
+    char next[FAT_LONG_NAME];
+    FatDir* dir = fatDevice ? OpenDir(0) : NULL;
+    if(!NextComponent(&path, name)) return NULL;
+    while(dir && NextComponent(&path, next)) {
+        dir = EnterDir(dir, name);
+        strcpy(name, next);
+    }
+    return dir;
+}
+
+// Lists the directory at path, long names where there are any and no
+// "." entry. Returns how many files were filled in, -1 for a bad path.
+int ListDirectory(const char* path, FileEntry* files, int max) {
+    FatDir* dir = OpenPath(path);
+    if(!dir) return -1;
+
+    char name[FAT_LONG_NAME];
+    FAT_DirEntry* entries = (FAT_DirEntry*)dir->entries;
+    int count = 0;
+    for(uint32_t i = 0; i < dir->entryCount && count < max; i++) {
+        if(entries[i].name[0] == 0x00) break;
+        if((uint8_t)entries[i].name[0] == 0xE5) continue;
+        if(entries[i].attributes & ATTR_VOLUME_ID) continue;      // labels and long name parts
+
+        if(!LongNameAt(dir, i, name)) FormatFATName(entries[i].name, name);
+        if(strcmp(name, ".") == 0) continue;
+
+        FileEntry* file = &files[count++];
+        int length = 0;
+        while(name[length] && length < MAX_FILENAME - 1) {
+            file->name[length] = name[length];
+            length++;
+        }
+        file->name[length] = '\0';
         file->isDirectory = (entries[i].attributes & ATTR_DIRECTORY) ? 1 : 0;
         file->size = entries[i].fileSize;
-        file->cluster = entries[i].clusterLow;
-        
-        fb->fileCount++;
+        file->cluster = EntryCluster(&entries[i]);
     }
+    return count;
 }
 
-uint16_t AllocateCluster() {
-    for(uint16_t i = 2; i < 2880; i++) {
-        if(fatTable[i] == 0) {
-            fatTable[i] = 0xFFF;
-            return i;
+// Shows the browser's folder, or the root if that folder is gone
+void LoadDirectory(FileBrowserData* fb) {
+    fb->scrollOffset = 0;
+    fb->selectedIndex = 0;
+    fb->fileCount = ListDirectory(fb->currentPath, fb->files, MAX_FILES);
+    if(fb->fileCount < 0) {
+        strcpy(fb->currentPath, "/");
+        fb->fileCount = ListDirectory(fb->currentPath, fb->files, MAX_FILES);
+        if(fb->fileCount < 0) fb->fileCount = 0;
+    }
+}
+
+// Moves the browser into the folder called name, or up one for "..".
+// Browser paths start and end with '/'.
+void EnterBrowserFolder(FileBrowserData* fb, const char* name) {
+    int length = strlen(fb->currentPath);
+    if(strcmp(name, "..") == 0) {
+        if(length <= 1) return;
+        length--;
+        while(length > 1 && fb->currentPath[length - 1] != '/') length--;
+        fb->currentPath[length] = '\0';
+    } else {
+        if(length + strlen(name) + 2 > (int)sizeof(fb->currentPath)) return;
+        strcat(fb->currentPath, name);
+        strcat(fb->currentPath, "/");
+    }
+    LoadDirectory(fb);
+}
+
+// Every open browser lists its folder again after a file changes
+static void RefreshFileBrowsers() {
+    for(int i = 0; i < windowCount; i++) {
+        if(windows[i].windowType == 2 && windows[i].visible) {
+            Window* win = &windows[i];
+            LoadDirectory(win->browserData);
+            InvalidateWindowRect(win, win->x, win->y, win->width, win->height);
         }
     }
+}
+
+static int ShortNameChar(char c) {
+    const char* extra = "$%'-_@~`!(){}^#&";
+    if((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 1;
+    for(; *extra; extra++) {
+        if(*extra == c) return 1;
+    }
     return 0;
 }
 
-void WriteFileContent(uint16_t cluster, const char* content, uint32_t size) {
-    if(cluster < 2) return;
-    uint32_t dataOffset = (bpb.reservedSectors + bpb.fatCount * bpb.sectorsPerFat + 
-                          (bpb.rootEntries * 32) / bpb.bytesPerSector) * bpb.bytesPerSector;
-    uint32_t clusterOffset = dataOffset + (cluster - 2) * bpb.sectorsPerCluster * bpb.bytesPerSector;
-    
-    uint8_t* dest = diskImage + clusterOffset;
-    for(uint32_t i = 0; i < size && i < bpb.sectorsPerCluster * bpb.bytesPerSector; i++) {
-        dest[i] = content[i];
+// Whether name can be stored as it is in an 8.3 entry: upper case, a base
+// of up to 8 and an extension of up to 3 valid characters. Fills in the
+// padded 8.3 form if so.
+static int FitsShortName(const char* name, char* shortName) {
+    int base = 0, ext = -1;
+    for(int i = 0; i < 11; i++) shortName[i] = ' ';
+    for(; *name; name++) {
+        if(*name == '.') {
+            if(ext >= 0 || base == 0) return 0;
+            ext = 0;
+        } else if(!ShortNameChar(*name)) {
+            return 0;
+        } else if(ext < 0) {
+            if(base == 8) return 0;
+            shortName[base++] = *name;
+        } else {
+            if(ext == 3) return 0;
+            shortName[8 + ext++] = *name;
+        }
     }
+    return base > 0 && ext != 0;
 }
 
-void ReadFileContent(uint16_t cluster, char* buffer, uint32_t size) {
-    if(cluster < 2) return;
-    uint32_t dataOffset = (bpb.reservedSectors + bpb.fatCount * bpb.sectorsPerFat + 
-                          (bpb.rootEntries * 32) / bpb.bytesPerSector) * bpb.bytesPerSector;
-    uint32_t clusterOffset = dataOffset + (cluster - 2) * bpb.sectorsPerCluster * bpb.bytesPerSector;
-    
-    uint8_t* src = diskImage + clusterOffset;
-    for(uint32_t i = 0; i < size && i < bpb.sectorsPerCluster * bpb.bytesPerSector; i++) {
-        buffer[i] = src[i];
+// A unique 8.3 alias for a long name, as Windows makes them: up to six
+// valid characters of the base, "~N", and three of the extension
+static void MakeShortName(const FatDir* dir, const char* name, char* shortName) {
+    const char* dot = NULL;
+    for(const char* p = name + 1; *p; p++) {
+        if(*p == '.') dot = p;
+    }
+    char base[6], ext[3];
+    int baseLength = 0, extLength = 0;
+    for(const char* p = name; *p && p != dot && baseLength < 6; p++) {
+        if(*p == '.' || *p == ' ') continue;
+        base[baseLength++] = ShortNameChar(UpperAscii(*p)) ? UpperAscii(*p) : '_';
+    }
+    if(baseLength == 0) base[baseLength++] = '_';
+    for(const char* p = dot ? dot + 1 : ""; *p && extLength < 3; p++) {
+        if(*p == ' ') continue;
+        ext[extLength++] = ShortNameChar(UpperAscii(*p)) ? UpperAscii(*p) : '_';
+    }
+
+    char formatted[13];
+    for(uint32_t n = 1; n < 1000000; n++) {
+        char tail[8];
+        int tailLength = 0;
+        for(uint32_t v = n; v; v /= 10) tail[tailLength++] = '0' + v % 10;
+        tail[tailLength++] = '~';
+
+        int keep = baseLength < 8 - tailLength ? baseLength : 8 - tailLength;
+        for(int i = 0; i < 11; i++) shortName[i] = ' ';
+        for(int i = 0; i < keep; i++) shortName[i] = base[i];
+        for(int i = 0; i < tailLength; i++) shortName[keep + i] = tail[tailLength - 1 - i];
+        for(int i = 0; i < extLength; i++) shortName[8 + i] = ext[i];
+        FormatFATName(shortName, formatted);
+        if(DirLookup(dir, formatted) < 0) return;
     }
 }
 
-void CreateNewFile(const char* filename, const char* content, uint32_t size) {
-    FAT12_DirEntry* entries = (FAT12_DirEntry*)rootDir;
-    
-    int emptySlot = -1;
-    for(int i = 0; i < bpb.rootEntries; i++) {
-        if(entries[i].name[0] == 0x00 || entries[i].name[0] == 0xE5) {
-            emptySlot = i;
-            break;
+static int ValidLongName(const char* name) {
+    const char* bad = "\\:*?\"<>|";
+    int length = strlen(name);
+    if(length == 0 || length > FAT_LONG_NAME - 1) return 0;
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    for(const char* p = name; *p; p++) {
+        if((uint8_t)*p < 0x20 || (uint8_t)*p >= 0x80) return 0;
+        for(const char* b = bad; *b; b++) {
+            if(*p == *b) return 0;
         }
     }
-    
-    if(emptySlot == -1) return;
-    
-    FAT12_DirEntry* entry = &entries[emptySlot];
-    
-    for(int i = 0; i < 11; i++) entry->name[i] = ' ';
-    
-    int nameLen = 0;
-    while(filename[nameLen] && filename[nameLen] != '.' && nameLen < 8) {
-        entry->name[nameLen] = filename[nameLen];
-        nameLen++;
+    return 1;
+}
+
+// A new chain holding content, or 0 with nothing allocated
+static uint32_t WriteNewChain(const char* content, uint32_t size) {
+    uint32_t cluster = AllocateChain(ClustersFor(size), 0);
+    if(!cluster) {
+        FlushFat();
+        return 0;
     }
-    
-    int dotPos = 0;
-    while(filename[dotPos] && filename[dotPos] != '.') dotPos++;
-    
-    if(filename[dotPos] == '.') {
-        dotPos++;
-        for(int i = 0; i < 3 && filename[dotPos]; i++, dotPos++) {
-            entry->name[8 + i] = filename[dotPos];
+    if(!WriteFileContent(cluster, content, size)) {
+        FreeChain(cluster);
+        FlushFat();
+        return 0;
+    }
+    return cluster;
+}
+
+// Saves content as the file at path. A file that is already there is
+// rewritten along its own chain and its entry updated where it is; a new
+// one gets an 8.3 entry, behind long name entries when the name does not
+// fit 8.3 as it is. Data goes out before the entry, so a failed save
+// leaves no entry pointing at garbage. An empty file has no clusters.
+int SaveFile(const char* path, const char* content, uint32_t size) {
+    char name[FAT_LONG_NAME];
+    FatDir* dir = OpenParent(path, name);
+    if(!dir || !ValidLongName(name)) return 0;
+
+    int index = DirLookup(dir, name);
+    if(index >= 0) {
+        FAT_DirEntry* entry = (FAT_DirEntry*)dir->entries + index;
+        if(entry->attributes & (ATTR_DIRECTORY | ATTR_READ_ONLY)) return 0;
+        uint32_t cluster = EntryCluster(entry);
+        if(size == 0) {
+            FreeChain(cluster);
+            cluster = 0;
+            if(!FlushFat()) return 0;
+        } else if(ValidCluster(cluster)) {
+            if(!WriteFileContent(cluster, content, size)) return 0;
+        } else {
+            cluster = WriteNewChain(content, size);
+            if(!cluster) return 0;
+        }
+        entry->attributes |= ATTR_ARCHIVE;
+        entry->clusterHigh = cluster >> 16;
+        entry->clusterLow = cluster;
+        entry->fileSize = size;
+        return WriteDirEntries(dir, index, 1);
+    }
+
+    char shortName[11];
+    uint32_t lfnCount = 0;
+    if(!FitsShortName(name, shortName)) {
+        MakeShortName(dir, name, shortName);
+        lfnCount = (strlen(name) + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+    }
+    int slot = FindFreeEntries(dir, lfnCount + 1);
+    while(slot < 0 && GrowDir(dir)) slot = FindFreeEntries(dir, lfnCount + 1);
+    if(slot < 0) return 0;
+
+    uint32_t cluster = 0;
+    if(size > 0) {
+        cluster = WriteNewChain(content, size);
+        if(!cluster) return 0;
+    }
+
+    // Long name parts go last part first, each holding 13 characters, a
+    // terminator after the name and 0xFFFF padding
+    uint32_t length = strlen(name);
+    uint8_t sum = ShortNameChecksum(shortName);
+    for(uint32_t n = 1; n <= lfnCount; n++) {
+        FAT_LfnEntry* lfn = (FAT_LfnEntry*)dir->entries + slot + lfnCount - n;
+        MemSet(lfn, 0, sizeof(FAT_LfnEntry));
+        lfn->order = n | (n == lfnCount ? FAT_LFN_LAST : 0);
+        lfn->attributes = ATTR_LONG_NAME;
+        lfn->checksum = sum;
+        for(int i = 0; i < FAT_LFN_CHARS; i++) {
+            uint32_t pos = (n - 1) * FAT_LFN_CHARS + i;
+            SetLfnChar(lfn, i, pos < length ? (uint8_t)name[pos] : pos == length ? 0 : 0xFFFF);
         }
     }
-    
+
+    index = slot + lfnCount;
+    FAT_DirEntry* entry = (FAT_DirEntry*)dir->entries + index;
+    MemSet(entry, 0, sizeof(FAT_DirEntry));
+    for(int i = 0; i < 11; i++) entry->name[i] = shortName[i];
     entry->attributes = ATTR_ARCHIVE;
-    uint16_t cluster = AllocateCluster();
+    entry->clusterHigh = cluster >> 16;
     entry->clusterLow = cluster;
     entry->fileSize = size;
-    
-    WriteFileContent(cluster, content, size);
+    dir->freeHint = index + 1;
+
+    IndexNewEntry(dir, index);
+    return WriteDirEntries(dir, slot, lfnCount + 1);
+}
+
+// Removes a file: its chain is freed and its entries, long name parts
+// included, are marked deleted. Folders are left alone.
+int DeleteFile(const char* path) {
+    char name[FAT_LONG_NAME];
+    FatDir* dir = OpenParent(path, name);
+    int index = dir ? DirLookup(dir, name) : -1;
+    if(index < 0) return 0;
+    FAT_DirEntry* entry = (FAT_DirEntry*)dir->entries + index;
+    if(entry->attributes & (ATTR_DIRECTORY | ATTR_READ_ONLY)) return 0;
+
+    int lfnCount = LongNameAt(dir, index, name);
+    if(lfnCount) IndexRemove(dir, name, index);
+    FormatFATName(entry->name, name);
+    IndexRemove(dir, name, index);
+
+    FreeChain(EntryCluster(entry));
+    uint32_t first = index - lfnCount;
+    FAT_DirEntry* entries = (FAT_DirEntry*)dir->entries;
+    for(uint32_t i = first; i <= (uint32_t)index; i++) entries[i].name[0] = (char)0xE5;
+    if(first < dir->freeHint) dir->freeHint = first;
+
+    int ok = WriteDirEntries(dir, first, lfnCount + 1);
+    if(!FlushFat()) ok = 0;
+    return ok;
 }
 
 void DrawFileBrowserContent(Window* win) {
     if(!win->visible) return;
     
-    FileBrowserData* fb = &win->browserData;
+    FileBrowserData* fb = win->browserData;
     
     int contentX = win->x + 8;
     int contentY = win->y + 38;
@@ -631,7 +1916,10 @@ void DrawFileBrowserContent(Window* win) {
     
     DrawRect(contentX - 4, contentY - 4, contentWidth + 8, contentHeight + 8, COLOR_WINDOW_BG);
     
-    DrawText(contentX, contentY, "Location: /", COLOR_BLACK);
+    char location[sizeof(fb->currentPath) + 10];
+    strcpy(location, "Location: ");
+    strcat(location, fb->currentPath);
+    DrawText(contentX, contentY, location, COLOR_BLACK);
     
     int headerY = contentY + 20;
     DrawRect(contentX, headerY, contentWidth, 20, 0xE0E0E0);
@@ -725,7 +2013,7 @@ void DrawFileBrowserContent(Window* win) {
 void TerminalAddLine(Window* win, const char* text) {
     if(win->windowType != 1) return;
     
-    TerminalData* term = &win->termData;
+    TerminalData* term = win->termData;
     if(term->lineCount < MAX_TERMINAL_LINES) {
         strcpy(term->lines[term->lineCount], text);
         term->lineCount++;
@@ -737,8 +2025,32 @@ void TerminalAddLine(Window* win, const char* text) {
     }
 }
 
+// Appends num / den with two decimals, e.g. "1.04x"
+static void AppendRatio(char* line, uint64_t num, uint64_t den) {
+    char digits[24];
+    uint64_t hundredths = den ? num * 100 / den : 0;
+    UIntToStr(hundredths / 100, digits);
+    strcat(line, digits);
+    strcat(line, ".");
+    if(hundredths % 100 < 10) strcat(line, "0");
+    UIntToStr(hundredths % 100, digits);
+    strcat(line, digits);
+    strcat(line, "x");
+}
+
+// Pads line with spaces up to column, for table output
+static void AppendPadding(char* line, int column) {
+    int len = strlen(line);
+    if(len >= column) {
+        strcat(line, " ");
+        return;
+    }
+    while(len < column) line[len++] = ' ';
+    line[len] = '\0';
+}
+
 void TerminalProcessCommand(Window* win, const char* cmd) {
-    TerminalData* term = &win->termData;
+    TerminalData* term = win->termData;
     
     if(term->historyCount < TERMINAL_HISTORY_SIZE) {
         strcpy(term->history[term->historyCount], cmd);
@@ -752,8 +2064,27 @@ void TerminalProcessCommand(Window* win, const char* cmd) {
         TerminalAddLine(win, "  echo   - Echo text");
         TerminalAddLine(win, "  about  - About RGOS");
         TerminalAddLine(win, "  date   - Show date");
-        TerminalAddLine(win, "  ls     - List files");
+        TerminalAddLine(win, "  ls [path] - List files");
+        TerminalAddLine(win, "  rm <path> - Delete a file");
         TerminalAddLine(win, "  whoami - Show user");
+        TerminalAddLine(win, "  gfxstat - Compositor counters");
+        TerminalAddLine(win, "  dmesg   - Boot log");
+        TerminalAddLine(win, "  framestat - Frame timing");
+        TerminalAddLine(win, "  uptime  - Clock and timers");
+        TerminalAddLine(win, "  inputstat - PS/2 input queues");
+        TerminalAddLine(win, "  eventstat - Event queue");
+        TerminalAddLine(win, "  ps      - Tasks and CPU time");
+        TerminalAddLine(win, "  smp [on|off] - Cores, parallel repaint");
+        TerminalAddLine(win, "  smpbench - Repaint time per core count");
+        TerminalAddLine(win, "  mem     - Physical memory");
+        TerminalAddLine(win, "  heap    - Kernel heap classes");
+        TerminalAddLine(win, "  boottime - Boot phase timestamps");
+        TerminalAddLine(win, "  lspci   - PCI functions");
+        TerminalAddLine(win, "  disks   - Block devices and I/O counts");
+        TerminalAddLine(win, "  diskbench [disk] - Read throughput");
+        TerminalAddLine(win, "  df      - Free space on the FAT volume");
+        TerminalAddLine(win, "  sync    - Write back the disk cache");
+        TerminalAddLine(win, "  cachestat - Disk cache counters");
     }
     else if(strcmp(cmd, "clear") == 0) {
         term->lineCount = 0;
@@ -763,18 +2094,725 @@ void TerminalProcessCommand(Window* win, const char* cmd) {
     }
     else if(strcmp(cmd, "about") == 0) {
         TerminalAddLine(win, "RGOS v2.1.0 - UEFI OS Developed from scratch by Connor Anderson");
-        TerminalAddLine(win, "With FAT12 File Browser");
+        TerminalAddLine(win, "With FAT File Browser");
     }
     else if(strcmp(cmd, "date") == 0) {
         TerminalAddLine(win, "Mon Oct 7 12:34:56 2024 (Incorrect Date For Now)");
     }
-    else if(strcmp(cmd, "ls") == 0) {
-        TerminalAddLine(win, "DOCUMENTS/  PICTURES/  README.TXT");
-        TerminalAddLine(win, "KERNEL.BIN  CONFIG.SYS");
+    else if(strcmp(cmd, "ls") == 0 || strncmp(cmd, "ls ", 3) == 0) {
+        FileEntry* files = (FileEntry*)HeapAlloc(MAX_FILES * sizeof(FileEntry));
+        int count = files ? ListDirectory(cmd[2] ? cmd + 3 : "/", files, MAX_FILES) : 0;
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        if(!files) {
+            TerminalAddLine(win, "Out of memory");
+        } else if(count < 0) {
+            TerminalAddLine(win, "No such directory");
+        }
+        for(int i = 0; i < count; i++) {
+            strcpy(line, files[i].name);
+            AppendPadding(line, 16);
+            if(files[i].isDirectory) {
+                strcat(line, "<DIR>");
+            } else {
+                UIntToStr(files[i].size, num);
+                strcat(line, num);
+            }
+            TerminalAddLine(win, line);
+        }
+        HeapFree(files);
+    }
+    else if(strncmp(cmd, "rm ", 3) == 0) {
+        if(DeleteFile(cmd + 3)) {
+            RefreshFileBrowsers();
+        } else {
+            TerminalAddLine(win, "rm: cannot remove that file");
+        }
     }
     else if(strcmp(cmd, "whoami") == 0) {
         TerminalAddLine(win, "user");
     }
+    else if(strcmp(cmd, "dmesg") == 0) {
+        for(int i = 0; i < KLogLineCount(); i++) {
+            TerminalAddLine(win, KLogLine(i));
+        }
+    }
+    else if(strcmp(cmd, "uptime") == 0) {
+        TimerInfo info;
+        GetTimerInfo(&info);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        uint64_t ms = ClockMs();
+        
+        strcpy(line, "Up ");
+        UIntToStr(ms / 1000, num);
+        strcat(line, num);
+        strcat(line, ".");
+        UIntToStr(ms % 1000 / 100, num);
+        strcat(line, num);
+        strcat(line, " s, TSC ");
+        UIntToStr(info.tscHz / 1000000, num);
+        strcat(line, num);
+        strcat(line, " MHz");
+        if(info.invariantTsc) strcat(line, " invariant");
+        TerminalAddLine(win, line);
+        
+        if(info.tscDeadline) {
+            strcpy(line, "LAPIC timer: TSC-deadline");
+        } else if(info.lapicHz) {
+            strcpy(line, "LAPIC timer: one-shot ");
+            UIntToStr(info.lapicHz / 1000, num);
+            strcat(line, num);
+            strcat(line, " kHz");
+        } else {
+            strcpy(line, "LAPIC timer: none");
+        }
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Timer IRQs ");
+        UIntToStr(info.interrupts, num);
+        strcat(line, num);
+        strcat(line, ", callbacks ");
+        UIntToStr(info.callbacks, num);
+        strcat(line, num);
+        strcat(line, ", active ");
+        IntToStr(info.activeTimers, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "inputstat") == 0) {
+        Ps2Stats stats;
+        GetPs2Stats(&stats);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        strcpy(line, "IRQ1 ");
+        UIntToStr(InterruptCount(VECTOR_IRQ_BASE + IRQ_KEYBOARD), num);
+        strcat(line, num);
+        strcat(line, ", IRQ12 ");
+        UIntToStr(InterruptCount(VECTOR_IRQ_BASE + IRQ_MOUSE), num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Keys ");
+        UIntToStr(stats.keyEvents, num);
+        strcat(line, num);
+        strcat(line, ", mouse packets ");
+        UIntToStr(stats.mousePackets, num);
+        strcat(line, num);
+        strcat(line, ", dropped ");
+        UIntToStr(stats.dropped, num);
+        strcat(line, num);
+        strcat(line, ", resyncs ");
+        UIntToStr(stats.resyncs, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Queue peak ");
+        IntToStr(stats.maxDepth, num);
+        strcat(line, num);
+        strcat(line, ", latency us last ");
+        IntToStr(stats.lastLatencyUs, num);
+        strcat(line, num);
+        strcat(line, " max ");
+        IntToStr(stats.maxLatencyUs, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "ps") == 0) {
+        static const char* stateNames[] = { "-", "ready", "run", "wait", "sleep", "dead" };
+        static const char* priorityNames[] = { "high", "normal", "idle" };
+        TaskInfo list[MAX_TASKS];
+        int count = GetTaskList(list, MAX_TASKS);
+        uint64_t total = 0;
+        for(int i = 0; i < count; i++) total += list[i].cpuUs;
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        TerminalAddLine(win, " ID NAME        PRIO    STATE  CPU ms   CPU%  SWITCHES");
+        for(int i = 0; i < count; i++) {
+            TaskInfo* t = &list[i];
+            strcpy(line, " ");
+            IntToStr(t->id, num);
+            strcat(line, num);
+            AppendPadding(line, 4);
+            strcat(line, t->name);
+            AppendPadding(line, 16);
+            strcat(line, priorityNames[t->priority]);
+            AppendPadding(line, 24);
+            strcat(line, stateNames[t->state]);
+            AppendPadding(line, 31);
+            UIntToStr(t->cpuUs / 1000, num);
+            strcat(line, num);
+            AppendPadding(line, 40);
+            uint64_t permille = total ? t->cpuUs * 1000 / total : 0;
+            UIntToStr(permille / 10, num);
+            strcat(line, num);
+            strcat(line, ".");
+            UIntToStr(permille % 10, num);
+            strcat(line, num);
+            AppendPadding(line, 46);
+            UIntToStr(t->switches, num);
+            strcat(line, num);
+            TerminalAddLine(win, line);
+        }
+    }
+    else if(strcmp(cmd, "eventstat") == 0) {
+        EventStats stats;
+        GetEventStats(&stats);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        strcpy(line, "Posted ");
+        UIntToStr(stats.posted, num);
+        strcat(line, num);
+        strcat(line, ", dispatched ");
+        UIntToStr(stats.dispatched, num);
+        strcat(line, num);
+        strcat(line, ", dropped ");
+        UIntToStr(stats.dropped, num);
+        strcat(line, num);
+        strcat(line, ", peak ");
+        IntToStr(stats.peakDepth, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "UI lock waits ");
+        UIntToStr(stats.lockContended, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Merged: moves ");
+        UIntToStr(stats.mergedMoves, num);
+        strcat(line, num);
+        strcat(line, ", timer ticks ");
+        UIntToStr(stats.mergedTimers, num);
+        strcat(line, num);
+        strcat(line, ", invalidates ");
+        UIntToStr(stats.mergedInvalidates, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "framestat") == 0) {
+        FrameStats stats;
+        GetFrameStats(&stats);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        uint64_t busy = stats.frames - stats.idleFrames;
+        
+        strcpy(line, "Frames: ");
+        UIntToStr(stats.frames, num);
+        strcat(line, num);
+        strcat(line, " at ");
+        IntToStr(stats.targetHz, num);
+        strcat(line, num);
+        strcat(line, " Hz, ");
+        UIntToStr(stats.idleFrames, num);
+        strcat(line, num);
+        strcat(line, " idle, ");
+        UIntToStr(stats.missedFrames, num);
+        strcat(line, num);
+        strcat(line, " missed");
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Last us: lock ");
+        IntToStr(stats.lastLockUs, num);
+        strcat(line, num);
+        strcat(line, " render ");
+        IntToStr(stats.lastRenderUs, num);
+        strcat(line, num);
+        strcat(line, " present ");
+        IntToStr(stats.lastPresentUs, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Avg us: lock ");
+        UIntToStr(busy ? stats.totalLockUs / busy : 0, num);
+        strcat(line, num);
+        strcat(line, " render ");
+        UIntToStr(busy ? stats.totalRenderUs / busy : 0, num);
+        strcat(line, num);
+        strcat(line, " present ");
+        UIntToStr(busy ? stats.totalPresentUs / busy : 0, num);
+        strcat(line, num);
+        strcat(line, ", peak ");
+        IntToStr(stats.peakFrameUs, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "smp") == 0 || strcmp(cmd, "smp on") == 0 || strcmp(cmd, "smp off") == 0) {
+        if(strcmp(cmd, "smp on") == 0) SetParallelCompose(1);
+        if(strcmp(cmd, "smp off") == 0) SetParallelCompose(0);
+        SmpStats stats;
+        GetSmpStats(&stats);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        strcpy(line, "CPUs online: ");
+        IntToStr(stats.cpus, num);
+        strcat(line, num);
+        strcat(line, ", parallel repaint ");
+        strcat(line, ParallelCompose() ? "on" : "off");
+        TerminalAddLine(win, line);
+        
+        TerminalAddLine(win, " CPU APIC  ITEMS     WAKEUPS");
+        for(int i = 0; i < stats.cpus; i++) {
+            const PerCpu* cpu = GetCpu(i);
+            strcpy(line, " ");
+            IntToStr(cpu->index, num);
+            strcat(line, num);
+            AppendPadding(line, 5);
+            UIntToStr(cpu->apicId, num);
+            strcat(line, num);
+            AppendPadding(line, 11);
+            UIntToStr(cpu->items, num);
+            strcat(line, num);
+            AppendPadding(line, 21);
+            UIntToStr(cpu->wakeups, num);
+            strcat(line, num);
+            TerminalAddLine(win, line);
+        }
+        
+        strcpy(line, "Jobs ");
+        UIntToStr(stats.jobs, num);
+        strcat(line, num);
+        strcat(line, ", items ");
+        UIntToStr(stats.items, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "mem") == 0) {
+        PageStats pages;
+        CompositorStats comp;
+        GetPageStats(&pages);
+        GetCompositorStats(&comp);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        uint64_t used = pages.totalPages - pages.freePages;
+        
+        strcpy(line, "Pages: ");
+        UIntToStr(pages.totalPages, num);
+        strcat(line, num);
+        strcat(line, " total, ");
+        UIntToStr(used, num);
+        strcat(line, num);
+        strcat(line, " used, ");
+        UIntToStr(pages.freePages, num);
+        strcat(line, num);
+        strcat(line, " free (");
+        UIntToStr(pages.freePages * PAGE_SIZE / (1024 * 1024), num);
+        strcat(line, num);
+        strcat(line, " MB)");
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Peak used ");
+        UIntToStr(pages.peakUsedPages, num);
+        strcat(line, num);
+        strcat(line, ", reclaimed from firmware ");
+        UIntToStr(pages.reclaimedPages, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Bitmap ");
+        UIntToStr(pages.bitmapPages, num);
+        strcat(line, num);
+        strcat(line, ", page tables ");
+        UIntToStr(pages.tablePages, num);
+        strcat(line, num);
+        strcat(line, ", window surfaces ");
+        UIntToStr(comp.surfacePages, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Allocations ");
+        UIntToStr(pages.allocations, num);
+        strcat(line, num);
+        strcat(line, ", frees ");
+        UIntToStr(pages.frees, num);
+        strcat(line, num);
+        strcat(line, ", failed ");
+        UIntToStr(pages.failures, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "heap") == 0) {
+        HeapStats heap;
+        GetHeapStats(&heap);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        strcpy(line, "In use ");
+        UIntToStr(heap.bytesInUse / 1024, num);
+        strcat(line, num);
+        strcat(line, " KB, peak ");
+        UIntToStr(heap.peakBytesInUse / 1024, num);
+        strcat(line, num);
+        strcat(line, " KB, failed ");
+        UIntToStr(heap.failures, num);
+        strcat(line, num);
+        strcat(line, ", bad frees ");
+        UIntToStr(heap.badFrees, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        TerminalAddLine(win, "Size   In use  Slabs  Allocs  Frees");
+        for(int i = 0; i < HEAP_CLASSES; i++) {
+            HeapClassStats* c = &heap.classes[i];
+            UIntToStr(c->size, num);
+            strcpy(line, num);
+            AppendPadding(line, 7);
+            UIntToStr(c->inUse, num);
+            strcat(line, num);
+            AppendPadding(line, 15);
+            UIntToStr(c->slabs, num);
+            strcat(line, num);
+            AppendPadding(line, 22);
+            UIntToStr(c->allocations, num);
+            strcat(line, num);
+            AppendPadding(line, 30);
+            UIntToStr(c->frees, num);
+            strcat(line, num);
+            TerminalAddLine(win, line);
+        }
+        
+        strcpy(line, "Large  ");
+        UIntToStr(heap.largeInUse, num);
+        strcat(line, num);
+        AppendPadding(line, 15);
+        UIntToStr(heap.largePages, num);
+        strcat(line, num);
+        strcat(line, "p");
+        AppendPadding(line, 22);
+        UIntToStr(heap.largeAllocations, num);
+        strcat(line, num);
+        AppendPadding(line, 30);
+        UIntToStr(heap.largeFrees, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "boottime") == 0) {
+        BootPhase phases[BOOT_PHASES];
+        GetBootPhases(phases);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        uint64_t last = 0;
+        
+        TerminalAddLine(win, FAST_BOOT ? "Phase              At ms     Step (fast boot)" :
+                                         "Phase              At ms     Step");
+        for(int i = 0; i < BOOT_PHASES; i++) {
+            strcpy(line, phases[i].name);
+            AppendPadding(line, 19);
+            if(!phases[i].reached) {
+                strcat(line, "-");
+                TerminalAddLine(win, line);
+                continue;
+            }
+            UIntToStr(phases[i].atUs / 1000, num);
+            strcat(line, num);
+            strcat(line, ".");
+            UIntToStr(phases[i].atUs % 1000 / 100, num);
+            strcat(line, num);
+            AppendPadding(line, 29);
+            // Under fast boot the first frame can beat PS/2; it gets no step
+            if(phases[i].atUs >= last) {
+                strcat(line, "+");
+                UIntToStr((phases[i].atUs - last) / 1000, num);
+                strcat(line, num);
+                last = phases[i].atUs;
+            }
+            TerminalAddLine(win, line);
+        }
+    }
+    else if(strcmp(cmd, "lspci") == 0) {
+        const PciDevice* devs;
+        int count = GetPciDevices(&devs);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        TerminalAddLine(win, "Slot      Vendor Device Class");
+        for(int i = 0; i < count; i++) {
+            const PciDevice* d = &devs[i];
+            UIntToStr(d->bus, num);
+            strcpy(line, num);
+            strcat(line, ":");
+            UIntToStr(d->device, num);
+            strcat(line, num);
+            strcat(line, ".");
+            UIntToStr(d->function, num);
+            strcat(line, num);
+            AppendPadding(line, 10);
+            HexToStr(d->vendorId, num);
+            strcat(line, num);
+            AppendPadding(line, 17);
+            HexToStr(d->deviceId, num);
+            strcat(line, num);
+            AppendPadding(line, 24);
+            HexToStr((d->classCode << 16) | (d->subclass << 8) | d->progIf, num);
+            strcat(line, num);
+            TerminalAddLine(win, line);
+        }
+    }
+    else if(strcmp(cmd, "disks") == 0) {
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        if(BlockDeviceCount() == 0) TerminalAddLine(win, "No block devices");
+        else TerminalAddLine(win, "Disk  Driver      MB      Reads   Writes  Errors");
+        for(int i = 0; i < BlockDeviceCount(); i++) {
+            BlockDevice* dev = GetBlockDevice(i);
+            strcpy(line, dev->name);
+            if(dev == fatDevice) strcat(line, "*");
+            AppendPadding(line, 6);
+            strcat(line, dev->driver);
+            AppendPadding(line, 18);
+            UIntToStr(dev->sectors * BLOCK_SECTOR_SIZE / (1024 * 1024), num);
+            strcat(line, num);
+            AppendPadding(line, 26);
+            UIntToStr(dev->stats.reads, num);
+            strcat(line, num);
+            AppendPadding(line, 34);
+            UIntToStr(dev->stats.writes, num);
+            strcat(line, num);
+            AppendPadding(line, 42);
+            UIntToStr(dev->stats.errors, num);
+            strcat(line, num);
+            if(dev->failed) strcat(line, " offline");
+            TerminalAddLine(win, line);
+        }
+    }
+    else if(strcmp(cmd, "diskbench") == 0 || strncmp(cmd, "diskbench ", 10) == 0) {
+        BlockDevice* dev = cmd[9] ? FindBlockDevice(cmd + 10) : fatDevice;
+        if(!dev && !cmd[9]) dev = GetBlockDevice(0);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        if(!dev) {
+            TerminalAddLine(win, "No such disk");
+        } else {
+            // The UI lock is let go between runs, and the terminal may be
+            // closed meanwhile
+            uint32_t serial = win->serial;
+            // Sequential reads cover 32 MB (or the disk); random ones are 4 KB
+            static const struct { const char* name; int random; uint32_t sectors; int depth; uint64_t requests; } runs[] = {
+                { "seq  128K qd1", 0, 256, 1, 256 },
+                { "seq  128K qd8", 0, 256, 8, 256 },
+                { "rand 4K   qd1", 1, 8, 1, 2048 },
+                { "rand 4K   qd8", 1, 8, 8, 2048 },
+                { "rand 4K   qd32", 1, 8, 32, 4096 },
+            };
+            strcpy(line, "Reading ");
+            strcat(line, dev->name);
+            strcat(line, ", queue depth up to ");
+            IntToStr(dev->queueDepth, num);
+            strcat(line, num);
+            TerminalAddLine(win, line);
+            for(int i = 0; i < (int)(sizeof(runs) / sizeof(runs[0])); i++) {
+                BlockBenchResult r;
+                if(i > 0) {
+                    UiYield();
+                    if(win->windowType == WINDOW_FREE || win->serial != serial) return;
+                }
+                int ok = BlockBench(dev, runs[i].random, runs[i].sectors, runs[i].depth, runs[i].requests, &r);
+                strcpy(line, "  ");
+                strcat(line, runs[i].name);
+                AppendPadding(line, 18);
+                if(!ok || r.us == 0) {
+                    strcat(line, "failed");
+                    TerminalAddLine(win, line);
+                    continue;
+                }
+                UIntToStr(r.bytes / r.us, num);
+                strcat(line, num);
+                strcat(line, " MB/s");
+                AppendPadding(line, 30);
+                UIntToStr(r.requests * 1000000 / r.us, num);
+                strcat(line, num);
+                strcat(line, " IOPS");
+                if(r.errors) {
+                    strcat(line, ", ");
+                    UIntToStr(r.errors, num);
+                    strcat(line, num);
+                    strcat(line, " errors");
+                }
+                TerminalAddLine(win, line);
+            }
+        }
+    }
+    else if(strcmp(cmd, "df") == 0) {
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        if(!fatDevice) {
+            TerminalAddLine(win, "No FAT volume");
+        } else {
+            strcpy(line, "FAT");
+            IntToStr(fatBits, num);
+            strcat(line, num);
+            strcat(line, " on ");
+            strcat(line, fatDevice->name);
+            strcat(line, ", ");
+            UIntToStr(ClusterBytes(), num);
+            strcat(line, num);
+            strcat(line, " byte clusters");
+            TerminalAddLine(win, line);
+            strcpy(line, "  ");
+            UIntToStr((uint64_t)freeClusters * ClusterBytes() / 1024, num);
+            strcat(line, num);
+            strcat(line, " KB free of ");
+            UIntToStr((uint64_t)clusterCount * ClusterBytes() / 1024, num);
+            strcat(line, num);
+            strcat(line, " KB (");
+            UIntToStr(freeClusters, num);
+            strcat(line, num);
+            strcat(line, " of ");
+            UIntToStr(clusterCount, num);
+            strcat(line, num);
+            strcat(line, " clusters)");
+            TerminalAddLine(win, line);
+        }
+    }
+    else if(strcmp(cmd, "sync") == 0) {
+        TerminalAddLine(win, CacheFlush(NULL) ? "Cache written back" : "Write-back failed");
+    }
+    else if(strcmp(cmd, "cachestat") == 0) {
+        CacheStats st;
+        GetCacheStats(&st);
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        
+        strcpy(line, "Blocks:     ");
+        UIntToStr(st.usedBlocks, num);
+        strcat(line, num);
+        strcat(line, " of ");
+        IntToStr(CACHE_BLOCKS, num);
+        strcat(line, num);
+        strcat(line, " used, ");
+        UIntToStr(st.dirtyBlocks, num);
+        strcat(line, num);
+        strcat(line, " dirty");
+        TerminalAddLine(win, line);
+        strcpy(line, "Hits:       ");
+        UIntToStr(st.hits, num);
+        strcat(line, num);
+        if(st.hits + st.misses) {
+            strcat(line, " (");
+            UIntToStr(st.hits * 100 / (st.hits + st.misses), num);
+            strcat(line, num);
+            strcat(line, "%)");
+        }
+        TerminalAddLine(win, line);
+        strcpy(line, "Misses:     ");
+        UIntToStr(st.misses, num);
+        strcat(line, num);
+        strcat(line, ", ");
+        UIntToStr(st.prefetches, num);
+        strcat(line, num);
+        strcat(line, " read ahead");
+        TerminalAddLine(win, line);
+        strcpy(line, "Evictions:  ");
+        UIntToStr(st.evictions, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        strcpy(line, "Writebacks: ");
+        UIntToStr(st.writebacks, num);
+        strcat(line, num);
+        strcat(line, " requests, ");
+        UIntToStr(st.sectorsWritten, num);
+        strcat(line, num);
+        strcat(line, " sectors");
+        TerminalAddLine(win, line);
+        strcpy(line, "Errors:     ");
+        UIntToStr(st.errors, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+    }
+    else if(strcmp(cmd, "smpbench") == 0) {
+        char line[MAX_LINE_LENGTH];
+        char num[24];
+        uint64_t single = 0;
+        
+        strcpy(line, "Full screen repaint, ");
+        IntToStr((int)fb->width, num);
+        strcat(line, num);
+        strcat(line, "x");
+        IntToStr((int)fb->height, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        for(int cores = 1; cores <= CpuCount(); cores++) {
+            uint64_t us = BenchmarkRepaint(cores, 10);
+            if(cores == 1) single = us;
+            strcpy(line, "  ");
+            IntToStr(cores, num);
+            strcat(line, num);
+            strcat(line, cores == 1 ? " core" : " cores");
+            AppendPadding(line, 12);
+            UIntToStr(us, num);
+            strcat(line, num);
+            strcat(line, " us");
+            AppendPadding(line, 24);
+            AppendRatio(line, single, us);
+            TerminalAddLine(win, line);
+        }
+    }
+    else if(strcmp(cmd, "gfxstat") == 0) {
+        CompositorStats stats;
+        GetCompositorStats(&stats);
+        char line[MAX_LINE_LENGTH];
+        char num[16];
+        
+        strcpy(line, "Frames composed: ");
+        IntToStr((int)stats.frames, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Last frame: ");
+        IntToStr((int)stats.lastFramePixels, num);
+        strcat(line, num);
+        strcat(line, " px in ");
+        IntToStr((int)stats.lastFrameRects, num);
+        strcat(line, num);
+        strcat(line, " rects");
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Avg per frame: ");
+        IntToStr(stats.frames ? (int)(stats.totalPixels / stats.frames) : 0, num);
+        strcat(line, num);
+        strcat(line, " px, peak ");
+        IntToStr((int)stats.peakFramePixels, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Overdraw: ");
+        AppendRatio(line, stats.totalDrawn, stats.totalPixels);
+        strcat(line, " avg, ");
+        AppendRatio(line, stats.lastFrameDrawn, stats.lastFramePixels);
+        strcat(line, " last frame");
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Presented: ");
+        IntToStr((int)(stats.totalPresentPixels / 1000), num);
+        strcat(line, num);
+        strcat(line, "K px, cursor-only frames ");
+        IntToStr((int)stats.cursorOnlyFrames, num);
+        strcat(line, num);
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Parallel frames: ");
+        IntToStr((int)stats.parallelFrames, num);
+        strcat(line, num);
+        strcat(line, ", last frame ");
+        IntToStr((int)stats.lastFrameTiles, num);
+        strcat(line, num);
+        strcat(line, " tiles");
+        TerminalAddLine(win, line);
+        
+        strcpy(line, "Full screen: ");
+        IntToStr((int)(fb->width * fb->height), num);
+        strcat(line, num);
+        strcat(line, " px");
+        TerminalAddLine(win, line);
+    }
     else if(strlen(cmd) > 0) {
         char error[MAX_LINE_LENGTH];
         strcpy(error, cmd);
@@ -786,7 +2824,7 @@ void TerminalProcessCommand(Window* win, const char* cmd) {
 void DrawTerminalContent(Window* win) {
     if(win->windowType != 1 || !win->visible) return;
     
-    TerminalData* term = &win->termData;
+    TerminalData* term = win->termData;
     int contentX = win->x + 8;
     int contentY = win->y + 38;
     int contentWidth = win->width - 16;
@@ -811,7 +2849,7 @@ void DrawTerminalContent(Window* win) {
 void DrawTextEditorContent(Window* win) {
     if(win->windowType != 3 || !win->visible) return;
     
-    TextEditorData* editor = &win->editorData;
+    TextEditorData* editor = win->editorData;
     int contentX = win->x + 8;
     int contentY = win->y + 38;
     int contentWidth = win->width - 16;
@@ -858,26 +2896,38 @@ void DrawTextEditorContent(Window* win) {
     int lineNum = 0;
     int charX = 0;
     
+    // Printable characters are collected into runs and drawn a line at a time
+    int runStart = 0;
+    int runLen = 0;
+    
     for(int i = 0; i < editor->contentLength && lineY < contentY + contentHeight - 12; i++) {
         char c = editor->content[i];
         
         if(c == '\n') {
+            DrawTextRun(contentX + (charX - runLen) * 8, lineY, editor->content + runStart, runLen, COLOR_BLACK);
+            runLen = 0;
             lineNum++;
             lineY += 12;
             charX = 0;
         } else if(c >= 32 && c <= 126) {
-            if(charX < 85) {
-                DrawChar(contentX + charX * 8, lineY, c, COLOR_BLACK);
-                charX++;
-            } else {
+            if(charX >= 85) {
+                DrawTextRun(contentX + (charX - runLen) * 8, lineY, editor->content + runStart, runLen, COLOR_BLACK);
+                runLen = 0;
                 lineNum++;
                 lineY += 12;
                 charX = 0;
-                DrawChar(contentX + charX * 8, lineY, c, COLOR_BLACK);
-                charX++;
+                if(lineY >= contentY + contentHeight - 12) break;
             }
+            if(runLen == 0) runStart = i;
+            runLen++;
+            charX++;
+        } else {
+            // Control characters take no space, so they split the run
+            DrawTextRun(contentX + (charX - runLen) * 8, lineY, editor->content + runStart, runLen, COLOR_BLACK);
+            runLen = 0;
         }
     }
+    DrawTextRun(contentX + (charX - runLen) * 8, lineY, editor->content + runStart, runLen, COLOR_BLACK);
     
     int statusY = win->y + win->height - 24;
     DrawRect(contentX - 4, statusY, contentWidth + 8, 20, 0xE0E0E0);
@@ -888,62 +2938,51 @@ void DrawTextEditorContent(Window* win) {
     }
 }
 
-void SaveCursorBackground(int x, int y) {
-    for(int dy = 0; dy < 20; dy++) {
-        for(int dx = 0; dx < 20; dx++) {
-            cursorBackBuffer[dy * 20 + dx] = GetPixel(x + dx, y + dy);
-        }
-    }
-    cursorBackBufferValid = 1;
-}
-
-void RestoreCursorBackground(int x, int y) {
-    if(!cursorBackBufferValid) return;
-    for(int dy = 0; dy < 20; dy++) {
-        for(int dx = 0; dx < 20; dx++) {
-            DrawPixel(x + dx, y + dy, cursorBackBuffer[dy * 20 + dx]);
-        }
-    }
-}
-
-void DrawCursor(int x, int y, int clicked) {
-    uint32_t cursorColor = clicked ? COLOR_CURSOR_CLICK : COLOR_CURSOR_NORMAL;
+// Cursor shapes are drawn once into the sprite surfaces at boot; the
+// compositor overlays the current one while presenting.
+void DrawCursorArrow(uint32_t cursorColor) {
     for(int dy = 0; dy < 16; dy++) {
         for(int dx = 0; dx <= dy && dx < 10; dx++) {
-            DrawPixel(x + dx, y + dy, cursorColor);
+            DrawPixel(dx, dy, cursorColor);
         }
     }
     for(int dy = 0; dy < 16; dy++) {
-        DrawPixel(x, y + dy, COLOR_BORDER);
+        DrawPixel(0, dy, COLOR_BORDER | CURSOR_OPAQUE);
         if(dy < 10) {
-            DrawPixel(x + dy, y + dy, COLOR_BORDER);
+            DrawPixel(dy, dy, COLOR_BORDER | CURSOR_OPAQUE);
         }
     }
 }
 
-void UpdateCursor(int newX, int newY, int clicked) {
-    if(cursorBackBufferValid) {
-        RestoreCursorBackground(oldMouseX, oldMouseY);
+// Four-way move cross, centred on the hotspot
+void DrawCursorMove(uint32_t cursorColor) {
+    DrawRect(2, 8, 15, 3, COLOR_BORDER | CURSOR_OPAQUE);
+    DrawRect(8, 2, 3, 15, COLOR_BORDER | CURSOR_OPAQUE);
+    DrawRect(3, 9, 13, 1, cursorColor);
+    DrawRect(9, 3, 1, 13, cursorColor);
+    for(int i = 1; i < 4; i++) {
+        DrawRect(2 + i, 9 - i, 1, 2 * i + 1, COLOR_BORDER | CURSOR_OPAQUE);
+        DrawRect(16 - i, 9 - i, 1, 2 * i + 1, COLOR_BORDER | CURSOR_OPAQUE);
+        DrawRect(9 - i, 2 + i, 2 * i + 1, 1, COLOR_BORDER | CURSOR_OPAQUE);
+        DrawRect(9 - i, 16 - i, 2 * i + 1, 1, COLOR_BORDER | CURSOR_OPAQUE);
     }
-    SaveCursorBackground(newX, newY);
-    DrawCursor(newX, newY, clicked);
 }
 
+// Renders frame and content; the compositor points the draw target at the
+// window's surface first, with the origin at the window position.
 void DrawWindow(Window* win) {
     if(!win->visible) return;
     
     uint32_t titleBarHeight = 30;
     
-    if(!win->dragging) {
-        DrawRect(win->x + 4, win->y + 4, win->width, win->height, 0x80000000);
-    }
-    
     DrawRect(win->x, win->y, win->width, win->height, COLOR_BORDER);
     
     uint32_t titleColor = win->isFocused ? win->titleBarColor : (win->titleBarColor & 0x808080);
     DrawRect(win->x + 2, win->y + 2, win->width - 4, titleBarHeight - 2, titleColor);
     DrawText(win->x + 10, win->y + 10, win->title, COLOR_WHITE);
     
+    // Apps only get the area inside the border and below the title bar
+    PushClipRect(win->x + 2, win->y + titleBarHeight, win->width - 4, win->height - titleBarHeight - 2);
         if(win->windowType == 1) {
         DrawTerminalContent(win);
     } else if(win->windowType == 2) {
@@ -951,23 +2990,17 @@ void DrawWindow(Window* win) {
     } else if(win->windowType == 3) {
         DrawTextEditorContent(win);
     } else if(win->windowType == 4) {
-        DrawTetrisBoard(win, &win->tetrisGame);
+        DrawTetrisBoard(win, win->tetrisGame);
     } else if(win->windowType == 5) {
-        DrawPaintApp(win, &win->paintData);
+        DrawPaintApp(win, win->paintData);
     } else {
         DrawRect(win->x + 2, win->y + titleBarHeight, win->width - 4, 
                  win->height - titleBarHeight - 2, win->backgroundColor);
     }
+    PopClipRect();
 
     DrawRect(win->x + win->width - 26, win->y + 6, 18, 18, 0xE81123);
     DrawText(win->x + win->width - 21, win->y + 11, "X", COLOR_WHITE);
-    
-    win->lastDrawX = win->x;
-    win->lastDrawY = win->y;
-}
-
-void ClearWindowArea(int x, int y, int w, int h) {
-    DrawRect(x, y, w, h, COLOR_DESKTOP_BG);
 }
 
 void DrawDesktop() {
@@ -994,42 +3027,128 @@ void DrawTaskbar() {
     DrawText(fb->width - 135, taskbarY + 16, "RGOS v2.1.0", COLOR_WHITE);
 }
 
-void RedrawEverything() {
-    cursorBackBufferValid = 0;
-    DrawDesktop();
+#include "compositor.c"
+
+void UpdateDraggingWindow(Window* win) {
+    if(!win->dragging || !win->visible) return;
+    InvalidateRect(win->lastDrawX, win->lastDrawY, win->width + WINDOW_SHADOW, win->height + WINDOW_SHADOW);
+    InvalidateWindow(win);
+    win->lastDrawX = win->x;
+    win->lastDrawY = win->y;
+}
+
+int PointInRect(int px, int py, int x, int y, int w, int h) {
+    return px >= x && px < x + w && py >= y && py < y + h;
+}
+
+// First closed or never used slot, or -1 when all are open
+static int FindFreeWindow() {
     for(int i = 0; i < windowCount; i++) {
-        if(windows[i].visible) {
-            DrawWindow(&windows[i]);
+        if(windows[i].windowType == WINDOW_FREE) return i;
+    }
+    return windowCount < MAX_WINDOWS ? windowCount : -1;
+}
+
+// Puts the window in handle's slot on top of the stack; returns the handle
+static int AddWindow(int handle) {
+    zOrder[zCount++] = handle;
+    if(handle >= windowCount) windowCount = handle + 1;
+    return handle;
+}
+
+// Moves handle to the top of the stack
+void RaiseWindow(int handle) {
+    int z = 0;
+    while(z < zCount && zOrder[z] != handle) z++;
+    if(z == zCount) return;
+    for(; z < zCount - 1; z++) zOrder[z] = zOrder[z + 1];
+    zOrder[zCount - 1] = handle;
+}
+
+void RemoveWindowFromStack(int handle) {
+    int z = 0;
+    while(z < zCount && zOrder[z] != handle) z++;
+    if(z == zCount) return;
+    for(; z < zCount - 1; z++) zOrder[z] = zOrder[z + 1];
+    zCount--;
+}
+
+// Topmost visible window containing the point, or -1
+int WindowFromPoint(int x, int y) {
+    for(int z = zCount - 1; z >= 0; z--) {
+        Window* win = &windows[zOrder[z]];
+        if(win->visible && PointInRect(x, y, win->x, win->y, win->width, win->height)) {
+            return zOrder[z];
         }
     }
-    DrawTaskbar();
-    SaveCursorBackground(mouseX, mouseY);
-    DrawCursor(mouseX, mouseY, mouseButtons);
+    return -1;
 }
 
-void UpdateDraggingWindow(Window* win) {
-    if(!win->dragging || !win->visible) return;
-    ClearWindowArea(win->lastDrawX, win->lastDrawY, win->width, win->height);
-    for(int i = 0; i < windowCount; i++) {
-        Window* other = &windows[i];
-        if(other == win || !other->visible) continue;
-        if(!(other->x + other->width < win->lastDrawX || 
-             other->x > win->lastDrawX + win->width ||
-             other->y + other->height < win->lastDrawY ||
-             other->y > win->lastDrawY + win->height)) {
-            DrawWindow(other);
+void FocusWindow(int handle) {
+    if(focusedWindow >= 0 && focusedWindow != handle) {
+        windows[focusedWindow].isFocused = 0;
+        InvalidateWindowContent(&windows[focusedWindow]);
+    }
+    focusedWindow = handle;
+    Window* win = &windows[handle];
+    if(!win->isFocused) {
+        win->isFocused = 1;
+        InvalidateWindowContent(win);
+    }
+    if(zCount > 0 && zOrder[zCount - 1] != handle) {
+        RaiseWindow(handle);
+        InvalidateWindow(win);
+    }
+}
+
+// Heap state for the window type; the about window has none
+static int AllocWindowState(Window* win) {
+    static const uint64_t stateSizes[WINDOW_TYPES] = {
+        0, sizeof(TerminalData), sizeof(FileBrowserData),
+        sizeof(TextEditorData), sizeof(TetrisGame), sizeof(PaintData)
+    };
+    win->appData = NULL;
+    if(stateSizes[win->windowType] == 0) return 1;
+    win->appData = HeapAllocZeroed(stateSizes[win->windowType]);
+    if(!win->appData) return 0;
+
+    if(win->windowType == 5) {
+        win->paintData->canvas = (uint32_t (*)[PAINT_CANVAS_WIDTH])
+            HeapAlloc(sizeof(uint32_t) * PAINT_CANVAS_WIDTH * PAINT_CANVAS_HEIGHT);
+        if(!win->paintData->canvas) {
+            HeapFree(win->appData);
+            win->appData = NULL;
+            return 0;
         }
     }
-    DrawWindow(win);
+    return 1;
+}
+
+// Frees everything the window owns and marks its slot free. The caller has
+// already taken it off the stack and cancelled its timer.
+static void ReleaseWindow(Window* win) {
+    if(win->windowType == 5 && win->paintData && win->paintData->filling) {
+        win->paintData->closed = 1;         // freed by the fill when it resumes
+    } else {
+        if(win->windowType == 5 && win->paintData) HeapFree(win->paintData->canvas);
+        HeapFree(win->appData);
+    }
+    FreeWindowSurface(win);
+    win->appData = NULL;
+    win->visible = 0;
+    win->dragging = 0;
+    win->isFocused = 0;
+    win->windowType = WINDOW_FREE;
 }
 
-void CreateWindow(int x, int y, int width, int height, const char* title, uint32_t color, int windowType) {
-    if(windowCount >= 16) return;
-    Window* win = &windows[windowCount];
+// Fills in what every window type shares and allocates its surface and
+// state; returns 0 with the slot left free if memory runs out
+static int SetupWindow(Window* win, int x, int y, int width, int height, const char* title, uint32_t color, int windowType) {
     win->x = x;
     win->y = y;
     win->width = width;
     win->height = height;
+    strcpy(win->title, title);
     win->titleBarColor = color;
     win->backgroundColor = COLOR_WINDOW_BG;
     win->visible = 1;
@@ -1038,78 +3157,70 @@ void CreateWindow(int x, int y, int width, int height, const char* title, uint32
     win->lastDrawY = y;
     win->windowType = windowType;
     win->isFocused = 0;
+    win->appData = NULL;
+    win->surface.pixels = NULL;
+    win->serial = ++windowSerial;
+    if(!AllocWindowState(win) || !InitWindowSurface(win)) {
+        ReleaseWindow(win);
+        return 0;
+    }
+    return 1;
+}
+
+// Closes the window for good; its handle may be reused right away
+void CloseWindow(int handle) {
+    Window* win = &windows[handle];
+    if(win->windowType == WINDOW_FREE) return;
+    win->visible = 0;
+    RemoveWindowFromStack(handle);
+    ClearWindowTimer(handle);
+    if(focusedWindow == handle) focusedWindow = -1;
+    InvalidateWindow(win);
+    ReleaseWindow(win);
+}
+
+int CreateWindow(int x, int y, int width, int height, const char* title, uint32_t color, int windowType) {
+    int handle = FindFreeWindow();
+    if(handle < 0) return -1;
+    Window* win = &windows[handle];
+    if(!SetupWindow(win, x, y, width, height, title, color, windowType)) return -1;
     
     if(windowType == 1) {
-        win->termData.lineCount = 0;
-        win->termData.inputPos = 0;
-        win->termData.inputBuffer[0] = '\0';
-        win->termData.historyCount = 0;
         TerminalAddLine(win, "RGOS Terminal v1.3");
         TerminalAddLine(win, "Type 'help' for commands");
         TerminalAddLine(win, "");
     } else if(windowType == 2) {
-        win->browserData.currentPath[0] = '/';
-        win->browserData.currentPath[1] = '\0';
-        LoadRootDirectory(&win->browserData);
-    } else if(windowType == 3) {
-        win->editorData.contentLength = 0;
-        win->editorData.cursorPos = 0;
-        win->editorData.scrollLine = 0;
-        win->editorData.modified = 0;
-        win->editorData.content[0] = '\0';
-        win->editorData.filename[0] = '\0';
+        win->browserData->currentPath[0] = '/';
+        win->browserData->currentPath[1] = '\0';
+        LoadDirectory(win->browserData);
     }
     
-    strcpy(win->title, title);
-    windowCount++;
-}
-
-void CreateTetrisWindow() {
-    if(windowCount >= 16) return;
-    Window* win = &windows[windowCount];
-    win->x = 150;
-    win->y = 50;
-    win->width = 480;
-    win->height = 480;
-    strcpy(win->title, "Tetris");
-    win->titleBarColor = COLOR_TITLEBAR_BLUE;
-    win->backgroundColor = COLOR_WINDOW_BG;
-    win->visible = 1;
-    win->dragging = 0;
-    win->lastDrawX = win->x;
-    win->lastDrawY = win->y;
-    win->windowType = 4;
-    win->isFocused = 0;
-    TetrisInit(&win->tetrisGame);
-    windowCount++;
-}
-
-void CreatePaintWindow() {
-    if(windowCount >= 16) return;
-    Window* win = &windows[windowCount];
-    win->x = 100;
-    win->y = 80;
-    win->width = 430;
-    win->height = 500;
-    strcpy(win->title, "Paint");
-    win->titleBarColor = COLOR_TITLEBAR_GREEN;
-    win->backgroundColor = 0xCCCCCC;
-    win->visible = 1;
-    win->dragging = 0;
-    win->lastDrawX = win->x;
-    win->lastDrawY = win->y;
-    win->windowType = 5;
-    win->isFocused = 0;
-    PaintInit(&win->paintData);
-    windowCount++;
+    return AddWindow(handle);
 }
 
-int PointInRect(int px, int py, int x, int y, int w, int h) {
-    return px >= x && px < x + w && py >= y && py < y + h;
+int CreateTetrisWindow() {
+    int handle = FindFreeWindow();
+    if(handle < 0) return -1;
+    Window* win = &windows[handle];
+    if(!SetupWindow(win, 150, 50, 480, 480, "Tetris", COLOR_TITLEBAR_BLUE, 4)) return -1;
+    TetrisInit(win->tetrisGame);
+    AddWindow(handle);
+    SetWindowTimer(handle, TETRIS_TICK_MS);
+    return handle;
+}
+
+int CreatePaintWindow() {
+    int handle = FindFreeWindow();
+    if(handle < 0) return -1;
+    Window* win = &windows[handle];
+    if(!SetupWindow(win, 100, 80, 430, 500, "Paint", COLOR_TITLEBAR_GREEN, 5)) return -1;
+    win->backgroundColor = 0xCCCCCC;
+    PaintInit(win->paintData);
+    return AddWindow(handle);
 }
 
 void HandleFileBrowserClick(Window* win, int x, int y) {
-    FileBrowserData* fb = &win->browserData;
+    FileBrowserData* fb = win->browserData;
     
     int contentX = win->x + 8;
     int contentY = win->y + 38;
@@ -1122,132 +3233,116 @@ void HandleFileBrowserClick(Window* win, int x, int y) {
         int clickedIndex = fb->scrollOffset + (y - fileY) / 20;
         if(clickedIndex < fb->fileCount) {
             fb->selectedIndex = clickedIndex;
-            DrawWindow(win);
+            InvalidateWindowContent(win);
         }
     }
 }
 
-void OpenFileInEditor(const char* filename, uint16_t cluster, uint32_t fileSize) {
-    CreateWindow(120, 120, 700, 500, "Text Editor", COLOR_TITLEBAR_BLUE, 3);
-    Window* editor = &windows[windowCount - 1];
+int OpenFileInEditor(const char* filename, uint32_t cluster, uint32_t fileSize) {
+    int handle = CreateWindow(120, 120, 700, 500, "Text Editor", COLOR_TITLEBAR_BLUE, 3);
+    if(handle < 0) return -1;
+    Window* editor = &windows[handle];
     
-    strcpy(editor->editorData.filename, filename);
+    strcpy(editor->editorData->filename, filename);
     
     if(cluster >= 2 && fileSize > 0) {
         if(fileSize > MAX_FILE_CONTENT - 1) fileSize = MAX_FILE_CONTENT - 1;
-        ReadFileContent(cluster, editor->editorData.content, fileSize);
-        editor->editorData.contentLength = fileSize;
-        editor->editorData.content[fileSize] = '\0';
+        ReadFileContent(cluster, editor->editorData->content, fileSize);
+        editor->editorData->contentLength = fileSize;
+        editor->editorData->content[fileSize] = '\0';
     } else {
-        editor->editorData.contentLength = 0;
-        editor->editorData.content[0] = '\0';
+        editor->editorData->contentLength = 0;
+        editor->editorData->content[0] = '\0';
     }
     
-    editor->editorData.cursorPos = 0;
-    editor->editorData.scrollLine = 0;
-    editor->editorData.modified = 0;
-    editor->editorData.editingFilename = 0;
-    editor->editorData.filenamePos = strlen(filename);
+    editor->editorData->cursorPos = 0;
+    editor->editorData->scrollLine = 0;
+    editor->editorData->modified = 0;
+    editor->editorData->editingFilename = 0;
+    editor->editorData->filenamePos = strlen(filename);
+    return handle;
 }
 
-void CreateNewFileEditor() {
-    CreateWindow(120, 120, 700, 500, "Text Editor - New File", COLOR_TITLEBAR_BLUE, 3);
-    Window* editor = &windows[windowCount - 1];
-    
-    strcpy(editor->editorData.filename, "newfile.txt");
-    editor->editorData.contentLength = 0;
-    editor->editorData.content[0] = '\0';
-    editor->editorData.cursorPos = 0;
-    editor->editorData.scrollLine = 0;
-    editor->editorData.modified = 0;
-    editor->editorData.editingFilename = 1;
-    editor->editorData.filenamePos = strlen(editor->editorData.filename);
-}
-
-void HandleMouseClick(int x, int y) {
-    for(int i = windowCount - 1; i >= 0; i--) {
-        Window* win = &windows[i];
-        if(!win->visible) continue;
-        
-        if(PointInRect(x, y, win->x, win->y, win->width, win->height)) {
-            for(int j = 0; j < windowCount; j++) {
-                windows[j].isFocused = 0;
-            }
-            win->isFocused = 1;
-            focusedWindow = i;
-         
-            Window tmpWindow = windows[windowCount - 1];
-            windows[windowCount - 1] = *win;
-            *win = tmpWindow;
-            
-if(PointInRect(x, y, 330, 30, 64, 64)) {
-    CreateTetrisWindow();
-    RedrawEverything();
-    return;
+// The new file's name starts out in directory, the browser's folder
+int CreateNewFileEditor(const char* directory) {
+    int handle = CreateWindow(120, 120, 700, 500, "Text Editor - New File", COLOR_TITLEBAR_BLUE, 3);
+    if(handle < 0) return -1;
+    Window* editor = &windows[handle];
+    
+    const char* name = "newfile.txt";
+    strcpy(editor->editorData->filename, strlen(directory) + strlen(name) < MAX_FILENAME ? directory : "/");
+    strcat(editor->editorData->filename, name);
+    editor->editorData->contentLength = 0;
+    editor->editorData->content[0] = '\0';
+    editor->editorData->cursorPos = 0;
+    editor->editorData->scrollLine = 0;
+    editor->editorData->modified = 0;
+    editor->editorData->editingFilename = 1;
+    editor->editorData->filenamePos = strlen(editor->editorData->filename);
+    return handle;
 }
 
-if(PointInRect(x, y, 430, 30, 64, 64)) {
-    CreatePaintWindow();
-    RedrawEverything();
-    return;
+// Damages a freshly created window so it shows up; failed creates pass -1
+void ShowNewWindow(int handle) {
+    if(handle >= 0) InvalidateWindow(&windows[handle]);
 }
-    
-            int closeX = win->x + win->width - 26;
-            int closeY = win->y + 6;
-            if(PointInRect(x, y, closeX, closeY, 18, 18)) {
-                win->visible = 0;
-                focusedWindow = -1;
-                RedrawEverything();
-                return;
-            }
-            
-            if(PointInRect(x, y, win->x, win->y, win->width, 30)) {
-                win->dragging = 1;
-                win->dragOffsetX = x - win->x;
-                win->dragOffsetY = y - win->y;
-            } else if(win->windowType == 2) {
-                HandleFileBrowserClick(win, x, y);
-            }
 
-            if(win->windowType == 5) {
-    HandlePaintMouseDown(win, &win->paintData, x, y);
-}
-            
-            RedrawEverything();
+void HandleMouseClick(int x, int y) {
+    int handle = WindowFromPoint(x, y);
+    if(handle >= 0) {
+        Window* win = &windows[handle];
+        FocusWindow(handle);
+    
+        int closeX = win->x + win->width - 26;
+        int closeY = win->y + 6;
+        if(PointInRect(x, y, closeX, closeY, 18, 18)) {
+            CloseWindow(handle);
             return;
         }
+        
+        if(PointInRect(x, y, win->x, win->y, win->width, 30)) {
+            win->dragging = 1;
+            win->dragOffsetX = x - win->x;
+            win->dragOffsetY = y - win->y;
+        } else if(win->windowType == 2) {
+            PostWindowEvent(handle, EVENT_BUTTON_DOWN, 1, x, y);
+        }
+
+        if(win->windowType == 5) {
+            PostWindowEvent(handle, EVENT_BUTTON_DOWN, 1, x, y);
+        }
+        return;
     }
     
     if(PointInRect(x, y, 130, 30, 64, 64)) {
-        CreateWindow(100, 100, 700, 500, "File Browser", COLOR_TITLEBAR_GREEN, 2);
-        RedrawEverything();
+        ShowNewWindow(CreateWindow(100, 100, 700, 500, "File Browser", COLOR_TITLEBAR_GREEN, 2));
     } else if(PointInRect(x, y, 230, 30, 64, 64)) {
-        CreateWindow(150, 150, 700, 500, "Terminal", COLOR_TITLEBAR_BLUE, 1);
-        RedrawEverything();
+        ShowNewWindow(CreateWindow(150, 150, 700, 500, "Terminal", COLOR_TITLEBAR_BLUE, 1));
+    } else if(PointInRect(x, y, 330, 30, 64, 64)) {
+        ShowNewWindow(CreateTetrisWindow());
+    } else if(PointInRect(x, y, 430, 30, 64, 64)) {
+        ShowNewWindow(CreatePaintWindow());
     }
 }
 
 void HandleMouseRelease() {
-    int anyDragging = 0;
     for(int i = 0; i < windowCount; i++) {
         if(windows[i].dragging) {
+            // The drop shadow comes back once the drag ends
             windows[i].dragging = 0;
-            anyDragging = 1;
+            InvalidateWindow(&windows[i]);
         }
         // Handle paint mouse up
-        if(windows[i].windowType == 5 && windows[i].paintData.isDrawing) {
-            HandlePaintMouseUp(&windows[i], &windows[i].paintData, mouseX, mouseY);
+        if(windows[i].windowType == 5 && windows[i].paintData->isDrawing) {
+            PostWindowEvent(i, EVENT_BUTTON_UP, 0, mouseX, mouseY);
         }
     }
-    if(anyDragging) {
-        RedrawEverything();
-    }
 }
 
 void HandleMouseMove(int x, int y) {
     for(int i = 0; i < windowCount; i++) {
-        if(windows[i].windowType == 5 && windows[i].paintData.isDrawing) {
-            HandlePaintMouseMove(&windows[i], &windows[i].paintData, x, y);
+        if(windows[i].windowType == 5 && windows[i].paintData->isDrawing) {
+            PostWindowEvent(i, EVENT_POINTER_MOVE, 1, x, y);
         }
     }
     
@@ -1267,6 +3362,11 @@ void HandleMouseMove(int x, int y) {
     }
 }
 
+// EVENT_TIMER from SetWindowTimer
+void HandleWindowTimer(Window* win) {
+    if(win->windowType == 4 && TetrisUpdate(win->tetrisGame)) TetrisInvalidate(win);
+}
+
 char ScancodeToChar(unsigned char scancode) {
     static const char scancodeMap[] = {
         0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
@@ -1281,24 +3381,26 @@ char ScancodeToChar(unsigned char scancode) {
     return 0;
 }
 
+// Hands a translated key to the task that runs the focused window
 void HandleKeyPress(unsigned char key) {
     if(focusedWindow < 0 || focusedWindow >= windowCount) return;
-    
-    Window* win = &windows[focusedWindow];
-    if(!win->visible) return;
-    
+    if(!windows[focusedWindow].visible) return;
+    PostWindowEvent(focusedWindow, EVENT_KEY_DOWN, key, 0, 0);
+}
+
+void HandleWindowKey(Window* win, unsigned char key) {
    if(win->windowType == 4) {
-        HandleTetrisKeyPress(win, &win->tetrisGame, key);
+        HandleTetrisKeyPress(win, win->tetrisGame, key);
         return;
     }
 
     if(win->windowType == 5) {
-        HandlePaintKeyPress(win, &win->paintData, key);
+        HandlePaintKeyPress(win, win->paintData, key);
         return;
     }
 
     if(win->windowType == 1) {
-        TerminalData* term = &win->termData;
+        TerminalData* term = win->termData;
         
         if(key == '\n') {
             term->inputBuffer[term->inputPos] = '\0';
@@ -1308,18 +3410,24 @@ void HandleKeyPress(unsigned char key) {
             strcat(cmdLine, term->inputBuffer);
             TerminalAddLine(win, cmdLine);
             
-            TerminalProcessCommand(win, term->inputBuffer);
-            
+            // Commands that let go of the UI lock (diskbench) may find the
+            // terminal closed when they return, so they run on a copy
+            char cmd[MAX_LINE_LENGTH];
+            strcpy(cmd, term->inputBuffer);
             term->inputPos = 0;
             term->inputBuffer[0] = '\0';
             
-            DrawWindow(win);
+            uint32_t serial = win->serial;
+            TerminalProcessCommand(win, cmd);
+            if(win->windowType == WINDOW_FREE || win->serial != serial) return;
+            
+            InvalidateWindowContent(win);
         }
         else if(key == '\b') {
             if(term->inputPos > 0) {
                 term->inputPos--;
                 term->inputBuffer[term->inputPos] = '\0';
-                DrawWindow(win);
+                InvalidateWindowContent(win);
             }
         }
         else if(key >= 32 && key <= 126) {
@@ -1327,11 +3435,11 @@ void HandleKeyPress(unsigned char key) {
                 term->inputBuffer[term->inputPos] = key;
                 term->inputPos++;
                 term->inputBuffer[term->inputPos] = '\0';
-                DrawWindow(win);
+                InvalidateWindowContent(win);
             }
         }
     } else if(win->windowType == 2) {
-        FileBrowserData* fb = &win->browserData;
+        FileBrowserData* fb = win->browserData;
         
         if(key == 'j' || key == 's') {
             if(fb->selectedIndex < fb->fileCount - 1) {
@@ -1340,7 +3448,7 @@ void HandleKeyPress(unsigned char key) {
                 if(fb->selectedIndex >= fb->scrollOffset + visibleFiles) {
                     fb->scrollOffset++;
                 }
-                DrawWindow(win);
+                InvalidateWindowContent(win);
             }
         } else if(key == 'k' || key == 'w') {
             if(fb->selectedIndex > 0) {
@@ -1348,35 +3456,42 @@ void HandleKeyPress(unsigned char key) {
                 if(fb->selectedIndex < fb->scrollOffset) {
                     fb->scrollOffset--;
                 }
-                DrawWindow(win);
+                InvalidateWindowContent(win);
             }
         } else if(key == '\n') {
             if(fb->selectedIndex >= 0 && fb->selectedIndex < fb->fileCount) {
                 FileEntry* file = &fb->files[fb->selectedIndex];
-                if(!file->isDirectory) {
-                    OpenFileInEditor(file->name, file->cluster, file->size);
-                    RedrawEverything();
+                if(file->isDirectory) {
+                    EnterBrowserFolder(fb, file->name);
+                    InvalidateWindowContent(win);
+                } else if(strlen(fb->currentPath) + strlen(file->name) < MAX_FILENAME) {
+                    char path[MAX_FILENAME];
+                    strcpy(path, fb->currentPath);
+                    strcat(path, file->name);
+                    ShowNewWindow(OpenFileInEditor(path, file->cluster, file->size));
                 }
             }
+        } else if(key == '\b') {
+            EnterBrowserFolder(fb, "..");
+            InvalidateWindowContent(win);
         } else if(key == 'n') {
-            CreateNewFileEditor();
-            RedrawEverything();
+            ShowNewWindow(CreateNewFileEditor(fb->currentPath));
         }
     } else if(win->windowType == 3) {
-        TextEditorData* editor = &win->editorData;
+        TextEditorData* editor = win->editorData;
         
         if(editor->editingFilename) {
             if(key == '\n') {
                 editor->editingFilename = 0;
                 editor->filename[63] = '\0';
-                DrawWindow(win);
+                InvalidateWindowContent(win);
             }
             else if(key == '\b') {
                 //Backspace (Did not work previously, very finnicky, needs proper fix)
                 if(editor->filenamePos > 0) {
                     editor->filenamePos--;
                     editor->filename[editor->filenamePos] = '\0';
-                    DrawWindow(win);
+                    InvalidateWindowContent(win);
                 }
             }
             else if(key >= 32 && key <= 126) {
@@ -1384,37 +3499,30 @@ void HandleKeyPress(unsigned char key) {
                     editor->filename[editor->filenamePos] = key;
                     editor->filenamePos++;
                     editor->filename[editor->filenamePos] = '\0';
-                    DrawWindow(win);
+                    InvalidateWindowContent(win);
                 }
             }
         } else {
             if(key == 1) {
-                CreateNewFile(editor->filename, editor->content, editor->contentLength);
-                editor->modified = 0;
-                
-                for(int i = 0; i < windowCount; i++) {
-                    if(windows[i].windowType == 2 && windows[i].visible) {
-                        LoadRootDirectory(&windows[i].browserData);
-                    }
-                }
-                
-                DrawWindow(win);
+                if(SaveFile(editor->filename, editor->content, editor->contentLength)) editor->modified = 0;
+                RefreshFileBrowsers();
+                InvalidateWindowContent(win);
             }
             else if(key == 2) {
                 editor->editingFilename = 1;
                 editor->filenamePos = strlen(editor->filename);
-                DrawWindow(win);
+                InvalidateWindowContent(win);
             }
             else if(key == 27) {
-                win->visible = 0;
-                RedrawEverything();
+                CloseWindow(win - windows);
+                return;
             }
             else if(key == '\b') {
                 if(editor->contentLength > 0) {
                     editor->contentLength--;
                     editor->content[editor->contentLength] = '\0';
                     editor->modified = 1;
-                    DrawWindow(win);
+                    InvalidateWindowContent(win);
                 }
             }
             else if(key >= 32 && key <= 126 || key == '\n') {
@@ -1423,83 +3531,41 @@ void HandleKeyPress(unsigned char key) {
                     editor->contentLength++;
                     editor->content[editor->contentLength] = '\0';
                     editor->modified = 1;
-                    DrawWindow(win);
+                    InvalidateWindowContent(win);
                 }
             }
         }
     }
 }
 
-void InitMouse() {
-    outb(0x64, 0xA8);
-    outb(0x64, 0x20);
-    uint8_t status = inb(0x60) | 2;
-    outb(0x64, 0x60);
-    outb(0x60, status);
-    outb(0x64, 0xD4);
-    outb(0x60, 0xF6);
-    inb(0x60);
-    outb(0x64, 0xD4);
-    outb(0x60, 0xF4);
-    inb(0x60);
-}
-
-void PollMouse() {
-    static uint8_t mouseCycle = 0;
-    static uint8_t mouseBytes[3];
-    
-    uint8_t status = inb(0x64);
-    if(!(status & 0x01)) return;
-    if(!(status & 0x20)) return;
-    
-    uint8_t data = inb(0x60);
-    mouseBytes[mouseCycle++] = data;
-    
-    if(mouseCycle == 3) {
-        mouseCycle = 0;
-        
-        int8_t deltaX = mouseBytes[1];
-        int8_t deltaY = -mouseBytes[2];
-        
-        oldMouseX = mouseX;
-        oldMouseY = mouseY;
-        
-        mouseX += deltaX;
-        mouseY += deltaY;
-        
-        if(mouseX < 0) mouseX = 0;
-        if(mouseY < 0) mouseY = 0;
-        if(mouseX >= fb->width - 20) mouseX = fb->width - 20;
-        if(mouseY >= fb->height - 20) mouseY = fb->height - 20;
-        
-        int leftButton = mouseBytes[0] & 0x01;
-        
-        if(leftButton && !mouseButtons) {
-            HandleMouseClick(mouseX, mouseY);
-        } else if(!leftButton && mouseButtons) {
-            HandleMouseRelease();
-        } else if(leftButton) {
-            HandleMouseMove(mouseX, mouseY);
-        } else if(mouseX != oldMouseX || mouseY != oldMouseY) {
-            UpdateCursor(mouseX, mouseY, leftButton);
-            oldMouseX = mouseX;
-            oldMouseY = mouseY;
-            return;
-        }
-        
-        mouseButtons = leftButton;
+// App side of PostWindowEvent, run in the task that owns the window type
+void HandleWindowEvent(Window* win, const Event* ev) {
+    switch(ev->type) {
+        case EVENT_KEY_DOWN:
+            HandleWindowKey(win, ev->code);
+            break;
+        case EVENT_BUTTON_DOWN:
+            if(win->windowType == 2) HandleFileBrowserClick(win, ev->x, ev->y);
+            if(win->windowType == 5) HandlePaintMouseDown(win, win->paintData, ev->x, ev->y);
+            break;
+        case EVENT_POINTER_MOVE:
+            if(win->windowType == 5) HandlePaintMouseMove(win, win->paintData, ev->x, ev->y);
+            break;
+        case EVENT_BUTTON_UP:
+            if(win->windowType == 5 && win->paintData->isDrawing) {
+                HandlePaintMouseUp(win, win->paintData, ev->x, ev->y);
+            }
+            break;
+        case EVENT_TIMER:
+            HandleWindowTimer(win);
+            break;
     }
 }
 
-void PollKeyboard() {
-    uint8_t status = inb(0x64);
-    if(!(status & 0x01)) return;
-    if(status & 0x20) return;
-    
-    unsigned char scancode = inb(0x60);
-    
-    if(scancode & 0x80) {
-        scancode &= 0x7F;
+// Key events go to the focused window through HandleKeyPress; modifier
+// keys only update the shift/ctrl state
+void HandleKeyEvent(unsigned char scancode, int down) {
+    if(!down) {
         if(scancode == 29) ctrlPressed = 0;
         if(scancode == 42 || scancode == 54) shiftPressed = 0;
         return;
@@ -1535,17 +3601,179 @@ void PollKeyboard() {
     }
 }
 
-void KernelMain(Framebuffer* framebuffer) {
-    fb = framebuffer;
-    // Show fake loading bar on boot (5-7 seconds)
+#include "interrupt.c"
+#include "apic.c"
+#include "timer.c"
+#include "task.c"
+#include "ps2.c"
+#include "event.c"
+#include "frame.c"
+#include "acpi.c"
+#include "smp.c"
+#include "pmm.c"
+#include "heap.c"
+#include "boottime.c"
+#include "cpu.c"
+#include "pci.c"
+#include "block.c"
+#include "virtio.c"
+#include "ahci.c"
+#include "bcache.c"
+
+// TSC cycles for one full-screen fill of the GOP framebuffer, best of three
+static uint64_t TimeFramebufferFill() {
+    uint64_t best = ~0ULL;
+    for(int pass = 0; pass < 3; pass++) {
+        uint64_t start = rdtsc();
+        uint32_t* row = frontSurface.pixels;
+        for(int y = 0; y < frontSurface.height; y++) {
+            cpuDispatch.blit->fillRow(row, COLOR_DESKTOP_BG, frontSurface.width);
+            row += frontSurface.stride;
+        }
+        BlitFence();
+        uint64_t cycles = rdtsc() - start;
+        if(cycles < best) best = cycles;
+    }
+    return best;
+}
+
+static void LogFramebufferFill(uint64_t cycles, int type) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    strcpy(line, "fb: fill ");
+    UIntToStr(cycles, num);
+    strcat(line, num);
+    strcat(line, " cycles/frame as ");
+    strcat(line, MemTypeName(type));
+    KLog(line);
+}
+
+// Switches the framebuffer to write-combining and logs fill speed either side
+void InitFramebufferMapping() {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    uint64_t fbBase = (uint64_t)frontSurface.pixels;
+    uint64_t fbBytes = (uint64_t)frontSurface.stride * frontSurface.height * sizeof(uint32_t);
+
+    strcpy(line, "fb: ");
+    HexToStr(fbBase, num);
+    strcat(line, num);
+    strcat(line, " ");
+    UIntToStr(fbBytes / 1024, num);
+    strcat(line, num);
+    strcat(line, " KB, PAT type ");
+    strcat(line, MemTypeName(PageMemType(fbBase)));
+    strcat(line, ", MTRR type ");
+    strcat(line, MemTypeName(MtrrMemType(fbBase)));
+    KLog(line);
+
+    uint64_t before = TimeFramebufferFill();
+    LogFramebufferFill(before, PageMemType(fbBase));
+
+    if(!InitPat()) {
+        KLog("fb: no PAT, keeping firmware mapping");
+        return;
+    }
+    if(!SetRangeWriteCombining(fbBase, fbBytes)) {
+        KLog("fb: could not build WC page tables, keeping firmware mapping");
+        return;
+    }
+    strcpy(line, "fb: remapped with ");
+    IntToStr(PageTablesUsed(), num);
+    strcat(line, num);
+    strcat(line, " kernel page tables");
+    KLog(line);
+
+    uint64_t after = TimeFramebufferFill();
+    LogFramebufferFill(after, PageMemType(fbBase));
+
+    uint64_t ratio10 = after ? before * 10 / after : 0;
+    strcpy(line, "fb: fill speedup ");
+    UIntToStr(ratio10 / 10, num);
+    strcat(line, num);
+    strcat(line, ".");
+    UIntToStr(ratio10 % 10, num);
+    strcat(line, num);
+    strcat(line, "x");
+    KLog(line);
+}
+
+// Continues in fn on the stack ending at top; fn never returns
+static void __attribute__((noreturn)) RunOnStack(uint64_t top, void (*fn)()) {
+    __asm__ volatile(
+        "mov %0, %%rsp\n"
+        "xor %%ebp, %%ebp\n"
+        "call *%1\n"
+        : : "r"(top), "r"(fn) : "memory");
+    __builtin_unreachable();
+}
+
+static BootInfo* kernelBootInfo;
+
+// Fast boot brings PS/2 up in a task: the handshake polls the controller,
+// and the compositor draws the first frame in the meantime
+static void Ps2InitTask(void* arg) {
+    InitPs2();
+    BootMark(BOOT_PHASE_MOUSE);
+}
+static uint8_t* kernelStack = NULL;
+
+static void __attribute__((noreturn)) KernelStart();
+
+// Boot services are gone by now. Until the kernel has its own GDT, page
+// tables and stack, boot-services memory is still in use and stays reserved.
+void KernelMain(BootInfo* info) {
+    kernelBootInfo = info;
+    InitBootTime(info);
+    InitBootCpu();
+    InitCpu();
+    InitInterrupts();
+    InitPageAllocator(info);
+    BootMark(BOOT_PHASE_MEMORY);
+    InitAcpi(info->acpiRsdp);
+
+    kernelStack = (uint8_t*)AllocPages(PAGES_FOR(TASK_STACK_SIZE));
+    if(!kernelStack) {
+        KLog("mem: no pages for the kernel stack");
+        KernelStart();
+    }
+    RunOnStack((uint64_t)kernelStack + TASK_STACK_SIZE, KernelStart);
+}
+
+static void KernelStart() {
+    if(kernelStack) ReclaimBootMemory();
+    fb = &kernelBootInfo->framebuffer;
+    frontSurface.pixels = fb->base;
+    frontSurface.width = fb->width;
+    frontSurface.height = fb->height;
+    frontSurface.stride = fb->pixelsPerScanLine;
+    InitScreenSurface();
+    ResetDrawTarget();
+    SelectPresentKernels();
+    InitTimer();
+    BootMark(BOOT_PHASE_TIMER);
+    InitFramebufferMapping();
+    InitSmp(kernelBootInfo->apTrampoline);
+    BootMark(BOOT_PHASE_SMP);
+    InitCursorSprites();
+    InitWindowShadow();
     SetRandomSeed((uint32_t)fb->width * (uint32_t)fb->height + fb->pixelsPerScanLine);
-    int loadDur = 20000 + Random(2000); // Time on srceen 
-    ShowLoadingBar(loadDur);
+    if(!FAST_BOOT) {
+        // Show fake loading bar on boot (5-7 seconds)
+        int loadDur = 5000 + Random(2000); // Time on srceen 
+        ShowLoadingBar(loadDur);
+    }
 
-    InitFAT12();
-    InitMouse();
-    
-    DrawDesktop();
+    InitPci();
+    InitVirtioBlk();
+    InitAhci();
+    InitCache();
+    InitFAT();
+    BootMark(BOOT_PHASE_FAT);
+    if(!FAST_BOOT) {
+        InitPs2();
+        BootMark(BOOT_PHASE_MOUSE);
+    }
     
     CreateWindow(100, 100, 700, 500, "File Browser", COLOR_TITLEBAR_GREEN, 2);
     CreateWindow(150, 150, 700, 500, "Terminal", COLOR_TITLEBAR_BLUE, 1);
@@ -1555,41 +3783,14 @@ void KernelMain(Framebuffer* framebuffer) {
     windows[0].isFocused = 1;
     focusedWindow = 0;
     
-    for(int i = 0; i < windowCount; i++) {
-        DrawWindow(&windows[i]);
-    }
-    
-    DrawTaskbar();
-    SaveCursorBackground(mouseX, mouseY);
-    DrawCursor(mouseX, mouseY, 0);
-    
-    while(1) {
-         
-       static int frameCounter = 0;
-static int needsRedraw = 0;
-
-frameCounter++;
-
-if(frameCounter >= 1000) {
-    frameCounter = 0;
-    for(int i = 0; i < windowCount; i++) {
-        if(windows[i].visible && windows[i].windowType == 4) {
-            TetrisUpdate(&windows[i].tetrisGame);
-            needsRedraw = 1;
-        }
-    }
-}
+    ShowCursor();
+    InvalidateScreen();
 
-if(needsRedraw) {
-    needsRedraw = 0;
-    for(int i = 0; i < windowCount; i++) {
-        if(windows[i].visible && windows[i].windowType == 4) {
-            DrawTetrisBoard(&windows[i], &windows[i].tetrisGame);
-        }
-    }
-}
-        PollMouse();
-        PollKeyboard();
-        for(volatile int i = 0; i < 5000; i++);
-    }
+    InitTasks();
+    StartEventTasks();
+    StartFrameTask();
+    StartCacheTask();
+    if(FAST_BOOT) CreateTask("ps2init", TASK_PRIORITY_NORMAL, Ps2InitTask, NULL);
+    RunIdleTask();
+    while(1) { }
 }
\ No newline at end of file
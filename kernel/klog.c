@@ -0,0 +1,33 @@
+// Kernel boot log. Subsystems report what they found and chose at boot here;
+// the terminal's dmesg command prints it. Keeps the newest KLOG_LINES lines.
+
+#ifndef KLOG_C
+#define KLOG_C
+
+#include "../include/klog.h"
+
+static char klogLines[KLOG_LINES][KLOG_LINE_LENGTH];
+static int klogTotal = 0;
+
+void KLog(const char* text) {
+    char* line = klogLines[klogTotal % KLOG_LINES];
+    int i = 0;
+    while(text[i] && i < KLOG_LINE_LENGTH - 1) {
+        line[i] = text[i];
+        i++;
+    }
+    line[i] = '\0';
+    klogTotal++;
+}
+
+int KLogLineCount() {
+    return klogTotal < KLOG_LINES ? klogTotal : KLOG_LINES;
+}
+
+// Index 0 is the oldest line still kept
+const char* KLogLine(int index) {
+    int first = klogTotal < KLOG_LINES ? 0 : klogTotal - KLOG_LINES;
+    return klogLines[(first + index) % KLOG_LINES];
+}
+
+#endif // KLOG_C
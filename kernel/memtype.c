@@ -0,0 +1,235 @@
+// CPU memory types. UEFI leaves the GOP framebuffer mapped however the
+// firmware liked, often UC, which makes every store to it a full bus
+// transaction. This reprograms one PAT slot to write-combining and builds
+// page tables where the framebuffer range uses it. Everything else keeps
+// the boot identity map's mapping and type (write-back for RAM).
+//
+// The live tables are never written: each table on the path to the
+// framebuffer is copied (or split, for large pages) into a small static pool
+// and CR3 is switched to the copy.
+
+#ifndef MEMTYPE_C
+#define MEMTYPE_C
+
+#include "../include/memtype.h"
+
+#define MSR_MTRRCAP        0xFE
+#define MSR_MTRR_PHYSBASE0 0x200
+#define MSR_MTRR_DEF_TYPE  0x2FF
+#define MSR_PAT            0x277
+
+#define PAGE_PRESENT   0x1ULL
+#define PAGE_PWT       0x8ULL
+#define PAGE_PCD       0x10ULL
+#define PAGE_LARGE     0x80ULL
+#define PAGE_PAT_4K    0x80ULL     // bit 7 is PAT in a 4KB entry, PS elsewhere
+#define PAGE_PAT_LARGE 0x1000ULL
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+static uint64_t ptPool[PT_POOL_PAGES][512] __attribute__((aligned(4096)));
+static int ptPoolUsed = 0;
+static int patReady = 0;
+
+static inline void Cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t ReadCR3() {
+    uint64_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t ReadCR4() {
+    uint64_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+const char* MemTypeName(int type) {
+    switch(type) {
+        case MEMTYPE_UC: return "UC";
+        case MEMTYPE_WC: return "WC";
+        case MEMTYPE_WT: return "WT";
+        case MEMTYPE_WP: return "WP";
+        case MEMTYPE_WB: return "WB";
+        case MEMTYPE_UCM: return "UC-";
+        default: return "?";
+    }
+}
+
+// Sets PAT slot PAT_WC_INDEX to WC. Returns 0 if the CPU has no PAT.
+int InitPat() {
+    uint32_t a, b, c, d;
+    Cpuid(1, &a, &b, &c, &d);
+    if(!(d & (1u << 16))) return 0;
+
+    uint64_t pat = rdmsr(MSR_PAT);
+    pat &= ~(0xFFULL << (PAT_WC_INDEX * 8));
+    pat |= (uint64_t)MEMTYPE_WC << (PAT_WC_INDEX * 8);
+
+    __asm__ volatile("wbinvd" ::: "memory");
+    wrmsr(MSR_PAT, pat);
+    patReady = 1;
+    return 1;
+}
+
+static uint64_t* AllocPageTable() {
+    if(ptPoolUsed == PT_POOL_PAGES) return NULL;
+    return ptPool[ptPoolUsed++];
+}
+
+// Bytes covered by one entry of a table at the given level (4 = PML4)
+static uint64_t LevelSpan(int level) {
+    return 1ULL << (12 + 9 * (level - 1));
+}
+
+// Finds the leaf entry mapping addr in the current tables
+static uint64_t LookupLeaf(uint64_t addr, int* leafLevel) {
+    uint64_t* table = (uint64_t*)(ReadCR3() & PAGE_ADDR_MASK);
+    for(int level = 4; level >= 1; level--) {
+        uint64_t entry = table[(addr / LevelSpan(level)) & 511];
+        if(!(entry & PAGE_PRESENT)) return 0;
+        if(level == 1 || (level <= 3 && (entry & PAGE_LARGE))) {
+            *leafLevel = level;
+            return entry;
+        }
+        table = (uint64_t*)(entry & PAGE_ADDR_MASK);
+    }
+    return 0;
+}
+
+// Memory type the page tables select for addr through the PAT
+int PageMemType(uint64_t addr) {
+    int level;
+    uint64_t entry = LookupLeaf(addr, &level);
+    if(!entry) return MEMTYPE_NONE;
+
+    int patBit = level == 1 ? (entry & PAGE_PAT_4K) != 0 : (entry & PAGE_PAT_LARGE) != 0;
+    int index = (patBit << 2) | (((entry & PAGE_PCD) != 0) << 1) | ((entry & PAGE_PWT) != 0);
+    uint32_t a, b, c, d;
+    Cpuid(1, &a, &b, &c, &d);
+    if(!(d & (1u << 16))) index &= 3;
+    return (int)((rdmsr(MSR_PAT) >> (index * 8)) & 7);
+}
+
+// Memory type the variable (and default) MTRRs give addr. Fixed-range MTRRs
+// only cover the first megabyte and are ignored.
+int MtrrMemType(uint64_t addr) {
+    uint32_t a, b, c, d;
+    Cpuid(1, &a, &b, &c, &d);
+    if(!(d & (1u << 12))) return MEMTYPE_NONE;
+
+    uint64_t defType = rdmsr(MSR_MTRR_DEF_TYPE);
+    if(!(defType & (1 << 11))) return MEMTYPE_UC;
+
+    int count = (int)(rdmsr(MSR_MTRRCAP) & 0xFF);
+    int type = MEMTYPE_NONE;
+    for(int i = 0; i < count; i++) {
+        uint64_t base = rdmsr(MSR_MTRR_PHYSBASE0 + i * 2);
+        uint64_t mask = rdmsr(MSR_MTRR_PHYSBASE0 + i * 2 + 1);
+        if(!(mask & (1 << 11))) continue;
+        mask &= PAGE_ADDR_MASK;
+        if((addr & mask) != (base & mask & PAGE_ADDR_MASK)) continue;
+
+        // Overlapping ranges: UC wins, then WT over WB
+        int rangeType = (int)(base & 0xFF);
+        if(type == MEMTYPE_NONE || rangeType == MEMTYPE_UC ||
+           (rangeType == MEMTYPE_WT && type == MEMTYPE_WB)) {
+            type = rangeType;
+        }
+    }
+    return type == MEMTYPE_NONE ? (int)(defType & 0xFF) : type;
+}
+
+// Gives entry the WC PAT slot, keeping every other attribute
+static uint64_t WithWriteCombining(uint64_t entry, int level) {
+    entry &= ~(PAGE_PCD | PAGE_PWT);
+    return entry | (level == 1 ? PAGE_PAT_4K : PAGE_PAT_LARGE);
+}
+
+// Replaces a large page with a table of the next size down, same mapping
+static uint64_t* SplitLargePage(uint64_t entry, int level) {
+    uint64_t* child = AllocPageTable();
+    if(!child) return NULL;
+
+    uint64_t base = entry & PAGE_ADDR_MASK & ~(LevelSpan(level) - 1);
+    uint64_t flags = entry & ~PAGE_ADDR_MASK;
+    if(level - 1 == 1) {
+        flags &= ~PAGE_LARGE;
+        if(entry & PAGE_PAT_LARGE) flags |= PAGE_PAT_4K;
+    } else if(entry & PAGE_PAT_LARGE) {
+        flags |= PAGE_PAT_LARGE;
+    }
+    for(int i = 0; i < 512; i++) {
+        child[i] = (base + i * LevelSpan(level - 1)) | flags;
+    }
+    return child;
+}
+
+int PageTablesUsed() {
+    return ptPoolUsed;
+}
+
+static uint64_t* CopyPageTable(const uint64_t* table) {
+    uint64_t* copy = AllocPageTable();
+    if(!copy) return NULL;
+    for(int i = 0; i < 512; i++) copy[i] = table[i];
+    return copy;
+}
+
+// Marks [start, end) WC inside table, which maps from tableBase at level.
+// table is already a private copy; children are copied before changing.
+static int MarkRangeWC(uint64_t* table, int level, uint64_t tableBase, uint64_t start, uint64_t end) {
+    uint64_t span = LevelSpan(level);
+    for(int i = 0; i < 512; i++) {
+        uint64_t entryBase = tableBase + i * span;
+        if(entryBase + span <= start || entryBase >= end) continue;
+
+        uint64_t entry = table[i];
+        if(!(entry & PAGE_PRESENT)) continue;
+
+        int leaf = level == 1 || (level <= 3 && (entry & PAGE_LARGE));
+        if(leaf && entryBase >= start && entryBase + span <= end) {
+            table[i] = WithWriteCombining(entry, level);
+            continue;
+        }
+
+        // Partly covered large page, or a table: descend into a private copy
+        uint64_t* child = leaf ? SplitLargePage(entry, level)
+                               : CopyPageTable((const uint64_t*)(entry & PAGE_ADDR_MASK));
+        if(!child) return 0;
+        uint64_t flags = entry & ~PAGE_ADDR_MASK & ~PAGE_LARGE;
+        table[i] = (uint64_t)child | flags;
+        if(!MarkRangeWC(child, level - 1, entryBase, start, end)) return 0;
+    }
+    return 1;
+}
+
+// Maps [base, base + size) write-combining and switches to the new tables.
+// Returns 0 and leaves the firmware tables active if anything is missing.
+int SetRangeWriteCombining(uint64_t base, uint64_t size) {
+    if(!patReady) return 0;
+    if(ReadCR4() & (1 << 12)) return 0;   // 5-level paging, not handled
+
+    uint64_t start = base & ~0xFFFULL;
+    uint64_t end = (base + size + 0xFFF) & ~0xFFFULL;
+
+    ptPoolUsed = 0;
+    uint64_t cr3 = ReadCR3();
+    uint64_t* pml4 = CopyPageTable((const uint64_t*)(cr3 & PAGE_ADDR_MASK));
+    if(!pml4 || !MarkRangeWC(pml4, 4, 0, start, end)) return 0;
+
+    uint64_t newCr3 = (uint64_t)pml4 | (cr3 & 0xFFF);
+    __asm__ volatile("mov %0, %%cr3" : : "r"(newCr3) : "memory");
+
+    // Writing CR3 leaves global translations cached; toggling PGE drops them
+    uint64_t cr4 = ReadCR4();
+    if(cr4 & (1 << 7)) {
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~(1ULL << 7)) : "memory");
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+    return 1;
+}
+
+#endif // MEMTYPE_C
@@ -0,0 +1,167 @@
+// PCI enumeration through the legacy configuration ports 0xCF8/0xCFC,
+// which every PC chipset (and QEMU's pc and q35 machines) still decodes.
+// The scan starts at bus 0 and follows PCI-to-PCI bridges to their
+// secondary buses instead of probing all 256, so it costs a few hundred
+// port accesses. Drivers look devices up in the table afterwards.
+//
+// BARs are left where the firmware put them. 32-bit memory BARs sit below
+// 4 GB, which the kernel identity maps uncached.
+
+#ifndef PCI_C
+#define PCI_C
+
+#include "../include/pci.h"
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+#define PCI_MULTIFUNCTION   0x80
+
+static PciDevice pciDevices[MAX_PCI_DEVICES];
+static int pciDeviceCount = 0;
+
+static uint32_t ConfigAddress(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)device << 11) |
+           ((uint32_t)function << 8) | (offset & 0xFC);
+}
+
+static uint32_t ConfigRead32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, ConfigAddress(bus, device, function, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t PciRead32(const PciDevice* dev, uint8_t offset) {
+    return ConfigRead32(dev->bus, dev->device, dev->function, offset);
+}
+
+uint16_t PciRead16(const PciDevice* dev, uint8_t offset) {
+    return PciRead32(dev, offset) >> ((offset & 2) * 8);
+}
+
+uint8_t PciRead8(const PciDevice* dev, uint8_t offset) {
+    return PciRead32(dev, offset) >> ((offset & 3) * 8);
+}
+
+void PciWrite32(const PciDevice* dev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, ConfigAddress(dev->bus, dev->device, dev->function, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void PciWrite16(const PciDevice* dev, uint8_t offset, uint16_t value) {
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t old = PciRead32(dev, offset);
+    PciWrite32(dev, offset, (old & ~(0xFFFFU << shift)) | ((uint32_t)value << shift));
+}
+
+// Base and size of a BAR; returns 0 for an unimplemented one. Decoding is
+// off while the BAR is sized, so the all-ones probe never hits a device.
+int PciReadBar(const PciDevice* dev, int index, PciBar* out) {
+    uint8_t offset = PCI_BAR0 + index * 4;
+    uint32_t low = PciRead32(dev, offset);
+    uint16_t command = PciRead16(dev, PCI_COMMAND);
+    int is64 = !(low & 1) && ((low >> 1) & 3) == 2;
+
+    PciWrite16(dev, PCI_COMMAND, command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+    PciWrite32(dev, offset, 0xFFFFFFFF);
+    uint32_t mask = PciRead32(dev, offset);
+    PciWrite32(dev, offset, low);
+    uint32_t highMask = 0xFFFFFFFF;
+    uint32_t high = 0;
+    if(is64) {
+        high = PciRead32(dev, offset + 4);
+        PciWrite32(dev, offset + 4, 0xFFFFFFFF);
+        highMask = PciRead32(dev, offset + 4);
+        PciWrite32(dev, offset + 4, high);
+    }
+    PciWrite16(dev, PCI_COMMAND, command);
+
+    out->io = low & 1;
+    if(out->io) {
+        out->base = low & ~3U;
+        out->size = (~(mask & ~3U) + 1) & 0xFFFF;
+    } else {
+        out->base = ((uint64_t)high << 32) | (low & ~0xFU);
+        out->size = ~(((uint64_t)highMask << 32) | (mask & ~0xFU)) + 1;
+    }
+    return out->io ? (mask & ~3U) != 0 : (mask & ~0xFU) != 0;
+}
+
+void PciEnable(const PciDevice* dev, uint16_t command) {
+    PciWrite16(dev, PCI_COMMAND, PciRead16(dev, PCI_COMMAND) | command);
+}
+
+static void ScanBus(uint8_t bus, int depth);
+
+static void AddFunction(uint8_t bus, uint8_t device, uint8_t function, int depth) {
+    uint32_t ids = ConfigRead32(bus, device, function, PCI_VENDOR_ID);
+    if((ids & 0xFFFF) == 0xFFFF) return;
+
+    uint32_t classReg = ConfigRead32(bus, device, function, PCI_CLASS);
+    if(pciDeviceCount < MAX_PCI_DEVICES) {
+        PciDevice* dev = &pciDevices[pciDeviceCount++];
+        dev->bus = bus;
+        dev->device = device;
+        dev->function = function;
+        dev->vendorId = ids & 0xFFFF;
+        dev->deviceId = ids >> 16;
+        dev->classCode = classReg >> 24;
+        dev->subclass = (classReg >> 16) & 0xFF;
+        dev->progIf = (classReg >> 8) & 0xFF;
+        dev->irqLine = ConfigRead32(bus, device, function, PCI_INTERRUPT_LINE) & 0xFF;
+    }
+
+    if((classReg >> 24) == PCI_CLASS_BRIDGE && ((classReg >> 16) & 0xFF) == PCI_SUBCLASS_PCI_BRIDGE) {
+        uint8_t secondary = ConfigRead32(bus, device, function, PCI_SECONDARY_BUS & 0xFC) >> 8;
+        if(secondary > bus && depth < 8) ScanBus(secondary, depth + 1);
+    }
+}
+
+static void ScanBus(uint8_t bus, int depth) {
+    for(uint8_t device = 0; device < 32; device++) {
+        if((ConfigRead32(bus, device, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+        uint8_t headerType = ConfigRead32(bus, device, 0, PCI_HEADER_TYPE & 0xFC) >> 16;
+        int functions = (headerType & PCI_MULTIFUNCTION) ? 8 : 1;
+        for(uint8_t function = 0; function < functions; function++) {
+            AddFunction(bus, device, function, depth);
+        }
+    }
+}
+
+void InitPci() {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    pciDeviceCount = 0;
+    ScanBus(0, 0);
+
+    strcpy(line, "pci: ");
+    IntToStr(pciDeviceCount, num);
+    strcat(line, num);
+    strcat(line, pciDeviceCount == MAX_PCI_DEVICES ? " functions (table full)" : " functions");
+    KLog(line);
+}
+
+// The nth function of a class; progIf -1 matches any
+const PciDevice* PciFindClass(uint8_t classCode, uint8_t subclass, int progIf, int nth) {
+    for(int i = 0; i < pciDeviceCount; i++) {
+        const PciDevice* dev = &pciDevices[i];
+        if(dev->classCode != classCode || dev->subclass != subclass) continue;
+        if(progIf >= 0 && dev->progIf != progIf) continue;
+        if(nth-- == 0) return dev;
+    }
+    return NULL;
+}
+
+const PciDevice* PciFindDevice(uint16_t vendorId, uint16_t deviceId, int nth) {
+    for(int i = 0; i < pciDeviceCount; i++) {
+        const PciDevice* dev = &pciDevices[i];
+        if(dev->vendorId != vendorId || dev->deviceId != deviceId) continue;
+        if(nth-- == 0) return dev;
+    }
+    return NULL;
+}
+
+int GetPciDevices(const PciDevice** out) {
+    *out = pciDevices;
+    return pciDeviceCount;
+}
+
+#endif // PCI_C
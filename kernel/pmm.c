@@ -0,0 +1,266 @@
+// Physical page allocator. The UEFI memory map from the bootloader says
+// which RAM is free; from then on one bit per 4 KB page tracks it (set =
+// in use), and runs of pages are found by a next-fit scan that skips full
+// bitmap words. Memory below 1 MB is left alone.
+//
+// Boot-services memory still holds the firmware's page tables and the stack
+// KernelMain started on, so it stays marked used until ReclaimBootMemory().
+// Before that, InitPageAllocator() builds the kernel's own identity map out
+// of free pages: 2 MB pages up to the top of RAM (at least 4 GB, for MMIO),
+// write-back where the map has RAM and uncached elsewhere.
+
+#ifndef PMM_C
+#define PMM_C
+
+#include "../include/pmm.h"
+
+#define PAGE_WRITE      0x2ULL
+#define PMM_LOW_LIMIT   0x100000
+#define PMM_NOT_FOUND   ~0ULL
+#define LARGE_PAGE_SIZE 0x200000ULL
+#define GIGABYTE        0x40000000ULL
+#define IDENTITY_MAP_MAX (512 * GIGABYTE)
+
+static uint64_t* pageBitmap = NULL;
+static uint64_t bitmapWords = 0;
+static uint64_t pageLimit = 0;          // pages the bitmap covers, from address 0
+static uint64_t searchHint = 0;
+static PageStats pageStats;
+static const BootInfo* memoryBootInfo = NULL;
+
+static const BootMemoryDescriptor* MemoryDescriptor(const BootInfo* info, uint64_t i) {
+    return (const BootMemoryDescriptor*)(info->memoryMap + i * info->descriptorSize);
+}
+
+static uint64_t MemoryDescriptorCount(const BootInfo* info) {
+    return info->descriptorSize ? info->memoryMapSize / info->descriptorSize : 0;
+}
+
+// Memory the kernel may eventually own
+static int IsUsableRam(uint32_t type) {
+    return type == BOOT_MEM_CONVENTIONAL || type == BOOT_MEM_BOOT_CODE ||
+           type == BOOT_MEM_BOOT_DATA || type == BOOT_MEM_LOADER_CODE ||
+           type == BOOT_MEM_LOADER_DATA;
+}
+
+// RAM of any kind, for the identity map's caching
+static int IsRam(uint32_t type) {
+    return IsUsableRam(type) || type == BOOT_MEM_RUNTIME_CODE ||
+           type == BOOT_MEM_RUNTIME_DATA || type == BOOT_MEM_ACPI_RECLAIM ||
+           type == BOOT_MEM_ACPI_NVS;
+}
+
+static inline int PageUsed(uint64_t page) {
+    return (pageBitmap[page >> 6] >> (page & 63)) & 1;
+}
+
+// Sets or clears the bits for [first, first + count) and returns how many
+// actually changed, so double frees and overlapping map entries do not
+// skew the counts
+static uint64_t MarkPages(uint64_t first, uint64_t count, int used) {
+    uint64_t changed = 0;
+    if(first >= pageLimit) return 0;
+    if(first + count > pageLimit) count = pageLimit - first;
+
+    for(uint64_t page = first; page < first + count; page++) {
+        uint64_t bit = 1ULL << (page & 63);
+        uint64_t* word = &pageBitmap[page >> 6];
+        if(((*word & bit) != 0) != used) {
+            *word ^= bit;
+            changed++;
+        }
+    }
+    return changed;
+}
+
+static void FreeRange(uint64_t start, uint64_t pages) {
+    uint64_t end = start + pages * PAGE_SIZE;
+    if(start < PMM_LOW_LIMIT) start = PMM_LOW_LIMIT;
+    if(end <= start) return;
+    pageStats.freePages += MarkPages(start / PAGE_SIZE, (end - start) / PAGE_SIZE, 0);
+}
+
+static uint64_t FindFreeRun(uint64_t from, uint64_t to, uint64_t count) {
+    uint64_t run = 0;
+    for(uint64_t page = from; page < to; page++) {
+        if((page & 63) == 0 && pageBitmap[page >> 6] == ~0ULL) {
+            run = 0;
+            page += 63;
+            continue;
+        }
+        if(PageUsed(page)) {
+            run = 0;
+            continue;
+        }
+        if(++run == count) return page + 1 - count;
+    }
+    return PMM_NOT_FOUND;
+}
+
+void* AllocPages(uint64_t count) {
+    if(count == 0 || !pageBitmap) return NULL;
+
+    uint64_t first = FindFreeRun(searchHint, pageLimit, count);
+    if(first == PMM_NOT_FOUND) first = FindFreeRun(0, pageLimit, count);
+    if(first == PMM_NOT_FOUND) {
+        pageStats.failures++;
+        return NULL;
+    }
+
+    MarkPages(first, count, 1);
+    searchHint = first + count;
+    pageStats.freePages -= count;
+    pageStats.allocations++;
+    uint64_t used = pageStats.totalPages - pageStats.freePages;
+    if(used > pageStats.peakUsedPages) pageStats.peakUsedPages = used;
+    return (void*)(first * PAGE_SIZE);
+}
+
+void* AllocZeroedPages(uint64_t count) {
+    void* pages = AllocPages(count);
+    if(pages) MemSet(pages, 0, count * PAGE_SIZE);
+    return pages;
+}
+
+void FreePages(void* addr, uint64_t count) {
+    if(!addr || count == 0) return;
+    uint64_t first = (uint64_t)addr / PAGE_SIZE;
+    pageStats.freePages += MarkPages(first, count, 0);
+    pageStats.frees++;
+    if(first < searchHint) searchHint = first;
+}
+
+// 2 MB identity map of [0, top). Large pages holding any RAM are write-back,
+// the rest uncached; the MTRRs still have the last word either way.
+static int BuildKernelPageTables(const BootInfo* info, uint64_t top) {
+    uint64_t gigabytes = (top + GIGABYTE - 1) / GIGABYTE;
+    uint64_t* pml4 = (uint64_t*)AllocZeroedPages(1);
+    uint64_t* pdpt = (uint64_t*)AllocZeroedPages(1);
+    uint64_t* pd = (uint64_t*)AllocZeroedPages(gigabytes);
+    if(!pml4 || !pdpt || !pd) return 0;
+    pageStats.tablePages = 2 + gigabytes;
+
+    uint64_t largePages = gigabytes * 512;
+    for(uint64_t i = 0; i < largePages; i++) {
+        pd[i] = (i * LARGE_PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | PAGE_PCD | PAGE_PWT;
+    }
+    for(uint64_t i = 0; i < MemoryDescriptorCount(info); i++) {
+        const BootMemoryDescriptor* d = MemoryDescriptor(info, i);
+        if(!IsRam(d->type)) continue;
+        uint64_t first = d->physicalStart / LARGE_PAGE_SIZE;
+        uint64_t last = (d->physicalStart + d->pageCount * PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+        for(uint64_t p = first; p <= last && p < largePages; p++) {
+            pd[p] &= ~(PAGE_PCD | PAGE_PWT);
+        }
+    }
+    for(uint64_t g = 0; g < gigabytes; g++) {
+        pdpt[g] = (uint64_t)&pd[g * 512] | PAGE_PRESENT | PAGE_WRITE;
+    }
+    pml4[0] = (uint64_t)pdpt | PAGE_PRESENT | PAGE_WRITE;
+
+    __asm__ volatile("mov %0, %%cr3" : : "r"((uint64_t)pml4) : "memory");
+    uint64_t cr4 = ReadCR4();
+    if(cr4 & (1 << 7)) {
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~(1ULL << 7)) : "memory");
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+    return 1;
+}
+
+void InitPageAllocator(const BootInfo* info) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    uint64_t count = MemoryDescriptorCount(info);
+    uint64_t ramTop = 0;
+    uint64_t mapTop = 4 * GIGABYTE;
+    memoryBootInfo = info;
+
+    for(uint64_t i = 0; i < count; i++) {
+        const BootMemoryDescriptor* d = MemoryDescriptor(info, i);
+        uint64_t end = d->physicalStart + d->pageCount * PAGE_SIZE;
+        if(IsUsableRam(d->type) && end > ramTop) ramTop = end;
+        if(end > mapTop) mapTop = end;
+    }
+    uint64_t fbEnd = (uint64_t)info->framebuffer.base +
+                     info->framebuffer.pixelsPerScanLine * info->framebuffer.height * sizeof(uint32_t);
+    if(fbEnd > mapTop) mapTop = fbEnd;
+    if(mapTop > IDENTITY_MAP_MAX) mapTop = IDENTITY_MAP_MAX;
+    if(ramTop > mapTop) ramTop = mapTop;
+
+    // The bitmap goes in the first free range above 1 MB big enough for it
+    pageLimit = ramTop / PAGE_SIZE;
+    bitmapWords = (pageLimit + 63) / 64;
+    uint64_t bitmapPages = PAGES_FOR(bitmapWords * sizeof(uint64_t));
+    for(uint64_t i = 0; i < count && !pageBitmap; i++) {
+        const BootMemoryDescriptor* d = MemoryDescriptor(info, i);
+        uint64_t start = d->physicalStart < PMM_LOW_LIMIT ? PMM_LOW_LIMIT : d->physicalStart;
+        uint64_t end = d->physicalStart + d->pageCount * PAGE_SIZE;
+        if(d->type == BOOT_MEM_CONVENTIONAL && end > start && (end - start) / PAGE_SIZE >= bitmapPages) {
+            pageBitmap = (uint64_t*)start;
+        }
+    }
+    if(!pageBitmap) {
+        KLog("mem: no room for the page bitmap");
+        return;
+    }
+
+    for(uint64_t i = 0; i < bitmapWords; i++) pageBitmap[i] = ~0ULL;
+    for(uint64_t i = 0; i < count; i++) {
+        const BootMemoryDescriptor* d = MemoryDescriptor(info, i);
+        if(IsUsableRam(d->type)) pageStats.totalPages += d->pageCount;
+        if(d->type == BOOT_MEM_CONVENTIONAL) FreeRange(d->physicalStart, d->pageCount);
+    }
+    pageStats.freePages -= MarkPages((uint64_t)pageBitmap / PAGE_SIZE, bitmapPages, 1);
+    pageStats.bitmapPages = bitmapPages;
+
+    if(!BuildKernelPageTables(info, mapTop)) {
+        KLog("mem: out of pages for the kernel page tables");
+    }
+
+    strcpy(line, "mem: ");
+    UIntToStr(count, num);
+    strcat(line, num);
+    strcat(line, " map entries, ");
+    UIntToStr(pageStats.totalPages * PAGE_SIZE / (1024 * 1024), num);
+    strcat(line, num);
+    strcat(line, " MB RAM, ");
+    UIntToStr(pageStats.freePages * PAGE_SIZE / (1024 * 1024), num);
+    strcat(line, num);
+    strcat(line, " MB free, identity map to ");
+    UIntToStr(mapTop / GIGABYTE, num);
+    strcat(line, num);
+    strcat(line, " GB");
+    KLog(line);
+}
+
+// Hands boot-services code and data to the allocator. Only safe once the
+// kernel runs on its own stack, GDT and page tables.
+void ReclaimBootMemory() {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    if(!pageBitmap) return;
+
+    uint64_t before = pageStats.freePages;
+    for(uint64_t i = 0; i < MemoryDescriptorCount(memoryBootInfo); i++) {
+        const BootMemoryDescriptor* d = MemoryDescriptor(memoryBootInfo, i);
+        if(d->type == BOOT_MEM_BOOT_CODE || d->type == BOOT_MEM_BOOT_DATA) {
+            FreeRange(d->physicalStart, d->pageCount);
+        }
+    }
+    pageStats.reclaimedPages = pageStats.freePages - before;
+
+    strcpy(line, "mem: reclaimed ");
+    UIntToStr(pageStats.reclaimedPages * PAGE_SIZE / 1024, num);
+    strcat(line, num);
+    strcat(line, " KB of boot-services memory, ");
+    UIntToStr(pageStats.freePages * PAGE_SIZE / (1024 * 1024), num);
+    strcat(line, num);
+    strcat(line, " MB free");
+    KLog(line);
+}
+
+void GetPageStats(PageStats* out) {
+    *out = pageStats;
+}
+
+#endif // PMM_C
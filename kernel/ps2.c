@@ -0,0 +1,187 @@
+// PS/2 keyboard and mouse. The controller raises IRQ1 for keyboard bytes and
+// IRQ12 for mouse bytes, so each handler knows which device a byte is from.
+// The handlers timestamp what they read and push it into a single-producer,
+// single-consumer ring per device. The input task drains both rings in
+// timestamp order into the event queue, so a busy system delays input
+// until the ring fills; after that new events are dropped and counted in
+// ps2Stats.dropped. Each push wakes the input task.
+
+#ifndef PS2_C
+#define PS2_C
+
+#include "../include/ps2.h"
+
+// Only the interrupt handler moves head and only ProcessInput moves tail.
+// Indices run freely and are masked on use.
+typedef struct {
+    Ps2Event events[PS2_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} Ps2Ring;
+
+static Ps2Ring keyRing;
+static Ps2Ring mouseRing;
+static Ps2Stats ps2Stats;
+
+static void Ps2RingPush(Ps2Ring* ring, const Ps2Event* ev) {
+    uint32_t head = ring->head;
+    uint32_t depth = head - ring->tail;
+    if(depth >= PS2_RING_SIZE) {
+        ps2Stats.dropped++;
+        return;
+    }
+    ring->events[head & (PS2_RING_SIZE - 1)] = *ev;
+    __asm__ volatile("" : : : "memory");   // slot before index; x86 keeps store order
+    ring->head = head + 1;
+    if(depth + 1 > ps2Stats.maxDepth) ps2Stats.maxDepth = depth + 1;
+}
+
+static Ps2Event* Ps2RingPeek(Ps2Ring* ring) {
+    uint32_t tail = ring->tail;
+    if(tail == ring->head) return NULL;
+    __asm__ volatile("" : : : "memory");
+    return &ring->events[tail & (PS2_RING_SIZE - 1)];
+}
+
+static void Ps2RingDrop(Ps2Ring* ring) {
+    __asm__ volatile("" : : : "memory");   // done reading the slot
+    ring->tail = ring->tail + 1;
+}
+
+static void KeyboardInterrupt(InterruptFrame* frame) {
+    uint8_t status = inb(PS2_STATUS);
+    if((status & 0x01) && !(status & 0x20)) {
+        Ps2Event ev;
+        ev.timeUs = ClockUs();
+        ev.bytes[0] = inb(PS2_DATA);
+        ev.bytes[1] = 0;
+        ev.bytes[2] = 0;
+        Ps2RingPush(&keyRing, &ev);
+        WakeInputTask();
+    }
+    PicEoi(IRQ_KEYBOARD);
+}
+
+static void MouseInterrupt(InterruptFrame* frame) {
+    static uint8_t packet[3];
+    static int cycle = 0;
+
+    uint8_t status = inb(PS2_STATUS);
+    if((status & 0x21) == 0x21) {
+        uint8_t data = inb(PS2_DATA);
+        if(cycle == 0 && !(data & 0x08)) {
+            // Bit 3 is always set in the first byte of a packet
+            ps2Stats.resyncs++;
+        } else {
+            packet[cycle++] = data;
+            if(cycle == 3) {
+                Ps2Event ev;
+                ev.timeUs = ClockUs();
+                ev.bytes[0] = packet[0];
+                ev.bytes[1] = packet[1];
+                ev.bytes[2] = packet[2];
+                Ps2RingPush(&mouseRing, &ev);
+                WakeInputTask();
+                cycle = 0;
+            }
+        }
+    }
+    PicEoi(IRQ_MOUSE);
+}
+
+static int Ps2WaitWrite() {
+    uint64_t end = ClockUs() + PS2_TIMEOUT_US;
+    while(inb(PS2_STATUS) & 0x02) {
+        if(ClockUs() > end) return 0;
+    }
+    return 1;
+}
+
+static int Ps2WaitRead() {
+    uint64_t end = ClockUs() + PS2_TIMEOUT_US;
+    while(!(inb(PS2_STATUS) & 0x01)) {
+        if(ClockUs() > end) return 0;
+    }
+    return 1;
+}
+
+static void Ps2Write(uint16_t port, uint8_t value) {
+    Ps2WaitWrite();
+    outb(port, value);
+}
+
+static uint8_t Ps2Read() {
+    if(!Ps2WaitRead()) return 0;
+    return inb(PS2_DATA);
+}
+
+static void Ps2Flush() {
+    for(int i = 0; i < 32 && (inb(PS2_STATUS) & 0x01); i++) {
+        inb(PS2_DATA);
+    }
+}
+
+// Sends a command to the mouse and eats its ACK
+static void MouseCommand(uint8_t command) {
+    Ps2Write(PS2_COMMAND, 0xD4);
+    Ps2Write(PS2_DATA, command);
+    Ps2Read();
+}
+
+void InitPs2() {
+    Ps2Write(PS2_COMMAND, 0xA8);            // enable the aux (mouse) port
+    Ps2Flush();
+
+    Ps2Write(PS2_COMMAND, 0x20);
+    uint8_t config = Ps2Read() | 0x03;      // IRQ1 and IRQ12 on
+    Ps2Write(PS2_COMMAND, 0x60);
+    Ps2Write(PS2_DATA, config);
+
+    MouseCommand(0xF6);                     // defaults
+    MouseCommand(0xF4);                     // start streaming
+    Ps2Flush();
+
+    SetInterruptHandler(VECTOR_IRQ_BASE + IRQ_KEYBOARD, KeyboardInterrupt);
+    SetInterruptHandler(VECTOR_IRQ_BASE + IRQ_MOUSE, MouseInterrupt);
+    PicUnmask(IRQ_KEYBOARD);
+    PicUnmask(IRQ_MOUSE);
+    KLog("ps2: keyboard on IRQ1, mouse on IRQ12");
+}
+
+// Posts every queued scancode and packet to the event queue, oldest first
+// across both devices. Returns the number taken off the rings.
+int ProcessInput() {
+    int handled = 0;
+    while(1) {
+        Ps2Event* key = Ps2RingPeek(&keyRing);
+        Ps2Event* mouse = Ps2RingPeek(&mouseRing);
+        if(!key && !mouse) break;
+
+        int isKey = key && (!mouse || key->timeUs <= mouse->timeUs);
+        Ps2Event ev = isKey ? *key : *mouse;
+        Ps2RingDrop(isKey ? &keyRing : &mouseRing);
+
+        uint32_t latency = ClockUs() - ev.timeUs;   // time spent in the ring
+        ps2Stats.lastLatencyUs = latency;
+        if(latency > ps2Stats.maxLatencyUs) ps2Stats.maxLatencyUs = latency;
+
+        if(isKey) {
+            ps2Stats.keyEvents++;
+            PostKeyScancode(ev.bytes[0], ev.timeUs);
+        } else {
+            ps2Stats.mousePackets++;
+            // 9-bit deltas: the sign bits live in the first byte
+            int dx = ev.bytes[1] - ((ev.bytes[0] << 4) & 0x100);
+            int dy = ev.bytes[2] - ((ev.bytes[0] << 3) & 0x100);
+            PostMousePacket(dx, -dy, ev.bytes[0] & 0x07, ev.timeUs);
+        }
+        handled++;
+    }
+    return handled;
+}
+
+void GetPs2Stats(Ps2Stats* out) {
+    *out = ps2Stats;
+}
+
+#endif // PS2_C
@@ -0,0 +1,98 @@
+// Rect and region arithmetic for the compositor's visibility and clip code.
+
+#ifndef REGION_C
+#define REGION_C
+
+#include "../include/region.h"
+
+static int RectArea(const Rect* r) {
+    return r->w * r->h;
+}
+
+static int RectIntersect(const Rect* a, const Rect* b, Rect* out) {
+    int x0 = a->x > b->x ? a->x : b->x;
+    int y0 = a->y > b->y ? a->y : b->y;
+    int x1 = (a->x + a->w < b->x + b->w) ? a->x + a->w : b->x + b->w;
+    int y1 = (a->y + a->h < b->y + b->h) ? a->y + a->h : b->y + b->h;
+    if(x0 >= x1 || y0 >= y1) return 0;
+    if(out) {
+        out->x = x0;
+        out->y = y0;
+        out->w = x1 - x0;
+        out->h = y1 - y0;
+    }
+    return 1;
+}
+
+static void RectUnion(const Rect* a, const Rect* b, Rect* out) {
+    int x0 = a->x < b->x ? a->x : b->x;
+    int y0 = a->y < b->y ? a->y : b->y;
+    int x1 = (a->x + a->w > b->x + b->w) ? a->x + a->w : b->x + b->w;
+    int y1 = (a->y + a->h > b->y + b->h) ? a->y + a->h : b->y + b->h;
+    out->x = x0;
+    out->y = y0;
+    out->w = x1 - x0;
+    out->h = y1 - y0;
+}
+
+void RegionSet(Region* region, const Rect* rect) {
+    region->count = 0;
+    if(rect->w > 0 && rect->h > 0) region->rects[region->count++] = *rect;
+}
+
+// Removes cut from the region. Each rect it crosses splits into up to four
+// bands (above, below, left, right). If the result would not fit the region
+// is left untouched, a superset, and 0 is returned; callers draw back to
+// front so a superset only costs overdraw.
+int RegionSubtract(Region* region, const Rect* cut) {
+    Rect out[MAX_REGION_RECTS];
+    int count = 0;
+
+    for(int i = 0; i < region->count; i++) {
+        const Rect* r = &region->rects[i];
+        Rect hit;
+        if(!RectIntersect(r, cut, &hit)) {
+            if(count == MAX_REGION_RECTS) return 0;
+            out[count++] = *r;
+            continue;
+        }
+
+        Rect pieces[4];
+        int n = 0;
+        if(hit.y > r->y) {
+            pieces[n].x = r->x; pieces[n].y = r->y;
+            pieces[n].w = r->w; pieces[n].h = hit.y - r->y;
+            n++;
+        }
+        if(hit.y + hit.h < r->y + r->h) {
+            pieces[n].x = r->x; pieces[n].y = hit.y + hit.h;
+            pieces[n].w = r->w; pieces[n].h = r->y + r->h - (hit.y + hit.h);
+            n++;
+        }
+        if(hit.x > r->x) {
+            pieces[n].x = r->x; pieces[n].y = hit.y;
+            pieces[n].w = hit.x - r->x; pieces[n].h = hit.h;
+            n++;
+        }
+        if(hit.x + hit.w < r->x + r->w) {
+            pieces[n].x = hit.x + hit.w; pieces[n].y = hit.y;
+            pieces[n].w = r->x + r->w - (hit.x + hit.w); pieces[n].h = hit.h;
+            n++;
+        }
+
+        if(count + n > MAX_REGION_RECTS) return 0;
+        for(int j = 0; j < n; j++) out[count++] = pieces[j];
+    }
+
+    region->count = count;
+    for(int i = 0; i < count; i++) region->rects[i] = out[i];
+    return 1;
+}
+
+int RegionArea(const Region* region) {
+    int area = 0;
+    for(int i = 0; i < region->count; i++) area += RectArea(&region->rects[i]);
+    return area;
+}
+
+#endif // REGION_C
@@ -0,0 +1,403 @@
+// Multiprocessor bring-up. The MADT lists the local APIC of every enabled
+// processor; each application processor (AP) gets INIT-SIPI-SIPI and starts
+// in real mode at a trampoline copied to the page the bootloader reserved
+// below 1 MB. The trampoline goes through protected mode straight into long
+// mode on the boot CPU's page tables and jumps to ApMain() on the AP's own
+// stack, which loads the kernel GDT and IDT and points GS at the AP's PerCpu.
+//
+// Tasks only run on the boot CPU. The APs sit halted until SmpRun() hands
+// out a job: a function and an item count. Every core taking part claims
+// items with an atomic counter, so the caller does its share as well and
+// returns once all items are done.
+
+#ifndef SMP_C
+#define SMP_C
+
+#include "../include/smp.h"
+
+#define MSR_EFER            0xC0000080
+#define MSR_GS_BASE         0xC0000101
+#define EFER_CARRY_MASK     0x901          // SCE, LME, NXE
+#define CR4_PCIDE           (1 << 17)      // may only be set in long mode
+#define CR4_OSXSAVE         (1 << 18)
+#define AP_START_TIMEOUT_US 100000
+#define SMP_JOB_CLOSED      0x40000000
+
+// Values the trampoline loads, in the order of the quads at apParams
+typedef struct {
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t arg;
+} ApParams;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) DescriptorPointer;
+
+// Boot CPU state every AP copies once it is in long mode
+typedef struct {
+    DescriptorPointer gdtr;
+    DescriptorPointer idtr;
+    uint16_t cs;
+    uint16_t ds;
+    uint64_t pat;
+    uint64_t xcr0;              // 0 when XSAVE is off
+} ApBootState;
+
+typedef struct {
+    SmpWorkFn fn;
+    void* arg;
+    int count;
+    int cores;
+    volatile int next;          // next item to claim, SMP_JOB_CLOSED between jobs
+    volatile int done;
+    volatile uint32_t generation;
+} SmpJob;
+
+static PerCpu cpus[MAX_CPUS];
+static int cpuCount = 1;
+static ApBootState apBoot;
+static SmpJob smpJob = { NULL, NULL, 0, 0, SMP_JOB_CLOSED, 0, 0 };
+static SmpStats smpStats;
+static uint64_t apTrampolinePage = 0;
+
+static void ApMain(PerCpu* cpu) __attribute__((used, noreturn));
+
+// Runs at page:0 in real mode, so every address is an offset from
+// apTrampoline, with EBX holding the page address once it is known.
+// The far jump pointers and the GDT pointer base are patched in
+// PrepareTrampoline(), the stack and argument per AP in StartAp().
+__asm__(
+    ".pushsection .text\n"
+    ".align 16\n"
+    ".code16\n"
+    "apTrampoline:\n"
+    "    cli\n"
+    "    cld\n"
+    "    xorl %ebx, %ebx\n"
+    "    movw %cs, %bx\n"
+    "    movw %bx, %ds\n"
+    "    shll $4, %ebx\n"
+    "    lgdtl (apGdtPointer - apTrampoline)\n"
+    "    movl %cr0, %eax\n"
+    "    orl $1, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *(apJump32 - apTrampoline)\n"
+    ".code32\n"
+    "apProtected:\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movl (apParams - apTrampoline + 16)(%ebx), %eax\n"
+    "    movl %eax, %cr4\n"
+    "    movl (apParams - apTrampoline + 8)(%ebx), %eax\n"
+    "    movl %eax, %cr3\n"
+    "    movl $0xC0000080, %ecx\n"
+    "    movl (apParams - apTrampoline + 24)(%ebx), %eax\n"
+    "    xorl %edx, %edx\n"
+    "    wrmsr\n"
+    "    movl (apParams - apTrampoline)(%ebx), %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *(apJump64 - apTrampoline)(%ebx)\n"
+    ".code64\n"
+    "apLong:\n"
+    "    movl %ebx, %ebx\n"
+    "    movq (apParams - apTrampoline + 32)(%rbx), %rsp\n"
+    "    movq (apParams - apTrampoline + 48)(%rbx), %rdi\n"
+    "    jmpq *(apParams - apTrampoline + 40)(%rbx)\n"
+    ".align 8\n"
+    "apGdt:\n"
+    "    .quad 0\n"
+    "    .quad 0x00CF9A000000FFFF\n"      // 0x08 32-bit code
+    "    .quad 0x00CF92000000FFFF\n"      // 0x10 data
+    "    .quad 0x00AF9A000000FFFF\n"      // 0x18 64-bit code
+    "apGdtPointer:\n"
+    "    .word 31\n"
+    "    .long 0\n"
+    "apJump32:\n"
+    "    .long 0\n"
+    "    .word 0x08\n"
+    "apJump64:\n"
+    "    .long 0\n"
+    "    .word 0x18\n"
+    ".align 8\n"
+    "apParams:\n"
+    "    .fill 7, 8, 0\n"
+    "apTrampolineEnd:\n"
+    ".popsection\n"
+);
+
+#define TRAMPOLINE_LABEL(name, out) __asm__ volatile("lea " #name "(%%rip), %0" : "=r"(out))
+
+// Items are claimed until they run out, or until the caller's core limit
+// says this CPU should not take part
+static void SmpWork(PerCpu* cpu) {
+    while(cpu->index < smpJob.cores) {
+        int item = __atomic_fetch_add(&smpJob.next, 1, __ATOMIC_ACQ_REL);
+        if(item >= smpJob.count) break;
+        smpJob.fn(item, smpJob.arg);
+        cpu->items++;
+        __atomic_fetch_add(&smpJob.done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void SmpWakeInterrupt(InterruptFrame* frame) {
+    (void)frame;
+    ThisCpu()->wakeups++;
+    LapicEoi();
+}
+
+// Interrupts stay off between checking for a job and halting, so a wakeup
+// IPI sent in between is held pending and ends the hlt right away
+static void __attribute__((noinline, noreturn)) ApIdle(PerCpu* cpu) {
+    uint32_t seen = smpJob.generation;
+    ResetDrawTarget();
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+
+    while(1) {
+        __asm__ volatile("cli");
+        if(smpJob.generation == seen) {
+            __asm__ volatile("sti; hlt");
+            continue;
+        }
+        seen = smpJob.generation;
+        __asm__ volatile("sti");
+        SmpWork(cpu);
+    }
+}
+
+static void ApMain(PerCpu* cpu) {
+    // Leave the trampoline's GDT for the kernel's, reloading CS by far return
+    __asm__ volatile(
+        "lgdt %0\n"
+        "pushq %1\n"
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "movw %w2, %%ds\n"
+        "movw %w2, %%es\n"
+        "movw %w2, %%ss\n"
+        "lidt %3\n"
+        : : "m"(apBoot.gdtr), "r"((uint64_t)apBoot.cs), "r"((uint64_t)apBoot.ds), "m"(apBoot.idtr)
+        : "rax", "memory");
+
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_PAT, apBoot.pat);
+    if(apBoot.xcr0) {
+        __asm__ volatile("xsetbv" : : "c"(0), "a"((uint32_t)apBoot.xcr0),
+                         "d"((uint32_t)(apBoot.xcr0 >> 32)));
+    }
+    InitLapicAp();
+    ApIdle(cpu);
+}
+
+// Called first thing in KernelMain, before anything looks at ThisCpu()
+void InitBootCpu() {
+    cpus[0].self = &cpus[0];
+    cpus[0].index = 0;
+    cpus[0].online = 1;
+    wrmsr(MSR_GS_BASE, (uint64_t)&cpus[0]);
+}
+
+static void SaveBootState() {
+    __asm__ volatile("sgdt %0" : "=m"(apBoot.gdtr));
+    __asm__ volatile("sidt %0" : "=m"(apBoot.idtr));
+    __asm__ volatile("mov %%cs, %0" : "=r"(apBoot.cs));
+    __asm__ volatile("mov %%ds, %0" : "=r"(apBoot.ds));
+    apBoot.pat = rdmsr(MSR_PAT);
+    apBoot.xcr0 = 0;
+    if(ReadCR4() & CR4_OSXSAVE) {
+        uint32_t lo, hi;
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        apBoot.xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+}
+
+// Copies the trampoline to its page and fills in everything but the stack
+// and the PerCpu argument. Returns 0 if the page tables are out of reach of
+// the trampoline's 32-bit CR3 load.
+static int PrepareTrampoline() {
+    uint8_t *start, *end, *gdt, *gdtPointer, *jump32, *jump64, *protectedEntry, *longEntry, *params;
+    TRAMPOLINE_LABEL(apTrampoline, start);
+    TRAMPOLINE_LABEL(apTrampolineEnd, end);
+    TRAMPOLINE_LABEL(apGdt, gdt);
+    TRAMPOLINE_LABEL(apGdtPointer, gdtPointer);
+    TRAMPOLINE_LABEL(apJump32, jump32);
+    TRAMPOLINE_LABEL(apJump64, jump64);
+    TRAMPOLINE_LABEL(apProtected, protectedEntry);
+    TRAMPOLINE_LABEL(apLong, longEntry);
+    TRAMPOLINE_LABEL(apParams, params);
+
+    uint64_t cr0, cr3 = ReadCR3();
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    if(cr3 >> 32) return 0;
+
+    uint8_t* page = (uint8_t*)apTrampolinePage;
+    for(uint8_t* p = start; p < end; p++) page[p - start] = *p;
+
+    uint32_t base = (uint32_t)apTrampolinePage;
+    *(uint32_t*)(page + (gdtPointer - start) + 2) = base + (uint32_t)(gdt - start);
+    *(uint32_t*)(page + (jump32 - start)) = base + (uint32_t)(protectedEntry - start);
+    *(uint32_t*)(page + (jump64 - start)) = base + (uint32_t)(longEntry - start);
+
+    ApParams* ap = (ApParams*)(page + (params - start));
+    ap->cr0 = cr0 & 0xFFFFFFFF;
+    ap->cr3 = cr3;
+    ap->cr4 = ReadCR4() & ~(uint64_t)CR4_PCIDE;
+    ap->efer = rdmsr(MSR_EFER) & EFER_CARRY_MASK;
+    ap->entry = (uint64_t)ApMain;
+    return 1;
+}
+
+static ApParams* TrampolineParams() {
+    uint8_t *start, *params;
+    TRAMPOLINE_LABEL(apTrampoline, start);
+    TRAMPOLINE_LABEL(apParams, params);
+    return (ApParams*)(apTrampolinePage + (params - start));
+}
+
+static int WaitOnline(PerCpu* cpu, uint64_t timeoutUs) {
+    uint64_t deadline = ClockUs() + timeoutUs;
+    while(ClockUs() < deadline) {
+        if(__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) return 1;
+        __asm__ volatile("pause");
+    }
+    return __atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE);
+}
+
+// INIT, 10 ms, then up to two SIPIs. The AP only sets online after it has
+// left the trampoline, so the page is free for the next one afterwards.
+static int StartAp(uint32_t apicId) {
+    PerCpu* cpu = &cpus[cpuCount];
+    cpu->self = cpu;
+    cpu->index = cpuCount;
+    cpu->apicId = apicId;
+    cpu->online = 0;
+    uint8_t* stack = (uint8_t*)AllocPages(PAGES_FOR(SMP_STACK_SIZE));
+    if(!stack) return 0;
+    cpu->stackTop = (uint64_t)stack + SMP_STACK_SIZE;
+
+    ApParams* params = TrampolineParams();
+    params->stack = cpu->stackTop - 8;          // as if ApMain had been called
+    params->arg = (uint64_t)cpu;
+
+    uint32_t vector = (uint32_t)(apTrampolinePage >> 12);
+    LapicSendIpi(apicId, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    SleepUs(10000);
+    for(int i = 0; i < 2; i++) {
+        LapicSendIpi(apicId, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | vector);
+        if(WaitOnline(cpu, 200)) break;
+    }
+    if(!WaitOnline(cpu, AP_START_TIMEOUT_US)) return 0;
+    cpuCount++;
+    return 1;
+}
+
+// trampolinePage is the page below 1 MB the bootloader set aside, or 0
+int InitSmp(uint64_t trampolinePage) {
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+    apTrampolinePage = trampolinePage;
+
+    cpus[0].apicId = LapicId();
+    strcpy(line, "smp: cpu 0 apic ");
+    UIntToStr(cpus[0].apicId, num);
+    strcat(line, num);
+    strcat(line, " online (boot)");
+    KLog(line);
+
+    const MadtInfo* madt = GetMadtInfo();
+    if(!LapicPresent() || !madt || madt->cpuCount < 2) {
+        KLog("smp: 1 cpu");
+        return 1;
+    }
+    if(!apTrampolinePage || apTrampolinePage >= 0x100000) {
+        KLog("smp: no trampoline page below 1 MB, 1 cpu");
+        return 1;
+    }
+
+    SaveBootState();
+    if(!PrepareTrampoline()) {
+        KLog("smp: page tables above 4 GB, 1 cpu");
+        return 1;
+    }
+    SetInterruptHandler(VECTOR_SMP_WAKE, SmpWakeInterrupt);
+
+    for(int i = 0; i < madt->cpuCount && cpuCount < MAX_CPUS; i++) {
+        uint32_t apicId = madt->apicIds[i];
+        if(apicId == cpus[0].apicId) continue;
+
+        int index = cpuCount;
+        int ok = StartAp(apicId);
+        strcpy(line, "smp: cpu ");
+        IntToStr(index, num);
+        strcat(line, num);
+        strcat(line, " apic ");
+        UIntToStr(apicId, num);
+        strcat(line, num);
+        strcat(line, ok ? " online" : " did not start");
+        KLog(line);
+    }
+
+    strcpy(line, "smp: ");
+    IntToStr(cpuCount, num);
+    strcat(line, num);
+    strcat(line, " of ");
+    IntToStr(madt->cpuCount, num);
+    strcat(line, num);
+    strcat(line, " cpus online");
+    KLog(line);
+    return cpuCount;
+}
+
+int CpuCount() {
+    return cpuCount;
+}
+
+const PerCpu* GetCpu(int index) {
+    if(index < 0 || index >= cpuCount) return NULL;
+    return &cpus[index];
+}
+
+// Runs fn(item, arg) for every item in [0, items) on up to `cores` CPUs and
+// returns when all are done. Boot CPU only; callers hold the UI lock, which
+// keeps jobs from overlapping.
+void SmpRun(SmpWorkFn fn, void* arg, int items, int cores) {
+    if(cores > cpuCount) cores = cpuCount;
+    if(cores < 1) cores = 1;
+
+    smpJob.fn = fn;
+    smpJob.arg = arg;
+    smpJob.count = items;
+    smpJob.cores = cores;
+    smpJob.done = 0;
+    __atomic_store_n(&smpJob.next, 0, __ATOMIC_RELEASE);
+    if(cores > 1) {
+        __atomic_fetch_add(&smpJob.generation, 1, __ATOMIC_RELEASE);
+        LapicSendIpi(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_ASSERT | VECTOR_SMP_WAKE);
+    }
+
+    SmpWork(ThisCpu());
+    while(__atomic_load_n(&smpJob.done, __ATOMIC_ACQUIRE) < items) {
+        __asm__ volatile("pause");
+    }
+    // A late AP still looking at this job now claims nothing
+    __atomic_store_n(&smpJob.next, SMP_JOB_CLOSED, __ATOMIC_RELEASE);
+
+    smpStats.jobs++;
+    smpStats.items += items;
+}
+
+void GetSmpStats(SmpStats* out) {
+    *out = smpStats;
+    out->cpus = cpuCount;
+}
+
+#endif // SMP_C
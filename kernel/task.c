@@ -0,0 +1,269 @@
+// Kernel tasks. Every task switch happens on the way out of an interrupt:
+// the interrupted task's registers and FPU state are already saved as an
+// InterruptFrame on its own stack, so switching is just returning another
+// task's saved frame to the stub. Preemption is a periodic timer that asks
+// for a reschedule; a task gives up the CPU itself (yield, wait, sleep,
+// blocking on a mutex) by raising VECTOR_YIELD.
+//
+// The scheduler picks the first ready task of the most urgent priority,
+// starting after the current one so equal priorities round-robin. The boot
+// context becomes task 0, the idle task, which only runs when nothing
+// else can.
+
+#ifndef TASK_C
+#define TASK_C
+
+#include "../include/task.h"
+
+typedef struct {
+    char name[TASK_NAME_LENGTH];
+    int state;
+    int priority;
+    uint64_t frame;          // saved InterruptFrame while switched out
+    TaskEntry entry;
+    void* arg;
+    volatile int wakePending;
+    uint64_t cpuTicks;
+    uint64_t switches;
+    uint64_t switchedIn;     // TSC when it last started running
+} Task;
+
+static Task tasks[MAX_TASKS];
+static int currentTask = 0;
+static int taskCount = 0;
+static volatile int needResched = 0;
+static int taskingActive = 0;
+
+static void YieldInterrupt(InterruptFrame* frame) {
+    needResched = 1;
+}
+
+static void PreemptTick(void* arg) {
+    needResched = 1;
+}
+
+int TaskSwitchPending() {
+    return taskingActive && needResched;
+}
+
+static int PickNextTask() {
+    for(int priority = 0; priority < TASK_PRIORITIES; priority++) {
+        for(int i = 1; i <= MAX_TASKS; i++) {
+            int id = (currentTask + i) % MAX_TASKS;
+            Task* t = &tasks[id];
+            if(t->priority != priority) continue;
+            if(t->state == TASK_READY || t->state == TASK_RUNNING) return id;
+        }
+    }
+    return 0;
+}
+
+// Called by the interrupt dispatcher with interrupts off; returns the frame
+// to resume
+uint64_t TaskSwitch(InterruptFrame* frame) {
+    Task* cur = &tasks[currentTask];
+    uint64_t now = rdtsc();
+    cur->frame = (uint64_t)frame;
+    cur->cpuTicks += now - cur->switchedIn;
+    needResched = 0;
+
+    int next = PickNextTask();
+    if(cur->state == TASK_RUNNING && next != currentTask) cur->state = TASK_READY;
+    Task* t = &tasks[next];
+    if(next != currentTask) t->switches++;
+    t->state = TASK_RUNNING;
+    t->switchedIn = now;
+    currentTask = next;
+    return t->frame;
+}
+
+// First code a new task runs, on its own stack with interrupts on
+static void TaskStart(int id) {
+    tasks[id].entry(tasks[id].arg);
+
+    DisableInterrupts();
+    tasks[id].state = TASK_DEAD;
+    TaskYield();
+}
+
+// Turns the running boot context into the idle task and starts preemption
+void InitTasks() {
+    Task* idle = &tasks[0];
+    strcpy(idle->name, "idle");
+    idle->priority = TASK_PRIORITY_IDLE;
+    idle->state = TASK_RUNNING;
+    idle->switchedIn = rdtsc();
+    taskCount = 1;
+    currentTask = 0;
+
+    SetInterruptHandler(VECTOR_YIELD, YieldInterrupt);
+    TimerPeriodic(TASK_SLICE_US, PreemptTick, NULL);
+    taskingActive = 1;
+    KLog("task: scheduler running");
+}
+
+int CreateTask(const char* name, int priority, TaskEntry entry, void* arg) {
+    if(taskCount >= MAX_TASKS) return -1;
+    uint8_t* stack = (uint8_t*)AllocPages(PAGES_FOR(TASK_STACK_SIZE));
+    if(!stack) return -1;
+    int id = taskCount++;
+    Task* t = &tasks[id];
+
+    uint64_t top = (uint64_t)stack + TASK_STACK_SIZE;
+    InterruptFrame* f = (InterruptFrame*)((top - sizeof(InterruptFrame) - 16) & ~15ULL);
+    uint8_t* raw = (uint8_t*)f;
+    for(unsigned i = 0; i < sizeof(InterruptFrame); i++) raw[i] = 0;
+
+    // Clean x87/SSE state: FCW 0x37F, MXCSR 0x1F80 (all exceptions masked).
+    // XRSTOR of this image (XSTATE_BV 0) resets x87 and AVX and still takes
+    // MXCSR from it.
+    uint8_t* fpu = FrameFpuState(f);
+    *(uint16_t*)&fpu[0] = 0x37F;
+    *(uint32_t*)&fpu[24] = 0x1F80;
+
+    uint16_t cs, ss;
+    __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+    __asm__ volatile("mov %%ss, %0" : "=r"(ss));
+    f->rip = (uint64_t)TaskStart;
+    f->cs = cs;
+    f->rflags = 0x202;
+    f->rsp = top - 8;           // as if TaskStart had been called
+    f->ss = ss;
+    f->rdi = id;
+
+    int n = 0;
+    while(name[n] && n < TASK_NAME_LENGTH - 1) {
+        t->name[n] = name[n];
+        n++;
+    }
+    t->name[n] = '\0';
+    t->priority = priority;
+    t->entry = entry;
+    t->arg = arg;
+    t->frame = (uint64_t)f;
+
+    uint64_t flags = DisableInterrupts();
+    t->state = TASK_READY;
+    if(priority < tasks[currentTask].priority) needResched = 1;
+    RestoreInterrupts(flags);
+    return id;
+}
+
+int TaskingActive() {
+    return taskingActive;
+}
+
+int CurrentTask() {
+    return currentTask;
+}
+
+void TaskYield() {
+    needResched = 1;
+    __asm__ volatile("int %0" : : "i"(VECTOR_YIELD) : "memory");
+}
+
+// Blocks until TaskWake; a wake that came first is not lost
+void TaskWait() {
+    uint64_t flags = DisableInterrupts();
+    Task* t = &tasks[currentTask];
+    while(!t->wakePending) {
+        t->state = TASK_BLOCKED;
+        TaskYield();
+    }
+    t->wakePending = 0;
+    RestoreInterrupts(flags);
+}
+
+// Makes a task ready; also safe from interrupt handlers
+static void MakeReady(int id) {
+    Task* t = &tasks[id];
+    if(t->state != TASK_BLOCKED && t->state != TASK_SLEEPING) return;
+    t->state = TASK_READY;
+    if(t->priority < tasks[currentTask].priority) needResched = 1;
+}
+
+void TaskWake(int id) {
+    if(id < 0 || id >= taskCount) return;
+    uint64_t flags = DisableInterrupts();
+    tasks[id].wakePending = 1;
+    if(tasks[id].state == TASK_BLOCKED) MakeReady(id);
+    RestoreInterrupts(flags);
+    if(needResched && !InInterrupt()) TaskYield();
+}
+
+static void SleepTimerExpired(void* arg) {
+    int id = (int)(intptr_t)arg;
+    if(tasks[id].state == TASK_SLEEPING) MakeReady(id);
+}
+
+void TaskSleepUntilUs(uint64_t deadlineUs) {
+    uint64_t now = ClockUs();
+    if(now >= deadlineUs) return;
+
+    uint64_t flags = DisableInterrupts();
+    int id = currentTask;
+    if(TimerOneShot(deadlineUs - now, SleepTimerExpired, (void*)(intptr_t)id) >= 0) {
+        tasks[id].state = TASK_SLEEPING;
+        TaskYield();
+    }
+    RestoreInterrupts(flags);
+
+    // No timer slot free: give way to others until the time has passed
+    while(ClockUs() < deadlineUs) TaskYield();
+}
+
+void RunIdleTask() {
+    while(1) {
+        __asm__ volatile("sti; hlt");
+    }
+}
+
+void MutexLock(Mutex* m) {
+    uint64_t flags = DisableInterrupts();
+    while(m->locked) {
+        m->waiters |= 1u << currentTask;
+        m->contended++;
+        tasks[currentTask].state = TASK_BLOCKED;
+        TaskYield();
+    }
+    m->locked = 1;
+    m->owner = currentTask;
+    RestoreInterrupts(flags);
+}
+
+void MutexUnlock(Mutex* m) {
+    uint64_t flags = DisableInterrupts();
+    uint32_t waiters = m->waiters;
+    m->locked = 0;
+    m->owner = -1;
+    m->waiters = 0;
+    for(int id = 0; id < taskCount; id++) {
+        if(waiters & (1u << id)) MakeReady(id);
+    }
+    RestoreInterrupts(flags);
+    if(needResched && !InInterrupt()) TaskYield();
+}
+
+int GetTaskList(TaskInfo* out, int max) {
+    uint64_t flags = DisableInterrupts();
+    uint64_t now = rdtsc();
+    TimerInfo timer;
+    GetTimerInfo(&timer);
+    int n = 0;
+    for(int id = 0; id < taskCount && n < max; id++) {
+        Task* t = &tasks[id];
+        uint64_t ticks = t->cpuTicks;
+        if(id == currentTask) ticks += now - t->switchedIn;
+        TaskInfo* info = &out[n++];
+        info->id = id;
+        strcpy(info->name, t->name);
+        info->state = t->state;
+        info->priority = t->priority;
+        info->cpuUs = timer.tscHz ? ticks / (timer.tscHz / 1000000) : 0;
+        info->switches = t->switches;
+    }
+    RestoreInterrupts(flags);
+    return n;
+}
+
+#endif // TASK_C
@@ -0,0 +1,304 @@
+// Timekeeping. The TSC is the clock: it is calibrated once against PIT
+// channel 2 and read directly by ClockNs/Us/Ms. Timers are a small table of
+// absolute TSC deadlines. The LAPIC timer is armed for the earliest one,
+// by TSC value in TSC-deadline mode or as a one-shot count otherwise, and
+// its interrupt runs the callbacks that are due. Sleeping halts the CPU
+// until the next interrupt instead of spinning.
+
+#ifndef TIMER_C
+#define TIMER_C
+
+#include "../include/timer.h"
+
+#define MSR_TSC_DEADLINE     0x6E0
+#define CALIBRATE_PIT_COUNT  11932     // 10 ms of PIT input clock
+#define CALIBRATE_RUNS       3
+#define LAPIC_DIVIDE_16      0x3
+
+typedef struct {
+    int active;
+    uint64_t deadline;      // TSC
+    uint64_t period;        // TSC ticks, 0 for one-shot
+    TimerCallback fn;       // may be NULL for a plain wakeup
+    void* arg;
+} Timer;
+
+static Timer timers[MAX_TIMERS];
+static TimerInfo timerInfo;
+static uint64_t bootTsc = 0;
+static uint64_t nsPerTsc = 0;       // 32.32 fixed point
+static uint64_t tscPerUs = 0;       // 32.32 fixed point
+static uint64_t lapicPerTsc = 0;    // 32.32 fixed point, one-shot mode only
+static int timerHardware = 0;       // LAPIC timer interrupt is wired up
+
+static inline uint64_t MulFrac(uint64_t value, uint64_t frac) {
+    return (uint64_t)(((unsigned __int128)value * frac) >> 32);
+}
+
+// TSC ticks while PIT channel 2 counts `count` down in mode 0
+static uint64_t PitMeasureTsc(uint16_t count) {
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);   // gate on, speaker off
+    outb(0x43, 0xB0);                          // channel 2, lo/hi, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+
+    uint64_t start = rdtsc();
+    while(!(inb(0x61) & 0x20));
+    return rdtsc() - start;
+}
+
+// Shortest of a few runs; anything that stalls the CPU only makes one longer
+static void CalibrateTsc() {
+    uint64_t best = ~0ULL;
+    for(int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint64_t ticks = PitMeasureTsc(CALIBRATE_PIT_COUNT);
+        if(ticks < best) best = ticks;
+    }
+    timerInfo.tscHz = best * PIT_HZ / CALIBRATE_PIT_COUNT;
+    if(timerInfo.tscHz == 0) timerInfo.tscHz = 1000000;
+
+    nsPerTsc = (1000000000ULL << 32) / timerInfo.tscHz;
+    tscPerUs = ((timerInfo.tscHz / 1000000) << 32) +
+               ((timerInfo.tscHz % 1000000) << 32) / 1000000;
+}
+
+// LAPIC timer ticks per 10 ms of TSC time, for one-shot counts
+static void CalibrateLapicTimer() {
+    LapicWrite(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    LapicWrite(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    LapicWrite(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+
+    uint64_t end = rdtsc() + timerInfo.tscHz / 100;
+    while(rdtsc() < end) {
+        __asm__ volatile("pause");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - LapicRead(LAPIC_TIMER_CURRENT);
+    LapicWrite(LAPIC_TIMER_INITIAL, 0);
+
+    timerInfo.lapicHz = (uint64_t)elapsed * 100;
+    lapicPerTsc = (timerInfo.lapicHz << 32) / timerInfo.tscHz;
+}
+
+// Arms the LAPIC timer for an absolute TSC deadline, or disarms it for 0
+static void ArmLapicTimer(uint64_t deadline) {
+    if(timerInfo.tscDeadline) {
+        wrmsr(MSR_TSC_DEADLINE, deadline);
+        return;
+    }
+    if(deadline == 0) {
+        LapicWrite(LAPIC_TIMER_INITIAL, 0);
+        return;
+    }
+    uint64_t now = rdtsc();
+    uint64_t count = deadline > now ? MulFrac(deadline - now, lapicPerTsc) : 1;
+    if(count == 0) count = 1;
+    if(count > 0xFFFFFFFF) count = 0xFFFFFFFF;     // fires early and re-arms
+    LapicWrite(LAPIC_TIMER_INITIAL, (uint32_t)count);
+}
+
+// Caller has interrupts disabled
+static void ProgramNextTimer() {
+    if(!timerHardware) return;
+    uint64_t next = 0;
+    for(int i = 0; i < MAX_TIMERS; i++) {
+        if(timers[i].active && (next == 0 || timers[i].deadline < next)) {
+            next = timers[i].deadline;
+        }
+    }
+    ArmLapicTimer(next);
+}
+
+// Caller has interrupts disabled
+static void RunDueTimers() {
+    uint64_t now = rdtsc();
+    for(int i = 0; i < MAX_TIMERS; i++) {
+        Timer* t = &timers[i];
+        if(!t->active || t->deadline > now) continue;
+
+        if(t->period) {
+            // Missed periods are dropped rather than delivered in a burst
+            do {
+                t->deadline += t->period;
+            } while(t->deadline <= now);
+        } else {
+            t->active = 0;
+        }
+        if(t->fn) {
+            timerInfo.callbacks++;
+            t->fn(t->arg);
+        }
+    }
+    ProgramNextTimer();
+}
+
+static void TimerInterrupt(InterruptFrame* frame) {
+    timerInfo.interrupts++;
+    RunDueTimers();
+    LapicEoi();
+}
+
+static int AddTimer(uint64_t deadline, uint64_t period, TimerCallback fn, void* arg) {
+    if(tscPerUs == 0) return -1;
+    uint64_t flags = DisableInterrupts();
+    int handle = -1;
+    for(int i = 0; i < MAX_TIMERS; i++) {
+        if(!timers[i].active) {
+            handle = i;
+            break;
+        }
+    }
+    if(handle >= 0) {
+        Timer* t = &timers[handle];
+        t->deadline = deadline;
+        t->period = period;
+        t->fn = fn;
+        t->arg = arg;
+        t->active = 1;
+        ProgramNextTimer();
+    }
+    RestoreInterrupts(flags);
+    return handle;
+}
+
+void InitTimer() {
+    uint32_t a, b, c, d;
+    char line[KLOG_LINE_LENGTH];
+    char num[24];
+
+    bootTsc = rdtsc();
+    CalibrateTsc();
+
+    Cpuid(0x80000000, &a, &b, &c, &d);
+    if(a >= 0x80000007) {
+        Cpuid(0x80000007, &a, &b, &c, &d);
+        timerInfo.invariantTsc = (d & (1 << 8)) != 0;
+    }
+
+    strcpy(line, "timer: TSC ");
+    UIntToStr(timerInfo.tscHz / 1000000, num);
+    strcat(line, num);
+    strcat(line, timerInfo.invariantTsc ? " MHz, invariant" : " MHz, not invariant");
+    KLog(line);
+
+    if(!InitLapic()) {
+        KLog("timer: no LAPIC, timers are polled while sleeping");
+        return;
+    }
+
+    Cpuid(1, &a, &b, &c, &d);
+    timerInfo.tscDeadline = (c & (1 << 24)) != 0;
+    SetInterruptHandler(VECTOR_TIMER, TimerInterrupt);
+
+    if(timerInfo.tscDeadline) {
+        LapicWrite(LAPIC_LVT_TIMER, VECTOR_TIMER | LAPIC_TIMER_DEADLINE);
+        __asm__ volatile("mfence" : : : "memory");   // LVT mode before the MSR write
+        KLog("timer: LAPIC in TSC-deadline mode");
+    } else {
+        CalibrateLapicTimer();
+        LapicWrite(LAPIC_LVT_TIMER, VECTOR_TIMER | LAPIC_TIMER_ONESHOT);
+        strcpy(line, "timer: LAPIC one-shot at ");
+        UIntToStr(timerInfo.lapicHz / 1000, num);
+        strcat(line, num);
+        strcat(line, " kHz");
+        KLog(line);
+    }
+
+    timerHardware = 1;
+    EnableInterrupts();
+}
+
+// Monotonic time since InitTimer
+uint64_t ClockNs() {
+    if(bootTsc == 0) return 0;
+    return MulFrac(rdtsc() - bootTsc, nsPerTsc);
+}
+
+uint64_t ClockUs() {
+    return ClockNs() / 1000;
+}
+
+uint64_t ClockMs() {
+    return ClockNs() / 1000000;
+}
+
+// For TSC stamps taken before InitTimer; 0 until the TSC is calibrated
+uint64_t TscToUs(uint64_t ticks) {
+    return MulFrac(ticks, nsPerTsc) / 1000;
+}
+
+// Callbacks run in interrupt context with interrupts disabled, so they
+// should only record state. Both return a handle for TimerCancel, or -1
+// when the table is full.
+int TimerOneShot(uint64_t delayUs, TimerCallback fn, void* arg) {
+    return AddTimer(rdtsc() + MulFrac(delayUs, tscPerUs), 0, fn, arg);
+}
+
+int TimerPeriodic(uint64_t periodUs, TimerCallback fn, void* arg) {
+    uint64_t period = MulFrac(periodUs, tscPerUs);
+    if(period == 0) period = 1;
+    return AddTimer(rdtsc() + period, period, fn, arg);
+}
+
+void TimerCancel(int handle) {
+    if(handle < 0 || handle >= MAX_TIMERS) return;
+    uint64_t flags = DisableInterrupts();
+    timers[handle].active = 0;
+    ProgramNextTimer();
+    RestoreInterrupts(flags);
+}
+
+// Waits until the clock reaches deadlineUs. A task just sleeps; outside a
+// task the CPU halts. The check and the hlt run with interrupts off and
+// sti; hlt re-enables them atomically, so a timer firing in between still
+// wakes the CPU.
+void SleepUntilUs(uint64_t deadlineUs) {
+    // A task sleeps on its own; the CPU keeps running the others
+    if(TaskingActive() && CurrentTask() != 0) {
+        TaskSleepUntilUs(deadlineUs);
+        return;
+    }
+
+    uint64_t deadline = bootTsc + MulFrac(deadlineUs, tscPerUs);
+    if(rdtsc() >= deadline) return;
+
+    uint64_t flags = DisableInterrupts();
+    int wake = -1;
+    if(timerHardware && (flags & 0x200)) {
+        wake = AddTimer(deadline, 0, NULL, NULL);
+    }
+
+    if(wake < 0) {
+        // No timer interrupt to wait for: spin, running timers by hand
+        while(rdtsc() < deadline) {
+            if(!timerHardware) RunDueTimers();
+            __asm__ volatile("pause");
+        }
+    } else {
+        while(rdtsc() < deadline) {
+            __asm__ volatile("sti; hlt; cli" : : : "memory");
+        }
+        if(timers[wake].active && timers[wake].fn == NULL && timers[wake].deadline == deadline) {
+            timers[wake].active = 0;
+            ProgramNextTimer();
+        }
+    }
+    RestoreInterrupts(flags);
+}
+
+void SleepUs(uint64_t us) {
+    SleepUntilUs(ClockUs() + us);
+}
+
+void SleepMs(uint64_t ms) {
+    SleepUs(ms * 1000);
+}
+
+void GetTimerInfo(TimerInfo* out) {
+    *out = timerInfo;
+    out->activeTimers = 0;
+    for(int i = 0; i < MAX_TIMERS; i++) {
+        if(timers[i].active) out->activeTimers++;
+    }
+}
+
+#endif // TIMER_C
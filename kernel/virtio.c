@@ -0,0 +1,197 @@
+// virtio-blk over the legacy (0.9.5) PCI interface: registers in I/O
+// BAR0, one request queue whose page number the driver writes. QEMU's
+// virtio-blk-pci is a transitional device, so this works there without
+// touching the capability lists and 64-bit BARs the modern interface
+// needs. No feature bits are taken.
+//
+// Each request is a three descriptor chain (header, data, status byte).
+// The queue is split into fixed slots, slot s owning descriptors 3s to
+// 3s+2 and one header and status byte in the slot page, so a finished
+// chain leads straight back to its request. Interrupts are suppressed;
+// the block layer polls the used ring.
+
+#ifndef VIRTIO_C
+#define VIRTIO_C
+
+#include "../include/virtio.h"
+
+#define VIRTIO_REG_DEVICE_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES   0x04
+#define VIRTIO_REG_QUEUE_ADDRESS    0x08
+#define VIRTIO_REG_QUEUE_SIZE       0x0C
+#define VIRTIO_REG_QUEUE_SELECT     0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY     0x10
+#define VIRTIO_REG_STATUS           0x12
+#define VIRTIO_REG_ISR              0x13
+#define VIRTIO_REG_BLK_CAPACITY     0x14
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FAILED        0x80
+
+#define VIRTIO_BLK_F_RO             (1 << 5)
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+
+#define VIRTQ_DESC_F_NEXT           1
+#define VIRTQ_DESC_F_WRITE          2      // device writes the buffer
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY      1
+
+#define VIRTIO_BLK_MAX_DEVICES      4
+#define VIRTIO_BLK_MAX_TRANSFER     256    // sectors, 128 KB
+
+typedef struct {
+    BlockDevice dev;
+    uint16_t io;
+    uint16_t queueSize;
+    volatile VirtqDesc* desc;
+    volatile VirtqAvail* avail;
+    volatile VirtqUsed* used;
+    uint16_t lastUsed;
+    int slotCount;
+    uint32_t freeSlots;           // bit per slot
+    VirtioBlkHeader* headers;
+    volatile uint8_t* statuses;
+    BlockRequest* slots[BLOCK_MAX_DEPTH];
+} VirtioBlk;
+
+static int virtioBlkCount = 0;
+
+static inline uint64_t AlignUp(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static int VirtioBlkSubmit(BlockDevice* dev, BlockRequest* req) {
+    VirtioBlk* vb = (VirtioBlk*)dev->driverData;
+    if(!vb->freeSlots) return 0;
+    int slot = __builtin_ctz(vb->freeSlots);
+    vb->freeSlots &= ~(1U << slot);
+    vb->slots[slot] = req;
+
+    VirtioBlkHeader* header = &vb->headers[slot];
+    header->type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    header->reserved = 0;
+    header->sector = req->lba;
+    vb->statuses[slot] = 0xFF;
+
+    uint16_t head = slot * 3;
+    volatile VirtqDesc* d = &vb->desc[head];
+    d[0].addr = (uint64_t)header;
+    d[0].len = sizeof(VirtioBlkHeader);
+    d[0].flags = VIRTQ_DESC_F_NEXT;
+    d[0].next = head + 1;
+    d[1].addr = (uint64_t)req->buffer;
+    d[1].len = req->count * BLOCK_SECTOR_SIZE;
+    d[1].flags = VIRTQ_DESC_F_NEXT | (req->write ? 0 : VIRTQ_DESC_F_WRITE);
+    d[1].next = head + 2;
+    d[2].addr = (uint64_t)&vb->statuses[slot];
+    d[2].len = 1;
+    d[2].flags = VIRTQ_DESC_F_WRITE;
+    d[2].next = 0;
+
+    // The chain must be visible before the index that publishes it, and
+    // the index before the notify
+    uint16_t idx = vb->avail->idx;
+    vb->avail->ring[idx % vb->queueSize] = head;
+    __sync_synchronize();
+    vb->avail->idx = idx + 1;
+    __sync_synchronize();
+    if(!(vb->used->flags & VIRTQ_USED_F_NO_NOTIFY)) outw(vb->io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    return 1;
+}
+
+static void VirtioBlkPoll(BlockDevice* dev) {
+    VirtioBlk* vb = (VirtioBlk*)dev->driverData;
+    while(vb->lastUsed != vb->used->idx) {
+        __sync_synchronize();
+        uint32_t head = vb->used->ring[vb->lastUsed % vb->queueSize].id;
+        vb->lastUsed++;
+        int slot = head / 3;
+        if(slot >= vb->slotCount || !vb->slots[slot]) continue;
+        BlockRequest* req = vb->slots[slot];
+        vb->slots[slot] = NULL;
+        vb->freeSlots |= 1U << slot;
+        BlockComplete(dev, req, vb->statuses[slot] == 0);
+    }
+}
+
+static int StartVirtioBlk(const PciDevice* pci) {
+    char line[KLOG_LINE_LENGTH];
+    PciBar bar;
+    if(!PciReadBar(pci, 0, &bar) || !bar.io) {
+        KLog("virtio: block device without an I/O BAR, skipped");
+        return 0;
+    }
+    PciEnable(pci, PCI_COMMAND_IO | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_OFF);
+    uint16_t io = bar.base;
+
+    outb(io + VIRTIO_REG_STATUS, 0);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    uint32_t features = inl(io + VIRTIO_REG_DEVICE_FEATURES);
+    outl(io + VIRTIO_REG_GUEST_FEATURES, 0);
+
+    outw(io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t queueSize = inw(io + VIRTIO_REG_QUEUE_SIZE);
+    uint64_t ringBytes = AlignUp(sizeof(VirtqDesc) * queueSize + 6 + 2 * queueSize, PAGE_SIZE) +
+                         AlignUp(6 + sizeof(VirtqUsedElem) * queueSize, PAGE_SIZE);
+    VirtioBlk* vb = (VirtioBlk*)HeapAllocZeroed(sizeof(VirtioBlk));
+    uint8_t* ring = queueSize ? (uint8_t*)AllocZeroedPages(PAGES_FOR(ringBytes)) : NULL;
+    uint8_t* slotPage = (uint8_t*)AllocZeroedPages(1);
+    if(!vb || !ring || !slotPage || queueSize < 3) {
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        KLog("virtio: could not set up the request queue");
+        return 0;
+    }
+
+    vb->io = io;
+    vb->queueSize = queueSize;
+    vb->desc = (volatile VirtqDesc*)ring;
+    vb->avail = (volatile VirtqAvail*)(ring + sizeof(VirtqDesc) * queueSize);
+    vb->used = (volatile VirtqUsed*)(ring + AlignUp(sizeof(VirtqDesc) * queueSize + 6 + 2 * queueSize, PAGE_SIZE));
+    vb->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    vb->slotCount = queueSize / 3 < BLOCK_MAX_DEPTH ? queueSize / 3 : BLOCK_MAX_DEPTH;
+    vb->freeSlots = vb->slotCount == 32 ? 0xFFFFFFFF : (1U << vb->slotCount) - 1;
+    vb->headers = (VirtioBlkHeader*)slotPage;
+    vb->statuses = slotPage + sizeof(VirtioBlkHeader) * BLOCK_MAX_DEPTH;
+    outl(io + VIRTIO_REG_QUEUE_ADDRESS, (uint64_t)ring / PAGE_SIZE);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    BlockDevice* dev = &vb->dev;
+    strcpy(dev->name, "vda");
+    dev->name[2] += virtioBlkCount;
+    dev->driver = "virtio-blk";
+    dev->sectors = (uint64_t)inl(io + VIRTIO_REG_BLK_CAPACITY) |
+                   ((uint64_t)inl(io + VIRTIO_REG_BLK_CAPACITY + 4) << 32);
+    dev->maxTransfer = VIRTIO_BLK_MAX_TRANSFER;
+    dev->queueDepth = vb->slotCount;
+    dev->readOnly = (features & VIRTIO_BLK_F_RO) != 0;
+    dev->driverData = vb;
+    dev->submit = VirtioBlkSubmit;
+    dev->poll = VirtioBlkPoll;
+    if(!RegisterBlockDevice(dev)) {
+        strcpy(line, "virtio: no room to register ");
+        strcat(line, dev->name);
+        KLog(line);
+        return 0;
+    }
+    virtioBlkCount++;
+    return 1;
+}
+
+// Returns how many disks were brought up
+int InitVirtioBlk() {
+    const PciDevice* pci;
+    for(int i = 0; (pci = PciFindDevice(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_ID, i)); i++) {
+        if(virtioBlkCount == VIRTIO_BLK_MAX_DEVICES) break;
+        StartVirtioBlk(pci);
+    }
+    if(PciFindDevice(VIRTIO_VENDOR_ID, VIRTIO_BLK_MODERN_ID, 0)) {
+        KLog("virtio: modern-only block device found, not supported");
+    }
+    return virtioBlkCount;
+}
+
+#endif // VIRTIO_C
@@ -0,0 +1,350 @@
+// Host-side microbenchmark for the kernel pixel kernels.
+// Build and run with: make bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../kernel/font.c"
+
+#define BENCH_STRIDE 1920
+#define BENCH_ROWS 1080
+#define BENCH_MIN_NS 50000000ULL
+
+typedef struct {
+    int w, h;
+} BenchSize;
+
+static const BenchSize benchSizes[] = {
+    {16, 16}, {64, 64}, {256, 256}, {640, 480}, {1024, 768}, {1920, 1080}
+};
+
+static uint32_t* dstBuffer;
+static uint32_t* srcBuffer;
+
+// The kernel decides in InitCpu(); on the host, libgcc's check also
+// covers the OS having enabled the YMM state
+static int HostHasAVX2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static uint64_t NowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The loop DrawRect used before the row kernels, kept as the baseline.
+static void FillRectBaseline(int w, int h, uint32_t color) {
+    for(int dy = 0; dy < h; dy++) {
+        uint32_t offset = dy * BENCH_STRIDE;
+        for(int dx = 0; dx < w; dx++) {
+            dstBuffer[offset + dx] = color;
+        }
+    }
+}
+
+static void CopyRectBaseline(int w, int h) {
+    for(int dy = 0; dy < h; dy++) {
+        for(int dx = 0; dx < w; dx++) {
+            dstBuffer[dy * BENCH_STRIDE + dx] = srcBuffer[dy * BENCH_STRIDE + dx];
+        }
+    }
+}
+
+static void FillRect(void (*fillRow)(uint32_t*, uint32_t, int), int w, int h, uint32_t color) {
+    uint32_t* row = dstBuffer;
+    for(int dy = 0; dy < h; dy++) {
+        fillRow(row, color, w);
+        row += BENCH_STRIDE;
+    }
+    BlitFence();
+}
+
+static void CopyRect(void (*copyRow)(uint32_t*, const uint32_t*, int), int w, int h) {
+    uint32_t* dst = dstBuffer;
+    const uint32_t* src = srcBuffer;
+    for(int dy = 0; dy < h; dy++) {
+        copyRow(dst, src, w);
+        dst += BENCH_STRIDE;
+        src += BENCH_STRIDE;
+    }
+    BlitFence();
+}
+
+static void BlendRect(void (*blendRow)(uint32_t*, const uint32_t*, int), int w, int h) {
+    uint32_t* dst = dstBuffer;
+    const uint32_t* src = srcBuffer;
+    for(int dy = 0; dy < h; dy++) {
+        blendRow(dst, src, w);
+        dst += BENCH_STRIDE;
+        src += BENCH_STRIDE;
+    }
+}
+
+static void FillAlphaRect(void (*fillAlphaRow)(uint32_t*, uint32_t, int), int w, int h, uint32_t color) {
+    uint32_t* row = dstBuffer;
+    for(int dy = 0; dy < h; dy++) {
+        fillAlphaRow(row, color, w);
+        row += BENCH_STRIDE;
+    }
+}
+
+// The SIMD blend kernels must match the scalar path bit for bit. Runs each
+// over a row of premultiplied pixels covering every alpha, with odd lengths
+// to exercise the scalar tails.
+static int CheckBlendKernels(int avx2) {
+    enum { N = 1027 };
+    static uint32_t src[N], base[N], expect[N], got[N];
+    int failures = 0;
+    for(int i = 0; i < N; i++) {
+        uint32_t a = (uint32_t)(i * 7) & 0xFF;
+        uint32_t straight = (a << 24) | (((uint32_t)i * 2654435761u) & 0xFFFFFF);
+        src[i] = PremultiplyColor(straight);
+        base[i] = (uint32_t)i * 40503u ^ 0x5A5A5A5Au;
+    }
+
+    void (*blendRows[])(uint32_t*, const uint32_t*, int) = {BlendRowSSE2, BlendRowAVX2};
+    void (*fillRows[])(uint32_t*, uint32_t, int) = {FillAlphaRowSSE2, FillAlphaRowAVX2};
+    for(int k = 0; k < (avx2 ? 2 : 1); k++) {
+        for(int len = N - 3; len <= N; len++) {
+            memcpy(expect, base, sizeof(base));
+            memcpy(got, base, sizeof(base));
+            BlendRowScalar(expect, src, len);
+            blendRows[k](got, src, len);
+            if(memcmp(expect, got, sizeof(got)) != 0) failures++;
+
+            uint32_t color = PremultiplyColor(0x80336699u + (uint32_t)len);
+            memcpy(expect, base, sizeof(base));
+            memcpy(got, base, sizeof(base));
+            FillAlphaRowScalar(expect, color, len);
+            fillRows[k](got, color, len);
+            if(memcmp(expect, got, sizeof(got)) != 0) failures++;
+        }
+    }
+    return failures;
+}
+
+// Same for the red/blue swapping copies used to present to RGBX screens
+static int CheckSwapKernels(int avx2) {
+    enum { N = 1027 };
+    static uint32_t src[N], expect[N], got[N];
+    int failures = 0;
+    for(int i = 0; i < N; i++) src[i] = (uint32_t)i * 2654435761u;
+
+    void (*swapRows[])(uint32_t*, const uint32_t*, int) = {
+        CopyRowSwapRBSSE2, CopyRowSwapRBSSE2NT, CopyRowSwapRBAVX2, CopyRowSwapRBAVX2NT
+    };
+    for(int k = 0; k < (avx2 ? 4 : 2); k++) {
+        for(int len = N - 3; len <= N; len++) {
+            memset(expect, 0, sizeof(expect));
+            memset(got, 0, sizeof(got));
+            CopyRowSwapRBScalar(expect, src, len);
+            swapRows[k](got, src, len);
+            if(memcmp(expect, got, sizeof(got)) != 0) failures++;
+        }
+    }
+    return failures;
+}
+
+// Every length up to a few vectors and every misalignment of both ends
+static int CheckMemKernels(int avx2) {
+    enum { N = 256 };
+    static uint8_t src[N + 64], expect[N + 64], got[N + 64];
+    int failures = 0;
+    for(int i = 0; i < N + 64; i++) src[i] = (uint8_t)(i * 151 + 7);
+
+    void (*copies[])(void*, const void*, uint64_t) = { MemCopyRepMovsb, MemCopySSE2, MemCopyAVX2 };
+    void (*sets[])(void*, uint8_t, uint64_t) = { MemSetRepStosb, MemSetSSE2, MemSetAVX2 };
+    for(int k = 0; k < (avx2 ? 3 : 2); k++) {
+        for(int offset = 0; offset < 32; offset++) {
+            for(int len = 0; len <= N; len++) {
+                memset(expect, 0xEE, sizeof(expect));
+                memset(got, 0xEE, sizeof(got));
+                memcpy(expect + offset, src + 31 - offset, len);
+                copies[k](got + offset, src + 31 - offset, len);
+                if(memcmp(expect, got, sizeof(got)) != 0) failures++;
+
+                memset(expect + offset, 0x5A, len);
+                sets[k](got + offset, 0x5A, len);
+                if(memcmp(expect, got, sizeof(got)) != 0) failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+// DrawPixel/DrawChar as they were before the glyph mask path: one bounds
+// check and one store per set bit.
+static void BaselinePixel(uint32_t x, uint32_t y, uint32_t color) {
+    if(x < BENCH_STRIDE && y < BENCH_ROWS) {
+        dstBuffer[y * BENCH_STRIDE + x] = color;
+    }
+}
+
+static void BaselineChar(uint32_t x, uint32_t y, unsigned char c, uint32_t color) {
+    if(c >= 128) c = '?';
+    const unsigned char* glyph = font8x8[c];
+    for(int row = 0; row < 8; row++) {
+        unsigned char line = glyph[row];
+        for(int col = 0; col < 8; col++) {
+            if(line & (1 << col)) {
+                BaselinePixel(x + col, y + row, color);
+            }
+        }
+    }
+}
+
+static const char benchLine[] =
+    "user@rgos:~$ ls DOCUMENTS/  PICTURES/  README.TXT  KERNEL.BIN  CONFIG.SYS 0123";
+
+#define BENCH_TEXT_LINES 64
+
+static void TextBaseline(int len) {
+    for(int line = 0; line < BENCH_TEXT_LINES; line++) {
+        for(int i = 0; i < len; i++) {
+            BaselineChar(i * 8, line * 12, benchLine[i], 0x00FF00);
+        }
+    }
+}
+
+static void TextPerChar(GlyphRowFn glyphRow, int len) {
+    Rect clip = {0, 0, BENCH_STRIDE, BENCH_ROWS};
+    for(int line = 0; line < BENCH_TEXT_LINES; line++) {
+        for(int i = 0; i < len; i++) {
+            RenderTextRun(dstBuffer, BENCH_STRIDE, &clip, i * 8, line * 12, benchLine + i, 1, 0x00FF00, glyphRow);
+        }
+    }
+}
+
+static void TextRun(GlyphRowFn glyphRow, int len) {
+    Rect clip = {0, 0, BENCH_STRIDE, BENCH_ROWS};
+    for(int line = 0; line < BENCH_TEXT_LINES; line++) {
+        RenderTextRun(dstBuffer, BENCH_STRIDE, &clip, 0, line * 12, benchLine, len, 0x00FF00, glyphRow);
+    }
+}
+
+static void ReportText(const char* variant, uint64_t chars, uint64_t ns) {
+    printf("  text  %-14s %8.2f Mchars/s\n", variant, (double)chars * 1000.0 / (double)ns);
+}
+
+#define BENCH_TEXT(variant, call) do { \
+        uint64_t iters = 0; \
+        uint64_t start = NowNs(); \
+        uint64_t elapsed; \
+        do { \
+            call; \
+            iters++; \
+            elapsed = NowNs() - start; \
+        } while(elapsed < BENCH_MIN_NS); \
+        ReportText(variant, iters * textLen * BENCH_TEXT_LINES, elapsed); \
+    } while(0)
+
+static void Report(const char* op, const char* variant, const BenchSize* size, uint64_t bytes, uint64_t ns) {
+    char dims[32];
+    snprintf(dims, sizeof(dims), "%dx%d", size->w, size->h);
+    printf("  %-5s %-10s %-10s %8.2f GB/s\n", op, variant, dims, (double)bytes / (double)ns);
+}
+
+#define BENCH_LOOP(op, variant, size, bytesPerIter, call) do { \
+        uint64_t iters = 0; \
+        uint64_t start = NowNs(); \
+        uint64_t elapsed; \
+        do { \
+            call; \
+            iters++; \
+            elapsed = NowNs() - start; \
+        } while(elapsed < BENCH_MIN_NS); \
+        Report(op, variant, size, (bytesPerIter) * iters, elapsed); \
+    } while(0)
+
+int main(void) {
+    dstBuffer = aligned_alloc(64, BENCH_STRIDE * BENCH_ROWS * sizeof(uint32_t));
+    srcBuffer = aligned_alloc(64, BENCH_STRIDE * BENCH_ROWS * sizeof(uint32_t));
+    if(!dstBuffer || !srcBuffer) return 1;
+    memset(dstBuffer, 0, BENCH_STRIDE * BENCH_ROWS * sizeof(uint32_t));
+    for(int i = 0; i < BENCH_STRIDE * BENCH_ROWS; i++) srcBuffer[i] = (uint32_t)i * 2654435761u;
+
+    int avx2 = HostHasAVX2();
+    printf("gfxbench: AVX2 %s\n", avx2 ? "available" : "not available");
+    int blendFailures = CheckBlendKernels(avx2);
+    printf("gfxbench: blend kernels %s scalar\n", blendFailures ? "DO NOT MATCH" : "match");
+    int swapFailures = CheckSwapKernels(avx2);
+    printf("gfxbench: swap kernels %s scalar\n", swapFailures ? "DO NOT MATCH" : "match");
+    int memFailures = CheckMemKernels(avx2);
+    printf("gfxbench: memcpy/memset kernels %s libc\n", memFailures ? "DO NOT MATCH" : "match");
+
+    for(unsigned i = 0; i < sizeof(benchSizes) / sizeof(benchSizes[0]); i++) {
+        const BenchSize* size = &benchSizes[i];
+        uint64_t bytes = (uint64_t)size->w * size->h * sizeof(uint32_t);
+
+        printf("%dx%d (%llu KB)\n", size->w, size->h, (unsigned long long)(bytes / 1024));
+        BENCH_LOOP("fill", "baseline", size, bytes, FillRectBaseline(size->w, size->h, 0x003366));
+        BENCH_LOOP("fill", "sse2", size, bytes, FillRect(FillRowSSE2, size->w, size->h, 0x003366));
+        BENCH_LOOP("fill", "sse2-nt", size, bytes, FillRect(FillRowSSE2NT, size->w, size->h, 0x003366));
+        if(avx2) {
+            BENCH_LOOP("fill", "avx2", size, bytes, FillRect(FillRowAVX2, size->w, size->h, 0x003366));
+            BENCH_LOOP("fill", "avx2-nt", size, bytes, FillRect(FillRowAVX2NT, size->w, size->h, 0x003366));
+        }
+
+        BENCH_LOOP("copy", "baseline", size, bytes, CopyRectBaseline(size->w, size->h));
+        BENCH_LOOP("copy", "sse2", size, bytes, CopyRect(CopyRowSSE2, size->w, size->h));
+        BENCH_LOOP("copy", "sse2-nt", size, bytes, CopyRect(CopyRowSSE2NT, size->w, size->h));
+        if(avx2) {
+            BENCH_LOOP("copy", "avx2", size, bytes, CopyRect(CopyRowAVX2, size->w, size->h));
+            BENCH_LOOP("copy", "avx2-nt", size, bytes, CopyRect(CopyRowAVX2NT, size->w, size->h));
+        }
+
+        BENCH_LOOP("swap", "scalar", size, bytes, CopyRect(CopyRowSwapRBScalar, size->w, size->h));
+        BENCH_LOOP("swap", "sse2", size, bytes, CopyRect(CopyRowSwapRBSSE2, size->w, size->h));
+        BENCH_LOOP("swap", "sse2-nt", size, bytes, CopyRect(CopyRowSwapRBSSE2NT, size->w, size->h));
+        if(avx2) {
+            BENCH_LOOP("swap", "avx2", size, bytes, CopyRect(CopyRowSwapRBAVX2, size->w, size->h));
+            BENCH_LOOP("swap", "avx2-nt", size, bytes, CopyRect(CopyRowSwapRBAVX2NT, size->w, size->h));
+        }
+
+        BENCH_LOOP("memcpy", "libc", size, bytes, memcpy(dstBuffer, srcBuffer, bytes));
+        BENCH_LOOP("memcpy", "rep-movsb", size, bytes, MemCopyRepMovsb(dstBuffer, srcBuffer, bytes));
+        BENCH_LOOP("memcpy", "sse2", size, bytes, MemCopySSE2(dstBuffer, srcBuffer, bytes));
+        if(avx2) {
+            BENCH_LOOP("memcpy", "avx2", size, bytes, MemCopyAVX2(dstBuffer, srcBuffer, bytes));
+        }
+        BENCH_LOOP("memset", "libc", size, bytes, memset(dstBuffer, 0, bytes));
+        BENCH_LOOP("memset", "rep-stosb", size, bytes, MemSetRepStosb(dstBuffer, 0, bytes));
+        BENCH_LOOP("memset", "sse2", size, bytes, MemSetSSE2(dstBuffer, 0, bytes));
+        if(avx2) {
+            BENCH_LOOP("memset", "avx2", size, bytes, MemSetAVX2(dstBuffer, 0, bytes));
+        }
+
+        // Source alphas span 0-255, so the blend cannot shortcut anything
+        BENCH_LOOP("blend", "scalar", size, bytes, BlendRect(BlendRowScalar, size->w, size->h));
+        BENCH_LOOP("blend", "sse2", size, bytes, BlendRect(BlendRowSSE2, size->w, size->h));
+        if(avx2) {
+            BENCH_LOOP("blend", "avx2", size, bytes, BlendRect(BlendRowAVX2, size->w, size->h));
+        }
+
+        BENCH_LOOP("fillA", "scalar", size, bytes, FillAlphaRect(FillAlphaRowScalar, size->w, size->h, 0x40000000));
+        BENCH_LOOP("fillA", "sse2", size, bytes, FillAlphaRect(FillAlphaRowSSE2, size->w, size->h, 0x40000000));
+        if(avx2) {
+            BENCH_LOOP("fillA", "avx2", size, bytes, FillAlphaRect(FillAlphaRowAVX2, size->w, size->h, 0x40000000));
+        }
+    }
+
+    int textLen = (int)sizeof(benchLine) - 1;
+    printf("text, %d lines of %d chars\n", BENCH_TEXT_LINES, textLen);
+    BENCH_TEXT("baseline", TextBaseline(textLen));
+    BENCH_TEXT("scalar/char", TextPerChar(GlyphRowScalar, textLen));
+    BENCH_TEXT("scalar/run", TextRun(GlyphRowScalar, textLen));
+    BENCH_TEXT("sse2/char", TextPerChar(GlyphRowSSE2, textLen));
+    BENCH_TEXT("sse2/run", TextRun(GlyphRowSSE2, textLen));
+    if(avx2) {
+        BENCH_TEXT("avx2/char", TextPerChar(GlyphRowAVX2, textLen));
+        BENCH_TEXT("avx2/run", TextRun(GlyphRowAVX2, textLen));
+    }
+
+    free(dstBuffer);
+    free(srcBuffer);
+    return blendFailures || swapFailures || memFailures ? 1 : 0;
+}